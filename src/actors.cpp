@@ -0,0 +1,323 @@
+#include "actors.h"
+
+#include "builtins.h"
+#include "memory.h"
+#include "output.h"
+#include "task.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+// Runs on a stack as large as a thread's, deep recursion fails the process
+// with a LimitError, see Task.
+struct Process {
+  Process(Task::Body body, Env env)
+      : task(std::move(body), std::move(env), Task::DEFAULT_STACK_SIZE) {}
+
+  Task task;
+  Channel mailbox = make_channel();
+  // set by receive() before suspending, until a message arrives
+  ChannelState *waiting_on = nullptr;
+};
+
+namespace {
+
+constinit thread_local Process *current_process = nullptr;
+
+class Scheduler {
+public:
+  static Scheduler &get() {
+    static Scheduler scheduler;
+    return scheduler;
+  }
+
+  void spawn(std::unique_ptr<Process> process) {
+    auto p = process.get();
+    {
+      std::lock_guard lock(mutex);
+      if (workers.empty()) {
+        start();
+      }
+      processes[p] = std::move(process);
+    }
+    schedule(p);
+  }
+
+  void schedule(Process *process) {
+    {
+      std::lock_guard lock(mutex);
+      queue.push_back(process);
+    }
+    ready.notify_one();
+  }
+
+  ~Scheduler() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    // unwinding the suspended processes could use what exit() already
+    // destroyed
+    for (auto &[p, process] : processes) {
+      process.release();
+    }
+  }
+
+private:
+  Scheduler() {
+    // constructed first, so that they are destroyed after the workers stop
+    stdout_sink();
+    stdout_mutex();
+  }
+
+  void start() {
+    auto count = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < count; ++i) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  void work() {
+    std::unique_lock lock(mutex);
+    while (true) {
+      ready.wait(lock, [&] { return stopping || !queue.empty(); });
+      if (stopping) {
+        return;
+      }
+      auto process = queue.front();
+      queue.pop_front();
+      lock.unlock();
+      run(process);
+      lock.lock();
+    }
+  }
+
+  // runs `process` until it suspends, then puts it back in the queue or
+  // on the channel it waits on
+  void run(Process *process) {
+    current_process = process;
+    try {
+      process->task.resume();
+    } catch (const std::exception &e) {
+      std::cerr << "Error in process: " << e.what() << std::endl;
+    }
+    current_process = nullptr;
+
+    if (process->task.done()) {
+      std::unique_ptr<Process> finished;
+      std::lock_guard lock(mutex);
+      finished = std::move(processes[process]);
+      processes.erase(process);
+      return;
+    }
+    if (auto channel = std::exchange(process->waiting_on, nullptr)) {
+      std::lock_guard lock(channel->mutex);
+      if (channel->messages.empty()) {
+        channel->waiting.push_back(process);
+        return;
+      }
+    }
+    schedule(process);
+  }
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<Process *> queue;
+  std::unordered_map<Process *, std::unique_ptr<Process>> processes;
+  std::vector<std::thread> workers;
+  bool stopping = false;
+};
+
+// lazy sequences are evaluated in place and files have a position, both
+// would be shared by the copies
+struct Unsendable : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Deep copies values. The environments of lambdas are copied once per
+// Isolator, lambdas sharing an environment still share its copy.
+class Isolator {
+public:
+  Result copy(const Result &value) { return std::visit(*this, value); }
+
+  // the bindings that cannot be passed are left out
+  Env copy(const Env &env) {
+    MemoryScope scope(MemoryCategory::Environment);
+    Env result;
+    for (const auto &[name, value] : env.bindings) {
+      try {
+        result.bindings[name] = copy(value);
+      } catch (const Unsendable &) {
+      }
+    }
+    return result;
+  }
+
+  template <typename T> Result operator()(const T &value) { return value; }
+
+  Result operator()(const List &list) {
+    List result;
+    result.list.reserve(list.list.size());
+    for (const auto &element : list.list) {
+      result.list.push_back(copy(element));
+    }
+    return result;
+  }
+
+  Result operator()(const Lambda &lambda) {
+    auto result = lambda;
+    result.env = copy(lambda.env);
+    return result;
+  }
+
+  Result operator()(const Seq &) {
+    throw Unsendable("Cannot pass a lazy sequence to another process");
+  }
+
+  Result operator()(const File &) {
+    throw Unsendable("Cannot pass a file to another process");
+  }
+
+private:
+  std::shared_ptr<Env> copy(const std::shared_ptr<Env> &env) {
+    if (env == nullptr) {
+      return nullptr;
+    }
+    auto &result = envs[env.get()];
+    if (result == nullptr) {
+      // registered before copying the bindings, which can refer to it
+      auto copied = std::make_shared<Env>();
+      result = copied;
+      *copied = copy(*env);
+    }
+    return result;
+  }
+
+  std::unordered_map<const Env *, std::shared_ptr<Env>> envs;
+};
+
+Channel channel_arg(const Result &arg, const std::string &op) {
+  if (auto channel = std::get_if<Channel>(&arg)) {
+    return *channel;
+  }
+  throw std::runtime_error("'" + op + "' requires a channel, got " +
+                           to_string(arg));
+}
+
+} // namespace
+
+Channel make_channel() { return Channel{std::make_shared<ChannelState>()}; }
+
+Result isolate(const Result &value) { return Isolator().copy(value); }
+
+void send(const Channel &channel, Result message) {
+  auto &state = *channel.state;
+  Process *waiting = nullptr;
+  {
+    std::lock_guard lock(state.mutex);
+    state.messages.push_back(std::move(message));
+    if (!state.waiting.empty()) {
+      waiting = state.waiting.front();
+      state.waiting.pop_front();
+    }
+  }
+  state.ready.notify_one();
+  if (waiting != nullptr) {
+    Scheduler::get().schedule(waiting);
+  }
+}
+
+Result receive(const Channel &channel) {
+  auto &state = *channel.state;
+  auto self = current_process;
+  std::unique_lock lock(state.mutex);
+  if (self == nullptr) {
+    state.ready.wait(lock, [&] { return !state.messages.empty(); });
+  } else {
+    // the worker resuming the process next can be another thread
+    while (state.messages.empty()) {
+      self->waiting_on = &state;
+      lock.unlock();
+      yield(Nil{});
+      lock.lock();
+    }
+  }
+  auto message = std::move(state.messages.front());
+  state.messages.pop_front();
+  return message;
+}
+
+Channel channel_fn(std::vector<Result> arguments) {
+  if (!arguments.empty()) {
+    throw std::runtime_error("'channel' takes no arguments");
+  }
+  return make_channel();
+}
+
+Channel spawn_fn(std::vector<Result> arguments, Env &env) {
+  if (arguments.empty()) {
+    throw std::runtime_error("'spawn' requires a function");
+  }
+  auto &fn = arguments[0];
+  if (!std::holds_alternative<Lambda>(fn) &&
+      !std::holds_alternative<Builtin>(fn)) {
+    throw std::runtime_error("Cannot spawn, not a function: " +
+                             to_string(fn));
+  }
+
+  Isolator isolator;
+  auto process_fn = isolator.copy(fn);
+  std::vector<Result> process_args;
+  for (int i = 1; i < arguments.size(); ++i) {
+    process_args.push_back(isolator.copy(arguments[i]));
+  }
+  auto process = std::make_unique<Process>(
+      [fn = std::move(process_fn),
+       args = std::move(process_args)](Env &env) mutable {
+        return call(fn, args, env);
+      },
+      isolator.copy(env));
+  auto mailbox = process->mailbox;
+  Scheduler::get().spawn(std::move(process));
+  return mailbox;
+}
+
+Nil send_fn(std::vector<Result> arguments) {
+  if (arguments.size() != 2) {
+    throw std::runtime_error("'send' requires a channel and a message");
+  }
+  send(channel_arg(arguments[0], "send"), isolate(arguments[1]));
+  return Nil{};
+}
+
+Result receive_fn(std::vector<Result> arguments) {
+  if (arguments.size() > 1) {
+    throw std::runtime_error("'receive' takes at most 1 argument");
+  }
+  if (!arguments.empty()) {
+    return receive(channel_arg(arguments[0], "receive"));
+  }
+  if (current_process == nullptr) {
+    throw std::runtime_error("'receive' without a channel outside of a "
+                             "process");
+  }
+  return receive(current_process->mailbox);
+}
+
+Channel self_fn(std::vector<Result> arguments) {
+  if (!arguments.empty()) {
+    throw std::runtime_error("'self' takes no arguments");
+  }
+  if (current_process == nullptr) {
+    throw std::runtime_error("'self' outside of a process");
+  }
+  return current_process->mailbox;
+}
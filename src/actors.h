@@ -0,0 +1,48 @@
+#pragma once
+
+#include "env.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Processes are functions evaluated concurrently by a pool of worker threads,
+// one per core. Each process runs as a Task on an environment of its own, and
+// processes only communicate through channels:
+//
+//   (define double (lambda (out) (send out (* 2 (receive)))))
+//   (define results (channel))
+//   (send (spawn double results) 21)   ; spawn returns the process mailbox
+//   (receive results)                  ; -> 42
+//
+// Scheduling is cooperative: a process runs until it waits on an empty
+// channel, calls (yield) or returns. Values are copied when they are passed
+// to another process, as arguments of spawn or as messages, so threads never
+// share an environment. Lazy sequences and files cannot be passed.
+//
+// Processes still running when the program exits are abandoned.
+
+struct Process;
+
+struct ChannelState {
+  std::mutex mutex;
+  // signaled for the receivers that are not processes
+  std::condition_variable ready;
+  std::deque<Result> messages;
+  // the processes suspended until a message arrives
+  std::deque<Process *> waiting;
+};
+
+Channel make_channel();
+// a copy of `value` that can be passed to another process
+Result isolate(const Result &value);
+void send(const Channel &channel, Result message);
+// takes the oldest message, waiting for one if there is none
+Result receive(const Channel &channel);
+
+Channel channel_fn(std::vector<Result> arguments);
+Channel spawn_fn(std::vector<Result> arguments, Env &env);
+Nil send_fn(std::vector<Result> arguments);
+Result receive_fn(std::vector<Result> arguments);
+Channel self_fn(std::vector<Result> arguments);
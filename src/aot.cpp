@@ -0,0 +1,567 @@
+#include "aot.h"
+
+#include "bignum.h"
+#include "builtins.h"
+#include "checker.h"
+#include "parser.h"
+#include "tokenizer.h"
+
+#include <cmath>
+#include <cstdio>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+
+// a C++ string literal, without trigraphs nor raw control characters
+std::string literal(const std::string &s) {
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c >= 0x20 && c < 0x7F && c != '?') {
+      out += static_cast<char>(c);
+    } else {
+      char escape[5];
+      std::snprintf(escape, sizeof(escape), "\\%03o", c);
+      out += escape;
+    }
+  }
+  return out + "\"";
+}
+
+std::string string_value(const String &s) {
+  return "String(" + literal(s) + ", " + std::to_string(s.size()) + ")";
+}
+
+// exact, as a hexadecimal floating literal
+std::string number_value(Number n) {
+  if (std::isnan(n)) {
+    return "std::numeric_limits<Number>::quiet_NaN()";
+  }
+  if (std::isinf(n)) {
+    return n > 0 ? "std::numeric_limits<Number>::infinity()"
+                 : "-std::numeric_limits<Number>::infinity()";
+  }
+  char buffer[64];
+  std::snprintf(buffer, sizeof(buffer), "%a", n);
+  return buffer;
+}
+
+class Translator {
+public:
+  std::string translate(const ExprList &program) {
+    Function run{"cpplisp_program"};
+    current = &run;
+    line("Result result;");
+    for (const auto &expr : program) {
+      auto value = emit(expr.get(), "env");
+      line("result = std::move(" + value + ");");
+    }
+    line("return result;");
+
+    std::ostringstream out;
+    out << "// generated by cpplisp --emit-cpp\n"
+        << "#include \"aot.h\"\n"
+        << "#include \"bignum.h\"\n"
+        << "#include \"builtins.h\"\n"
+        << "#include \"output.h\"\n\n"
+        << "#include <limits>\n\n"
+        << "namespace {\n\n";
+    for (const auto &f : functions) {
+      out << "Result " << f.first << "(Env &env);\n";
+    }
+    out << "\n" << constants.str() << "\n";
+    for (const auto &f : functions) {
+      out << "Result " << f.first << "(Env &env) {\n" << f.second << "}\n\n";
+    }
+    out << "} // namespace\n\n"
+        << "Result cpplisp_program(Env &env) {\n"
+        << run.code.str() << "}\n\n"
+        << "#ifndef CPPLISP_NO_MAIN\n"
+        << "int main() {\n"
+        << "  Env env;\n"
+        << "  auto result = cpplisp_program(env);\n"
+        << "  auto &sink = stdout_sink();\n"
+        << "  print_value(sink, result);\n"
+        << "  sink.put('\\n');\n"
+        << "  sink.flush();\n"
+        << "  return 0;\n"
+        << "}\n"
+        << "#endif\n";
+    return out.str();
+  }
+
+private:
+  struct Function {
+    std::string name;
+    std::ostringstream code;
+    int indent = 1;
+    int temps = 0;
+  };
+
+  void line(const std::string &code) {
+    current->code << std::string(2 * current->indent, ' ') << code << "\n";
+  }
+
+  void open(const std::string &code) {
+    line(code);
+    current->indent++;
+  }
+
+  void close(const std::string &code = "}") {
+    current->indent--;
+    line(code);
+  }
+
+  std::string temp(const std::string &prefix = "t") {
+    return prefix + std::to_string(++current->temps);
+  }
+
+  // a constant holding the name, to look it up without building a string
+  std::string name(const std::string &symbol) {
+    auto it = names.find(symbol);
+    if (it != names.end()) {
+      return it->second;
+    }
+    auto id = "name" + std::to_string(names.size());
+    constants << "const std::string " << id << " = " << literal(symbol)
+              << ";\n";
+    names.emplace(symbol, id);
+    return id;
+  }
+
+  std::string constant(const std::string &type, const std::string &value) {
+    auto id = "constant" + std::to_string(constant_count++);
+    constants << "const " << type << " " << id << " = " << value << ";\n";
+    return id;
+  }
+
+  std::string datum(const Result &value) {
+    if (std::holds_alternative<Nil>(value)) {
+      return "Result(Nil{})";
+    } else if (auto n = std::get_if<Number>(&value)) {
+      return "Result(Number(" + number_value(*n) + "))";
+    } else if (auto n = std::get_if<BigInt>(&value)) {
+      return "parse_integer(\"" + to_decimal(*n) + "\")";
+    } else if (auto b = std::get_if<Boolean>(&value)) {
+      return *b ? "Result(true)" : "Result(false)";
+    } else if (auto s = std::get_if<String>(&value)) {
+      return "Result(" + string_value(*s) + ")";
+    } else if (auto s = std::get_if<Symbol>(&value)) {
+      return "Result(Symbol{" + literal(s->name) + "})";
+    } else if (auto l = std::get_if<List>(&value)) {
+      std::string out = "Result(List(std::vector<Result>{";
+      for (int i = 0; i < l->list.size(); ++i) {
+        out += (i > 0 ? ", " : "") + datum(l->list[i]);
+      }
+      return out + "}))";
+    }
+    throw std::runtime_error("Cannot translate the quoted value " +
+                             to_string(value));
+  }
+
+  // emits the statements evaluating `expr` in the Env named `env`, returns
+  // the name of the variable holding its value
+  std::string emit(Expr *expr, const std::string &env) {
+    auto result = temp();
+    if (auto e = dynamic_cast<LiteralExpr<Number> *>(expr)) {
+      line("Result " + result + " = Number(" + number_value(e->value) + ");");
+    } else if (auto e = dynamic_cast<LiteralExpr<String> *>(expr)) {
+      line("Result " + result + " = " + string_value(e->value) + ";");
+    } else if (dynamic_cast<LiteralExpr<Nil> *>(expr)) {
+      line("Result " + result + ";");
+    } else if (auto e = dynamic_cast<QuoteExpr *>(expr)) {
+      line("Result " + result + " = " +
+           constant("Result", datum(e->value)) + ";");
+    } else if (auto e = dynamic_cast<SymbolExpr *>(expr)) {
+      line("Result " + result + " = aot_symbol(" + env + ", " +
+           name(e->symbol.name) + ");");
+    } else if (auto e = dynamic_cast<QuasiquoteExpr *>(expr)) {
+      auto list = temp("list");
+      line("List " + list + ";");
+      for (const auto &[splice, part] : e->parts) {
+        auto value = emit(part.get(), env);
+        if (splice) {
+          line("aot_splice(" + list + ", std::move(" + value + "));");
+        } else {
+          line(list + ".list.push_back(std::move(" + value + "));");
+        }
+      }
+      line("Result " + result + " = std::move(" + list + ");");
+    } else if (auto e = dynamic_cast<ListExpr *>(expr)) {
+      emit_call(*e, env, result);
+    } else if (auto e = dynamic_cast<DoExpr *>(expr)) {
+      line("Result " + result + ";");
+      for (const auto &sub : e->expressions) {
+        auto value = emit(sub.get(), env);
+        line(result + " = std::move(" + value + ");");
+      }
+    } else if (auto e = dynamic_cast<IfExpr *>(expr)) {
+      line("Result " + result + ";");
+      auto condition = emit(e->expressions[0].get(), env);
+      open("if (is_true(std::move(" + condition + "))) {");
+      assign(result, e->expressions[1].get(), env);
+      close("} else {");
+      current->indent++;
+      assign(result, e->expressions[2].get(), env);
+      close();
+    } else if (auto e = dynamic_cast<CondExpr *>(expr)) {
+      emit_cond(*e, env, result);
+    } else if (auto e = dynamic_cast<DefineExpr *>(expr)) {
+      auto value = emit(e->expr.get(), env);
+      line(env + "[" + name(e->var.symbol.name) + "] = std::move(" + value +
+           ");");
+      line("Result " + result + ";");
+    } else if (auto e = dynamic_cast<LetExpr *>(expr)) {
+      line("Result " + result + ";");
+      open("{");
+      auto scope = temp("env");
+      line("Env " + scope + " = " + env + ";");
+      for (const auto &[symbol, init] : e->vars) {
+        auto value = emit(init.get(), scope);
+        line(scope + "[" + name(symbol.name) + "] = std::move(" + value +
+             ");");
+      }
+      assign(result, e->expr.get(), scope);
+      close();
+    } else if (auto e = dynamic_cast<LoopExpr *>(expr)) {
+      emit_loop(*e, env, result);
+    } else if (auto e = dynamic_cast<RecurExpr *>(expr)) {
+      open("if (" + env + ".loop == nullptr) {");
+      line("throw std::runtime_error(\"'recur' outside of 'loop'\");");
+      close();
+      line(env + ".loop->next.resize(" +
+           std::to_string(e->expressions.size()) + ");");
+      for (int i = 0; i < e->expressions.size(); ++i) {
+        auto value = emit(e->expressions[i].get(), env);
+        line(env + ".loop->next[" + std::to_string(i) + "] = std::move(" +
+             value + ");");
+      }
+      line(env + ".loop->recur = true;");
+      line("Result " + result + ";");
+    } else if (auto e = dynamic_cast<LambdaExpr *>(expr)) {
+      emit_lambda(*e, env, result);
+    } else if (auto e = dynamic_cast<AndExpr *>(expr)) {
+      emit_logical(e->exprs, env, result, false);
+    } else if (auto e = dynamic_cast<OrExpr *>(expr)) {
+      emit_logical(e->exprs, env, result, true);
+    } else if (auto e = dynamic_cast<InlinedCallExpr *>(expr)) {
+      // the original call, which is what the inlined body stands for
+      return emit(e->call.get(), env);
+    } else if (auto e = dynamic_cast<ConstantExpr *>(expr)) {
+      return emit(e->call.get(), env);
+    } else {
+      throw std::runtime_error("Cannot translate expression to C++");
+    }
+    return result;
+  }
+
+  void assign(const std::string &result, Expr *expr, const std::string &env) {
+    auto value = emit(expr, env);
+    line(result + " = std::move(" + value + ");");
+  }
+
+  void emit_call(ListExpr &e, const std::string &env,
+                 const std::string &result) {
+    if (e.numeric != NumericOp::None) {
+      emit_numeric(e, env, result);
+      return;
+    }
+    if (e.expressions.empty()) {
+      line("Result " + result + " = List();");
+      return;
+    }
+
+    auto args = [&] {
+      auto args = temp("args");
+      line("std::vector<Result> " + args + ";");
+      line(args + ".reserve(" + std::to_string(e.expressions.size() - 1) +
+           ");");
+      for (int i = 1; i < e.expressions.size(); ++i) {
+        auto value = emit(e.expressions[i].get(), env);
+        line(args + ".push_back(std::move(" + value + "));");
+      }
+      return args;
+    };
+
+    if (auto head = dynamic_cast<SymbolExpr *>(e.expressions[0].get())) {
+      auto callee = temp("callee");
+      line("auto " + callee + " = aot_callee(" + env + ", " +
+           name(head->symbol.name) + ");");
+      auto values = args();
+      line("Result " + result + " = aot_apply(" + callee + ", " + values +
+           ", " + env + ");");
+    } else {
+      auto fn = emit(e.expressions[0].get(), env);
+      line("aot_check_callable(" + fn + ");");
+      auto values = args();
+      line("Result " + result + " = call(" + fn + ", " + values + ", " + env +
+           ");");
+    }
+  }
+
+  // a call marked by the checker, like evaluate_numeric
+  void emit_numeric(ListExpr &e, const std::string &env,
+                    const std::string &result) {
+    auto number = [&](int i) {
+      auto value = emit(e.expressions[i].get(), env);
+      auto n = temp("n");
+      line("Result " + n + " = aot_number(" + value + ");");
+      return n;
+    };
+
+    if (e.numeric >= NumericOp::Equal) {
+      auto a = number(1);
+      auto b = number(2);
+      std::string op = e.numeric == NumericOp::Equal       ? "=="
+                       : e.numeric == NumericOp::Less      ? "<"
+                       : e.numeric == NumericOp::Greater   ? ">"
+                       : e.numeric == NumericOp::LessEqual ? "<="
+                                                           : ">=";
+      line("Result " + result + " = compare_numbers(" + a + ", " + b +
+           ", \"" + (op == "==" ? "=" : op) + "\") " + op + " 0;");
+      return;
+    }
+
+    std::string op = e.numeric == NumericOp::Add        ? "Add"
+                     : e.numeric == NumericOp::Subtract ? "Subtract"
+                     : e.numeric == NumericOp::Multiply ? "Multiply"
+                                                        : "Divide";
+    auto acc = temp("n");
+    int first = 1;
+    if (e.numeric == NumericOp::Add) {
+      line("Result " + acc + " = Number(0);");
+    } else {
+      line("Result " + acc + " = " + number(1) + ";");
+      first = 2;
+    }
+    for (int i = first; i < e.expressions.size(); ++i) {
+      auto x = number(i);
+      line(acc + " = arithmetic(NumericOp::" + op + ", " + acc + ", " + x +
+           ");");
+    }
+    line("Result " + result + " = std::move(" + acc + ");");
+  }
+
+  void emit_cond(CondExpr &e, const std::string &env,
+                 const std::string &result) {
+    line("Result " + result + ";");
+    int depth = 0;
+    for (const auto &clause : e.expressions) {
+      auto pair = dynamic_cast<ListExpr *>(clause.get());
+      if (pair == nullptr || pair->expressions.size() < 2) {
+        line(pair == nullptr ? "throw std::runtime_error(\"Clause is not a "
+                               "pair of expressions\");"
+                             : "throw std::runtime_error(\"Require two "
+                               "expressions per clause in 'cond'\");");
+        break;
+      }
+      auto test = dynamic_cast<SymbolExpr *>(pair->expressions[0].get());
+      if (test != nullptr && test->symbol.name == "else") {
+        assign(result, pair->expressions[1].get(), env);
+        break;
+      }
+      auto condition = emit(pair->expressions[0].get(), env);
+      open("if (is_true(std::move(" + condition + "))) {");
+      assign(result, pair->expressions[1].get(), env);
+      close("} else {");
+      current->indent++;
+      depth++;
+    }
+    while (depth-- > 0) {
+      close();
+    }
+  }
+
+  void emit_loop(LoopExpr &e, const std::string &env,
+                 const std::string &result) {
+    line("Result " + result + ";");
+    open("{");
+    auto frame = temp("env");
+    auto loop = temp("loop");
+    line("Env " + frame + " = " + env + ";");
+    line("LoopFrame " + loop + ";");
+    line(frame + ".loop = &" + loop + ";");
+    std::vector<std::string> slots;
+    for (const auto &[symbol, init] : e.vars) {
+      // bound before its value is evaluated, like in LoopExpr
+      auto slot = temp("slot");
+      line("Result &" + slot + " = " + frame + "[" + name(symbol.name) +
+           "];");
+      auto value = emit(init.get(), frame);
+      line(slot + " = std::move(" + value + ");");
+      slots.push_back(slot);
+    }
+    open("while (true) {");
+    line("count_step();");
+    auto value = emit(e.expr.get(), frame);
+    open("if (!" + loop + ".recur) {");
+    line(result + " = std::move(" + value + ");");
+    line("break;");
+    close();
+    line(loop + ".recur = false;");
+    for (int i = 0; i < slots.size(); ++i) {
+      line(slots[i] + " = std::move(" + loop + ".next[" + std::to_string(i) +
+           "]);");
+    }
+    close();
+    close();
+  }
+
+  void emit_lambda(LambdaExpr &e, const std::string &env,
+                   const std::string &result) {
+    // the same checks as LambdaExpr::evaluate, reported when it is evaluated
+    std::vector<std::string> args;
+    std::optional<std::size_t> rest_index;
+    for (const auto &arg : e.arguments.expressions) {
+      auto symbol = dynamic_cast<SymbolExpr *>(arg.get());
+      if (symbol == nullptr) {
+        line("throw SyntaxError(\"Lambda argument is not a symbol\");");
+        line("Result " + result + ";");
+        return;
+      }
+      if (symbol->symbol.name == "&" && !rest_index) {
+        rest_index = args.size();
+      } else {
+        args.push_back("Symbol{" + literal(symbol->symbol.name) + "}");
+      }
+    }
+    bool variadic = rest_index.has_value();
+    if (variadic && args.size() != *rest_index + 1) {
+      line("throw SyntaxError(\"Expected a single argument after '&'\");");
+      line("Result " + result + ";");
+      return;
+    }
+
+    auto fn = "lambda" + std::to_string(functions.size());
+    auto enclosing = current;
+    Function body{fn};
+    current = &body;
+    auto value = emit(e.body.get(), "env");
+    line("return " + value + ";");
+    current = enclosing;
+    functions.emplace_back(fn, body.code.str());
+
+    std::string list = "{";
+    for (int i = 0; i < args.size(); ++i) {
+      list += (i > 0 ? ", " : "") + args[i];
+    }
+    auto params = constant("std::vector<Symbol>", list + "}");
+    auto native =
+        constant("ExprPtr", "std::make_shared<NativeExpr>(" + fn + ")");
+    line("Result " + result + " = aot_lambda(" + env + ", " + params + ", " +
+         (variadic ? "true" : "false") + ", " + native + ");");
+  }
+
+  // 'and' when `is_or` is false: the first operand whose truth is not
+  // `is_or` decides the value
+  void emit_logical(const ExprList &exprs, const std::string &env,
+                    const std::string &result, bool is_or) {
+    std::string initial = is_or ? "false" : "true";
+    std::string decided = is_or ? "true" : "false";
+    line("Result " + result + " = " + initial + ";");
+    int depth = 0;
+    for (const auto &expr : exprs) {
+      auto value = emit(expr.get(), env);
+      open(std::string("if (") + (is_or ? "" : "!") + "is_true(std::move(" +
+           value + "))) {");
+      line(result + " = " + decided + ";");
+      close("} else {");
+      current->indent++;
+      depth++;
+    }
+    while (depth-- > 0) {
+      close();
+    }
+  }
+
+  Function *current = nullptr;
+  // name and body of each lambda
+  std::vector<std::pair<std::string, std::string>> functions;
+  std::ostringstream constants;
+  std::unordered_map<std::string, std::string> names;
+  int constant_count = 0;
+};
+
+} // namespace
+
+std::string emit_cpp(const std::string &program) {
+  // the parse environment only serves the macros
+  Env env;
+  auto ast = Parser(&env).parse_all(tokenize(program));
+  try {
+    // marks the arithmetic on numbers, translated to plain C++ arithmetic
+    check_program(ast, env);
+  } catch (TypeError &) {
+    // the error is reported when the program runs, like when interpreted
+    ast = Parser(&env).parse_all(tokenize(program));
+  }
+  return Translator().translate(ast);
+}
+
+Callee aot_callee(Env &env, const std::string &name) {
+  if (auto func = env.get(name)) {
+    if (auto lambda = std::get_if<Lambda>(func)) {
+      return {lambda, nullptr};
+    } else if (auto builtin = std::get_if<Builtin>(func)) {
+      return {nullptr, builtin->fn};
+    }
+    throw std::runtime_error("Cannot apply, not a function: " +
+                             to_string(*func));
+  } else if (auto builtin = find_builtin(name)) {
+    return {nullptr, builtin->fn};
+  }
+  throw std::runtime_error("Unknown operation: " + name);
+}
+
+Result aot_apply(const Callee &callee, std::vector<Result> &args, Env &env) {
+  if (callee.lambda != nullptr) {
+    return apply_lambda(*callee.lambda, env, args);
+  }
+  return callee.builtin(args, env);
+}
+
+Result aot_symbol(Env &env, const std::string &name) {
+  if (auto val = env.get(name)) {
+    return *val;
+  } else if (auto builtin = find_builtin(name)) {
+    return *builtin;
+  }
+  throw std::runtime_error("Undeclared symbol " + name);
+}
+
+Result aot_lambda(Env &env, const std::vector<Symbol> &args, bool variadic,
+                  const ExprPtr &body) {
+  auto closure_env = std::make_shared<Env>();
+  *closure_env = env;
+  closure_env->loop = nullptr;
+  return Lambda{args, body, closure_env, variadic};
+}
+
+const Result &aot_number(const Result &value) {
+  if (is_number(value)) {
+    return value;
+  }
+  throw std::runtime_error("Expected a number, got " + to_string(value));
+}
+
+void aot_check_callable(const Result &fn) {
+  if (!std::holds_alternative<Lambda>(fn) &&
+      !std::holds_alternative<Builtin>(fn)) {
+    throw std::runtime_error("Unknown operator");
+  }
+}
+
+void aot_splice(List &list, Result value) {
+  if (auto l = std::get_if<List>(&value)) {
+    for (std::size_t i = 0; i < l->list.size(); ++i) {
+      list.list.push_back(l->list.take(i));
+    }
+  } else {
+    throw std::runtime_error("Can only splice a list, got " +
+                             to_string(value));
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "ast.h"
+#include "resources.h"
+
+#include <string>
+#include <vector>
+
+// Translates a program to C++ source. The generated code evaluates the forms
+// like the interpreter, with the same environments and builtins, but each
+// expression is a statement of a C++ function instead of a node of the tree.
+// It defines `Result cpplisp_program(Env &env)` and, unless CPPLISP_NO_MAIN
+// is defined, a main() printing the result like `cpplisp script`. Build it
+// against liblisp with src/ in the include path. Macros are expanded when
+// translating, so they can only use the builtins.
+std::string emit_cpp(const std::string &program);
+
+// Runtime support of the generated code.
+
+// the body of a compiled lambda
+struct NativeExpr : public Expr {
+  using Fn = Result (*)(Env &env);
+
+  explicit NativeExpr(Fn fn) : fn(fn) {}
+  Result evaluate(Env &env) override { return fn(env); }
+
+  Fn fn;
+};
+
+// the function a call refers to, looked up before its arguments are evaluated
+struct Callee {
+  const Lambda *lambda = nullptr;
+  BuiltinFn builtin = nullptr;
+};
+
+Callee aot_callee(Env &env, const std::string &name);
+Result aot_apply(const Callee &callee, std::vector<Result> &args, Env &env);
+Result aot_symbol(Env &env, const std::string &name);
+Result aot_lambda(Env &env, const std::vector<Symbol> &args, bool variadic,
+                  const ExprPtr &body);
+// the operand of a call marked by the checker, see ListExpr::numeric;
+// throws unless it is a Number or a BigInt
+const Result &aot_number(const Result &value);
+// throws unless `fn` is a lambda or a builtin
+void aot_check_callable(const Result &fn);
+// appends the elements of `value`, for ,@
+void aot_splice(List &list, Result value);
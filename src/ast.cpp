@@ -1,6 +1,18 @@
 #include "ast.h"
 
+#include "bignum.h"
 #include "builtins.h"
+#include "jit.h"
+#include "memory.h"
+#include "resources.h"
+
+#include <optional>
+
+// a copy of the bindings of `env`, counted as environment memory
+Env copy_env(const Env &env) {
+  MemoryScope scope(MemoryCategory::Environment);
+  return env;
+}
 
 std::vector<Result> eval_all(Env &env, const ExprList &exprs) {
   std::vector<Result> results;
@@ -11,28 +23,78 @@ std::vector<Result> eval_all(Env &env, const ExprList &exprs) {
   return results;
 }
 
+// evaluates the arguments of a call, without copying the expressions
+std::vector<Result> eval_arguments(Env &env, const ExprList &exprs) {
+  std::vector<Result> results;
+  results.reserve(exprs.size() - 1);
+  for (int i = 1; i < exprs.size(); ++i) {
+    results.push_back(exprs[i]->evaluate(env));
+  }
+  return results;
+}
+
 Result apply_lambda(const Lambda &lambda, Env &env,
                     const std::vector<Result> &args) {
-  Env bindings = env;
-  for (int i = 0; i < args.size(); ++i) {
-    bindings[lambda.arguments[i].name] = args[i];
+  if (!lambda.variadic && args.size() != lambda.arguments.size()) {
+    throw std::runtime_error(
+        "Expected " + std::to_string(lambda.arguments.size()) +
+        " arguments, got " + std::to_string(args.size()));
+  }
+  count_step();
+  CallDepth depth;
+  // native code does not count its steps
+  if (!resource_state.active) {
+    if (auto result = jit_call(lambda, env, args)) {
+      return *result;
+    }
+  }
+
+  MemoryScope scope(MemoryCategory::Environment);
+  Env bindings = lambda.module ? *lambda.env : env;
+  bindings.loop = nullptr;
+  if (lambda.variadic) {
+    // the last argument collects the remaining values in a list
+    auto fixed = lambda.arguments.size() - 1;
+    if (args.size() < fixed) {
+      throw std::runtime_error("Expected at least " + std::to_string(fixed) +
+                               " arguments");
+    }
+    for (int i = 0; i < fixed; ++i) {
+      bindings[lambda.arguments[i].name] = args[i];
+    }
+    bindings[lambda.arguments.back().name] =
+        List(std::vector<Result>(args.begin() + fixed, args.end()));
+  } else {
+    for (int i = 0; i < args.size(); ++i) {
+      bindings[lambda.arguments[i].name] = args[i];
+    }
   }
 
   // in this order, the bindings from parameters are not replaced by the
   // lambda.env values in case they match
-  bindings.merge(*lambda.env);
+  bindings.merge(lambda.module ? env : *lambda.env);
+  // what the body allocates is not part of the call
+  MemoryScope body_scope(MemoryCategory::Other);
   return lambda.body->evaluate(bindings);
 }
 
 Result SymbolExpr::evaluate(Env &env) {
   if (auto val = env.get(symbol.name)) {
     return *val;
+  } else if (auto builtin = find_builtin(symbol.name)) {
+    return *builtin;
   } else {
     throw std::runtime_error("Undeclared symbol " + symbol.name);
   }
 }
 
 Result ListExpr::evaluate(Env &env) {
+  // unless the operator was bound after the program was checked
+  if (numeric != NumericOp::None &&
+      env.get(static_cast<SymbolExpr *>(expressions[0].get())->symbol.name) ==
+          nullptr) {
+    return evaluate_numeric(env);
+  }
   if (expressions.empty()) {
     return List();
   }
@@ -41,24 +103,95 @@ Result ListExpr::evaluate(Env &env) {
   if (expr != nullptr) {
     if (auto func = env.get(expr->symbol.name)) {
       if (auto lambda = std::get_if<Lambda>(func)) {
-        return apply_lambda(*lambda, env, eval_all(env, rest(expressions)));
+        return apply_lambda(*lambda, env, eval_arguments(env, expressions));
+      } else if (auto builtin = std::get_if<Builtin>(func)) {
+        auto args = eval_arguments(env, expressions);
+        return builtin->fn(args, env);
       } else {
         throw std::runtime_error("Cannot apply, not a function: " +
                                  to_string(*func));
       }
+    } else if (auto builtin = find_builtin(expr->symbol.name)) {
+      auto args = eval_arguments(env, expressions);
+      return builtin->fn(args, env);
     } else {
-      return apply_op(expr->symbol.name, eval_all(env, rest(expressions)));
+      throw std::runtime_error("Unknown operation: " + expr->symbol.name);
     }
   } else {
     auto obj = expressions[0]->evaluate(env);
-    if (auto lambda = std::get_if<Lambda>(&obj)) {
-      return apply_lambda(*lambda, env, eval_all(env, rest(expressions)));
+    if (std::holds_alternative<Lambda>(obj) ||
+        std::holds_alternative<Builtin>(obj)) {
+      auto args = eval_arguments(env, expressions);
+      return call(obj, args, env);
     } else {
       throw std::runtime_error("Unknown operator");
     }
   }
 }
 
+Result ListExpr::evaluate_numeric(Env &env) {
+  auto number = [&](int i) {
+    auto value = expressions[i]->evaluate(env);
+    // the checker proved it, this only guards against a redefinition of a
+    // function called by the argument after the program was checked
+    if (is_number(value)) {
+      return value;
+    }
+    throw std::runtime_error("Expected a number, got " + to_string(value));
+  };
+
+  if (numeric >= NumericOp::Equal) {
+    // both evaluated first, in order
+    auto a = number(1);
+    auto b = number(2);
+    auto order = compare_numbers(a, b, "=");
+    switch (numeric) {
+    case NumericOp::Equal:
+      return order == 0;
+    case NumericOp::Less:
+      return order < 0;
+    case NumericOp::Greater:
+      return order > 0;
+    case NumericOp::LessEqual:
+      return order <= 0;
+    default:
+      return order >= 0;
+    }
+  }
+
+  Result n = numeric == NumericOp::Add ? Number(0) : number(1);
+  for (int i = numeric == NumericOp::Add ? 1 : 2; i < expressions.size();
+       ++i) {
+    n = arithmetic(numeric, n, number(i));
+  }
+  return n;
+}
+
+Result ConstantExpr::evaluate(Env &env) {
+  if (env.get(op) == nullptr) {
+    return value;
+  }
+  return call->evaluate(env);
+}
+
+Result QuasiquoteExpr::evaluate(Env &env) {
+  List list;
+  for (const auto &[splice, expr] : parts) {
+    auto value = expr->evaluate(env);
+    if (!splice) {
+      list.list.push_back(std::move(value));
+    } else if (auto l = std::get_if<List>(&value)) {
+      for (std::size_t i = 0; i < l->list.size(); ++i) {
+        list.list.push_back(l->list.take(i));
+      }
+    } else {
+      throw std::runtime_error("Can only splice a list, got " +
+                               to_string(value));
+    }
+  }
+  return list;
+}
+
 Result DoExpr::evaluate(Env &env) {
   // keep only last result, discard the rest for optimisation
   Result res;
@@ -106,7 +239,7 @@ Result DefineExpr::evaluate(Env &env) {
 }
 
 Result LetExpr::evaluate(Env &env) {
-  Env new_env = env;
+  Env new_env = copy_env(env);
   for (const auto &pair : vars) {
     // passing new_env to evaluate() make the previous bindings available to
     // further declarations, e.g.: (let (x 1 y (+ x 2)) y) -> 3
@@ -116,20 +249,134 @@ Result LetExpr::evaluate(Env &env) {
   return expr->evaluate(new_env);
 }
 
+Result LoopExpr::evaluate(Env &env) {
+  Env frame = copy_env(env);
+  LoopFrame loop;
+  frame.loop = &loop;
+
+  // references to the bindings stay valid, the loop variables are reassigned
+  // in place on each iteration
+  std::vector<Result *> slots;
+  slots.reserve(vars.size());
+  for (const auto &pair : vars) {
+    auto &slot = frame[pair.first.name];
+    slot = pair.second->evaluate(frame);
+    slots.push_back(&slot);
+  }
+
+  while (true) {
+    count_step();
+    auto res = expr->evaluate(frame);
+    if (!loop.recur) {
+      return res;
+    }
+    loop.recur = false;
+    for (int i = 0; i < slots.size(); ++i) {
+      *slots[i] = std::move(loop.next[i]);
+    }
+  }
+}
+
+Result RecurExpr::evaluate(Env &env) {
+  if (env.loop == nullptr) {
+    throw std::runtime_error("'recur' outside of 'loop'");
+  }
+  // evaluate everything before touching the frame, the arguments can refer
+  // to the current values of the loop variables
+  auto &next = env.loop->next;
+  next.resize(expressions.size());
+  for (int i = 0; i < expressions.size(); ++i) {
+    next[i] = expressions[i]->evaluate(env);
+  }
+  env.loop->recur = true;
+  return Nil{};
+}
+
+LambdaExpr::LambdaExpr(ListExpr args, ExprPtr body)
+    : arguments(std::move(args)), body(std::move(body)),
+      jit(std::make_shared<JitInfo>()) {}
+
 Result LambdaExpr::evaluate(Env &env) {
   std::vector<Symbol> args;
+  // index of the rest argument, after '&'
+  std::optional<std::size_t> rest_index;
   for (const auto &arg : arguments.expressions) {
     auto symbol = dynamic_cast<SymbolExpr *>(arg.get());
     if (symbol == nullptr) {
       throw SyntaxError("Lambda argument is not a symbol");
     }
-    args.push_back(symbol->symbol);
+    if (symbol->symbol.name == "&" && !rest_index) {
+      rest_index = args.size();
+    } else {
+      args.push_back(symbol->symbol);
+    }
+  }
+  bool variadic = rest_index.has_value();
+  if (variadic && args.size() != *rest_index + 1) {
+    throw SyntaxError("Expected a single argument after '&'");
   }
 
   // copy env to pointer
+  MemoryScope scope(MemoryCategory::Closure);
   auto closure_env = std::make_shared<Env>();
   *closure_env = env;
-  return Lambda{args, body, closure_env};
+  closure_env->loop = nullptr;
+  return Lambda{args, body, closure_env, variadic, false, jit};
+}
+
+Result InlineExpr::evaluate(Env &env) {
+  auto values = eval_all(env, args);
+  if (in_place) {
+    return evaluate_in_place(env, std::move(values));
+  }
+
+  Env bindings = copy_env(env);
+  bindings.loop = nullptr;
+  for (int i = 0; i < params.size(); ++i) {
+    bindings[params[i].name] = std::move(values[i]);
+  }
+  return body->evaluate(bindings);
+}
+
+Result InlineExpr::evaluate_in_place(Env &env, std::vector<Result> values) {
+  // restores the bindings of the caller, even when the body throws
+  struct Restore {
+    Env &env;
+    const std::vector<Symbol> &params;
+    std::vector<std::optional<Result>> saved;
+
+    ~Restore() {
+      for (int i = saved.size() - 1; i >= 0; --i) {
+        if (saved[i]) {
+          env[params[i].name] = std::move(*saved[i]);
+        } else {
+          env.bindings.erase(params[i].name);
+        }
+      }
+    }
+  } restore{env, params, {}};
+
+  restore.saved.reserve(params.size());
+  for (int i = 0; i < params.size(); ++i) {
+    auto [it, inserted] = env.bindings.try_emplace(params[i].name);
+    if (inserted) {
+      restore.saved.emplace_back();
+    } else {
+      restore.saved.emplace_back(std::move(it->second));
+    }
+    it->second = std::move(values[i]);
+  }
+  return body->evaluate(env);
+}
+
+Result InlinedCallExpr::evaluate(Env &env) {
+  if (auto value = env.get(name)) {
+    if (auto lambda = std::get_if<Lambda>(value);
+        lambda != nullptr && lambda->body == body) {
+      return inlined->evaluate(env);
+    }
+  }
+  return call->evaluate(env);
 }
 
 Result AndExpr::evaluate(Env &env) {
@@ -3,6 +3,7 @@
 #include "env.h"
 #include "types.h"
 #include "utility.h"
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <unordered_map>
@@ -11,6 +12,11 @@
 struct Expr {
   virtual Result evaluate(Env &env) = 0;
   //  virtual ~Expr() = default;
+
+  // where the expression starts in the source, 0 when unknown (see
+  // Parser::record_positions)
+  std::uint32_t line = 0;
+  std::uint32_t column = 0;
 };
 
 using ExprPtr = std::shared_ptr<Expr>;
@@ -35,12 +41,64 @@ template <typename T> struct LiteralExpr : public Expr {
   T value;
 };
 
+// a quoted value, evaluates to itself
+struct QuoteExpr : public Expr {
+  explicit QuoteExpr(Result value) : value(std::move(value)) {}
+  Result evaluate(Env &env) override { return value; }
+
+  Result value;
+};
+
+// a call building data from constants, e.g. (list 1 2 3), evaluated by the
+// parser: evaluates to `value` while `op` is the builtin, to the call once a
+// binding shadows it
+struct ConstantExpr : public Expr {
+  ConstantExpr(std::string op, Result value, ExprPtr call)
+      : op(std::move(op)), value(std::move(value)), call(std::move(call)) {}
+  Result evaluate(Env &env) override;
+
+  std::string op;
+  Result value;
+  ExprPtr call;
+};
+
+// builds a list from a quasiquoted template, the spliced parts are
+// concatenated instead of inserted
+struct QuasiquoteExpr : public Expr {
+  using Parts = std::vector<std::pair<bool, ExprPtr>>;
+
+  explicit QuasiquoteExpr(Parts parts) : parts(std::move(parts)) {}
+  Result evaluate(Env &env) override;
+
+  Parts parts;
+};
+
+enum class NumericOp {
+  None,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Equal,
+  Less,
+  Greater,
+  LessEqual,
+  GreaterEqual
+};
+
 struct ListExpr : public Expr {
   ListExpr() = default;
   explicit ListExpr(ExprList exprs) : expressions(std::move(exprs)) {}
   Result evaluate(Env &env) override;
 
   ExprList expressions{};
+  // set by the checker on calls to an arithmetic or comparison builtin with
+  // arguments proven to be numbers, the call then skips the lookup of the
+  // builtin and the argument vector, as long as the operator is not bound
+  NumericOp numeric = NumericOp::None;
+
+private:
+  Result evaluate_numeric(Env &env);
 };
 
 struct DoExpr : public Expr {
@@ -88,13 +146,71 @@ struct LetExpr : public Expr {
   ExprPtr expr;
 };
 
+// Iterates without growing the stack: 'recur' stores the next values of the
+// loop variables here and the loop rebinds them in place.
+struct LoopFrame {
+  std::vector<Result> next;
+  bool recur = false;
+};
+
+struct LoopExpr : public Expr {
+  LoopExpr(LetExpr::Bindings vars, ExprPtr expr)
+      : vars(std::move(vars)), expr(std::move(expr)) {}
+  Result evaluate(Env &env) override;
+
+  LetExpr::Bindings vars;
+  ExprPtr expr;
+};
+
+struct RecurExpr : public Expr {
+  explicit RecurExpr(ExprList exprs) : expressions(std::move(exprs)) {}
+  Result evaluate(Env &env) override;
+
+  ExprList expressions;
+};
+
 struct LambdaExpr : public Expr {
-  LambdaExpr(ListExpr args, ExprPtr body)
-      : arguments(std::move(args)), body(std::move(body)) {}
+  LambdaExpr(ListExpr args, ExprPtr body);
   Result evaluate(Env &env) override;
 
   ListExpr arguments;
   ExprPtr body;
+  // shared by the lambdas it creates, which can run on several threads
+  std::shared_ptr<JitInfo> jit;
+};
+
+// the body of a lambda inlined at a call site: the arguments are evaluated
+// and bound like in apply_lambda, without the lambda value nor its closure
+struct InlineExpr : public Expr {
+  InlineExpr(std::vector<Symbol> params, ExprList args, ExprPtr body)
+      : params(std::move(params)), args(std::move(args)),
+        body(std::move(body)) {}
+  Result evaluate(Env &env) override;
+
+  std::vector<Symbol> params;
+  ExprList args;
+  ExprPtr body;
+  // the body neither binds names nor calls lambdas: the arguments are bound
+  // in the caller's environment for its evaluation instead of a copy
+  bool in_place = false;
+
+private:
+  Result evaluate_in_place(Env &env, std::vector<Result> values);
+};
+
+// evaluates `inlined` while `name` is bound to the lambda whose body was
+// inlined, and falls back to the original call once it is redefined
+struct InlinedCallExpr : public Expr {
+  InlinedCallExpr(std::string name, ExprPtr body, ExprPtr inlined,
+                  ExprPtr call)
+      : name(std::move(name)), body(std::move(body)),
+        inlined(std::move(inlined)), call(std::move(call)) {}
+  Result evaluate(Env &env) override;
+
+  std::string name;
+  ExprPtr body;
+  ExprPtr inlined;
+  ExprPtr call;
 };
 
 struct AndExpr : public Expr {
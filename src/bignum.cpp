@@ -0,0 +1,521 @@
+#include "bignum.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+using Limb = std::uint32_t;
+using Wide = std::uint64_t;
+// least significant limb first, without leading zero limbs
+using Magnitude = std::vector<Limb>;
+
+// products of operands at least this long, in limbs, use Karatsuba
+constexpr std::size_t KARATSUBA_THRESHOLD = 32;
+// 10^9, the decimal digits are converted 9 at a time
+constexpr Limb DECIMAL_BASE = 1000000000;
+
+struct Integer {
+  bool negative = false;
+  Magnitude magnitude;
+};
+
+void trim(Magnitude &a) {
+  while (!a.empty() && a.back() == 0) {
+    a.pop_back();
+  }
+}
+
+int compare(const Magnitude &a, const Magnitude &b) {
+  if (a.size() != b.size()) {
+    return a.size() < b.size() ? -1 : 1;
+  }
+  for (auto i = a.size(); i-- > 0;) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+Magnitude add(const Magnitude &a, const Magnitude &b) {
+  const auto &longer = a.size() >= b.size() ? a : b;
+  const auto &shorter = a.size() >= b.size() ? b : a;
+  Magnitude sum(longer.size() + 1);
+  Wide carry = 0;
+  for (std::size_t i = 0; i < longer.size(); ++i) {
+    carry += Wide(longer[i]) + (i < shorter.size() ? shorter[i] : 0);
+    sum[i] = Limb(carry);
+    carry >>= 32;
+  }
+  sum.back() = Limb(carry);
+  trim(sum);
+  return sum;
+}
+
+// a - b, with a >= b
+Magnitude subtract(const Magnitude &a, const Magnitude &b) {
+  Magnitude difference(a.size());
+  Wide borrow = 0;
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    Wide subtrahend = (i < b.size() ? b[i] : 0) + borrow;
+    borrow = Wide(a[i]) < subtrahend;
+    difference[i] = Limb(Wide(a[i]) - subtrahend);
+  }
+  trim(difference);
+  return difference;
+}
+
+// a += b << (32 * offset), a is large enough for the sum
+void add_at(Magnitude &a, const Magnitude &b, std::size_t offset) {
+  Wide carry = 0;
+  std::size_t i = 0;
+  for (; i < b.size(); ++i) {
+    carry += Wide(a[offset + i]) + b[i];
+    a[offset + i] = Limb(carry);
+    carry >>= 32;
+  }
+  for (auto j = offset + i; carry != 0; ++j) {
+    carry += a[j];
+    a[j] = Limb(carry);
+    carry >>= 32;
+  }
+}
+
+Magnitude schoolbook(const Limb *a, std::size_t n, const Limb *b,
+                     std::size_t m) {
+  Magnitude product(n + m);
+  for (std::size_t i = 0; i < n; ++i) {
+    Wide carry = 0;
+    for (std::size_t j = 0; j < m; ++j) {
+      // at most (2^32 - 1)^2 + 2 (2^32 - 1), it fits
+      carry += Wide(a[i]) * b[j] + product[i + j];
+      product[i + j] = Limb(carry);
+      carry >>= 32;
+    }
+    product[i + m] = Limb(carry);
+  }
+  trim(product);
+  return product;
+}
+
+// Karatsuba: with a = a1 B + a0 and b = b1 B + b0, a b is
+// a1 b1 B^2 + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B + a0 b0, three
+// products of half the size instead of four
+Magnitude multiply(const Limb *a, std::size_t n, const Limb *b,
+                   std::size_t m) {
+  if (std::min(n, m) < KARATSUBA_THRESHOLD) {
+    return schoolbook(a, n, b, m);
+  }
+  auto half = std::max(n, m) / 2;
+  auto a0 = std::min(n, half);
+  auto b0 = std::min(m, half);
+  auto low = multiply(a, a0, b, b0);
+  auto high = multiply(a + a0, n - a0, b + b0, m - b0);
+
+  auto part = [](const Limb *p, std::size_t from, std::size_t to) {
+    Magnitude magnitude(p + from, p + to);
+    trim(magnitude);
+    return magnitude;
+  };
+  auto a_sum = add(part(a, 0, a0), part(a, a0, n));
+  auto b_sum = add(part(b, 0, b0), part(b, b0, m));
+  auto middle = multiply(a_sum.data(), a_sum.size(), b_sum.data(),
+                         b_sum.size());
+  middle = subtract(subtract(middle, low), high);
+
+  Magnitude product(n + m + 1);
+  add_at(product, low, 0);
+  add_at(product, middle, half);
+  add_at(product, high, 2 * half);
+  trim(product);
+  return product;
+}
+
+Magnitude multiply(const Magnitude &a, const Magnitude &b) {
+  return multiply(a.data(), a.size(), b.data(), b.size());
+}
+
+// the quotient, `a` becomes the remainder
+Magnitude divide_small(Magnitude &a, Limb divisor) {
+  Magnitude quotient(a.size());
+  Wide remainder = 0;
+  for (auto i = a.size(); i-- > 0;) {
+    remainder = (remainder << 32) | a[i];
+    quotient[i] = Limb(remainder / divisor);
+    remainder %= divisor;
+  }
+  trim(quotient);
+  a.assign(1, Limb(remainder));
+  trim(a);
+  return quotient;
+}
+
+Magnitude shift_left(const Magnitude &a, int bits) {
+  Magnitude shifted(a.size() + 1);
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    auto wide = Wide(a[i]) << bits;
+    shifted[i] |= Limb(wide);
+    shifted[i + 1] = Limb(wide >> 32);
+  }
+  return shifted;
+}
+
+Magnitude shift_right(const Magnitude &a, int bits) {
+  Magnitude shifted(a.size());
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    auto wide = Wide(a[i]) | (i + 1 < a.size() ? Wide(a[i + 1]) << 32 : 0);
+    shifted[i] = Limb(wide >> bits);
+  }
+  trim(shifted);
+  return shifted;
+}
+
+// the quotient and the remainder, Knuth's algorithm D
+std::pair<Magnitude, Magnitude> divide(const Magnitude &a,
+                                       const Magnitude &b) {
+  if (compare(a, b) < 0) {
+    return {Magnitude(), a};
+  }
+  if (b.size() == 1) {
+    auto remainder = a;
+    auto quotient = divide_small(remainder, b[0]);
+    return {std::move(quotient), std::move(remainder)};
+  }
+
+  // the estimates of the quotient limbs are off by at most 2 once the top
+  // limb of the divisor has its high bit set
+  int bits = std::countl_zero(b.back());
+  auto u = shift_left(a, bits);
+  auto v = shift_left(b, bits);
+  trim(v);
+  auto n = v.size();
+  auto m = u.size() - n;
+  Magnitude quotient(m);
+  for (auto j = m; j-- > 0;) {
+    auto numerator = (Wide(u[j + n]) << 32) | u[j + n - 1];
+    auto estimate = numerator / v[n - 1];
+    auto rest = numerator % v[n - 1];
+    while (estimate >> 32 ||
+           estimate * v[n - 2] > ((rest << 32) | u[j + n - 2])) {
+      estimate--;
+      rest += v[n - 1];
+      if (rest >> 32) {
+        break;
+      }
+    }
+
+    // u[j .. j + n] -= estimate v
+    Wide carry = 0;
+    Wide borrow = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      auto product = estimate * v[i] + carry;
+      carry = product >> 32;
+      auto subtrahend = (product & 0xFFFFFFFF) + borrow;
+      borrow = Wide(u[i + j]) < subtrahend;
+      u[i + j] = Limb(Wide(u[i + j]) - subtrahend);
+    }
+    auto subtrahend = carry + borrow;
+    bool negative = Wide(u[j + n]) < subtrahend;
+    u[j + n] = Limb(Wide(u[j + n]) - subtrahend);
+    if (negative) {
+      // one too many, adds v back
+      estimate--;
+      carry = 0;
+      for (std::size_t i = 0; i < n; ++i) {
+        carry += Wide(u[i + j]) + v[i];
+        u[i + j] = Limb(carry);
+        carry >>= 32;
+      }
+      u[j + n] += Limb(carry);
+    }
+    quotient[j] = Limb(estimate);
+  }
+  trim(quotient);
+  u.resize(n);
+  return {std::move(quotient), shift_right(u, bits)};
+}
+
+bool integral(const Result &value) {
+  if (auto n = std::get_if<Number>(&value)) {
+    return std::isfinite(*n) && std::trunc(*n) == *n;
+  }
+  return std::holds_alternative<BigInt>(value);
+}
+
+// An integer computed exactly. Exact results beyond 2^53 are BigInts, so a
+// larger Number, like 1e300, comes from a rounded computation or literal.
+bool exact(const Result &value) {
+  if (auto n = std::get_if<Number>(&value)) {
+    return std::trunc(*n) == *n && std::abs(*n) <= MAX_EXACT;
+  }
+  return true;
+}
+
+double approximate(const Result &value) {
+  if (auto n = std::get_if<Number>(&value)) {
+    return *n;
+  }
+  return to_double(std::get<BigInt>(value));
+}
+
+Magnitude magnitude_of(double x) {
+  x = std::abs(x);
+  if (x == 0) {
+    return {};
+  }
+  // x = mantissa 2^exponent, with an integer mantissa of 53 bits
+  int exponent;
+  auto mantissa = Wide(std::ldexp(std::frexp(x, &exponent), 53));
+  exponent -= 53;
+  if (exponent <= 0) {
+    mantissa >>= -exponent;
+    Magnitude magnitude{Limb(mantissa), Limb(mantissa >> 32)};
+    trim(magnitude);
+    return magnitude;
+  }
+  Magnitude magnitude(exponent / 32);
+  magnitude.push_back(Limb(mantissa));
+  magnitude.push_back(Limb(mantissa >> 32));
+  magnitude.push_back(0);
+  auto bits = exponent % 32;
+  if (bits != 0) {
+    magnitude = shift_left(magnitude, bits);
+  }
+  trim(magnitude);
+  return magnitude;
+}
+
+// `value` is exact
+Integer integer(const Result &value) {
+  if (auto n = std::get_if<Number>(&value)) {
+    return {*n < 0, magnitude_of(*n)};
+  }
+  const auto &big = std::get<BigInt>(value);
+  return {big.negative, *big.limbs};
+}
+
+// a Number when it is small enough
+Result normalize(Integer n) {
+  if (n.magnitude.size() <= 2) {
+    Wide value = 0;
+    for (auto i = n.magnitude.size(); i-- > 0;) {
+      value = (value << 32) | n.magnitude[i];
+    }
+    if (value <= Wide(MAX_EXACT)) {
+      auto number = static_cast<Number>(value);
+      return n.negative && value != 0 ? -number : number;
+    }
+  }
+  return BigInt{n.negative, std::make_shared<const Magnitude>(
+                                std::move(n.magnitude))};
+}
+
+Integer add(const Integer &a, const Integer &b) {
+  if (a.negative == b.negative) {
+    return {a.negative, add(a.magnitude, b.magnitude)};
+  }
+  if (compare(a.magnitude, b.magnitude) >= 0) {
+    return {a.negative, subtract(a.magnitude, b.magnitude)};
+  }
+  return {b.negative, subtract(b.magnitude, a.magnitude)};
+}
+
+const char *operator_name(NumericOp op) {
+  switch (op) {
+  case NumericOp::Add:
+    return "+";
+  case NumericOp::Subtract:
+    return "-";
+  case NumericOp::Multiply:
+    return "*";
+  default:
+    return "/";
+  }
+}
+
+void check_numbers(const Result &a, const Result &b, const std::string &op) {
+  for (const auto *value : {&a, &b}) {
+    if (!is_number(*value)) {
+      throw std::runtime_error("'" + op + "' requires numbers, got " +
+                               to_string(*value));
+    }
+  }
+}
+
+void check_integers(const Result &a, const Result &b, const std::string &op) {
+  for (const auto *value : {&a, &b}) {
+    if (!integral(*value)) {
+      throw std::runtime_error("'" + op + "' requires integers, got " +
+                               to_string(*value));
+    }
+  }
+  if (auto n = std::get_if<Number>(&b); n && *n == 0) {
+    throw std::runtime_error("Division by zero");
+  }
+}
+
+std::size_t combine(std::size_t seed, std::size_t hash) {
+  return seed ^ (hash + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+}
+
+} // namespace
+
+Result arithmetic_slow(NumericOp op, const Result &a, const Result &b) {
+  check_numbers(a, b, operator_name(op));
+  if (!exact(a) || !exact(b)) {
+    auto x = approximate(a);
+    auto y = approximate(b);
+    switch (op) {
+    case NumericOp::Add:
+      return x + y;
+    case NumericOp::Subtract:
+      return x - y;
+    case NumericOp::Multiply:
+      return x * y;
+    default:
+      return x / y;
+    }
+  }
+
+  auto x = integer(a);
+  auto y = integer(b);
+  switch (op) {
+  case NumericOp::Add:
+    return normalize(add(x, y));
+  case NumericOp::Subtract:
+    y.negative = !y.negative;
+    return normalize(add(x, y));
+  case NumericOp::Multiply:
+    return normalize(
+        {x.negative != y.negative, multiply(x.magnitude, y.magnitude)});
+  default:
+    if (!y.magnitude.empty()) {
+      auto [quotient, remainder] = divide(x.magnitude, y.magnitude);
+      if (remainder.empty()) {
+        return normalize({x.negative != y.negative, std::move(quotient)});
+      }
+    }
+    return approximate(a) / approximate(b);
+  }
+}
+
+std::partial_ordering compare_slow(const Result &a, const Result &b,
+                                   const char *op) {
+  check_numbers(a, b, op);
+  if (!integral(a) || !integral(b)) {
+    // a fraction is smaller than any BigInt in magnitude
+    return approximate(a) <=> approximate(b);
+  }
+  auto x = integer(a);
+  auto y = integer(b);
+  if (x.negative != y.negative) {
+    return x.negative ? std::partial_ordering::less
+                      : std::partial_ordering::greater;
+  }
+  auto order = compare(x.magnitude, y.magnitude);
+  if (x.negative) {
+    order = -order;
+  }
+  return order <=> 0;
+}
+
+Result quotient(const Result &a, const Result &b) {
+  check_integers(a, b, "quotient");
+  auto numbers = std::holds_alternative<Number>(a) &&
+                 std::holds_alternative<Number>(b);
+  if (numbers || !exact(a) || !exact(b)) {
+    auto x = approximate(a);
+    auto y = approximate(b);
+    // without -0
+    return (x - std::fmod(x, y)) / y + 0.0;
+  }
+  auto dividend = integer(a);
+  auto divisor = integer(b);
+  auto quotient = divide(dividend.magnitude, divisor.magnitude).first;
+  return normalize(
+      {dividend.negative != divisor.negative, std::move(quotient)});
+}
+
+Result remainder(const Result &a, const Result &b) {
+  check_integers(a, b, "remainder");
+  auto numbers = std::holds_alternative<Number>(a) &&
+                 std::holds_alternative<Number>(b);
+  if (numbers || !exact(a) || !exact(b)) {
+    return std::fmod(approximate(a), approximate(b)) + 0.0;
+  }
+  auto dividend = integer(a);
+  auto divisor = integer(b);
+  auto remainder = divide(dividend.magnitude, divisor.magnitude).second;
+  return normalize({dividend.negative, std::move(remainder)});
+}
+
+Result parse_integer(const std::string &digits) {
+  Integer n;
+  std::size_t start = 0;
+  if (!digits.empty() && (digits[0] == '-' || digits[0] == '+')) {
+    n.negative = digits[0] == '-';
+    start = 1;
+  }
+  // the first chunk is shorter, the next ones have 9 digits
+  auto chunk = (digits.size() - start) % 9;
+  for (auto i = start; i < digits.size(); chunk = 9) {
+    if (chunk == 0) {
+      continue;
+    }
+    Wide carry = std::stoul(digits.substr(i, chunk));
+    Wide scale = 1;
+    for (std::size_t k = 0; k < chunk; ++k) {
+      scale *= 10;
+    }
+    for (auto &limb : n.magnitude) {
+      carry += Wide(limb) * scale;
+      limb = Limb(carry);
+      carry >>= 32;
+    }
+    if (carry != 0) {
+      n.magnitude.push_back(Limb(carry));
+    }
+    i += chunk;
+  }
+  return normalize(std::move(n));
+}
+
+std::string to_decimal(const BigInt &n) {
+  // 9 digits per division, least significant first
+  std::vector<Limb> chunks;
+  auto magnitude = *n.limbs;
+  while (!magnitude.empty()) {
+    auto quotient = divide_small(magnitude, DECIMAL_BASE);
+    chunks.push_back(magnitude.empty() ? 0 : magnitude[0]);
+    magnitude = std::move(quotient);
+  }
+  std::string out = n.negative ? "-" : "";
+  out += chunks.empty() ? "0" : std::to_string(chunks.back());
+  for (auto i = chunks.size() - 1; i-- > 0;) {
+    auto digits = std::to_string(chunks[i]);
+    out.append(9 - digits.size(), '0');
+    out += digits;
+  }
+  return out;
+}
+
+double to_double(const BigInt &n) {
+  double value = 0;
+  for (auto i = n.limbs->size(); i-- > 0;) {
+    value = value * 4294967296.0 + (*n.limbs)[i];
+  }
+  return n.negative ? -value : value;
+}
+
+std::size_t hash_integer(const Result &value) {
+  auto n = integer(value);
+  std::size_t hash = n.negative ? 0x2d : 0x2b;
+  for (auto limb : n.magnitude) {
+    hash = combine(hash, limb);
+  }
+  return hash;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ast.h"
+
+#include <cmath>
+#include <compare>
+#include <string>
+
+// Exact integer arithmetic. A Number holding an integer is exact: the sum,
+// difference and product of integers, and their quotient when it is an
+// integer, are computed exactly. Results beyond 2^53 in magnitude, which
+// a double cannot represent exactly, are BigInts, and a result back in that
+// range is a Number again, so each integer has a single representation.
+// Arithmetic involving a fraction uses doubles.
+//
+//   (define factorial (lambda (n) (if (= n 0) 1 (* n (factorial (- n 1))))))
+//   (factorial 25) ; -> 15511210043330985984000000
+//
+// BigInts are printed in decimal and integer literals beyond 2^53 are read
+// as BigInts.
+
+// every integer up to this magnitude is a Number
+constexpr Number MAX_EXACT = 9007199254740992.0;
+
+// a Number or a BigInt
+inline bool is_number(const Result &value) {
+  return std::holds_alternative<Number>(value) ||
+         std::holds_alternative<BigInt>(value);
+}
+
+Result arithmetic_slow(NumericOp op, const Result &a, const Result &b);
+
+// a + b, a - b, a * b or a / b, `op` is one of the arithmetic operations;
+// throws unless both are numbers
+inline Result arithmetic(NumericOp op, const Result &a, const Result &b) {
+  auto x = std::get_if<Number>(&a);
+  auto y = std::get_if<Number>(&b);
+  if (x != nullptr && y != nullptr) {
+    Number n = op == NumericOp::Add        ? *x + *y
+               : op == NumericOp::Subtract ? *x - *y
+               : op == NumericOp::Multiply ? *x * *y
+                                           : *x / *y;
+    // 2^53 itself can be a rounded result
+    if (std::abs(n) < MAX_EXACT || op == NumericOp::Divide) {
+      return n;
+    }
+  }
+  return arithmetic_slow(op, a, b);
+}
+
+std::partial_ordering compare_slow(const Result &a, const Result &b,
+                                   const char *op);
+
+// unordered when one of them is NaN, throws unless both are numbers
+inline std::partial_ordering compare_numbers(const Result &a, const Result &b,
+                                             const char *op) {
+  auto x = std::get_if<Number>(&a);
+  auto y = std::get_if<Number>(&b);
+  if (x != nullptr && y != nullptr) {
+    return *x <=> *y;
+  }
+  return compare_slow(a, b, op);
+}
+
+// truncated towards 0, like C++: (quotient -7 2) is -3, (remainder -7 2) -1
+Result quotient(const Result &a, const Result &b);
+Result remainder(const Result &a, const Result &b);
+
+// the integer written in decimal, a Number when it is small enough
+Result parse_integer(const std::string &digits);
+std::string to_decimal(const BigInt &n);
+// the nearest double, approximately
+double to_double(const BigInt &n);
+// hashes like a BigInt, for integers stored in a Number beyond 2^53
+std::size_t hash_integer(const Result &value);
@@ -1,100 +1,166 @@
 #include "builtins.h"
 
-#include <iostream>
+#include "actors.h"
+#include "bignum.h"
+#include "formats.h"
+#include "io.h"
+#include "library.h"
+#include "memory.h"
+#include "modules.h"
+#include "output.h"
+#include "regex.h"
+#include "resources.h"
+#include "seq.h"
+#include "task.h"
+
+#include <type_traits>
+
+const Result &number_value(const Result &arg, const std::string &op) {
+  if (!is_number(arg)) {
+    throw std::runtime_error("'" + op + "' requires numbers, got " +
+                             to_string(arg));
+  }
+  return arg;
+}
+
+void check_at_least_one_arg(const std::vector<Result> &arguments,
+                            const std::string &op) {
+  if (arguments.empty()) {
+    throw std::runtime_error("'" + op + "' requires at least 1 argument");
+  }
+}
 
-Number plus_fn(const std::vector<Result> &arguments) {
-  Number n = 0;
-  for (auto a : arguments) {
-    n += std::get<Number>(a);
+Result plus_fn(const std::vector<Result> &arguments) {
+  Result n = Number(0);
+  for (const auto &a : arguments) {
+    n = arithmetic(NumericOp::Add, n, a);
   }
   return n;
 }
 
-Number minus_fn(const std::vector<Result> &arguments) {
-  Number n = std::get<Number>(arguments[0]);
+Result minus_fn(const std::vector<Result> &arguments) {
+  check_at_least_one_arg(arguments, "-");
+  Result n = number_value(arguments[0], "-");
   for (int i = 1; i < arguments.size(); ++i) {
-    n -= std::get<Number>(arguments[i]);
+    n = arithmetic(NumericOp::Subtract, n, arguments[i]);
   }
   return n;
 }
 
-Number divide_fn(const std::vector<Result> &arguments) {
-  Number n = std::get<Number>(arguments[0]);
+Result divide_fn(const std::vector<Result> &arguments) {
+  check_at_least_one_arg(arguments, "/");
+  Result n = number_value(arguments[0], "/");
   for (int i = 1; i < arguments.size(); ++i) {
-    n /= std::get<Number>(arguments[i]);
+    n = arithmetic(NumericOp::Divide, n, arguments[i]);
   }
   return n;
 }
 
-Number multiply_fn(const std::vector<Result> &arguments) {
-  Number n = std::get<Number>(arguments[0]);
+Result multiply_fn(const std::vector<Result> &arguments) {
+  check_at_least_one_arg(arguments, "*");
+  Result n = number_value(arguments[0], "*");
   for (int i = 1; i < arguments.size(); ++i) {
-    n *= std::get<Number>(arguments[i]);
+    n = arithmetic(NumericOp::Multiply, n, arguments[i]);
   }
   return n;
 }
 
-void check_one_args(const std::vector<Result> &arguments) {
+void check_one_args(const std::vector<Result> &arguments,
+                    const std::string &op) {
   if (arguments.size() != 1) {
-    throw std::runtime_error("'=' operator requires exactly 1 argument");
+    throw std::runtime_error("'" + op + "' requires exactly 1 argument");
   }
 }
 
-void check_two_args(const std::vector<Result> &arguments) {
+void check_two_args(const std::vector<Result> &arguments,
+                    const std::string &op) {
   if (arguments.size() != 2) {
-    throw std::runtime_error("'=' operator requires exactly 2 arguments");
+    throw std::runtime_error("'" + op + "' requires exactly 2 arguments");
   }
 }
 
 bool equals_fn(const std::vector<Result> &arguments) {
-  check_two_args(arguments);
-  return std::get<Number>(arguments[0]) == std::get<Number>(arguments[1]);
+  check_two_args(arguments, "=");
+  return compare_numbers(arguments[0], arguments[1], "=") == 0;
+}
+
+bool equal_fn(const std::vector<Result> &arguments) {
+  check_two_args(arguments, "equal?");
+  return equal(arguments[0], arguments[1]);
+}
+
+// fits in the integers a number represents exactly
+Number hash_fn(const std::vector<Result> &arguments) {
+  check_one_args(arguments, "hash");
+  return static_cast<Number>(hash_value(arguments[0]) &
+                             ((std::size_t(1) << 53) - 1));
 }
 
 bool less_than_fn(const std::vector<Result> &arguments) {
-  check_two_args(arguments);
-  return std::get<Number>(arguments[0]) < std::get<Number>(arguments[1]);
+  check_two_args(arguments, "<");
+  return compare_numbers(arguments[0], arguments[1], "<") < 0;
 }
 
 bool greater_than_fn(const std::vector<Result> &arguments) {
-  check_two_args(arguments);
-  return std::get<Number>(arguments[0]) > std::get<Number>(arguments[1]);
+  check_two_args(arguments, ">");
+  return compare_numbers(arguments[0], arguments[1], ">") > 0;
 }
 
 bool less_than_equals_fn(const std::vector<Result> &arguments) {
-  return less_than_fn(arguments) || equals_fn(arguments);
+  check_two_args(arguments, "<=");
+  return compare_numbers(arguments[0], arguments[1], "<=") <= 0;
 }
 
 bool greater_than_equals_fn(const std::vector<Result> &arguments) {
-  return greater_than_fn(arguments) || equals_fn(arguments);
+  check_two_args(arguments, ">=");
+  return compare_numbers(arguments[0], arguments[1], ">=") >= 0;
+}
+
+Result quotient_fn(const std::vector<Result> &arguments) {
+  check_two_args(arguments, "quotient");
+  return quotient(arguments[0], arguments[1]);
+}
+
+Result remainder_fn(const std::vector<Result> &arguments) {
+  check_two_args(arguments, "remainder");
+  return remainder(arguments[0], arguments[1]);
 }
 
 Number length_fn(const std::vector<Result> &arguments) {
-  check_one_args(arguments);
+  check_one_args(arguments, "length");
   if (auto seq = std::get_if<List>(&arguments[0])) {
     return seq->list.size();
+  } else if (auto lazy = std::get_if<Seq>(&arguments[0])) {
+    Number n = 0;
+    for (auto s = *lazy; !seq_empty(s); s = seq_rest(s)) {
+      n++;
+    }
+    return n;
   } else {
     throw std::runtime_error("Can only get length of list");
   }
 }
 
+// The list arguments of cons, append and set-nth are modified in place when
+// nothing else shares their elements, or when they are transient.
+
 List cons_fn(std::vector<Result> arguments) {
-  check_two_args(arguments);
+  check_two_args(arguments, "cons");
 
   if (auto seq = std::get_if<List>(&arguments[1])) {
-    seq->list.insert(seq->list.begin(), arguments[0]);
-    return *seq;
+    seq->list.insert(seq->list.cbegin(), std::move(arguments[0]));
+    return std::move(*seq);
   } else {
     throw std::runtime_error("Can only cons to list");
   }
 }
 
 List append_fn(std::vector<Result> arguments) {
-  check_two_args(arguments);
+  check_two_args(arguments, "append");
 
   if (auto seq = std::get_if<List>(&arguments[1])) {
-    seq->list.push_back(arguments[0]);
-    return *seq;
+    seq->list.push_back(std::move(arguments[0]));
+    return std::move(*seq);
   } else {
     throw std::runtime_error("Can only append to list");
   }
@@ -102,9 +168,14 @@ List append_fn(std::vector<Result> arguments) {
 
 List concat_fn(const std::vector<Result> &arguments) {
   List list;
-  for (auto arg : arguments) {
+  for (const auto &arg : arguments) {
     if (auto l = std::get_if<List>(&arg)) {
       std::copy(l->list.begin(), l->list.end(), std::back_inserter(list.list));
+    } else if (std::holds_alternative<Seq>(arg)) {
+      Cursor cursor(arg);
+      while (auto value = cursor.next()) {
+        list.list.push_back(std::move(*value));
+      }
     } else {
       throw std::runtime_error("Can only concat lists");
     }
@@ -113,13 +184,15 @@ List concat_fn(const std::vector<Result> &arguments) {
 }
 
 Result get_fn(const std::vector<Result> &arguments) {
+  check_two_args(arguments, "get");
   if (auto seq = std::get_if<List>(&arguments[0])) {
     if (auto indice = std::get_if<Number>(&arguments[1])) {
       int i = (int)*indice;
-      if (i <= seq->list.size()) {
+      if (i >= 0 && i < seq->list.size()) {
         return seq->list[i];
       } else {
-        throw std::runtime_error("Indice " + std::to_string(i) + " too high");
+        throw std::runtime_error("Indice " + std::to_string(i) +
+                                 " out of range");
       }
     } else {
       throw std::runtime_error("'get' requires a number as indice");
@@ -129,35 +202,114 @@ Result get_fn(const std::vector<Result> &arguments) {
   }
 }
 
+List set_nth_fn(std::vector<Result> arguments) {
+  if (arguments.size() != 3) {
+    throw std::runtime_error("'set-nth' requires a list, an index and a "
+                             "value");
+  }
+  auto seq = std::get_if<List>(&arguments[0]);
+  if (seq == nullptr) {
+    throw std::runtime_error("'set-nth' requires a list");
+  }
+  auto n = std::get_if<Number>(&arguments[1]);
+  if (n == nullptr || *n < 0 || *n >= seq->list.size()) {
+    throw std::runtime_error("Index " + to_string(arguments[1]) +
+                             " out of range");
+  }
+  seq->list[static_cast<std::size_t>(*n)] = std::move(arguments[2]);
+  return std::move(*seq);
+}
+
+// (transient xs) is modified in place by cons, append and set-nth, even
+// when it is bound to variables, (persistent! xs) freezes it again
+List transient_fn(std::vector<Result> arguments) {
+  check_one_args(arguments, "transient");
+  if (auto seq = std::get_if<List>(&arguments[0])) {
+    seq->list.make_transient();
+    return std::move(*seq);
+  }
+  throw std::runtime_error("'transient' requires a list");
+}
+
+List persistent_fn(std::vector<Result> arguments) {
+  check_one_args(arguments, "persistent!");
+  if (auto seq = std::get_if<List>(&arguments[0])) {
+    seq->list.make_persistent();
+    return std::move(*seq);
+  }
+  throw std::runtime_error("'persistent!' requires a list");
+}
+
 List list_fn(std::vector<Result> arguments) {
   return List(std::move(arguments));
 }
 
+bool empty_fn(const std::vector<Result> &arguments) {
+  check_one_args(arguments, "empty?");
+  if (auto seq = std::get_if<List>(&arguments[0])) {
+    return seq->list.empty();
+  } else if (auto lazy = std::get_if<Seq>(&arguments[0])) {
+    return seq_empty(*lazy);
+  } else {
+    throw std::runtime_error("Can only check emptiness of list");
+  }
+}
+
 Result first_fn(const std::vector<Result> &arguments) {
+  check_one_args(arguments, "first");
   if (auto seq = std::get_if<List>(&arguments[0])) {
-    return seq->list[0];
+    // like a lazy sequence, nil when empty
+    return seq->list.empty() ? Nil{} : seq->list[0];
+  } else if (auto lazy = std::get_if<Seq>(&arguments[0])) {
+    return seq_first(*lazy);
   } else {
     throw std::runtime_error("Can only get first item from list");
   }
 }
 
-List rest_fn(std::vector<Result> arguments) {
+Result rest_fn(std::vector<Result> arguments) {
+  check_one_args(arguments, "rest");
   if (auto seq = std::get_if<List>(&arguments[0])) {
-    seq->list.erase(seq->list.begin());
-    return *seq;
+    if (seq->list.empty()) {
+      return List();
+    }
+    if (seq->list.transient()) {
+      // a copy, only cons, append and set-nth modify a transient list
+      return List(std::vector<Result>(std::next(seq->list.cbegin()),
+                                      seq->list.cend()));
+    }
+    seq->list.erase(seq->list.cbegin());
+    return std::move(*seq);
+  } else if (auto lazy = std::get_if<Seq>(&arguments[0])) {
+    return seq_rest(*lazy);
   } else {
     throw std::runtime_error("Can only get the rest of a list");
   }
 }
 
-Nil println_fn(const std::vector<Result> &arguments) {
+void print_all(Sink &sink, const std::vector<Result> &arguments) {
   for (int i = 0; i < arguments.size(); ++i) {
-    std::cout << to_string(arguments[i]);
-    if (i < arguments.size() - 1) {
-      std::cout << " ";
+    if (i > 0) {
+      sink.put(' ');
     }
+    print_value(sink, arguments[i]);
   }
-  std::cout << std::endl;
+}
+
+Nil print_fn(const std::vector<Result> &arguments) {
+  std::lock_guard lock(stdout_mutex());
+  auto &sink = stdout_sink();
+  print_all(sink, arguments);
+  sink.sync(false);
+  return Nil{};
+}
+
+Nil println_fn(const std::vector<Result> &arguments) {
+  std::lock_guard lock(stdout_mutex());
+  auto &sink = stdout_sink();
+  print_all(sink, arguments);
+  sink.put('\n');
+  sink.sync(true);
   return Nil{};
 }
 
@@ -169,45 +321,164 @@ bool not_fn(const std::vector<Result> &arguments) {
   return !is_true(arguments[0]);
 }
 
-Result apply_op(const std::string &op, const std::vector<Result> &arguments) {
-  if (op == "+") {
-    return plus_fn(arguments);
-  } else if (op == "-") {
-    return minus_fn(arguments);
-  } else if (op == "/") {
-    return divide_fn(arguments);
-  } else if (op == "*") {
-    return multiply_fn(arguments);
-  } else if (op == "=") {
-    return equals_fn(arguments);
-  } else if (op == ">") {
-    return greater_than_fn(arguments);
-  } else if (op == "<") {
-    return less_than_fn(arguments);
-  } else if (op == "<=") {
-    return less_than_equals_fn(arguments);
-  } else if (op == ">=") {
-    return greater_than_equals_fn(arguments);
-  } else if (op == "length") {
-    return length_fn(arguments);
-  } else if (op == "cons") {
-    return cons_fn(arguments);
-  } else if (op == "append") {
-    return append_fn(arguments);
-  } else if (op == "concat") {
-    return concat_fn(arguments);
-  } else if (op == "get") {
-    return get_fn(arguments);
-  } else if (op == "list") {
-    return list_fn(arguments);
-  } else if (op == "first") {
-    return first_fn(arguments);
-  } else if (op == "rest") {
-    return rest_fn(arguments);
-  } else if (op == "println") {
-    return println_fn(arguments);
-  } else if (op == "not") {
-    return not_fn(arguments);
+List memory_stats_fn(const std::vector<Result> &arguments) {
+  if (!arguments.empty()) {
+    throw std::runtime_error("'memory-stats' takes no arguments");
+  }
+  auto stats = memory_stats();
+  auto row = [](const char *name, const MemoryCounters &counters) {
+    return List({String(name), Number(counters.live_bytes),
+                 Number(counters.peak_bytes), Number(counters.allocations)});
+  };
+
+  List rows;
+  rows.list.push_back(row("total", stats.total));
+  for (int i = 0; i < MEMORY_CATEGORIES; ++i) {
+    rows.list.push_back(row(memory_category_name(MemoryCategory(i)),
+                            stats.categories[i]));
+  }
+  return rows;
+}
+
+// the memory of the value a builtin returns, by its type
+template <typename T> constexpr MemoryCategory result_category() {
+  if constexpr (std::is_same_v<T, List>) {
+    return MemoryCategory::List;
+  } else if constexpr (std::is_same_v<T, String>) {
+    return MemoryCategory::String;
+  } else {
+    return MemoryCategory::Other;
+  }
+}
+
+// adapts the signature of a builtin implementation to BuiltinFn
+template <auto F> Result native(std::vector<Result> &arguments, Env &env) {
+  count_step();
+  auto invoke = [&] {
+    if constexpr (std::is_invocable_v<decltype(F), std::vector<Result>,
+                                      Env &>) {
+      return F(std::move(arguments), env);
+    } else {
+      return F(std::move(arguments));
+    }
+  };
+  constexpr auto category = result_category<decltype(invoke())>();
+  if constexpr (category != MemoryCategory::Other) {
+    MemoryScope scope(category);
+    return invoke();
+  } else {
+    return invoke();
+  }
+}
+
+const Builtin BUILTINS[] = {
+    {"+", native<plus_fn>},
+    {"-", native<minus_fn>},
+    {"/", native<divide_fn>},
+    {"*", native<multiply_fn>},
+    {"=", native<equals_fn>},
+    {"equal?", native<equal_fn>},
+    {"hash", native<hash_fn>},
+    {">", native<greater_than_fn>},
+    {"<", native<less_than_fn>},
+    {"<=", native<less_than_equals_fn>},
+    {">=", native<greater_than_equals_fn>},
+    {"quotient", native<quotient_fn>},
+    {"remainder", native<remainder_fn>},
+    {"length", native<length_fn>},
+    {"cons", native<cons_fn>},
+    {"append", native<append_fn>},
+    {"concat", native<concat_fn>},
+    {"get", native<get_fn>},
+    {"list", native<list_fn>},
+    {"set-nth", native<set_nth_fn>},
+    {"transient", native<transient_fn>},
+    {"persistent!", native<persistent_fn>},
+    {"empty?", native<empty_fn>},
+    {"first", native<first_fn>},
+    {"rest", native<rest_fn>},
+    {"print", native<print_fn>},
+    {"println", native<println_fn>},
+    {"not", native<not_fn>},
+    {"map", native<map_fn>},
+    {"filter", native<filter_fn>},
+    {"fold", native<fold_fn>},
+    {"reverse", native<reverse_fn>},
+    {"nth", native<nth_fn>},
+    {"last", native<last_fn>},
+    {"sort", native<sort_fn>},
+    {"sort-by", native<sort_by_fn>},
+    {"merge", native<merge_fn>},
+    {"group-by", native<group_by_fn>},
+    {"count-by", native<count_by_fn>},
+    {"frequencies", native<frequencies_fn>},
+    {"distinct", native<distinct_fn>},
+    {"any?", native<any_fn>},
+    {"all?", native<all_fn>},
+    {"count", native<count_fn>},
+    {"range", native<range_fn>},
+    {"iterate", native<iterate_fn>},
+    {"take", native<take_fn>},
+    {"drop", native<drop_fn>},
+    {"lazy-map", native<lazy_map_fn>},
+    {"lazy-filter", native<lazy_filter_fn>},
+    {"reduce", native<reduce_fn>},
+    {"open-file", native<open_file_fn>},
+    {"read-line", native<read_line_fn>},
+    {"read-lines", native<read_lines_fn>},
+    {"read-all", native<read_all_fn>},
+    {"write", native<write_fn>},
+    {"flush", native<flush_fn>},
+    {"close", native<close_fn>},
+    {"json-parse", native<json_parse_fn>},
+    {"json-string", native<json_string_fn>},
+    {"read-json", native<read_json_fn>},
+    {"write-json", native<write_json_fn>},
+    {"read-csv", native<read_csv_fn>},
+    {"write-csv", native<write_csv_fn>},
+    {"field", native<field_fn>},
+    {"regex", native<regex_fn>},
+    {"re-match?", native<re_match_fn>},
+    {"re-find", native<re_find_fn>},
+    {"re-find-all", native<re_find_all_fn>},
+    {"memory-stats", native<memory_stats_fn>},
+    {"yield", native<yield_fn>},
+    {"channel", native<channel_fn>},
+    {"spawn", native<spawn_fn>},
+    {"send", native<send_fn>},
+    {"receive", native<receive_fn>},
+    {"self", native<self_fn>},
+    {"load", native<load_fn>},
+    {"require", native<require_fn>},
+};
+
+const Builtin *find_builtin(const std::string &name) {
+  static const auto table = [] {
+    std::unordered_map<std::string, const Builtin *> t;
+    for (const auto &builtin : BUILTINS) {
+      t[builtin.name] = &builtin;
+    }
+    return t;
+  }();
+
+  auto it = table.find(name);
+  return it != table.end() ? it->second : nullptr;
+}
+
+Result call(const Result &fn, std::vector<Result> &arguments, Env &env) {
+  if (auto lambda = std::get_if<Lambda>(&fn)) {
+    return apply_lambda(*lambda, env, arguments);
+  } else if (auto builtin = std::get_if<Builtin>(&fn)) {
+    return builtin->fn(arguments, env);
+  } else {
+    throw std::runtime_error("Cannot apply, not a function: " + to_string(fn));
+  }
+}
+
+Result apply_op(const std::string &op, std::vector<Result> arguments,
+                Env &env) {
+  if (auto builtin = find_builtin(op)) {
+    return builtin->fn(arguments, env);
   } else {
     throw std::runtime_error("Unknown operation: " + op);
   }
@@ -216,6 +487,8 @@ Result apply_op(const std::string &op, const std::vector<Result> &arguments) {
 struct TruthVisitor {
   bool operator()(Number n) { return n != 0; }
 
+  bool operator()(BigInt &) { return true; }
+
   bool operator()(Nil &) { return false; }
 
   bool operator()(Boolean b) { return b; }
@@ -231,6 +504,18 @@ struct TruthVisitor {
   }
 
   bool operator()(const String &s) { return !s.empty(); }
+
+  bool operator()(File &) { return true; }
+
+  bool operator()(Builtin &) { return true; }
+
+  bool operator()(Channel &) { return true; }
+
+  bool operator()(Regex &) { return true; }
+
+  bool operator()(Seq &) {
+    throw std::runtime_error("Cannot get bool value from Seq");
+  }
 };
 
 bool is_true(Result res) { return std::visit(TruthVisitor{}, res); }
\ No newline at end of file
@@ -2,5 +2,10 @@
 
 #include "ast.h"
 
-Result apply_op(const std::string &op, const std::vector<Result> &arguments);
+const Builtin *find_builtin(const std::string &name);
+// calls a lambda or a builtin
+Result call(const Result &fn, std::vector<Result> &arguments, Env &env);
+
+Result apply_op(const std::string &op, std::vector<Result> arguments,
+                Env &env);
 bool is_true(Result res);
\ No newline at end of file
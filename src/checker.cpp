@@ -0,0 +1,616 @@
+#include "checker.h"
+
+#include "builtins.h"
+
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+constexpr auto MANY = std::numeric_limits<std::size_t>::max();
+
+struct Signature {
+  std::size_t min_args;
+  std::size_t max_args;
+  // required type of every argument, Any when the builtin checks them itself
+  Type argument;
+  Type result;
+  NumericOp numeric = NumericOp::None;
+};
+
+const Signature *find_signature(const std::string &name) {
+  static const std::unordered_map<std::string, Signature> signatures = {
+      {"+", {0, MANY, Type::Number, Type::Number, NumericOp::Add}},
+      {"-", {1, MANY, Type::Number, Type::Number, NumericOp::Subtract}},
+      {"*", {1, MANY, Type::Number, Type::Number, NumericOp::Multiply}},
+      {"/", {1, MANY, Type::Number, Type::Number, NumericOp::Divide}},
+      {"=", {2, 2, Type::Number, Type::Boolean, NumericOp::Equal}},
+      {"<", {2, 2, Type::Number, Type::Boolean, NumericOp::Less}},
+      {">", {2, 2, Type::Number, Type::Boolean, NumericOp::Greater}},
+      {"<=", {2, 2, Type::Number, Type::Boolean, NumericOp::LessEqual}},
+      {">=", {2, 2, Type::Number, Type::Boolean, NumericOp::GreaterEqual}},
+      {"quotient", {2, 2, Type::Number, Type::Number}},
+      {"remainder", {2, 2, Type::Number, Type::Number}},
+      {"not", {1, 1, Type::Any, Type::Boolean}},
+      {"equal?", {2, 2, Type::Any, Type::Boolean}},
+      {"hash", {1, 1, Type::Any, Type::Number}},
+      {"length", {1, 1, Type::Any, Type::Number}},
+      {"cons", {2, 2, Type::Any, Type::List}},
+      {"append", {2, 2, Type::Any, Type::List}},
+      {"concat", {0, MANY, Type::Any, Type::List}},
+      {"get", {2, 2, Type::Any, Type::Any}},
+      {"list", {0, MANY, Type::Any, Type::List}},
+      {"set-nth", {3, 3, Type::Any, Type::List}},
+      {"transient", {1, 1, Type::Any, Type::List}},
+      {"persistent!", {1, 1, Type::Any, Type::List}},
+      {"empty?", {1, 1, Type::Any, Type::Boolean}},
+      {"first", {1, 1, Type::Any, Type::Any}},
+      {"rest", {1, 1, Type::Any, Type::Any}},
+      {"print", {0, MANY, Type::Any, Type::Nil}},
+      {"println", {0, MANY, Type::Any, Type::Nil}},
+      {"map", {2, 2, Type::Any, Type::List}},
+      {"filter", {2, 2, Type::Any, Type::List}},
+      {"fold", {3, 3, Type::Any, Type::Any}},
+      {"reverse", {1, 1, Type::Any, Type::List}},
+      {"nth", {2, 2, Type::Any, Type::Any}},
+      {"last", {1, 1, Type::Any, Type::Any}},
+      {"sort", {1, 2, Type::Any, Type::List}},
+      {"sort-by", {2, 2, Type::Any, Type::List}},
+      {"merge", {2, 3, Type::Any, Type::List}},
+      {"group-by", {2, 2, Type::Any, Type::List}},
+      {"count-by", {2, 2, Type::Any, Type::List}},
+      {"frequencies", {1, 1, Type::Any, Type::List}},
+      {"distinct", {1, 1, Type::Any, Type::List}},
+      {"any?", {2, 2, Type::Any, Type::Boolean}},
+      {"all?", {2, 2, Type::Any, Type::Boolean}},
+      {"count", {2, 2, Type::Any, Type::Number}},
+      {"range", {0, 3, Type::Number, Type::Any}},
+      {"iterate", {2, 2, Type::Any, Type::Any}},
+      {"take", {2, 2, Type::Any, Type::Any}},
+      {"drop", {2, 2, Type::Any, Type::Any}},
+      {"lazy-map", {2, 2, Type::Any, Type::Any}},
+      {"lazy-filter", {2, 2, Type::Any, Type::Any}},
+      {"reduce", {2, 3, Type::Any, Type::Any}},
+      {"open-file", {1, 2, Type::String, Type::Any}},
+      {"read-all", {0, 1, Type::Any, Type::String}},
+      {"flush", {0, 1, Type::Any, Type::Nil}},
+      {"close", {1, 1, Type::Any, Type::Nil}},
+      {"json-parse", {1, 1, Type::String, Type::Any}},
+      {"json-string", {1, 1, Type::Any, Type::String}},
+      {"read-json", {0, 1, Type::Any, Type::Any}},
+      {"write-json", {1, 2, Type::Any, Type::Nil}},
+      {"read-csv", {0, 2, Type::Any, Type::Any}},
+      {"write-csv", {1, 3, Type::Any, Type::Nil}},
+      {"field", {2, 2, Type::Any, Type::Any}},
+      {"regex", {1, 1, Type::String, Type::Any}},
+      {"re-match?", {2, 4, Type::Any, Type::Boolean}},
+      {"re-find", {2, 4, Type::Any, Type::Any}},
+      {"re-find-all", {2, 4, Type::Any, Type::List}},
+      {"memory-stats", {0, 0, Type::Any, Type::List}},
+      {"yield", {0, 1, Type::Any, Type::Any}},
+      {"channel", {0, 0, Type::Any, Type::Any}},
+      {"spawn", {1, MANY, Type::Any, Type::Any}},
+      {"send", {2, 2, Type::Any, Type::Nil}},
+      {"receive", {0, 1, Type::Any, Type::Any}},
+      {"self", {0, 0, Type::Any, Type::Any}},
+      {"load", {1, 1, Type::String, Type::Any}},
+      {"require", {1, 2, Type::String, Type::Nil}},
+  };
+
+  auto it = signatures.find(name);
+  return it != signatures.end() ? &it->second : nullptr;
+}
+
+std::string describe(Type type) {
+  switch (type) {
+  case Type::Nil:
+    return "nil";
+  case Type::Number:
+    return "a number";
+  case Type::Boolean:
+    return "a boolean";
+  case Type::String:
+    return "a string";
+  case Type::List:
+    return "a list";
+  case Type::Function:
+    return "a function";
+  default:
+    return "a value";
+  }
+}
+
+Type type_of(const Result &value) {
+  if (std::holds_alternative<Nil>(value)) {
+    return Type::Nil;
+  } else if (std::holds_alternative<Number>(value) ||
+             std::holds_alternative<BigInt>(value)) {
+    return Type::Number;
+  } else if (std::holds_alternative<Boolean>(value)) {
+    return Type::Boolean;
+  } else if (std::holds_alternative<String>(value)) {
+    return Type::String;
+  } else if (std::holds_alternative<List>(value)) {
+    return Type::List;
+  } else if (std::holds_alternative<Lambda>(value) ||
+             std::holds_alternative<Builtin>(value)) {
+    return Type::Function;
+  }
+  return Type::Any;
+}
+
+// the type of a value that can come from either expression
+Type join(Type a, Type b) {
+  if (a == Type::Never) {
+    return b;
+  } else if (b == Type::Never) {
+    return a;
+  }
+  return a == b ? a : Type::Any;
+}
+
+struct Arity {
+  std::size_t fixed;
+  bool variadic;
+};
+
+Arity lambda_arity(const LambdaExpr &lambda) {
+  Arity arity{0, false};
+  for (const auto &arg : lambda.arguments.expressions) {
+    auto symbol = dynamic_cast<SymbolExpr *>(arg.get());
+    if (symbol != nullptr && symbol->symbol.name == "&") {
+      arity.variadic = true;
+      return arity;
+    }
+    arity.fixed++;
+  }
+  return arity;
+}
+
+// a name bound exactly once in the program, by a 'define'
+struct Global {
+  Type type = Type::Any;
+  std::optional<Arity> arity;
+};
+
+class Checker {
+public:
+  Checker(const ExprList &program, const Env &env)
+      : bindings(program, env), env(env) {
+    collect_globals();
+    for (const auto &expr : program) {
+      collect_modules(expr.get());
+    }
+  }
+
+  Type infer(Expr *expr) {
+    if (dynamic_cast<LiteralExpr<Number> *>(expr)) {
+      return Type::Number;
+    } else if (dynamic_cast<LiteralExpr<String> *>(expr)) {
+      return Type::String;
+    } else if (dynamic_cast<LiteralExpr<Nil> *>(expr)) {
+      return Type::Nil;
+    } else if (auto e = dynamic_cast<QuoteExpr *>(expr)) {
+      return type_of(e->value);
+    } else if (auto e = dynamic_cast<SymbolExpr *>(expr)) {
+      return lookup(e->symbol.name);
+    } else if (auto e = dynamic_cast<ListExpr *>(expr)) {
+      return infer_call(*e);
+    } else if (auto e = dynamic_cast<DoExpr *>(expr)) {
+      Type type = Type::Nil;
+      for (const auto &child : e->expressions) {
+        type = infer(child.get());
+      }
+      return type;
+    } else if (auto e = dynamic_cast<IfExpr *>(expr)) {
+      infer(e->expressions[0].get());
+      return join(infer(e->expressions[1].get()),
+                  infer(e->expressions[2].get()));
+    } else if (auto e = dynamic_cast<CondExpr *>(expr)) {
+      return infer_cond(*e);
+    } else if (auto e = dynamic_cast<DefineExpr *>(expr)) {
+      infer(e->expr.get());
+      // a local redefined in a branch can keep its previous value
+      if (scope.contains(e->var.symbol.name)) {
+        scope[e->var.symbol.name] = Type::Any;
+      }
+      return Type::Nil;
+    } else if (auto e = dynamic_cast<LetExpr *>(expr)) {
+      auto saved = scope;
+      for (const auto &var : e->vars) {
+        scope[var.first.name] = infer(var.second.get());
+      }
+      auto type = infer(e->expr.get());
+      scope = std::move(saved);
+      return type;
+    } else if (auto e = dynamic_cast<LoopExpr *>(expr)) {
+      return infer_loop(*e);
+    } else if (auto e = dynamic_cast<RecurExpr *>(expr)) {
+      for (int i = 0; i < e->expressions.size(); ++i) {
+        auto type = infer(e->expressions[i].get());
+        if (!loops.empty() && i < loops.back().size()) {
+          loops.back()[i] = join(loops.back()[i], type);
+        }
+      }
+      return Type::Never;
+    } else if (auto e = dynamic_cast<LambdaExpr *>(expr)) {
+      infer_lambda(*e);
+      return Type::Function;
+    } else if (auto e = dynamic_cast<InlineExpr *>(expr)) {
+      std::vector<Type> args;
+      for (const auto &arg : e->args) {
+        args.push_back(infer(arg.get()));
+      }
+      auto saved = scope;
+      for (int i = 0; i < e->params.size(); ++i) {
+        scope[e->params[i].name] = args[i];
+      }
+      auto type = infer(e->body.get());
+      scope = std::move(saved);
+      return type;
+    } else if (auto e = dynamic_cast<InlinedCallExpr *>(expr)) {
+      return join(infer(e->call.get()), infer(e->inlined.get()));
+    } else if (auto e = dynamic_cast<ConstantExpr *>(expr)) {
+      // the builtin can be redefined, the call tells
+      return infer(e->call.get());
+    }
+
+    for_each_child(expr, [&](Expr *child) { infer(child); });
+    if (dynamic_cast<AndExpr *>(expr) || dynamic_cast<OrExpr *>(expr)) {
+      return Type::Boolean;
+    }
+    return Type::Any;
+  }
+
+private:
+  void collect_globals() {
+    for (const auto &[name, value] : bindings.definitions()) {
+      if (!bindings.trusted(name)) {
+        continue;
+      }
+      auto &global = globals[name];
+      if (auto lambda = dynamic_cast<LambdaExpr *>(value)) {
+        global.type = Type::Function;
+        global.arity = lambda_arity(*lambda);
+      } else if (dynamic_cast<LiteralExpr<Number> *>(value)) {
+        global.type = Type::Number;
+      } else if (dynamic_cast<LiteralExpr<String> *>(value)) {
+        global.type = Type::String;
+      } else if (auto quote = dynamic_cast<QuoteExpr *>(value)) {
+        global.type = type_of(quote->value);
+      }
+    }
+  }
+
+  // the aliases of the modules the program requires, the names they export
+  // are bound when it runs
+  void collect_modules(Expr *expr) {
+    auto call = dynamic_cast<ListExpr *>(expr);
+    auto head = call != nullptr && !call->expressions.empty()
+                    ? dynamic_cast<SymbolExpr *>(call->expressions[0].get())
+                    : nullptr;
+    if (head != nullptr && head->symbol.name == "require" &&
+        times_bound("require") == 0 && !bound_in_env("require")) {
+      auto &args = call->expressions;
+      auto literal = [&](std::size_t i) {
+        auto s = dynamic_cast<LiteralExpr<String> *>(args[i].get());
+        return s != nullptr ? std::optional(s->value) : std::nullopt;
+      };
+      std::optional<std::string> alias;
+      if (args.size() == 3) {
+        alias = literal(2);
+      } else if (args.size() == 2) {
+        if (auto name = literal(1)) {
+          alias = std::filesystem::path(*name).stem().string();
+        }
+      }
+      if (alias) {
+        modules.insert(*alias);
+      } else {
+        any_module = true;
+      }
+    }
+    for_each_child(expr, [&](Expr *child) { collect_modules(child); });
+  }
+
+  bool exported(const std::string &name) const {
+    auto slash = name.find('/');
+    if (slash == 0 || slash == std::string::npos) {
+      return false;
+    }
+    return any_module || modules.contains(name.substr(0, slash));
+  }
+
+  std::size_t times_bound(const std::string &name) const {
+    return bindings.times_bound(name);
+  }
+
+  bool bound_in_env(const std::string &name) const {
+    return bindings.bound_in_env(name);
+  }
+
+  Type lookup(const std::string &name) {
+    if (auto it = scope.find(name); it != scope.end()) {
+      return it->second;
+    }
+    if (times_bound(name) == 0) {
+      if (bound_in_env(name)) {
+        return type_of(env.bindings.at(name));
+      } else if (find_builtin(name)) {
+        return Type::Function;
+      }
+    } else if (auto it = globals.find(name); it != globals.end()) {
+      return it->second.type;
+    }
+    return Type::Any;
+  }
+
+  void fail(const std::string &message) {
+    // types are not final while a loop is being widened
+    if (speculative == 0) {
+      throw TypeError(message);
+    }
+  }
+
+  void check_arity(const std::string &name, std::size_t min_args,
+                   std::size_t max_args, std::size_t count) {
+    if (count >= min_args && count <= max_args) {
+      return;
+    }
+    std::string expected;
+    if (min_args == max_args) {
+      expected = std::to_string(min_args);
+    } else if (count < min_args) {
+      expected = "at least " + std::to_string(min_args);
+    } else {
+      expected = "at most " + std::to_string(max_args);
+    }
+    fail("'" + name + "' expects " + expected + " arguments, got " +
+         std::to_string(count));
+  }
+
+  void check_arity(const std::string &name, Arity arity, std::size_t count) {
+    check_arity(name, arity.fixed, arity.variadic ? MANY : arity.fixed,
+                count);
+  }
+
+  Type infer_call(ListExpr &call) {
+    call.numeric = NumericOp::None;
+    if (call.expressions.empty()) {
+      return Type::List;
+    }
+
+    std::vector<Type> args;
+    for (int i = 1; i < call.expressions.size(); ++i) {
+      args.push_back(infer(call.expressions[i].get()));
+    }
+
+    auto head = dynamic_cast<SymbolExpr *>(call.expressions[0].get());
+    if (head == nullptr) {
+      infer(call.expressions[0].get());
+      if (auto lambda = dynamic_cast<LambdaExpr *>(call.expressions[0].get())) {
+        check_arity("lambda", lambda_arity(*lambda), args.size());
+      }
+      return Type::Any;
+    }
+
+    const auto &name = head->symbol.name;
+    if (scope.contains(name)) {
+      return Type::Any;
+    }
+
+    if (times_bound(name) == 0 && bound_in_env(name)) {
+      if (auto lambda = std::get_if<Lambda>(&env.bindings.at(name))) {
+        check_arity(name, {lambda->arguments.size(), lambda->variadic},
+                    args.size());
+      }
+      return Type::Any;
+    } else if (times_bound(name) == 0) {
+      if (exported(name)) {
+        return Type::Any;
+      } else if (!find_builtin(name)) {
+        fail("Unknown operation: " + name);
+        return Type::Any;
+      }
+      return infer_builtin_call(call, name, args);
+    } else if (auto it = globals.find(name); it != globals.end()) {
+      if (it->second.arity) {
+        check_arity(name, *it->second.arity, args.size());
+      }
+    }
+    return Type::Any;
+  }
+
+  Type infer_builtin_call(ListExpr &call, const std::string &name,
+                          const std::vector<Type> &args) {
+    auto signature = find_signature(name);
+    if (signature == nullptr) {
+      return Type::Any;
+    }
+
+    check_arity(name, signature->min_args, signature->max_args, args.size());
+    bool proven = true;
+    for (int i = 0; i < args.size(); ++i) {
+      if (signature->argument == Type::Any || args[i] == Type::Never) {
+        continue;
+      }
+      if (args[i] == Type::Any) {
+        proven = false;
+      } else if (args[i] != signature->argument) {
+        fail("'" + name + "' expects " + describe(signature->argument) +
+             " as argument " + std::to_string(i + 1) + ", got " +
+             describe(args[i]));
+        proven = false;
+      }
+    }
+
+    if (proven && signature->numeric != NumericOp::None) {
+      call.numeric = signature->numeric;
+    }
+    return signature->result;
+  }
+
+  Type infer_cond(CondExpr &cond) {
+    Type type = Type::Never;
+    bool exhaustive = false;
+    for (const auto &clause : cond.expressions) {
+      auto pair = dynamic_cast<ListExpr *>(clause.get());
+      if (pair == nullptr || pair->expressions.size() < 2) {
+        // reported when evaluated
+        return Type::Any;
+      }
+      auto test = dynamic_cast<SymbolExpr *>(pair->expressions[0].get());
+      if (test != nullptr && test->symbol.name == "else") {
+        exhaustive = true;
+      } else {
+        infer(pair->expressions[0].get());
+      }
+      type = join(type, infer(pair->expressions[1].get()));
+      if (exhaustive) {
+        break;
+      }
+    }
+    return exhaustive ? type : join(type, Type::Nil);
+  }
+
+  Type infer_loop(LoopExpr &loop) {
+    auto saved = scope;
+    std::vector<Type> types;
+    for (const auto &var : loop.vars) {
+      types.push_back(infer(var.second.get()));
+      scope[var.first.name] = types.back();
+    }
+
+    // the types passed to 'recur' widen the types of the loop variables until
+    // they are stable, then the body is checked a last time with them
+    for (bool stable = false; !stable;) {
+      for (int i = 0; i < types.size(); ++i) {
+        scope[loop.vars[i].first.name] = types[i];
+      }
+      loops.emplace_back(types.size(), Type::Never);
+      speculative++;
+      infer(loop.expr.get());
+      speculative--;
+      auto recurred = std::move(loops.back());
+      loops.pop_back();
+
+      stable = true;
+      for (int i = 0; i < types.size(); ++i) {
+        auto type = join(types[i], recurred[i]);
+        stable = stable && type == types[i];
+        types[i] = type;
+      }
+    }
+
+    for (int i = 0; i < types.size(); ++i) {
+      scope[loop.vars[i].first.name] = types[i];
+    }
+    loops.emplace_back(types.size(), Type::Never);
+    auto type = infer(loop.expr.get());
+    loops.pop_back();
+    scope = std::move(saved);
+    return type;
+  }
+
+  void infer_lambda(LambdaExpr &lambda) {
+    // free names resolve in the caller, only the arguments are local
+    auto saved_scope = std::move(scope);
+    auto saved_loops = std::move(loops);
+    scope.clear();
+    loops.clear();
+
+    bool rest = false;
+    for (const auto &arg : lambda.arguments.expressions) {
+      if (auto symbol = dynamic_cast<SymbolExpr *>(arg.get())) {
+        if (symbol->symbol.name == "&") {
+          rest = true;
+        } else {
+          scope[symbol->symbol.name] = rest ? Type::List : Type::Any;
+        }
+      }
+    }
+    infer(lambda.body.get());
+
+    scope = std::move(saved_scope);
+    loops = std::move(saved_loops);
+  }
+
+  ProgramBindings bindings;
+  const Env &env;
+  std::unordered_map<std::string, Global> globals;
+  std::unordered_set<std::string> modules;
+  // a module is required with an alias only known when the program runs
+  bool any_module = false;
+  // the arguments and 'let' bindings of the lambda being checked
+  std::unordered_map<std::string, Type> scope;
+  // the types passed to 'recur' for each enclosing loop, innermost last
+  std::vector<std::vector<Type>> loops;
+  int speculative = 0;
+};
+
+} // namespace
+
+ProgramBindings::ProgramBindings(const ExprList &program, const Env &env)
+    : env(env) {
+  for (const auto &expr : program) {
+    count(expr.get());
+  }
+  // the arguments of the lambdas already defined are bound when they run
+  for (const auto &[name, value] : env.bindings) {
+    if (auto lambda = std::get_if<Lambda>(&value)) {
+      for (const auto &arg : lambda->arguments) {
+        bind(arg.name);
+      }
+      count(lambda->body.get());
+    }
+  }
+}
+
+void ProgramBindings::count(Expr *expr) {
+  if (auto e = dynamic_cast<DefineExpr *>(expr)) {
+    bind(e->var.symbol.name);
+    defined[e->var.symbol.name] = e->expr.get();
+  } else if (auto e = dynamic_cast<LetExpr *>(expr)) {
+    for (const auto &var : e->vars) {
+      bind(var.first.name);
+    }
+  } else if (auto e = dynamic_cast<LoopExpr *>(expr)) {
+    for (const auto &var : e->vars) {
+      bind(var.first.name);
+    }
+  } else if (auto e = dynamic_cast<LambdaExpr *>(expr)) {
+    for (const auto &arg : e->arguments.expressions) {
+      if (auto symbol = dynamic_cast<SymbolExpr *>(arg.get())) {
+        bind(symbol->symbol.name);
+      }
+    }
+  } else if (auto e = dynamic_cast<InlineExpr *>(expr)) {
+    for (const auto &param : e->params) {
+      bind(param.name);
+    }
+  }
+  for_each_child(expr, [&](Expr *child) { count(child); });
+}
+
+std::size_t ProgramBindings::times_bound(const std::string &name) const {
+  auto it = counts.find(name);
+  return it != counts.end() ? it->second : 0;
+}
+
+bool ProgramBindings::bound_in_env(const std::string &name) const {
+  return env.bindings.contains(name);
+}
+
+bool ProgramBindings::trusted(const std::string &name) const {
+  return times_bound(name) <= 1 && !bound_in_env(name);
+}
+
+void check_program(const ExprList &program, const Env &env) {
+  Checker checker(program, env);
+  for (const auto &expr : program) {
+    checker.infer(expr.get());
+  }
+}
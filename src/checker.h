@@ -0,0 +1,93 @@
+#pragma once
+
+#include "ast.h"
+
+#include <string>
+#include <unordered_map>
+
+// What the checker knows about the value of an expression. `Any` when it can
+// be of several types, `Never` for 'recur', which does not produce a value.
+enum class Type { Any, Never, Nil, Number, Boolean, String, List, Function };
+
+// Calls `f` on each direct subexpression of `expr`.
+template <typename F> void for_each_child(Expr *expr, F f) {
+  auto all = [&](const ExprList &exprs) {
+    for (const auto &e : exprs) {
+      f(e.get());
+    }
+  };
+
+  if (auto e = dynamic_cast<ListExpr *>(expr)) {
+    all(e->expressions);
+  } else if (auto e = dynamic_cast<QuasiquoteExpr *>(expr)) {
+    for (const auto &part : e->parts) {
+      f(part.second.get());
+    }
+  } else if (auto e = dynamic_cast<DoExpr *>(expr)) {
+    all(e->expressions);
+  } else if (auto e = dynamic_cast<IfExpr *>(expr)) {
+    all(e->expressions);
+  } else if (auto e = dynamic_cast<CondExpr *>(expr)) {
+    all(e->expressions);
+  } else if (auto e = dynamic_cast<DefineExpr *>(expr)) {
+    f(e->expr.get());
+  } else if (auto e = dynamic_cast<LetExpr *>(expr)) {
+    for (const auto &var : e->vars) {
+      f(var.second.get());
+    }
+    f(e->expr.get());
+  } else if (auto e = dynamic_cast<LoopExpr *>(expr)) {
+    for (const auto &var : e->vars) {
+      f(var.second.get());
+    }
+    f(e->expr.get());
+  } else if (auto e = dynamic_cast<RecurExpr *>(expr)) {
+    all(e->expressions);
+  } else if (auto e = dynamic_cast<LambdaExpr *>(expr)) {
+    f(e->body.get());
+  } else if (auto e = dynamic_cast<AndExpr *>(expr)) {
+    all(e->exprs);
+  } else if (auto e = dynamic_cast<OrExpr *>(expr)) {
+    all(e->exprs);
+  } else if (auto e = dynamic_cast<InlineExpr *>(expr)) {
+    all(e->args);
+    f(e->body.get());
+  } else if (auto e = dynamic_cast<InlinedCallExpr *>(expr)) {
+    f(e->inlined.get());
+    f(e->call.get());
+  } else if (auto e = dynamic_cast<ConstantExpr *>(expr)) {
+    f(e->call.get());
+  }
+}
+
+// The names bound by a program, and by the lambdas of `env` it can call.
+// Lambdas see the bindings of their caller, so a name is only trusted when it
+// is bound at most once and `env` does not already bind it.
+class ProgramBindings {
+public:
+  ProgramBindings(const ExprList &program, const Env &env);
+
+  std::size_t times_bound(const std::string &name) const;
+  bool bound_in_env(const std::string &name) const;
+  bool trusted(const std::string &name) const;
+  // the value of each name bound by a 'define'
+  const std::unordered_map<std::string, Expr *> &definitions() const {
+    return defined;
+  }
+
+  const Env &env;
+
+private:
+  void bind(const std::string &name) { counts[name]++; }
+  void count(Expr *expr);
+
+  std::unordered_map<std::string, std::size_t> counts;
+  std::unordered_map<std::string, Expr *> defined;
+};
+
+// Checks a whole program before it is evaluated: the number of arguments of
+// calls to builtins and to lambdas, and the types of the arguments of
+// builtins, throwing a TypeError on the first mismatch. Calls to arithmetic
+// and comparison builtins with arguments proven to be numbers are marked so
+// that they skip the runtime checks (see ListExpr::numeric).
+void check_program(const ExprList &program, const Env &env);
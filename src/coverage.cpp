@@ -0,0 +1,282 @@
+#include "coverage.h"
+
+#include "parser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <utility>
+
+namespace {
+
+const char *expression_kind(Expr *expr) {
+  if (dynamic_cast<ListExpr *>(expr)) {
+    return "call";
+  } else if (dynamic_cast<SymbolExpr *>(expr)) {
+    return "symbol";
+  } else if (dynamic_cast<QuoteExpr *>(expr) ||
+             dynamic_cast<QuasiquoteExpr *>(expr) ||
+             dynamic_cast<ConstantExpr *>(expr)) {
+    return "quote";
+  } else if (dynamic_cast<DoExpr *>(expr)) {
+    return "do";
+  } else if (dynamic_cast<IfExpr *>(expr)) {
+    return "if";
+  } else if (dynamic_cast<CondExpr *>(expr)) {
+    return "cond";
+  } else if (dynamic_cast<DefineExpr *>(expr)) {
+    return "define";
+  } else if (dynamic_cast<LetExpr *>(expr)) {
+    return "let";
+  } else if (dynamic_cast<LoopExpr *>(expr)) {
+    return "loop";
+  } else if (dynamic_cast<RecurExpr *>(expr)) {
+    return "recur";
+  } else if (dynamic_cast<LambdaExpr *>(expr)) {
+    return "lambda";
+  } else if (dynamic_cast<AndExpr *>(expr)) {
+    return "and";
+  } else if (dynamic_cast<OrExpr *>(expr)) {
+    return "or";
+  }
+  return "literal";
+}
+
+std::vector<std::string> split_lines(const std::string &source) {
+  std::vector<std::string> lines;
+  std::istringstream in(source);
+  std::string line;
+  while (std::getline(in, line)) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// the call starting at `column`, up to the end of the line
+std::string call_text(const std::string &line, std::uint32_t column) {
+  constexpr std::size_t MAX_LENGTH = 40;
+  std::size_t end = column - 1;
+  int depth = 0;
+  bool string = false;
+  while (end < line.size()) {
+    auto c = line[end++];
+    if (string) {
+      string = c != '"';
+    } else if (c == '"') {
+      string = true;
+    } else if (c == '(') {
+      depth++;
+    } else if (c == ')' && --depth == 0) {
+      break;
+    }
+  }
+  auto text = line.substr(std::min<std::size_t>(column - 1, line.size()),
+                          end - (column - 1));
+  if (text.size() > MAX_LENGTH) {
+    text = text.substr(0, MAX_LENGTH - 3) + "...";
+  }
+  return text;
+}
+
+// the time of the calls nested in the current one, excluded from its time
+constinit thread_local std::uint64_t nested_nanoseconds = 0;
+
+} // namespace
+
+CountedExpr::CountedExpr(ExprPtr expr, bool timed)
+    : expr(std::move(expr)), timed(timed) {
+  line = this->expr->line;
+  column = this->expr->column;
+}
+
+Result CountedExpr::evaluate(Env &env) {
+  hits.fetch_add(1, std::memory_order_relaxed);
+  if (!timed) {
+    return expr->evaluate(env);
+  }
+
+  // also counted when the call throws
+  struct Timer {
+    CountedExpr &call;
+    std::uint64_t enclosing_nested = std::exchange(nested_nanoseconds, 0);
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+
+    ~Timer() {
+      std::uint64_t elapsed =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count();
+      call.nanoseconds.fetch_add(elapsed - nested_nanoseconds,
+                                 std::memory_order_relaxed);
+      nested_nanoseconds = enclosing_nested + elapsed;
+    }
+  } timer{*this};
+  return expr->evaluate(env);
+}
+
+Result Coverage::evaluate(Env &env) {
+  auto tokens = tokenize(source);
+  Parser parser(&env);
+  parser.record_positions = true;
+  Result res;
+  while (!parser.done(tokens)) {
+    res = instrument(parser.parse(tokens), nullptr)->evaluate(env);
+  }
+  return res;
+}
+
+// Wraps the expressions of `expr` that have a position in counters,
+// replacing its subexpressions in place.
+ExprPtr Coverage::instrument(const ExprPtr &expr, const CountedExpr *parent) {
+  auto e = expr.get();
+  ExprPtr result = expr;
+  if (e->line != 0) {
+    auto call = dynamic_cast<ListExpr *>(e);
+    auto counter = std::make_shared<CountedExpr>(
+        expr, call != nullptr && !call->expressions.empty());
+    counted.push_back({counter, parent, expression_kind(e)});
+    parent = counter.get();
+    result = counter;
+  }
+
+  auto all = [&](ExprList &exprs, std::size_t from = 0) {
+    for (auto i = from; i < exprs.size(); ++i) {
+      exprs[i] = instrument(exprs[i], parent);
+    }
+  };
+  auto bindings = [&](LetExpr::Bindings &vars) {
+    for (auto &var : vars) {
+      var.second = instrument(var.second, parent);
+    }
+  };
+
+  if (auto list = dynamic_cast<ListExpr *>(e)) {
+    // an operator named by a symbol is looked up by the call itself
+    auto named = !list->expressions.empty() &&
+                 dynamic_cast<SymbolExpr *>(list->expressions[0].get());
+    all(list->expressions, named ? 1 : 0);
+  } else if (auto cond = dynamic_cast<CondExpr *>(e)) {
+    // the clauses are read by the 'cond', only their parts are counted
+    for (auto &clause : cond->expressions) {
+      auto pair = dynamic_cast<ListExpr *>(clause.get());
+      if (pair == nullptr || pair->expressions.empty()) {
+        continue;
+      }
+      auto test = dynamic_cast<SymbolExpr *>(pair->expressions[0].get());
+      all(pair->expressions, test && test->symbol.name == "else" ? 1 : 0);
+    }
+  } else if (auto quasi = dynamic_cast<QuasiquoteExpr *>(e)) {
+    for (auto &part : quasi->parts) {
+      part.second = instrument(part.second, parent);
+    }
+  } else if (auto block = dynamic_cast<DoExpr *>(e)) {
+    all(block->expressions);
+  } else if (auto branch = dynamic_cast<IfExpr *>(e)) {
+    all(branch->expressions);
+  } else if (auto define = dynamic_cast<DefineExpr *>(e)) {
+    define->expr = instrument(define->expr, parent);
+  } else if (auto let = dynamic_cast<LetExpr *>(e)) {
+    bindings(let->vars);
+    let->expr = instrument(let->expr, parent);
+  } else if (auto loop = dynamic_cast<LoopExpr *>(e)) {
+    bindings(loop->vars);
+    loop->expr = instrument(loop->expr, parent);
+  } else if (auto recur = dynamic_cast<RecurExpr *>(e)) {
+    all(recur->expressions);
+  } else if (auto lambda = dynamic_cast<LambdaExpr *>(e)) {
+    lambda->body = instrument(lambda->body, parent);
+  } else if (auto conjunction = dynamic_cast<AndExpr *>(e)) {
+    all(conjunction->exprs);
+  } else if (auto disjunction = dynamic_cast<OrExpr *>(e)) {
+    all(disjunction->exprs);
+  }
+  return result;
+}
+
+void Coverage::report(std::ostream &out) const {
+  std::map<std::uint32_t, std::vector<const Counter *>> by_line;
+  for (const auto &counter : counted) {
+    by_line[counter.expr->line].push_back(&counter);
+  }
+
+  char text[128];
+  auto lines = split_lines(source);
+  for (std::uint32_t n = 1; n <= lines.size(); ++n) {
+    auto it = by_line.find(n);
+    if (it == by_line.end()) {
+      std::snprintf(text, sizeof(text), "%12s %5u | ", "-", n);
+      out << text << lines[n - 1] << '\n';
+      continue;
+    }
+
+    std::uint64_t hits = 0;
+    for (auto counter : it->second) {
+      hits = std::max<std::uint64_t>(hits, counter->expr->hits);
+    }
+    if (hits == 0) {
+      std::snprintf(text, sizeof(text), "%12s %5u | ", "#####", n);
+    } else {
+      std::snprintf(text, sizeof(text), "%12llu %5u | ",
+                    static_cast<unsigned long long>(hits), n);
+    }
+    out << text << lines[n - 1] << '\n';
+
+    auto counters = it->second;
+    std::stable_sort(counters.begin(), counters.end(),
+                     [](const Counter *a, const Counter *b) {
+                       return a->expr->column < b->expr->column;
+                     });
+    for (auto counter : counters) {
+      auto count = counter->expr->hits.load();
+      if (count == hits ||
+          (counter->parent != nullptr && count == counter->parent->hits)) {
+        continue;
+      }
+      std::snprintf(text, sizeof(text), "%12s %5s | ", "", "");
+      out << text << std::string(counter->expr->column - 1, ' ') << '^'
+          << count << '\n';
+    }
+  }
+
+  std::vector<const Counter *> calls;
+  for (const auto &counter : counted) {
+    if (counter.expr->timed && counter.expr->hits != 0) {
+      calls.push_back(&counter);
+    }
+  }
+  std::stable_sort(calls.begin(), calls.end(),
+                   [](const Counter *a, const Counter *b) {
+                     return a->expr->nanoseconds > b->expr->nanoseconds;
+                   });
+  calls.resize(std::min<std::size_t>(calls.size(), 10));
+  if (calls.empty()) {
+    return;
+  }
+  std::snprintf(text, sizeof(text), "\n%-12s%12s%12s  %s\n", "call", "count",
+                "self ms", "(without nested calls)");
+  out << text;
+  for (auto call : calls) {
+    auto &expr = *call->expr;
+    std::snprintf(text, sizeof(text), "%u:%u", expr.line, expr.column);
+    std::string position = text;
+    std::snprintf(text, sizeof(text), "%-12s%12llu%12.3f  ", position.c_str(),
+                  static_cast<unsigned long long>(expr.hits.load()),
+                  expr.nanoseconds / 1e6);
+    std::string code;
+    if (expr.line <= lines.size()) {
+      code = call_text(lines[expr.line - 1], expr.column);
+    }
+    out << text << code << '\n';
+  }
+}
+
+void Coverage::dump(std::ostream &out) const {
+  for (const auto &counter : counted) {
+    const auto &expr = *counter.expr;
+    out << expr.line << ' ' << expr.column << ' ' << counter.kind << ' '
+        << expr.hits << ' ' << expr.nanoseconds << '\n';
+  }
+}
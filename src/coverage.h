@@ -0,0 +1,65 @@
+#pragma once
+
+#include "ast.h"
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Counts how often each expression of a program is evaluated, and how long
+// its calls take, to find the code that never runs and the hot spots:
+//
+//   Coverage coverage(program);
+//   coverage.evaluate(env);
+//   coverage.report(std::cerr);
+//
+// Only the instrumented program pays for the counters, they are nodes
+// wrapped around its expressions. Its lambdas are never compiled by the JIT,
+// and the code expanded from a macro is counted as a whole, at the call.
+
+// the counters of an expression, evaluates it
+struct CountedExpr : public Expr {
+  CountedExpr(ExprPtr expr, bool timed);
+  Result evaluate(Env &env) override;
+
+  ExprPtr expr;
+  // only calls are timed
+  bool timed;
+  std::atomic<std::uint64_t> hits = 0;
+  // spent in the call itself, without the nested calls
+  std::atomic<std::uint64_t> nanoseconds = 0;
+};
+
+class Coverage {
+public:
+  explicit Coverage(std::string source) : source(std::move(source)) {}
+
+  // parses, instruments and evaluates the source, each form once the
+  // previous ones are evaluated like eval_with_env()
+  Result evaluate(Env &env);
+
+  // The source with the evaluations of each line, "#####" when it was never
+  // evaluated, and a mark under the expressions evaluated a different number
+  // of times than the line and their parent. The calls taking the most time
+  // follow.
+  void report(std::ostream &out) const;
+  // one expression per line: "line column kind hits nanoseconds"
+  void dump(std::ostream &out) const;
+
+  struct Counter {
+    std::shared_ptr<CountedExpr> expr;
+    // the closest counted expression containing it, if any
+    const CountedExpr *parent;
+    const char *kind;
+  };
+  const std::vector<Counter> &counters() const { return counted; }
+
+private:
+  ExprPtr instrument(const ExprPtr &expr, const CountedExpr *parent);
+
+  std::string source;
+  // in the order of the source
+  std::vector<Counter> counted;
+};
@@ -6,22 +6,26 @@
 
 //using Env = std::unordered_map<std::string, Result>;
 
+struct LoopFrame;
+
 class Env {
 public:
   Env() {
       bindings["true"] = true;
       bindings["false"] = false;
+      bindings["nil"] = Nil{};
   };
 
-  Result* get(std::string key) {
-    if (bindings.contains(key)) {
-      return &bindings.at(key);
+  Result* get(const std::string &key) {
+    auto it = bindings.find(key);
+    if (it != bindings.end()) {
+      return &it->second;
     } else {
       return nullptr;
     }
   }
 
-  Result& operator[](std::string key) {
+  Result& operator[](const std::string &key) {
     return bindings[key];
   }
 
@@ -30,4 +34,6 @@ public:
   }
 
   std::unordered_map<std::string, Result> bindings;
+  // innermost 'loop' being evaluated, target of 'recur'
+  LoopFrame *loop = nullptr;
 };
\ No newline at end of file
@@ -0,0 +1,763 @@
+#include "formats.h"
+
+#include "bignum.h"
+#include "io.h"
+#include "seq.h"
+
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// values nested deeper are rejected rather than overflowing the stack
+constexpr int MAX_JSON_DEPTH = 512;
+
+// The offset of the first byte from `from` on that is `a` or `b`, or a
+// control character when `controls`, the size of `text` when there is none.
+std::size_t find_special(std::string_view text, std::size_t from, char a,
+                         char b, bool controls) {
+  auto data = text.data();
+  auto size = text.size();
+#ifdef __SSE2__
+  const auto va = _mm_set1_epi8(a);
+  const auto vb = _mm_set1_epi8(b);
+  const auto last_control = _mm_set1_epi8(0x1F);
+  for (; from + 16 <= size; from += 16) {
+    auto chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + from));
+    auto hits =
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb));
+    if (controls) {
+      // the bytes up to 0x1F are left unchanged by the unsigned minimum
+      hits = _mm_or_si128(
+          hits, _mm_cmpeq_epi8(_mm_min_epu8(chunk, last_control), chunk));
+    }
+    if (auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits))) {
+      return from + std::countr_zero(mask);
+    }
+  }
+#endif
+  for (; from < size; ++from) {
+    auto c = static_cast<unsigned char>(data[from]);
+    if (c == a || c == b || (controls && c < 0x20)) {
+      return from;
+    }
+  }
+  return size;
+}
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// The length of the JSON number at the start of `text`, 0 when there is
+// none; `integer` tells whether it has no fraction nor exponent.
+std::size_t number_length(std::string_view text, bool &integer) {
+  std::size_t pos = 0;
+  auto digits = [&] {
+    auto start = pos;
+    while (pos < text.size() && is_digit(text[pos])) {
+      pos++;
+    }
+    return pos - start;
+  };
+  if (pos < text.size() && text[pos] == '-') {
+    pos++;
+  }
+  auto whole = pos;
+  if (digits() == 0 || (text[whole] == '0' && pos - whole > 1)) {
+    return 0;
+  }
+  integer = true;
+  if (pos < text.size() && text[pos] == '.') {
+    pos++;
+    integer = false;
+    if (digits() == 0) {
+      return 0;
+    }
+  }
+  if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+    pos++;
+    integer = false;
+    if (pos < text.size() && (text[pos] == '+' || text[pos] == '-')) {
+      pos++;
+    }
+    if (digits() == 0) {
+      return 0;
+    }
+  }
+  return pos;
+}
+
+// `text` is a JSON number
+Result number_value(std::string_view text, bool integer) {
+  // the digits a double keeps exactly, see parse_integer
+  auto digits = text.size() - (text[0] == '-');
+  if (integer && digits > 15) {
+    return parse_integer(std::string(text));
+  }
+  Number n = 0;
+  auto parsed = std::from_chars(text.data(), text.data() + text.size(), n);
+  if (parsed.ec == std::errc::result_out_of_range) {
+    // too small is 0, too large is infinite, like strtod
+    auto exponent = text.find_first_of("eE");
+    bool small = exponent != std::string_view::npos &&
+                 text[exponent + 1] == '-';
+    n = small ? 0.0 : HUGE_VAL;
+    return text[0] == '-' ? -n : n;
+  }
+  return n;
+}
+
+class JsonParser {
+public:
+  explicit JsonParser(std::string_view text) : text(text) {}
+
+  Result parse() {
+    auto result = value(0);
+    skip_space();
+    if (pos < text.size()) {
+      fail("unexpected '" + std::string(1, text[pos]) + "'");
+    }
+    return result;
+  }
+
+private:
+  [[noreturn]] void fail(const std::string &message) const {
+    throw std::runtime_error("Invalid JSON at offset " + std::to_string(pos) +
+                             ": " + message);
+  }
+
+  void skip_space() {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' ||
+                                 text[pos] == '\n' || text[pos] == '\r')) {
+      pos++;
+    }
+  }
+
+  void expect(char c) {
+    skip_space();
+    if (pos >= text.size() || text[pos] != c) {
+      fail(std::string("expected '") + c + "'");
+    }
+    pos++;
+  }
+
+  // the next character is the end of a list, after the separators
+  bool end_of(char close) {
+    skip_space();
+    if (pos < text.size() && text[pos] == close) {
+      pos++;
+      return true;
+    }
+    return false;
+  }
+
+  Result value(int depth) {
+    if (depth > MAX_JSON_DEPTH) {
+      fail("nesting too deep");
+    }
+    skip_space();
+    if (pos >= text.size()) {
+      fail("unexpected end");
+    }
+    switch (text[pos]) {
+    case '{': {
+      pos++;
+      std::vector<Result> fields;
+      if (!end_of('}')) {
+        do {
+          skip_space();
+          if (pos >= text.size() || text[pos] != '"') {
+            fail("expected a key");
+          }
+          std::vector<Result> pair;
+          pair.reserve(2);
+          pair.emplace_back(Symbol{string()});
+          expect(':');
+          pair.push_back(value(depth + 1));
+          fields.emplace_back(List(std::move(pair)));
+        } while (!separator('}'));
+      }
+      return List(std::move(fields));
+    }
+    case '[': {
+      pos++;
+      std::vector<Result> items;
+      if (!end_of(']')) {
+        do {
+          items.push_back(value(depth + 1));
+        } while (!separator(']'));
+      }
+      return List(std::move(items));
+    }
+    case '"':
+      return string();
+    case 't':
+      return keyword("true", true);
+    case 'f':
+      return keyword("false", false);
+    case 'n':
+      return keyword("null", Nil{});
+    default: {
+      bool integer = false;
+      auto length = number_length(text.substr(pos), integer);
+      if (length == 0) {
+        fail("unexpected '" + std::string(1, text[pos]) + "'");
+      }
+      auto n = number_value(text.substr(pos, length), integer);
+      pos += length;
+      return n;
+    }
+    }
+  }
+
+  // true at the end of the list, false after a ','
+  bool separator(char close) {
+    skip_space();
+    if (pos < text.size() && text[pos] == ',') {
+      pos++;
+      return false;
+    }
+    if (pos < text.size() && text[pos] == close) {
+      pos++;
+      return true;
+    }
+    fail(std::string("expected ',' or '") + close + "'");
+  }
+
+  Result keyword(std::string_view word, Result value) {
+    if (text.substr(pos, word.size()) != word) {
+      fail("unexpected '" + std::string(1, text[pos]) + "'");
+    }
+    pos += word.size();
+    return value;
+  }
+
+  // after the opening quote
+  std::string string() {
+    pos++;
+    std::string s;
+    while (true) {
+      auto end = find_special(text, pos, '"', '\\', true);
+      s.append(text.substr(pos, end - pos));
+      pos = end;
+      if (pos >= text.size()) {
+        fail("unterminated string");
+      }
+      auto c = text[pos++];
+      if (c == '"') {
+        return s;
+      } else if (c != '\\') {
+        fail("control character in a string");
+      } else if (pos >= text.size()) {
+        fail("unterminated string");
+      }
+      switch (auto escaped = text[pos++]) {
+      case '"':
+      case '\\':
+      case '/':
+        s += escaped;
+        break;
+      case 'b':
+        s += '\b';
+        break;
+      case 'f':
+        s += '\f';
+        break;
+      case 'n':
+        s += '\n';
+        break;
+      case 'r':
+        s += '\r';
+        break;
+      case 't':
+        s += '\t';
+        break;
+      case 'u':
+        append_utf8(s, code_point());
+        break;
+      default:
+        fail("invalid escape");
+      }
+    }
+  }
+
+  unsigned hex4() {
+    if (pos + 4 > text.size()) {
+      fail("invalid \\u escape");
+    }
+    unsigned value = 0;
+    auto res = std::from_chars(text.data() + pos, text.data() + pos + 4,
+                               value, 16);
+    if (res.ptr != text.data() + pos + 4) {
+      fail("invalid \\u escape");
+    }
+    pos += 4;
+    return value;
+  }
+
+  // after the "\u", combines the surrogate pairs
+  unsigned code_point() {
+    auto high = hex4();
+    if (high < 0xD800 || high > 0xDBFF) {
+      return high;
+    }
+    if (text.substr(pos, 2) != "\\u") {
+      fail("unpaired surrogate");
+    }
+    pos += 2;
+    auto low = hex4();
+    if (low < 0xDC00 || low > 0xDFFF) {
+      fail("unpaired surrogate");
+    }
+    return 0x10000 + ((high - 0xD800) << 10) + (low - 0xDC00);
+  }
+
+  static void append_utf8(std::string &s, unsigned c) {
+    if (c < 0x80) {
+      s += static_cast<char>(c);
+    } else if (c < 0x800) {
+      s += static_cast<char>(0xC0 | (c >> 6));
+      s += static_cast<char>(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+      s += static_cast<char>(0xE0 | (c >> 12));
+      s += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      s += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+      s += static_cast<char>(0xF0 | (c >> 18));
+      s += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+      s += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      s += static_cast<char>(0x80 | (c & 0x3F));
+    }
+  }
+
+  std::string_view text;
+  std::size_t pos = 0;
+};
+
+void write_number(Sink &sink, Number n) {
+  char buffer[64];
+  std::to_chars_result res;
+  if (std::trunc(n) == n && std::abs(n) <= MAX_EXACT) {
+    res = std::to_chars(buffer, buffer + sizeof buffer,
+                        static_cast<long long>(n));
+  } else {
+    // the shortest representation that reads back the same
+    res = std::to_chars(buffer, buffer + sizeof buffer, n);
+  }
+  sink.write(std::string_view(buffer, res.ptr - buffer));
+}
+
+void write_json_string(Sink &sink, std::string_view s) {
+  sink.put('"');
+  std::size_t pos = 0;
+  while (true) {
+    auto end = find_special(s, pos, '"', '\\', true);
+    sink.write(s.substr(pos, end - pos));
+    if (end == s.size()) {
+      break;
+    }
+    auto c = static_cast<unsigned char>(s[end]);
+    switch (c) {
+    case '"':
+      sink.write("\\\"");
+      break;
+    case '\\':
+      sink.write("\\\\");
+      break;
+    case '\n':
+      sink.write("\\n");
+      break;
+    case '\r':
+      sink.write("\\r");
+      break;
+    case '\t':
+      sink.write("\\t");
+      break;
+    default: {
+      char escape[8];
+      std::snprintf(escape, sizeof escape, "\\u%04x", c);
+      sink.write(escape);
+    }
+    }
+    pos = end + 1;
+  }
+  sink.put('"');
+}
+
+// a non-empty list of (key value) pairs with symbols as keys
+bool is_object(const List &list) {
+  if (list.list.empty()) {
+    return false;
+  }
+  for (const auto &item : list.list) {
+    auto pair = std::get_if<List>(&item);
+    if (pair == nullptr || pair->list.size() != 2 ||
+        !std::holds_alternative<Symbol>(pair->list[0])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// a field written like a JSON number, or a string
+Result csv_field(std::string_view text) {
+  bool integer = false;
+  if (!text.empty() && number_length(text, integer) == text.size()) {
+    return number_value(text, integer);
+  }
+  return String(text);
+}
+
+void write_csv_field(Sink &sink, const Result &field, char separator) {
+  if (auto n = std::get_if<Number>(&field)) {
+    write_number(sink, *n);
+    return;
+  } else if (std::holds_alternative<Nil>(field)) {
+    return;
+  }
+  auto s = std::holds_alternative<String>(field) ? std::get<String>(field)
+                                                  : to_string(field);
+  // quoted when it would not read back as the same string
+  bool integer = false;
+  bool quoted = (std::holds_alternative<String>(field) && !s.empty() &&
+                 number_length(s, integer) == s.size()) ||
+                find_special(s, 0, separator, '"', true) != s.size();
+  if (!quoted) {
+    sink.write(s);
+    return;
+  }
+  sink.put('"');
+  std::size_t pos = 0;
+  while (true) {
+    auto end = find_special(s, pos, '"', '"', false);
+    sink.write(std::string_view(s).substr(pos, end - pos));
+    if (end == s.size()) {
+      break;
+    }
+    sink.write("\"\"");
+    pos = end + 1;
+  }
+  sink.put('"');
+}
+
+std::shared_ptr<FileHandle> reader_arg(const std::vector<Result> &arguments,
+                                       const std::string &op) {
+  if (arguments.empty()) {
+    return stdin_handle();
+  }
+  if (auto file = std::get_if<File>(&arguments[0])) {
+    return file->handle;
+  }
+  throw std::runtime_error("'" + op + "' requires a file");
+}
+
+char separator_arg(const Result &arg, const std::string &op) {
+  auto s = std::get_if<String>(&arg);
+  if (s == nullptr || s->size() != 1 || *s == "\"") {
+    throw std::runtime_error("'" + op + "' requires a one-character "
+                             "separator, got " +
+                             to_string(arg));
+  }
+  return (*s)[0];
+}
+
+bool blank(std::string_view line) {
+  return line.find_first_not_of(" \t\r") == std::string_view::npos;
+}
+
+class JsonLineGenerator : public Generator {
+public:
+  explicit JsonLineGenerator(std::shared_ptr<FileHandle> file)
+      : file(std::move(file)) {}
+
+  std::optional<Result> next() override {
+    std::string line;
+    do {
+      if (!file->read_line(line)) {
+        return std::nullopt;
+      }
+      line_number++;
+    } while (blank(line));
+    try {
+      return parse_json(line);
+    } catch (const std::runtime_error &e) {
+      throw std::runtime_error(file->name + ":" +
+                               std::to_string(line_number) + ": " + e.what());
+    }
+  }
+
+private:
+  std::shared_ptr<FileHandle> file;
+  std::size_t line_number = 0;
+};
+
+class CsvGenerator : public Generator {
+public:
+  CsvGenerator(std::shared_ptr<FileHandle> file, char separator)
+      : file(std::move(file)), separator(separator) {}
+
+  std::optional<Result> next() override {
+    std::string record;
+    do {
+      if (!read_line(record)) {
+        return std::nullopt;
+      }
+    } while (record.empty());
+    while (true) {
+      if (auto fields = parse_csv_record(record, separator)) {
+        return List(std::move(*fields));
+      }
+      // a line break in a quoted field
+      std::string line;
+      if (!read_line(line)) {
+        throw std::runtime_error(file->name + ": unterminated quoted field");
+      }
+      record += '\n';
+      record += line;
+    }
+  }
+
+private:
+  // without the '\r' of a "\r\n"
+  bool read_line(std::string &line) {
+    if (!file->read_line(line)) {
+      return false;
+    }
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    return true;
+  }
+
+  std::shared_ptr<FileHandle> file;
+  char separator;
+};
+
+} // namespace
+
+Result parse_json(std::string_view text) { return JsonParser(text).parse(); }
+
+void write_json(Sink &sink, const Result &value) {
+  if (auto n = std::get_if<Number>(&value)) {
+    if (std::isfinite(*n)) {
+      write_number(sink, *n);
+    } else {
+      // JSON has no infinities nor NaN
+      sink.write("null");
+    }
+  } else if (auto n = std::get_if<BigInt>(&value)) {
+    sink.write(to_decimal(*n));
+  } else if (auto b = std::get_if<Boolean>(&value)) {
+    sink.write(*b ? "true" : "false");
+  } else if (std::holds_alternative<Nil>(value)) {
+    sink.write("null");
+  } else if (auto s = std::get_if<String>(&value)) {
+    write_json_string(sink, *s);
+  } else if (auto s = std::get_if<Symbol>(&value)) {
+    write_json_string(sink, s->name);
+  } else if (auto l = std::get_if<List>(&value)) {
+    bool object = is_object(*l);
+    sink.put(object ? '{' : '[');
+    for (std::size_t i = 0; i < l->list.size(); ++i) {
+      if (i > 0) {
+        sink.put(',');
+      }
+      if (object) {
+        const auto &pair = std::get<List>(l->list[i]).list;
+        write_json_string(sink, std::get<Symbol>(pair[0]).name);
+        sink.put(':');
+        write_json(sink, pair[1]);
+      } else {
+        write_json(sink, l->list[i]);
+      }
+    }
+    sink.put(object ? '}' : ']');
+  } else if (auto seq = std::get_if<Seq>(&value)) {
+    sink.put('[');
+    for (auto s = *seq; !seq_empty(s); s = seq_rest(s)) {
+      if (s.node != seq->node) {
+        sink.put(',');
+      }
+      write_json(sink, seq_first(s));
+    }
+    sink.put(']');
+  } else {
+    throw std::runtime_error("Cannot write " + to_string(value) +
+                             " as JSON");
+  }
+}
+
+std::optional<std::vector<Result>> parse_csv_record(std::string_view record,
+                                                    char separator) {
+  std::vector<Result> fields;
+  std::size_t pos = 0;
+  while (true) {
+    if (pos < record.size() && record[pos] == '"') {
+      std::string field;
+      pos++;
+      while (true) {
+        auto quote = find_special(record, pos, '"', '"', false);
+        field.append(record.substr(pos, quote - pos));
+        if (quote == record.size()) {
+          return std::nullopt;
+        }
+        pos = quote + 1;
+        if (pos < record.size() && record[pos] == '"') {
+          field += '"';
+          pos++;
+        } else {
+          break;
+        }
+      }
+      // lenient: what follows the closing quote is part of the field
+      auto end = find_special(record, pos, separator, separator, false);
+      field.append(record.substr(pos, end - pos));
+      fields.emplace_back(std::move(field));
+      pos = end;
+    } else {
+      auto end = find_special(record, pos, separator, separator, false);
+      fields.push_back(csv_field(record.substr(pos, end - pos)));
+      pos = end;
+    }
+    if (pos == record.size()) {
+      return fields;
+    }
+    pos++;
+  }
+}
+
+void write_csv_record(Sink &sink, std::span<const Result> fields,
+                      char separator) {
+  for (std::size_t i = 0; i < fields.size(); ++i) {
+    if (i > 0) {
+      sink.put(separator);
+    }
+    write_csv_field(sink, fields[i], separator);
+  }
+  sink.put('\n');
+}
+
+Result json_parse_fn(const std::vector<Result> &arguments) {
+  if (arguments.size() != 1 || !std::holds_alternative<String>(arguments[0])) {
+    throw std::runtime_error("'json-parse' requires a string");
+  }
+  return parse_json(std::get<String>(arguments[0]));
+}
+
+String json_string_fn(const std::vector<Result> &arguments) {
+  if (arguments.size() != 1) {
+    throw std::runtime_error("'json-string' requires exactly 1 argument");
+  }
+  StringSink sink;
+  write_json(sink, arguments[0]);
+  return std::move(sink.str());
+}
+
+Seq read_json_fn(const std::vector<Result> &arguments) {
+  return make_seq(
+      std::make_shared<JsonLineGenerator>(reader_arg(arguments, "read-json")));
+}
+
+Nil write_json_fn(const std::vector<Result> &arguments) {
+  if (arguments.empty() || arguments.size() > 2) {
+    throw std::runtime_error("'write-json' requires an optional file and a "
+                             "value");
+  }
+  // written to a string first, nothing is written when it fails
+  StringSink line;
+  write_json(line, arguments.back());
+  line.put('\n');
+
+  std::lock_guard lock(stdout_mutex());
+  Sink *sink = &stdout_sink();
+  if (arguments.size() == 2) {
+    auto file = std::get_if<File>(&arguments[0]);
+    if (file == nullptr) {
+      throw std::runtime_error("'write-json' requires a file, got " +
+                               to_string(arguments[0]));
+    }
+    sink = &file->handle->output();
+  }
+  sink->write(line.str());
+  sink->sync(true);
+  return Nil{};
+}
+
+Seq read_csv_fn(const std::vector<Result> &arguments) {
+  if (arguments.size() > 2) {
+    throw std::runtime_error("'read-csv' requires an optional file and "
+                             "separator");
+  }
+  auto file = reader_arg(arguments, "read-csv");
+  auto separator =
+      arguments.size() == 2 ? separator_arg(arguments[1], "read-csv") : ',';
+  return make_seq(std::make_shared<CsvGenerator>(file, separator));
+}
+
+Nil write_csv_fn(const std::vector<Result> &arguments) {
+  // [file] record [separator]
+  std::size_t start = 0;
+  Sink *sink = &stdout_sink();
+  if (!arguments.empty()) {
+    if (auto file = std::get_if<File>(&arguments[0])) {
+      sink = &file->handle->output();
+      start = 1;
+    }
+  }
+  auto record = start < arguments.size()
+                    ? std::get_if<List>(&arguments[start])
+                    : nullptr;
+  if (record == nullptr || arguments.size() > start + 2) {
+    throw std::runtime_error("'write-csv' requires an optional file, a list "
+                             "and an optional separator");
+  }
+  auto separator = arguments.size() == start + 2
+                       ? separator_arg(arguments[start + 1], "write-csv")
+                       : ',';
+
+  StringSink line;
+  write_csv_record(line, record->list.elements(), separator);
+  std::lock_guard lock(stdout_mutex());
+  sink->write(line.str());
+  sink->sync(true);
+  return Nil{};
+}
+
+Result field_fn(const std::vector<Result> &arguments) {
+  if (arguments.size() != 2) {
+    throw std::runtime_error("'field' requires an object and a key");
+  }
+  auto object = std::get_if<List>(&arguments[0]);
+  if (object == nullptr) {
+    throw std::runtime_error("'field' requires a list of pairs, got " +
+                             to_string(arguments[0]));
+  }
+  const std::string *key = nullptr;
+  if (auto s = std::get_if<Symbol>(&arguments[1])) {
+    key = &s->name;
+  } else if (auto s = std::get_if<String>(&arguments[1])) {
+    key = s;
+  } else {
+    throw std::runtime_error("'field' requires a symbol or a string key, "
+                             "got " +
+                             to_string(arguments[1]));
+  }
+  for (const auto &item : object->list) {
+    auto pair = std::get_if<List>(&item);
+    if (pair == nullptr || pair->list.size() != 2) {
+      continue;
+    }
+    auto name = std::get_if<Symbol>(&pair->list[0]);
+    if (name != nullptr && name->name == *key) {
+      return pair->list[1];
+    }
+  }
+  return Nil{};
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "output.h"
+#include "types.h"
+
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// JSON and CSV, read one record at a time into lazy sequences and written
+// back out:
+//
+//   (define events (read-json (open-file "events.jsonl")))
+//   (lazy-filter (lambda (e) (= (field e 'status) 500)) events)
+//   (write-json out '((status 200) (path "/")))  ; {"status":200,"path":"/"}
+//   (read-csv (open-file "table.csv"))           ; lazy sequence of lists
+//   (write-csv out (list "a" 1 "b,c"))            ; a,1,"b,c"
+//
+// JSON arrays are lists and objects lists of (key value) pairs, with the
+// keys as symbols; a list of such pairs is written as an object. null is
+// nil, and integers beyond 2^53 are BigInts. read-json reads JSON lines: a
+// value per non-blank line.
+//
+// CSV records are lists of fields. A field written like a JSON number, and
+// not quoted, is read as a number, the others are strings. Quoted fields
+// can contain the separator, "" for a quote and line breaks.
+//
+// The scanners look for the characters ending a run of plain text 16 bytes
+// at a time, with SSE2 where it is available.
+
+// throws on invalid JSON
+Result parse_json(std::string_view text);
+void write_json(Sink &sink, const Result &value);
+
+// the fields of a CSV record, nothing when it ends inside a quoted field and
+// continues on the next line
+std::optional<std::vector<Result>> parse_csv_record(std::string_view record,
+                                                    char separator);
+void write_csv_record(Sink &sink, std::span<const Result> fields,
+                      char separator);
+
+Result json_parse_fn(const std::vector<Result> &arguments);
+String json_string_fn(const std::vector<Result> &arguments);
+Seq read_json_fn(const std::vector<Result> &arguments);
+Nil write_json_fn(const std::vector<Result> &arguments);
+Seq read_csv_fn(const std::vector<Result> &arguments);
+Nil write_csv_fn(const std::vector<Result> &arguments);
+Result field_fn(const std::vector<Result> &arguments);
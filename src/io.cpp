@@ -0,0 +1,393 @@
+#include "io.h"
+
+#include "output.h"
+#include "seq.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::size_t READ_BUFFER_SIZE = 1 << 20;
+// mapped pages behind the read position are dropped in chunks of this size
+constexpr std::size_t MMAP_RELEASE_CHUNK = 64 << 20;
+
+std::size_t mmap_threshold_bytes = 16 << 20;
+
+std::runtime_error io_error(const std::string &what, const std::string &name) {
+  return std::runtime_error(what + " " + name + ": " + std::strerror(errno));
+}
+
+class FdReader : public FileHandle {
+public:
+  FdReader(int fd, std::string name, bool owns_fd)
+      : FileHandle(std::move(name)), fd(fd), owns_fd(owns_fd),
+        buffer(READ_BUFFER_SIZE) {}
+
+  ~FdReader() override { FdReader::close(); }
+
+  bool read_line(std::string &line) override {
+    check_open();
+    line.clear();
+    bool found_data = false;
+    while (true) {
+      if (pos == end && !fill()) {
+        return found_data;
+      }
+      found_data = true;
+      auto start = buffer.data() + pos;
+      auto newline =
+          static_cast<const char *>(std::memchr(start, '\n', end - pos));
+      if (newline != nullptr) {
+        line.append(start, newline - start);
+        pos += newline - start + 1;
+        return true;
+      }
+      line.append(start, end - pos);
+      pos = end;
+    }
+  }
+
+  std::string read_all() override {
+    check_open();
+    std::string content(buffer.data() + pos, end - pos);
+    pos = end;
+
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      content.reserve(st.st_size);
+    }
+    while (fill()) {
+      content.append(buffer.data(), end);
+      pos = end;
+    }
+    return content;
+  }
+
+  void close() override {
+    // stdin stays usable for the rest of the program
+    if (!closed && owns_fd) {
+      ::close(fd);
+      closed = true;
+    }
+  }
+
+private:
+  // refills the buffer, returns false at end of input
+  bool fill() {
+    pos = end = 0;
+    if (fd == 0) {
+      // make prompts visible before blocking on the terminal
+      stdout_sink().flush();
+    }
+    while (!eof) {
+      auto n = ::read(fd, buffer.data(), buffer.size());
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw io_error("Cannot read", name);
+      }
+      if (n == 0) {
+        eof = true;
+        break;
+      }
+      end = n;
+      return true;
+    }
+    return false;
+  }
+
+  int fd;
+  bool owns_fd;
+  bool eof = false;
+  std::vector<char> buffer;
+  std::size_t pos = 0;
+  std::size_t end = 0;
+};
+
+class MmapReader : public FileHandle {
+public:
+  MmapReader(const char *data, std::size_t size, std::string name)
+      : FileHandle(std::move(name)), data(data), size(size) {
+    madvise(const_cast<char *>(data), size, MADV_SEQUENTIAL);
+  }
+
+  ~MmapReader() override { MmapReader::close(); }
+
+  bool read_line(std::string &line) override {
+    check_open();
+    if (pos >= size) {
+      return false;
+    }
+    auto start = data + pos;
+    auto newline =
+        static_cast<const char *>(std::memchr(start, '\n', size - pos));
+    auto line_end = newline != nullptr ? newline : data + size;
+    line.assign(start, line_end);
+    pos = line_end - data + 1;
+    release_consumed();
+    return true;
+  }
+
+  std::string read_all() override {
+    check_open();
+    if (pos >= size) {
+      return "";
+    }
+    std::string content(data + pos, size - pos);
+    pos = size;
+    return content;
+  }
+
+  void close() override {
+    if (!closed) {
+      munmap(const_cast<char *>(data), size);
+    }
+    closed = true;
+  }
+
+private:
+  // keeps the resident set constant when streaming through a large mapping
+  void release_consumed() {
+    if (pos - released < MMAP_RELEASE_CHUNK || pos >= size) {
+      return;
+    }
+    auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    auto until = (pos / page) * page;
+    madvise(const_cast<char *>(data) + released, until - released,
+            MADV_DONTNEED);
+    released = until;
+  }
+
+  const char *data;
+  std::size_t size;
+  std::size_t pos = 0;
+  std::size_t released = 0;
+};
+
+class SinkWriter : public FileHandle {
+public:
+  // stdout is shared with println and is never closed
+  SinkWriter(std::shared_ptr<FdSink> sink, int fd, std::string name)
+      : FileHandle(std::move(name)), sink(std::move(sink)), fd(fd) {}
+
+  ~SinkWriter() override {
+    try {
+      SinkWriter::close();
+    } catch (std::runtime_error &) {
+      // nothing sensible to do with a failed write while unwinding
+    }
+  }
+
+  Sink &output() override {
+    check_open();
+    return *sink;
+  }
+
+  void close() override {
+    if (closed || fd < 0) {
+      return;
+    }
+    sink->flush();
+    ::close(fd);
+    closed = true;
+  }
+
+private:
+  std::shared_ptr<FdSink> sink;
+  int fd;
+};
+
+std::shared_ptr<FileHandle> open_reader(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw io_error("Cannot open file", path);
+  }
+
+  struct stat st {};
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      static_cast<std::size_t>(st.st_size) >= mmap_threshold_bytes) {
+    auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      ::close(fd);
+      return std::make_shared<MmapReader>(static_cast<const char *>(data),
+                                          st.st_size, path);
+    }
+  }
+  return std::make_shared<FdReader>(fd, path, true);
+}
+
+std::shared_ptr<FileHandle> open_writer(const std::string &path,
+                                        bool append) {
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  int fd = ::open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    throw io_error("Cannot open file", path);
+  }
+  return std::make_shared<SinkWriter>(
+      std::make_shared<FdSink>(fd, path, Buffering::Full), fd, path);
+}
+
+FileHandle &file_argument(const std::vector<Result> &arguments,
+                          const std::string &op) {
+  if (arguments.empty()) {
+    return *stdin_handle();
+  }
+  if (auto file = std::get_if<File>(&arguments[0])) {
+    return *file->handle;
+  }
+  throw std::runtime_error("'" + op + "' requires a file");
+}
+
+class LineGenerator : public Generator {
+public:
+  explicit LineGenerator(std::shared_ptr<FileHandle> file)
+      : file(std::move(file)) {}
+
+  std::optional<Result> next() override {
+    std::string line;
+    if (file->read_line(line)) {
+      return line;
+    }
+    return std::nullopt;
+  }
+
+private:
+  std::shared_ptr<FileHandle> file;
+};
+
+} // namespace
+
+void FileHandle::check_open() const {
+  if (closed) {
+    throw std::runtime_error("File is closed: " + name);
+  }
+}
+
+bool FileHandle::read_line(std::string &) {
+  throw std::runtime_error("File not opened for reading: " + name);
+}
+
+std::string FileHandle::read_all() {
+  throw std::runtime_error("File not opened for reading: " + name);
+}
+
+Sink &FileHandle::output() {
+  throw std::runtime_error("File not opened for writing: " + name);
+}
+
+std::shared_ptr<FileHandle> open_file(const std::string &path,
+                                      const std::string &mode) {
+  if (mode == "r") {
+    return path == "-" ? stdin_handle() : open_reader(path);
+  } else if (mode == "w" || mode == "a") {
+    return path == "-" ? stdout_handle() : open_writer(path, mode == "a");
+  } else {
+    throw std::runtime_error("Unknown file mode: " + mode);
+  }
+}
+
+std::shared_ptr<FileHandle> stdin_handle() {
+  static auto handle = std::make_shared<FdReader>(0, "<stdin>", false);
+  return handle;
+}
+
+std::shared_ptr<FileHandle> stdout_handle() {
+  // aliases the static stdout sink, which outlives every handle
+  static auto handle = std::make_shared<SinkWriter>(
+      std::shared_ptr<FdSink>(&stdout_sink(), [](FdSink *) {}), -1,
+      "<stdout>");
+  return handle;
+}
+
+std::size_t mmap_threshold() { return mmap_threshold_bytes; }
+
+void set_mmap_threshold(std::size_t bytes) { mmap_threshold_bytes = bytes; }
+
+File open_file_fn(const std::vector<Result> &arguments) {
+  if (arguments.empty() || arguments.size() > 2) {
+    throw std::runtime_error(
+        "'open-file' requires a path and an optional mode");
+  }
+  auto path = std::get_if<String>(&arguments[0]);
+  if (path == nullptr) {
+    throw std::runtime_error("'open-file' requires a string as path");
+  }
+  std::string mode = "r";
+  if (arguments.size() == 2) {
+    if (auto m = std::get_if<String>(&arguments[1])) {
+      mode = *m;
+    } else {
+      throw std::runtime_error("'open-file' requires a string as mode");
+    }
+  }
+  return File{open_file(*path, mode)};
+}
+
+Result read_line_fn(const std::vector<Result> &arguments) {
+  std::string line;
+  if (file_argument(arguments, "read-line").read_line(line)) {
+    return line;
+  }
+  return Nil{};
+}
+
+Seq read_lines_fn(const std::vector<Result> &arguments) {
+  if (arguments.empty()) {
+    return make_seq(std::make_shared<LineGenerator>(stdin_handle()));
+  }
+  if (auto file = std::get_if<File>(&arguments[0])) {
+    return make_seq(std::make_shared<LineGenerator>(file->handle));
+  }
+  throw std::runtime_error("'read-lines' requires a file");
+}
+
+String read_all_fn(const std::vector<Result> &arguments) {
+  return file_argument(arguments, "read-all").read_all();
+}
+
+Nil write_fn(const std::vector<Result> &arguments) {
+  // writes to stdout unless the first argument is a file
+  std::lock_guard lock(stdout_mutex());
+  int start = 0;
+  Sink *sink = &stdout_sink();
+  if (!arguments.empty()) {
+    if (auto file = std::get_if<File>(&arguments[0])) {
+      sink = &file->handle->output();
+      start = 1;
+    }
+  }
+
+  for (int i = start; i < arguments.size(); ++i) {
+    if (auto s = std::get_if<String>(&arguments[i])) {
+      sink->write(*s);
+    } else {
+      print_value(*sink, arguments[i]);
+    }
+  }
+  sink->sync(false);
+  return Nil{};
+}
+
+Nil flush_fn(const std::vector<Result> &arguments) {
+  if (arguments.empty()) {
+    stdout_sink().flush();
+  } else {
+    file_argument(arguments, "flush").output().flush();
+  }
+  return Nil{};
+}
+
+Nil close_fn(const std::vector<Result> &arguments) {
+  if (arguments.size() != 1) {
+    throw std::runtime_error("'close' requires exactly 1 argument");
+  }
+  file_argument(arguments, "close").close();
+  return Nil{};
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "output.h"
+#include "types.h"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// An open file, stdin or stdout. Readers and writers are buffered, regular
+// files at least `mmap_threshold()` bytes long are memory-mapped instead.
+class FileHandle {
+public:
+  explicit FileHandle(std::string name) : name(std::move(name)) {}
+  virtual ~FileHandle() = default;
+
+  // reads the next line without its '\n', returns false at end of input
+  virtual bool read_line(std::string &line);
+  // reads everything up to the end of input
+  virtual std::string read_all();
+  // the buffered sink of a file opened for writing
+  virtual Sink &output();
+  virtual void close() { closed = true; }
+
+  std::string name;
+  bool closed = false;
+
+protected:
+  void check_open() const;
+};
+
+std::shared_ptr<FileHandle> open_file(const std::string &path,
+                                      const std::string &mode);
+std::shared_ptr<FileHandle> stdin_handle();
+std::shared_ptr<FileHandle> stdout_handle();
+
+std::size_t mmap_threshold();
+void set_mmap_threshold(std::size_t bytes);
+
+File open_file_fn(const std::vector<Result> &arguments);
+Result read_line_fn(const std::vector<Result> &arguments);
+Seq read_lines_fn(const std::vector<Result> &arguments);
+String read_all_fn(const std::vector<Result> &arguments);
+Nil write_fn(const std::vector<Result> &arguments);
+Nil flush_fn(const std::vector<Result> &arguments);
+Nil close_fn(const std::vector<Result> &arguments);
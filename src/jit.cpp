@@ -0,0 +1,636 @@
+#include "jit.h"
+
+#include "bignum.h"
+#include "resources.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define CPPLISP_JIT 1
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+bool enabled = true;
+std::size_t threshold = 64;
+
+// lambdas with more arguments are not compiled
+constexpr std::size_t MAX_NATIVE_ARGS = 8;
+
+#ifdef CPPLISP_JIT
+
+// condition codes of the two-byte jcc rel32 instructions
+enum Condition : std::uint8_t {
+  JB = 0x82,
+  JAE = 0x83,
+  JE = 0x84,
+  JNE = 0x85,
+  JBE = 0x86,
+  JA = 0x87,
+  JP = 0x8A,
+};
+
+// Emits the few x86-64 instructions the compiler needs, with forward jumps
+// patched once their label is bound.
+class Assembler {
+public:
+  using Label = std::size_t;
+
+  void emit(std::initializer_list<std::uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+  }
+
+  void imm32(std::int32_t value) {
+    auto bytes = reinterpret_cast<const std::uint8_t *>(&value);
+    code.insert(code.end(), bytes, bytes + 4);
+  }
+
+  void imm64(std::uint64_t value) {
+    auto bytes = reinterpret_cast<const std::uint8_t *>(&value);
+    code.insert(code.end(), bytes, bytes + 8);
+  }
+
+  void patch32(std::size_t pos, std::int32_t value) {
+    std::memcpy(code.data() + pos, &value, 4);
+  }
+
+  Label label() {
+    labels.push_back(-1);
+    return labels.size() - 1;
+  }
+
+  void bind(Label label) { labels[label] = code.size(); }
+
+  void jump(Label target) {
+    emit({0xE9});
+    rel32(target);
+  }
+
+  void jump(Condition condition, Label target) {
+    emit({0x0F, condition});
+    rel32(target);
+  }
+
+  void call(Label target) {
+    emit({0xE8});
+    rel32(target);
+  }
+
+  void finish() {
+    for (auto [pos, label] : fixups) {
+      patch32(pos, static_cast<std::int32_t>(labels[label] - (pos + 4)));
+    }
+  }
+
+  // movsd xmm0, [rbx + disp]
+  void load_argument(std::int32_t disp) {
+    emit({0xF2, 0x0F, 0x10, 0x83});
+    imm32(disp);
+  }
+
+  // movsd xmm{reg}, [rbp + disp]
+  void load_slot(int reg, std::int32_t disp) {
+    emit({0xF2, 0x0F, 0x10, static_cast<std::uint8_t>(0x85 | (reg << 3))});
+    imm32(disp);
+  }
+
+  // movsd [rbp + disp], xmm0
+  void store_slot(std::int32_t disp) {
+    emit({0xF2, 0x0F, 0x11, 0x85});
+    imm32(disp);
+  }
+
+  // xmm0 = value
+  void load_constant(double value) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    emit({0x48, 0xB8});
+    imm64(bits);
+    emit({0x66, 0x48, 0x0F, 0x6E, 0xC0});
+  }
+
+  std::vector<std::uint8_t> code;
+
+private:
+  void rel32(Label target) {
+    fixups.emplace_back(code.size(), target);
+    imm32(0);
+  }
+
+  std::vector<std::int64_t> labels;
+  std::vector<std::pair<std::size_t, Label>> fixups;
+};
+
+// Compiles a lambda body to a function taking its arguments as an array of
+// doubles. Every value is a number, kept in xmm0; intermediate values are
+// spilled to stack slots addressed from rbp, rbx holds the arguments and r12
+// the NativeState.
+class Compiler {
+public:
+  Compiler(const Lambda &lambda, Env &env, JitInfo &info)
+      : lambda(lambda), env(env), info(info) {}
+
+  bool compile() {
+    if (lambda.variadic || lambda.arguments.size() > MAX_NATIVE_ARGS) {
+      return false;
+    }
+    for (int i = 0; i < lambda.arguments.size(); ++i) {
+      locals[lambda.arguments[i].name] = {true, i};
+    }
+
+    auto start = as.label();
+    as.bind(start);
+    // push rbp; mov rbp, rsp; push rbx; push r12; mov rbx, rdi; mov r12, rsi
+    as.emit({0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54});
+    as.emit({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4});
+    // sub rsp, frame
+    as.emit({0x48, 0x81, 0xEC});
+    auto frame_pos = as.code.size();
+    as.imm32(0);
+
+    self_label = start;
+    epilogue = as.label();
+    overflow = as.label();
+    auto stack = as.label();
+    static_assert(offsetof(NativeState, stack_limit) == 8);
+    // cmp rsp, [r12 + 8]; jb stack
+    as.emit({0x49, 0x3B, 0x64, 0x24, 0x08});
+    as.jump(JB, stack);
+    if (!value(lambda.body.get(), 0)) {
+      return false;
+    }
+
+    // lea rsp, [rbp - 16]; pop r12; pop rbx; pop rbp; ret
+    as.bind(epilogue);
+    as.emit({0x48, 0x8D, 0x65, 0xF0, 0x41, 0x5C, 0x5B, 0x5D, 0xC3});
+    // mov byte [r12], Inexact
+    as.bind(overflow);
+    as.emit({0x41, 0xC6, 0x04, 0x24, NativeState::Inexact});
+    as.jump(epilogue);
+    // mov byte [r12], Stack
+    as.bind(stack);
+    as.emit({0x41, 0xC6, 0x04, 0x24, NativeState::Stack});
+    as.jump(epilogue);
+
+    // keeps rsp 16-byte aligned at calls
+    std::int32_t frame = (8 * slots + 15) / 16 * 16;
+    as.patch32(frame_pos, frame);
+    as.finish();
+    return install();
+  }
+
+private:
+  struct Local {
+    bool argument;
+    int index;
+  };
+
+  static std::int32_t slot(int index) { return -24 - 8 * index; }
+
+  void store(int index) {
+    slots = std::max(slots, index + 1);
+    as.store_slot(slot(index));
+  }
+
+  // an arithmetic or comparison builtin, not shadowed by a local
+  bool use_operator(const std::string &name) {
+    if (locals.contains(name)) {
+      return false;
+    }
+    if (std::find(info.operators.begin(), info.operators.end(), name) ==
+        info.operators.end()) {
+      info.operators.push_back(name);
+    }
+    return true;
+  }
+
+  bool is_self(const std::string &name) {
+    if (locals.contains(name)) {
+      return false;
+    }
+    if (!info.self.empty()) {
+      return name == info.self;
+    }
+    auto value = env.get(name);
+    if (value == nullptr) {
+      return false;
+    }
+    auto other = std::get_if<Lambda>(value);
+    if (other == nullptr || other->body != lambda.body) {
+      return false;
+    }
+    info.self = name;
+    return true;
+  }
+
+  static bool is_arithmetic(const std::string &name) {
+    return name == "+" || name == "-" || name == "*" || name == "/";
+  }
+
+  static bool is_comparison(const std::string &name) {
+    return name == "=" || name == "<" || name == ">" || name == "<=" ||
+           name == ">=";
+  }
+
+  // evaluates `expr` into xmm0
+  bool value(Expr *expr, int depth) {
+    if (auto e = dynamic_cast<LiteralExpr<Number> *>(expr)) {
+      as.load_constant(e->value);
+      return true;
+    } else if (auto e = dynamic_cast<SymbolExpr *>(expr)) {
+      auto it = locals.find(e->symbol.name);
+      if (it == locals.end()) {
+        return false;
+      }
+      if (it->second.argument) {
+        as.load_argument(8 * it->second.index);
+      } else {
+        as.load_slot(0, slot(it->second.index));
+      }
+      return true;
+    } else if (auto e = dynamic_cast<ListExpr *>(expr)) {
+      return call(*e, depth);
+    } else if (auto e = dynamic_cast<IfExpr *>(expr)) {
+      auto otherwise = as.label();
+      auto end = as.label();
+      if (!branch(e->expressions[0].get(), depth, otherwise, false) ||
+          !value(e->expressions[1].get(), depth)) {
+        return false;
+      }
+      as.jump(end);
+      as.bind(otherwise);
+      if (!value(e->expressions[2].get(), depth)) {
+        return false;
+      }
+      as.bind(end);
+      return true;
+    } else if (auto e = dynamic_cast<CondExpr *>(expr)) {
+      return cond(*e, depth);
+    } else if (auto e = dynamic_cast<LetExpr *>(expr)) {
+      auto saved = locals;
+      for (const auto &[symbol, init] : e->vars) {
+        if (!value(init.get(), depth)) {
+          return false;
+        }
+        store(depth);
+        locals[symbol.name] = {false, depth++};
+      }
+      auto result = value(e->expr.get(), depth);
+      locals = std::move(saved);
+      return result;
+    }
+    return false;
+  }
+
+  bool call(ListExpr &e, int depth) {
+    if (e.expressions.empty()) {
+      return false;
+    }
+    auto head = dynamic_cast<SymbolExpr *>(e.expressions[0].get());
+    if (head == nullptr) {
+      return false;
+    }
+    const auto &name = head->symbol.name;
+    auto argc = e.expressions.size() - 1;
+
+    if (is_arithmetic(name) && use_operator(name)) {
+      // same order of operations as the builtins: (+) starts from 0
+      int first = 1;
+      if (name == "+") {
+        as.load_constant(0);
+      } else if (argc == 0 || !value(e.expressions[1].get(), depth)) {
+        return false;
+      } else {
+        first = 2;
+      }
+      for (int i = first; i < e.expressions.size(); ++i) {
+        store(depth);
+        if (!value(e.expressions[i].get(), depth + 1)) {
+          return false;
+        }
+        // movapd xmm1, xmm0; movsd xmm0, [slot]; op xmm0, xmm1
+        as.emit({0x66, 0x0F, 0x28, 0xC8});
+        as.load_slot(0, slot(depth));
+        std::uint8_t op = name == "+"   ? 0x58
+                          : name == "-" ? 0x5C
+                          : name == "*" ? 0x59
+                                        : 0x5E;
+        as.emit({0xF2, 0x0F, op, 0xC1});
+        if (name != "/") {
+          check_exact();
+        }
+      }
+      return true;
+    }
+
+    if (is_self(name)) {
+      if (argc != lambda.arguments.size()) {
+        return false;
+      }
+      // the arguments are stored in consecutive slots, in ascending order
+      for (int i = 0; i < argc; ++i) {
+        if (!value(e.expressions[i + 1].get(), depth + argc)) {
+          return false;
+        }
+        store(depth + argc - 1 - i);
+      }
+      // lea rdi, [rbp + disp]
+      as.emit({0x48, 0x8D, 0xBD});
+      as.imm32(slot(depth + std::max<int>(argc, 1) - 1));
+      // mov rsi, r12
+      as.emit({0x4C, 0x89, 0xE6});
+      as.call(self_label);
+      // cmp byte [r12], 0
+      as.emit({0x41, 0x80, 0x3C, 0x24, 0x00});
+      as.jump(JNE, epilogue);
+      return true;
+    }
+    return false;
+  }
+
+  // Leaves through `overflow` when xmm0 is 2^53 or beyond in magnitude, it
+  // can be rounded: the interpreter computes it exactly. Infinities and NaN
+  // leave too, the interpreter gives them the same value.
+  void check_exact() {
+    // movq rax, xmm0; btr rax, 63; mov rcx, 2^53; cmp rax, rcx; jae overflow
+    as.emit({0x66, 0x48, 0x0F, 0x7E, 0xC0, 0x48, 0x0F, 0xBA, 0xF0, 0x3F});
+    std::uint64_t bits;
+    std::memcpy(&bits, &MAX_EXACT, sizeof(bits));
+    as.emit({0x48, 0xB9});
+    as.imm64(bits);
+    as.emit({0x48, 0x39, 0xC8});
+    as.jump(JAE, overflow);
+  }
+
+  bool cond(CondExpr &e, int depth) {
+    auto end = as.label();
+    for (const auto &clause : e.expressions) {
+      auto pair = dynamic_cast<ListExpr *>(clause.get());
+      if (pair == nullptr || pair->expressions.size() < 2) {
+        return false;
+      }
+      auto test = dynamic_cast<SymbolExpr *>(pair->expressions[0].get());
+      if (test != nullptr && test->symbol.name == "else") {
+        if (!value(pair->expressions[1].get(), depth)) {
+          return false;
+        }
+        as.bind(end);
+        return true;
+      }
+      auto next = as.label();
+      if (!branch(pair->expressions[0].get(), depth, next, false) ||
+          !value(pair->expressions[1].get(), depth)) {
+        return false;
+      }
+      as.jump(end);
+      as.bind(next);
+    }
+    // without 'else' the value can be nil
+    return false;
+  }
+
+  // jumps to `target` when the truth of `expr` is `when_true`
+  bool branch(Expr *expr, int depth, Assembler::Label target,
+              bool when_true) {
+    if (auto e = dynamic_cast<AndExpr *>(expr)) {
+      return logical(e->exprs, depth, target, when_true, false);
+    } else if (auto e = dynamic_cast<OrExpr *>(expr)) {
+      return logical(e->exprs, depth, target, when_true, true);
+    }
+
+    auto call = dynamic_cast<ListExpr *>(expr);
+    auto head = call != nullptr && !call->expressions.empty()
+                    ? dynamic_cast<SymbolExpr *>(call->expressions[0].get())
+                    : nullptr;
+    if (head != nullptr && head->symbol.name == "not" &&
+        call->expressions.size() == 2 && use_operator("not")) {
+      return branch(call->expressions[1].get(), depth, target, !when_true);
+    }
+    if (head != nullptr && is_comparison(head->symbol.name) &&
+        call->expressions.size() == 3 && use_operator(head->symbol.name)) {
+      return compare(head->symbol.name, *call, depth, target, when_true);
+    }
+
+    // a number is true when it is not 0
+    if (!value(expr, depth)) {
+      return false;
+    }
+    // xorpd xmm1, xmm1; ucomisd xmm0, xmm1
+    as.emit({0x66, 0x0F, 0x57, 0xC9, 0x66, 0x0F, 0x2E, 0xC1});
+    if (when_true) {
+      as.jump(JNE, target);
+      as.jump(JP, target);
+    } else {
+      auto skip = as.label();
+      as.jump(JP, skip);
+      as.jump(JE, target);
+      as.bind(skip);
+    }
+    return true;
+  }
+
+  bool logical(const ExprList &exprs, int depth, Assembler::Label target,
+               bool when_true, bool is_or) {
+    // (and) is true, (or) is false
+    if (exprs.empty()) {
+      if (when_true != is_or) {
+        as.jump(target);
+      }
+      return true;
+    }
+    // the operands short-circuit on `is_or`, to `target` when it is the
+    // awaited truth and past the expression otherwise
+    auto skip = as.label();
+    for (int i = 0; i < exprs.size() - 1; ++i) {
+      auto to = when_true == is_or ? target : skip;
+      if (!branch(exprs[i].get(), depth, to, is_or)) {
+        return false;
+      }
+    }
+    if (!branch(exprs.back().get(), depth, target, when_true)) {
+      return false;
+    }
+    as.bind(skip);
+    return true;
+  }
+
+  bool compare(const std::string &op, ListExpr &call, int depth,
+               Assembler::Label target, bool when_true) {
+    if (!value(call.expressions[1].get(), depth)) {
+      return false;
+    }
+    store(depth);
+    if (!value(call.expressions[2].get(), depth + 1)) {
+      return false;
+    }
+    // xmm1 = left, xmm0 = right
+    as.load_slot(1, slot(depth));
+
+    // NaN is unordered: CF, ZF and PF are set and every comparison is false
+    if (op == "=") {
+      as.emit({0x66, 0x0F, 0x2E, 0xC8});
+      if (when_true) {
+        auto skip = as.label();
+        as.jump(JP, skip);
+        as.jump(JE, target);
+        as.bind(skip);
+      } else {
+        as.jump(JP, target);
+        as.jump(JNE, target);
+      }
+      return true;
+    }
+
+    // a < b and a <= b compare b with a, so that each test is "above"
+    if (op == "<" || op == "<=") {
+      as.emit({0x66, 0x0F, 0x2E, 0xC1}); // ucomisd xmm0, xmm1
+    } else {
+      as.emit({0x66, 0x0F, 0x2E, 0xC8}); // ucomisd xmm1, xmm0
+    }
+    bool strict = op == "<" || op == ">";
+    if (when_true) {
+      as.jump(strict ? JA : JAE, target);
+    } else {
+      as.jump(strict ? JBE : JB, target);
+    }
+    return true;
+  }
+
+  bool install() {
+    auto size = as.code.size();
+    auto code = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      return false;
+    }
+    std::memcpy(code, as.code.data(), size);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(code, size);
+      return false;
+    }
+    info.code = code;
+    info.code_size = size;
+    info.native = reinterpret_cast<NativeFn>(code);
+    return true;
+  }
+
+  const Lambda &lambda;
+  Env &env;
+  JitInfo &info;
+  Assembler as;
+  Assembler::Label self_label = 0;
+  Assembler::Label epilogue = 0;
+  Assembler::Label overflow = 0;
+  std::unordered_map<std::string, Local> locals;
+  int slots = 0;
+};
+
+#endif
+
+// held while compiling, lambdas can be called from several threads
+std::mutex compile_mutex;
+
+void compile(const Lambda &lambda, Env &env, JitInfo &info) {
+#ifdef CPPLISP_JIT
+  if (Compiler(lambda, env, info).compile()) {
+    info.state.store(JitInfo::State::Compiled, std::memory_order_release);
+    return;
+  }
+#endif
+  info.state.store(JitInfo::State::Failed, std::memory_order_release);
+}
+
+// the names the native code relies on still refer to the builtins and to
+// the lambda itself
+bool guards_hold(const Lambda &lambda, Env &env, const JitInfo &info) {
+  if (!info.self.empty()) {
+    auto self = env.get(info.self);
+    auto other = self != nullptr ? std::get_if<Lambda>(self) : nullptr;
+    if (other == nullptr || other->body != lambda.body) {
+      return false;
+    }
+  }
+  for (const auto &op : info.operators) {
+    if (env.get(op) != nullptr || lambda.env->get(op) != nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+JitInfo::~JitInfo() {
+#ifdef CPPLISP_JIT
+  if (code != nullptr) {
+    munmap(code, code_size);
+  }
+#endif
+}
+
+std::optional<Result> jit_call(const Lambda &lambda, Env &env,
+                               const std::vector<Result> &args) {
+  auto info = lambda.jit.get();
+  if (info == nullptr || !enabled) {
+    return std::nullopt;
+  }
+  auto state = info->state.load(std::memory_order_acquire);
+  if (state == JitInfo::State::Counting) {
+    // a plain increment, lost counts only delay the compilation
+    auto calls = info->calls.load(std::memory_order_relaxed) + 1;
+    info->calls.store(calls, std::memory_order_relaxed);
+    if (calls < threshold) {
+      return std::nullopt;
+    }
+    std::lock_guard lock(compile_mutex);
+    if (info->state.load(std::memory_order_relaxed) ==
+        JitInfo::State::Counting) {
+      compile(lambda, env, *info);
+    }
+    state = info->state.load(std::memory_order_relaxed);
+  }
+  if (state != JitInfo::State::Compiled) {
+    return std::nullopt;
+  }
+
+  double values[MAX_NATIVE_ARGS];
+  for (int i = 0; i < args.size(); ++i) {
+    auto n = std::get_if<Number>(&args[i]);
+    if (n == nullptr) {
+      return std::nullopt;
+    }
+    values[i] = *n;
+  }
+  if (!guards_hold(lambda, env, *info)) {
+    return std::nullopt;
+  }
+  NativeState native;
+  native.stack_limit = resource_state.stack_limit;
+  auto n = info->native(values, &native);
+  if (native.exit == NativeState::Stack) {
+    throw_stack_exceeded();
+  } else if (native.exit == NativeState::Inexact) {
+    return std::nullopt;
+  }
+  return n;
+}
+
+bool jit_supported() {
+#ifdef CPPLISP_JIT
+  return true;
+#else
+  return false;
+#endif
+}
+
+void set_jit_enabled(bool value) { enabled = value; }
+
+std::size_t jit_threshold() { return threshold; }
+
+void set_jit_threshold(std::size_t calls) { threshold = calls; }
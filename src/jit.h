@@ -0,0 +1,63 @@
+#pragma once
+
+#include "ast.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Passed to native code, which returns early with `exit` set when a sum,
+// difference or product leaves the integers a double represents exactly (see
+// bignum.h), or when its stack reaches `stack_limit`.
+struct NativeState {
+  enum Exit : std::uint8_t { None, Inexact, Stack };
+
+  Exit exit = None;
+  std::uintptr_t stack_limit = 0;
+};
+
+// Native code of a numeric lambda, takes its arguments as an array.
+using NativeFn = double (*)(const double *args, NativeState *state);
+
+// Shared by the lambdas created from the same LambdaExpr: counts their calls
+// and holds the native code once they are hot.
+struct JitInfo {
+  JitInfo() = default;
+  JitInfo(const JitInfo &) = delete;
+  JitInfo &operator=(const JitInfo &) = delete;
+  ~JitInfo();
+
+  enum class State { Counting, Compiled, Failed };
+
+  // written once compiled, the other fields are set before
+  std::atomic<State> state = State::Counting;
+  // approximate when counted by several threads
+  std::atomic<std::size_t> calls = 0;
+  NativeFn native = nullptr;
+  void *code = nullptr;
+  std::size_t code_size = 0;
+  // the name the body calls itself with, if it does
+  std::string self;
+  // the builtins it uses, they must not be rebound where it is called
+  std::vector<std::string> operators;
+};
+
+// Counts a call to `lambda`, compiling its body to x86-64 once it is called
+// `jit_threshold()` times. Bodies made of numbers, arguments, 'let',
+// arithmetic, comparisons, 'if'/'cond'/'and'/'or'/'not' and calls to
+// themselves are supported, the other lambdas stay interpreted. Returns
+// nothing when the lambda has to be interpreted: not compiled, arguments
+// that are not numbers, an operator rebound by the caller, or a result that
+// needs a BigInt. Throws a LimitError when the native calls exhaust the stack
+// of a task.
+std::optional<Result> jit_call(const Lambda &lambda, Env &env,
+                               const std::vector<Result> &args);
+
+// whether native code can be generated on this platform
+bool jit_supported();
+void set_jit_enabled(bool enabled);
+std::size_t jit_threshold();
+void set_jit_threshold(std::size_t calls);
@@ -0,0 +1,467 @@
+#include "library.h"
+
+#include "bignum.h"
+#include "builtins.h"
+#include "seq.h"
+
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace {
+
+void check_arguments(const std::vector<Result> &arguments, int count,
+                     const std::string &op) {
+  if (arguments.size() != count) {
+    throw std::runtime_error("'" + op + "' requires exactly " +
+                             std::to_string(count) + " arguments");
+  }
+}
+
+void check_function(const Result &fn, const std::string &op) {
+  if (!std::holds_alternative<Lambda>(fn) &&
+      !std::holds_alternative<Builtin>(fn)) {
+    throw std::runtime_error("'" + op + "' requires a function, got " +
+                             to_string(fn));
+  }
+}
+
+// calls fn on each element of a list or a sequence, moving the elements out
+template <typename F> void for_each(Result seq, F &&f) {
+  if (auto l = std::get_if<List>(&seq)) {
+    for (std::size_t i = 0; i < l->list.size(); ++i) {
+      f(l->list.take(i));
+    }
+  } else {
+    Cursor cursor(std::move(seq));
+    while (auto value = cursor.next()) {
+      f(std::move(*value));
+    }
+  }
+}
+
+// calls fn with a single argument, reusing the argument vector
+struct Caller {
+  Caller(const Result &fn, Env &env) : fn(fn), env(env) {}
+
+  Result operator()(Result value) {
+    // a builtin can take ownership of the argument vector
+    args.resize(1);
+    args[0] = std::move(value);
+    return call(fn, args, env);
+  }
+
+  const Result &fn;
+  Env &env;
+  std::vector<Result> args;
+};
+
+// a list the caller can reorder, a transient one is copied
+List to_list(Result seq) {
+  if (auto l = std::get_if<List>(&seq)) {
+    if (l->list.transient()) {
+      return List(std::vector<Result>(l->list.cbegin(), l->list.cend()));
+    }
+    return std::move(*l);
+  }
+  List list;
+  for_each(std::move(seq),
+           [&](Result value) { list.list.push_back(std::move(value)); });
+  return list;
+}
+
+// natural ordering used by 'sort' without a comparator
+bool less_than(const Result &a, const Result &b) {
+  if (is_number(a) && is_number(b)) {
+    return compare_numbers(a, b, "sort") < 0;
+  } else if (auto x = std::get_if<String>(&a)) {
+    if (auto y = std::get_if<String>(&b)) {
+      return *x < *y;
+    }
+  }
+  throw std::runtime_error("Cannot compare " + to_string(a) + " and " +
+                           to_string(b));
+}
+
+// below this size a sort runs on a single thread
+constexpr std::size_t PARALLEL_SORT = 1 << 15;
+
+// Stable sort: chunks of the items are sorted by threads of their own, then
+// merged pairwise, the merges of each round in parallel too.
+template <typename T, typename Less>
+void parallel_stable_sort(std::vector<T> &items, Less less) {
+  auto threads = std::min<std::size_t>(
+      std::max(1u, std::thread::hardware_concurrency()),
+      items.size() / PARALLEL_SORT);
+  if (threads < 2) {
+    std::stable_sort(items.begin(), items.end(), less);
+    return;
+  }
+
+  std::vector<std::size_t> bounds;
+  for (std::size_t i = 0; i <= threads; ++i) {
+    bounds.push_back(items.size() * i / threads);
+  }
+  {
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 0; i < threads; ++i) {
+      workers.emplace_back([&, i] {
+        std::stable_sort(items.begin() + bounds[i],
+                         items.begin() + bounds[i + 1], less);
+      });
+    }
+  }
+
+  std::vector<T> buffer(items.size());
+  auto from = items.begin();
+  auto to = buffer.begin();
+  while (bounds.size() > 2) {
+    std::vector<std::size_t> merged;
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 0; i + 1 < bounds.size(); i += 2) {
+      merged.push_back(bounds[i]);
+      auto first = bounds[i], middle = bounds[i + 1];
+      if (i + 2 == bounds.size()) {
+        // the last run of an odd count is left as it is
+        std::move(from + first, from + middle, to + first);
+        continue;
+      }
+      auto last = bounds[i + 2];
+      workers.emplace_back([=, &less] {
+        // on ties, merge takes from the first run, keeping the sort stable
+        std::merge(std::make_move_iterator(from + first),
+                   std::make_move_iterator(from + middle),
+                   std::make_move_iterator(from + middle),
+                   std::make_move_iterator(from + last), to + first, less);
+      });
+    }
+    merged.push_back(bounds.back());
+    workers.clear();
+    bounds = std::move(merged);
+    std::swap(from, to);
+  }
+  if (from == buffer.begin()) {
+    items.swap(buffer);
+  }
+}
+
+// The indices of the keys in sorted order, ties in their original order.
+// Numbers and strings are sorted as doubles and string views, in parallel
+// for long lists; keys of other types on a single thread.
+std::vector<std::size_t> sorted_order(std::span<const Result> keys) {
+  auto all = [&](auto type) {
+    using T = decltype(type);
+    return std::all_of(keys.begin(), keys.end(), [](const Result &key) {
+      return std::holds_alternative<T>(key);
+    });
+  };
+  auto indices = [](const auto &pairs) {
+    std::vector<std::size_t> order;
+    order.reserve(pairs.size());
+    for (const auto &[key, index] : pairs) {
+      order.push_back(index);
+    }
+    return order;
+  };
+  auto by_key = [](const auto &a, const auto &b) { return a.first < b.first; };
+
+  if (all(Number{})) {
+    std::vector<std::pair<Number, std::size_t>> pairs;
+    pairs.reserve(keys.size());
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      pairs.emplace_back(std::get<Number>(keys[i]), i);
+    }
+    parallel_stable_sort(pairs, by_key);
+    return indices(pairs);
+  }
+  if (all(String{})) {
+    std::vector<std::pair<std::string_view, std::size_t>> pairs;
+    pairs.reserve(keys.size());
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      pairs.emplace_back(std::get<String>(keys[i]), i);
+    }
+    parallel_stable_sort(pairs, by_key);
+    return indices(pairs);
+  }
+  std::vector<std::size_t> order(keys.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+    return less_than(keys[a], keys[b]);
+  });
+  return order;
+}
+
+// the elements of the list, in the given order
+List reorder(List list, const std::vector<std::size_t> &order) {
+  List result;
+  result.list.reserve(order.size());
+  for (auto i : order) {
+    result.list.push_back(list.list.take(i));
+  }
+  return result;
+}
+
+// a list of (key value) pairs, like a JSON object
+List pairs_list(std::vector<std::pair<Result, Result>> pairs) {
+  List result;
+  result.list.reserve(pairs.size());
+  for (auto &[key, value] : pairs) {
+    result.list.push_back(List({std::move(key), std::move(value)}));
+  }
+  return result;
+}
+
+// the number of elements with each key, in the order the keys first appear
+template <typename Key> List count_by(Result seq, Key &&key) {
+  std::unordered_map<Result, std::size_t, ResultHash, ResultEqual> indices;
+  std::vector<std::pair<Result, Result>> counts;
+  for_each(std::move(seq), [&](Result value) {
+    auto [it, added] =
+        indices.try_emplace(key(std::move(value)), counts.size());
+    if (added) {
+      counts.emplace_back(it->first, Number(0));
+    }
+    std::get<Number>(counts[it->second].second)++;
+  });
+  return pairs_list(std::move(counts));
+}
+
+} // namespace
+
+List map_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 2, "map");
+  check_function(arguments[0], "map");
+  List result;
+  if (auto l = std::get_if<List>(&arguments[1])) {
+    result.list.reserve(l->list.size());
+  }
+  Caller fn(arguments[0], env);
+  for_each(std::move(arguments[1]), [&](Result value) {
+    result.list.push_back(fn(std::move(value)));
+  });
+  return result;
+}
+
+List filter_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 2, "filter");
+  check_function(arguments[0], "filter");
+  List result;
+  Caller pred(arguments[0], env);
+  for_each(std::move(arguments[1]), [&](Result value) {
+    if (is_true(pred(value))) {
+      result.list.push_back(std::move(value));
+    }
+  });
+  return result;
+}
+
+Result fold_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 3, "fold");
+  return reduce_fn(std::move(arguments), env);
+}
+
+List reverse_fn(std::vector<Result> arguments) {
+  check_arguments(arguments, 1, "reverse");
+  auto list = to_list(std::move(arguments[0]));
+  std::reverse(list.list.begin(), list.list.end());
+  return list;
+}
+
+Result nth_fn(std::vector<Result> arguments) {
+  check_arguments(arguments, 2, "nth");
+  auto n = std::get_if<Number>(&arguments[1]);
+  if (n == nullptr || *n < 0 || std::trunc(*n) != *n) {
+    throw std::runtime_error("'nth' requires a non-negative integer as index");
+  }
+  auto index = static_cast<std::size_t>(*n);
+
+  if (auto l = std::get_if<List>(&arguments[0])) {
+    if (index < l->list.size()) {
+      return l->list.take(index);
+    }
+  } else {
+    Cursor cursor(std::move(arguments[0]));
+    for (std::size_t i = 0; auto value = cursor.next(); ++i) {
+      if (i == index) {
+        return std::move(*value);
+      }
+    }
+  }
+  throw std::runtime_error("Index " + std::to_string(index) + " out of range");
+}
+
+Result last_fn(std::vector<Result> arguments) {
+  check_arguments(arguments, 1, "last");
+  Result last = Nil{};
+  if (auto l = std::get_if<List>(&arguments[0])) {
+    if (!l->list.empty()) {
+      last = l->list.take(l->list.size() - 1);
+    }
+  } else {
+    for_each(std::move(arguments[0]),
+             [&](Result value) { last = std::move(value); });
+  }
+  return last;
+}
+
+List sort_fn(std::vector<Result> arguments, Env &env) {
+  // (sort seq) or (sort less-than seq), the sort is stable
+  if (arguments.size() == 1) {
+    auto list = to_list(std::move(arguments[0]));
+    auto order = sorted_order(list.list.elements());
+    return reorder(std::move(list), order);
+  }
+
+  check_arguments(arguments, 2, "sort");
+  check_function(arguments[0], "sort");
+  auto list = to_list(std::move(arguments[1]));
+  std::vector<Result> args;
+  std::stable_sort(list.list.begin(), list.list.end(),
+                   [&](const Result &a, const Result &b) {
+                     args.assign({a, b});
+                     return is_true(call(arguments[0], args, env));
+                   });
+  return list;
+}
+
+List sort_by_fn(std::vector<Result> arguments, Env &env) {
+  // (sort-by key seq), the key of each element is computed once
+  check_arguments(arguments, 2, "sort-by");
+  check_function(arguments[0], "sort-by");
+  auto list = to_list(std::move(arguments[1]));
+  std::vector<Result> keys;
+  keys.reserve(list.list.size());
+  Caller key(arguments[0], env);
+  for (const auto &value : list.list.elements()) {
+    keys.push_back(key(value));
+  }
+  return reorder(std::move(list), sorted_order(keys));
+}
+
+List merge_fn(std::vector<Result> arguments, Env &env) {
+  // (merge xs ys) or (merge less-than xs ys), of two sorted sequences; on
+  // ties the elements of xs come first
+  if (arguments.size() != 2) {
+    check_arguments(arguments, 3, "merge");
+    check_function(arguments[0], "merge");
+  }
+  auto offset = arguments.size() - 2;
+  auto xs = to_list(std::move(arguments[offset]));
+  auto ys = to_list(std::move(arguments[offset + 1]));
+  std::vector<Result> args;
+  auto less = [&](const Result &a, const Result &b) {
+    if (offset == 0) {
+      return less_than(a, b);
+    }
+    args.assign({a, b});
+    return is_true(call(arguments[0], args, env));
+  };
+
+  List result;
+  result.list.reserve(xs.list.size() + ys.list.size());
+  std::size_t i = 0, j = 0;
+  while (i < xs.list.size() && j < ys.list.size()) {
+    if (less(std::as_const(ys.list)[j], std::as_const(xs.list)[i])) {
+      result.list.push_back(ys.list.take(j++));
+    } else {
+      result.list.push_back(xs.list.take(i++));
+    }
+  }
+  for (; i < xs.list.size(); ++i) {
+    result.list.push_back(xs.list.take(i));
+  }
+  for (; j < ys.list.size(); ++j) {
+    result.list.push_back(ys.list.take(j));
+  }
+  return result;
+}
+
+List group_by_fn(std::vector<Result> arguments, Env &env) {
+  // (group-by key seq) -> ((key elements...) ...), the groups in the order
+  // their keys first appear
+  check_arguments(arguments, 2, "group-by");
+  check_function(arguments[0], "group-by");
+  std::unordered_map<Result, std::size_t, ResultHash, ResultEqual> indices;
+  std::vector<std::pair<Result, Result>> groups;
+  Caller key(arguments[0], env);
+  for_each(std::move(arguments[1]), [&](Result value) {
+    auto [it, added] = indices.try_emplace(key(value), groups.size());
+    if (added) {
+      groups.emplace_back(it->first, List());
+    }
+    std::get<List>(groups[it->second].second).list.push_back(std::move(value));
+  });
+  return pairs_list(std::move(groups));
+}
+
+List count_by_fn(std::vector<Result> arguments, Env &env) {
+  // (count-by key seq) -> ((key count) ...)
+  check_arguments(arguments, 2, "count-by");
+  check_function(arguments[0], "count-by");
+  return count_by(std::move(arguments[1]), Caller(arguments[0], env));
+}
+
+List frequencies_fn(std::vector<Result> arguments) {
+  // (frequencies seq) -> ((value count) ...)
+  check_arguments(arguments, 1, "frequencies");
+  return count_by(std::move(arguments[0]), [](Result value) { return value; });
+}
+
+List distinct_fn(std::vector<Result> arguments) {
+  // the first occurrence of each value, in order
+  check_arguments(arguments, 1, "distinct");
+  std::unordered_set<Result, ResultHash, ResultEqual> seen;
+  List result;
+  for_each(std::move(arguments[0]), [&](Result value) {
+    if (seen.insert(value).second) {
+      result.list.push_back(std::move(value));
+    }
+  });
+  return result;
+}
+
+bool any_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 2, "any?");
+  check_function(arguments[0], "any?");
+  Caller pred(arguments[0], env);
+  Cursor cursor(std::move(arguments[1]));
+  while (auto value = cursor.next()) {
+    if (is_true(pred(std::move(*value)))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool all_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 2, "all?");
+  check_function(arguments[0], "all?");
+  Caller pred(arguments[0], env);
+  Cursor cursor(std::move(arguments[1]));
+  while (auto value = cursor.next()) {
+    if (!is_true(pred(std::move(*value)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Number count_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 2, "count");
+  check_function(arguments[0], "count");
+  Number n = 0;
+  Caller pred(arguments[0], env);
+  for_each(std::move(arguments[1]), [&](Result value) {
+    if (is_true(pred(std::move(value)))) {
+      n++;
+    }
+  });
+  return n;
+}
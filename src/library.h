@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.h"
+#include <vector>
+
+// Native implementations of the standard library. They accept lists as well
+// as lazy sequences, and functions can be lambdas or builtins.
+
+List map_fn(std::vector<Result> arguments, Env &env);
+List filter_fn(std::vector<Result> arguments, Env &env);
+Result fold_fn(std::vector<Result> arguments, Env &env);
+List reverse_fn(std::vector<Result> arguments);
+Result nth_fn(std::vector<Result> arguments);
+Result last_fn(std::vector<Result> arguments);
+List sort_fn(std::vector<Result> arguments, Env &env);
+List sort_by_fn(std::vector<Result> arguments, Env &env);
+List merge_fn(std::vector<Result> arguments, Env &env);
+List group_by_fn(std::vector<Result> arguments, Env &env);
+List count_by_fn(std::vector<Result> arguments, Env &env);
+List frequencies_fn(std::vector<Result> arguments);
+List distinct_fn(std::vector<Result> arguments);
+bool any_fn(std::vector<Result> arguments, Env &env);
+bool all_fn(std::vector<Result> arguments, Env &env);
+Number count_fn(std::vector<Result> arguments, Env &env);
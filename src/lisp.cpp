@@ -6,7 +6,10 @@
 
 #include "lisp.h"
 
-std::string stdlib() {
+// The standard library is native (see library.h), this is the equivalent
+// implementation in cpplisp. Loading it shadows the builtins, it is kept as a
+// reference and as a fallback.
+std::string interpreted_stdlib() {
   return R"stdlib(
 (define empty? (lambda (seq)
   (= (length seq) 0)))
@@ -15,6 +18,44 @@ std::string stdlib() {
   (if (empty? seq)
       (list)
       (cons (fn (first seq)) (map fn (rest seq))))))
+
+(define filter (lambda (pred seq)
+  (if (empty? seq)
+      (list)
+      (if (pred (first seq))
+          (cons (first seq) (filter pred (rest seq)))
+          (filter pred (rest seq))))))
+
+(define fold (lambda (fn acc seq)
+  (if (empty? seq)
+      acc
+      (fold fn (fn acc (first seq)) (rest seq)))))
+
+(define reverse (lambda (seq)
+  (fold (lambda (acc x) (cons x acc)) (list) seq)))
+
+(define nth (lambda (seq n)
+  (if (= n 0)
+      (first seq)
+      (nth (rest seq) (- n 1)))))
+
+(define last (lambda (seq)
+  (cond ((empty? seq) nil)
+        ((empty? (rest seq)) (first seq))
+        (else (last (rest seq))))))
+
+(define any? (lambda (pred seq)
+  (if (empty? seq)
+      false
+      (if (pred (first seq)) true (any? pred (rest seq))))))
+
+(define all? (lambda (pred seq)
+  (if (empty? seq)
+      true
+      (if (pred (first seq)) (all? pred (rest seq)) false))))
+
+(define count (lambda (pred seq)
+  (length (filter pred seq))))
 )stdlib";
 }
 
@@ -26,8 +67,28 @@ Result eval_all(const ExprList &exprs, Env &env) {
   return res;
 }
 
+std::string stdlib() { return interpreted_stdlib(); }
+
+Result eval_program_with_stdlib(const std::string &program) {
+  return eval_program(program);
+}
+
 Result eval_with_env(const std::string &program, Env &env) {
-  auto ast = Parser().parse_all(tokenize(program));
+  // each expression is parsed once the previous ones are evaluated, so
+  // that macros can use the functions defined before them
+  auto tokens = tokenize(program);
+  Parser parser(&env);
+  Result res;
+  while (!parser.done(tokens)) {
+    res = parser.parse(tokens)->evaluate(env);
+  }
+  return res;
+}
+
+Result eval_checked(const std::string &program, Env &env) {
+  auto ast = Parser(&env).parse_all(tokenize(program));
+  optimize_program(ast, env);
+  check_program(ast, env);
   return eval_all(ast, env);
 }
 
@@ -36,9 +97,9 @@ Result eval_program(const std::string &program) {
   return eval_with_env(program, env);
 }
 
-Result eval_program_with_stdlib(const std::string &program) {
+Result eval_program_with_interpreted_stdlib(const std::string &program) {
   Env env;
-  eval_with_env(stdlib(), env);
+  eval_with_env(interpreted_stdlib(), env);
   return eval_with_env(program, env);
 }
 
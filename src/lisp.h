@@ -6,12 +6,34 @@
 #include <variant>
 #include <vector>
 
+#include "actors.h"
+#include "aot.h"
+#include "bignum.h"
+#include "checker.h"
+#include "coverage.h"
+#include "formats.h"
+#include "jit.h"
+#include "modules.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "program.h"
+#include "regex.h"
+#include "resources.h"
+#include "task.h"
 #include "tokenizer.h"
 #include "types.h"
 
+std::string interpreted_stdlib();
+// the former name of interpreted_stdlib
 std::string stdlib();
 
 Result eval_with_env(const std::string &program, Env &env);
+// parses, optimizes and checks the whole program (see optimize_program and
+// check_program) before evaluating it, macros can then only use the functions
+// already defined in env
+Result eval_checked(const std::string &program, Env &env);
 Result eval_program(const std::string &program);
+// the former way to get the standard library, which is now always available:
+// the same as eval_program
 Result eval_program_with_stdlib(const std::string &program);
+Result eval_program_with_interpreted_stdlib(const std::string &program);
@@ -0,0 +1,162 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+constinit thread_local MemoryCategory current_memory_category =
+    MemoryCategory::Other;
+
+namespace {
+
+// Allocations are counted per thread first and added to the shared counters
+// in batches, keeping atomic operations off the allocation path. The shared
+// counters can miss the last few events of each running thread.
+constexpr std::size_t FLUSH_EVENTS = 256;
+constexpr std::int64_t FLUSH_BYTES = 64 * 1024;
+// index of the total in the counter arrays
+constexpr std::size_t TOTAL = MEMORY_CATEGORIES;
+
+struct Counter {
+  std::atomic<std::int64_t> live{0};
+  std::atomic<std::int64_t> peak{0};
+  std::atomic<std::size_t> allocations{0};
+
+  void add(std::int64_t bytes, std::size_t count) {
+    auto now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    allocations.fetch_add(count, std::memory_order_relaxed);
+    auto highest = peak.load(std::memory_order_relaxed);
+    while (now > highest &&
+           !peak.compare_exchange_weak(highest, now,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+
+  MemoryCounters load() const {
+    auto bytes = live.load(std::memory_order_relaxed);
+    return {static_cast<std::size_t>(std::max<std::int64_t>(bytes, 0)),
+            static_cast<std::size_t>(peak.load(std::memory_order_relaxed)),
+            allocations.load(std::memory_order_relaxed)};
+  }
+};
+
+constinit Counter counters[MEMORY_CATEGORIES + 1];
+
+struct Pending {
+  std::int64_t bytes[MEMORY_CATEGORIES + 1];
+  std::size_t allocations[MEMORY_CATEGORIES + 1];
+  std::size_t events;
+};
+
+constinit thread_local Pending pending{};
+// exact, for the heap limit
+constinit thread_local std::int64_t thread_live = 0;
+constinit thread_local std::int64_t heap_limit = 0;
+constinit thread_local bool heap_limit_hit = false;
+
+void flush() {
+  // flushes what is left when the thread exits
+  struct ThreadExit {
+    ~ThreadExit() { flush(); }
+  };
+  static thread_local ThreadExit thread_exit;
+
+  for (int i = 0; i <= TOTAL; ++i) {
+    if (pending.bytes[i] != 0 || pending.allocations[i] != 0) {
+      counters[i].add(pending.bytes[i], pending.allocations[i]);
+      pending.bytes[i] = 0;
+      pending.allocations[i] = 0;
+    }
+  }
+  pending.events = 0;
+}
+
+} // namespace
+
+void count_allocation(MemoryCategory category, std::int64_t bytes,
+                      std::size_t count) {
+  auto i = static_cast<std::size_t>(category);
+  thread_live += bytes;
+  pending.bytes[i] += bytes;
+  pending.bytes[TOTAL] += bytes;
+  pending.allocations[i] += count;
+  pending.allocations[TOTAL] += count;
+  if (++pending.events == FLUSH_EVENTS || pending.bytes[TOTAL] >= FLUSH_BYTES ||
+      pending.bytes[TOTAL] <= -FLUSH_BYTES) {
+    flush();
+  }
+}
+
+bool heap_limit_allows(std::size_t bytes) {
+  if (heap_limit != 0 &&
+      thread_live + static_cast<std::int64_t>(bytes) > heap_limit) {
+    heap_limit_hit = true;
+    return false;
+  }
+  return true;
+}
+
+std::int64_t thread_live_bytes() { return thread_live; }
+
+void set_thread_heap_limit(std::int64_t bytes) {
+  heap_limit = bytes;
+  heap_limit_hit = false;
+}
+
+std::int64_t thread_heap_limit() { return heap_limit; }
+
+bool thread_heap_limit_exceeded() { return heap_limit_hit; }
+
+MemoryStats memory_stats() {
+  flush();
+  MemoryStats stats;
+  stats.total = counters[TOTAL].load();
+  for (int i = 0; i < MEMORY_CATEGORIES; ++i) {
+    stats.categories[i] = counters[i].load();
+  }
+  return stats;
+}
+
+const char *memory_category_name(MemoryCategory category) {
+  switch (category) {
+  case MemoryCategory::Ast:
+    return "ast";
+  case MemoryCategory::Environment:
+    return "environments";
+  case MemoryCategory::Closure:
+    return "closures";
+  case MemoryCategory::List:
+    return "lists";
+  case MemoryCategory::String:
+    return "strings";
+  default:
+    return "other";
+  }
+}
+
+void print_memory_stats(std::ostream &out, const MemoryStats &stats) {
+  auto row = [&](const char *name, const MemoryCounters &counters) {
+    char line[128];
+    std::snprintf(line, sizeof(line), "%-14s%14zu%14zu%14zu\n", name,
+                  counters.live_bytes, counters.peak_bytes,
+                  counters.allocations);
+    out << line;
+  };
+
+  char header[128];
+  std::snprintf(header, sizeof(header), "%-14s%14s%14s%14s\n", "memory",
+                "live bytes", "peak bytes", "allocations");
+  out << header;
+  for (int i = 0; i < MEMORY_CATEGORIES; ++i) {
+    row(memory_category_name(static_cast<MemoryCategory>(i)),
+        stats.categories[i]);
+  }
+  row("total", stats.total);
+}
+
+void print_memory_stats_at_exit() {
+  std::atexit([] { print_memory_stats(std::cerr, memory_stats()); });
+}
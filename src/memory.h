@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// What the memory is allocated for, see MemoryScope. Allocations made outside
+// of any scope are counted as Other.
+enum class MemoryCategory { Other, Ast, Environment, Closure, List, String };
+constexpr std::size_t MEMORY_CATEGORIES = 6;
+
+struct MemoryCounters {
+  std::size_t live_bytes = 0;
+  std::size_t peak_bytes = 0;
+  std::size_t allocations = 0;
+};
+
+struct MemoryStats {
+  MemoryCounters total;
+  std::array<MemoryCounters, MEMORY_CATEGORIES> categories;
+
+  const MemoryCounters &operator[](MemoryCategory category) const {
+    return categories[static_cast<std::size_t>(category)];
+  }
+};
+
+// The counters of the global operator new since the program started. Sizes
+// are the bytes requested, without the overhead of the allocator; memory
+// freed in another category than the one it was allocated in is still
+// counted in the latter.
+//
+// Allocations are only counted, and the heap limits only enforced, in the
+// programs linking the lisp_memstats library, which replaces the global
+// operator new. Without it the counters stay at 0.
+MemoryStats memory_stats();
+const char *memory_category_name(MemoryCategory category);
+void print_memory_stats(std::ostream &out, const MemoryStats &stats);
+// prints the stats to stderr when the program exits
+void print_memory_stats_at_exit();
+
+// The bytes allocated and not freed by this thread, minus what it freed for
+// other threads.
+std::int64_t thread_live_bytes();
+// Makes the allocations of this thread fail once thread_live_bytes() would
+// exceed `bytes`, 0 removes the limit.
+void set_thread_heap_limit(std::int64_t bytes);
+std::int64_t thread_heap_limit();
+// whether the limit made an allocation fail since it was set
+bool thread_heap_limit_exceeded();
+
+// for the operator new of lisp_memstats: counts an allocation of `bytes`
+// (`count` 1) or a deallocation (negative `bytes`, `count` 0)
+void count_allocation(MemoryCategory category, std::int64_t bytes,
+                      std::size_t count);
+// false when allocating `bytes` would exceed the heap limit of this thread
+bool heap_limit_allows(std::size_t bytes);
+
+extern constinit thread_local MemoryCategory current_memory_category;
+
+// Counts the allocations made by this thread during its lifetime in
+// `category`.
+class MemoryScope {
+public:
+  explicit MemoryScope(MemoryCategory category)
+      : previous(current_memory_category) {
+    current_memory_category = category;
+  }
+  ~MemoryScope() { current_memory_category = previous; }
+
+  MemoryScope(const MemoryScope &) = delete;
+  MemoryScope &operator=(const MemoryScope &) = delete;
+
+private:
+  MemoryCategory previous;
+};
@@ -0,0 +1,71 @@
+#include "memory.h"
+
+#include <cstdlib>
+#include <new>
+
+// The global operator new and delete counting the allocations for
+// memory_stats() and the heap limits. Only the programs that link this file,
+// through the lisp_memstats library, pay for the header of each allocation.
+
+namespace {
+
+// stored in front of each allocation, keeps the alignment of malloc
+struct alignas(std::max_align_t) Header {
+  std::size_t size;
+  MemoryCategory category;
+};
+
+void *allocate(std::size_t size) noexcept {
+  if (!heap_limit_allows(size)) {
+    return nullptr;
+  }
+  auto header = static_cast<Header *>(std::malloc(sizeof(Header) + size));
+  if (header == nullptr) {
+    return nullptr;
+  }
+  header->size = size;
+  header->category = current_memory_category;
+  count_allocation(header->category, static_cast<std::int64_t>(size), 1);
+  return header + 1;
+}
+
+void deallocate(void *p) noexcept {
+  if (p == nullptr) {
+    return;
+  }
+  auto header = static_cast<Header *>(p) - 1;
+  count_allocation(header->category, -static_cast<std::int64_t>(header->size),
+                   0);
+  std::free(header);
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+  while (true) {
+    if (auto p = allocate(size)) {
+      return p;
+    }
+    auto handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return operator new(size);
+  } catch (const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void operator delete(void *p) noexcept { deallocate(p); }
+
+void operator delete(void *p, std::size_t) noexcept { deallocate(p); }
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  deallocate(p);
+}
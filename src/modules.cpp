@@ -0,0 +1,221 @@
+#include "modules.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+
+struct CachedModule {
+  std::filesystem::file_time_type modified;
+  std::uintmax_t size;
+  ProgramHandle program;
+};
+
+std::mutex cache_mutex;
+// by canonical path
+std::unordered_map<std::string, CachedModule> cache;
+
+// the files being loaded by this thread, innermost last
+thread_local std::vector<std::filesystem::path> loading;
+
+class Loading {
+public:
+  explicit Loading(const std::filesystem::path &path) {
+    for (const auto &file : loading) {
+      if (file == path) {
+        throw std::runtime_error("Circular load of " + path.string());
+      }
+    }
+    loading.push_back(path);
+  }
+  ~Loading() { loading.pop_back(); }
+
+  Loading(const Loading &) = delete;
+  Loading &operator=(const Loading &) = delete;
+};
+
+// a file loaded in it could expand them
+bool has_macros(const Env &env) {
+  for (const auto &[name, value] : env.bindings) {
+    if (auto lambda = std::get_if<Lambda>(&value); lambda && lambda->macro) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string string_arg(const Result &arg, const std::string &op) {
+  if (auto s = std::get_if<String>(&arg)) {
+    return *s;
+  }
+  throw std::runtime_error("'" + op + "' requires a string, got " +
+                           to_string(arg));
+}
+
+} // namespace
+
+std::vector<std::filesystem::path> &module_search_path() {
+  static std::vector<std::filesystem::path> path = [] {
+    std::vector<std::filesystem::path> directories{"."};
+    if (auto variable = std::getenv("CPPLISP_PATH")) {
+      std::istringstream in(variable);
+      std::string directory;
+      while (std::getline(in, directory, ':')) {
+        if (!directory.empty()) {
+          directories.emplace_back(directory);
+        }
+      }
+    }
+    return directories;
+  }();
+  return path;
+}
+
+std::filesystem::path resolve_module(const std::string &name) {
+  std::vector<std::filesystem::path> directories;
+  if (!loading.empty()) {
+    directories.push_back(loading.back().parent_path());
+  }
+  const auto &search_path = module_search_path();
+  directories.insert(directories.end(), search_path.begin(),
+                     search_path.end());
+
+  for (const auto &candidate : {name, name + ".cpplisp"}) {
+    std::filesystem::path path(candidate);
+    if (path.is_absolute()) {
+      if (std::filesystem::is_regular_file(path)) {
+        return std::filesystem::canonical(path);
+      }
+      continue;
+    }
+    for (const auto &directory : directories) {
+      if (std::filesystem::is_regular_file(directory / path)) {
+        return std::filesystem::canonical(directory / path);
+      }
+    }
+  }
+  throw std::runtime_error("Cannot find module " + name);
+}
+
+ProgramHandle cached_module(const std::filesystem::path &path) {
+  auto modified = std::filesystem::last_write_time(path);
+  auto size = std::filesystem::file_size(path);
+  std::lock_guard lock(cache_mutex);
+  auto it = cache.find(path.string());
+  if (it != cache.end() && it->second.modified == modified &&
+      it->second.size == size) {
+    return it->second.program;
+  }
+  return nullptr;
+}
+
+Result load_module(const std::filesystem::path &path, Env &env) {
+  // the cached forms were expanded without macros
+  bool cacheable = !has_macros(env);
+  if (cacheable) {
+    if (auto program = cached_module(path)) {
+      return run(program, env);
+    }
+  }
+
+  auto modified = std::filesystem::last_write_time(path);
+  auto size = std::filesystem::file_size(path);
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    throw std::runtime_error("Cannot open file " + path.string());
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  Result result;
+  auto program = compile_and_run(buffer.str(), env, result);
+
+  if (cacheable) {
+    std::lock_guard lock(cache_mutex);
+    cache[path.string()] = {modified, size, program};
+  }
+  return result;
+}
+
+Result load_fn(std::vector<Result> arguments, Env &env) {
+  if (arguments.size() != 1) {
+    throw std::runtime_error("'load' requires a file name");
+  }
+  auto path = resolve_module(string_arg(arguments[0], "load"));
+  Loading file(path);
+  return load_module(path, env);
+}
+
+Nil require_fn(std::vector<Result> arguments, Env &env) {
+  if (arguments.empty() || arguments.size() > 2) {
+    throw std::runtime_error("'require' requires a module name and an "
+                             "optional alias");
+  }
+  auto name = string_arg(arguments[0], "require");
+  auto alias = arguments.size() == 2
+                   ? string_arg(arguments[1], "require")
+                   : std::filesystem::path(name).stem().string();
+  auto path = resolve_module(name);
+
+  // a binding no symbol can refer to marks the file as loaded, with the
+  // alias of its names
+  auto loaded = "module " + path.string();
+  if (auto marker = env.get(loaded)) {
+    auto prefix = std::get<String>(*marker) + "/";
+    if (prefix != alias + "/") {
+      std::vector<std::pair<std::string, Result>> exports;
+      for (const auto &[name, value] : env.bindings) {
+        if (name.starts_with(prefix)) {
+          exports.emplace_back(alias + "/" + name.substr(prefix.size()),
+                               value);
+        }
+      }
+      for (auto &[name, value] : exports) {
+        env[name] = std::move(value);
+      }
+    }
+    return Nil{};
+  }
+
+  Env module;
+  {
+    Loading file(path);
+    load_module(path, module);
+  }
+
+  // Lambdas see the bindings of their caller, which only has the prefixed
+  // names: the module's own are added to their closure, and come first.
+  auto scope = std::make_shared<Env>(module);
+  const Env defaults;
+  for (const auto &[name, value] : module.bindings) {
+    // the bindings of the modules it requires are not exported
+    if (defaults.bindings.count(name) != 0 ||
+        name.find('/') != std::string::npos ||
+        name.starts_with("module ")) {
+      continue;
+    }
+    auto &bound = env[alias + "/" + name];
+    bound = value;
+    auto lambda = std::get_if<Lambda>(&bound);
+    if (lambda == nullptr) {
+      continue;
+    }
+    lambda->module = true;
+    bool captured = false;
+    for (const auto &binding : lambda->env->bindings) {
+      captured = captured || module.bindings.count(binding.first) == 0;
+    }
+    if (captured) {
+      // it also keeps the values it captured, e.g. from a 'let'
+      auto closure = std::make_shared<Env>(*lambda->env);
+      closure->merge(module);
+      lambda->env = closure;
+    } else {
+      lambda->env = scope;
+    }
+  }
+  env[loaded] = String(alias);
+  return Nil{};
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "program.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Code split across files. (load "file") evaluates a file in the current
+// environment. (require "name") evaluates the module name.cpplisp once per
+// environment, in an environment of its own, and binds what it defines as
+// name/..., or alias/... with (require "name" "alias"):
+//
+//   ; geometry.cpplisp
+//   (define square (lambda (x) (* x x)))
+//   (define area (lambda (r) (* 3.14159 (square r))))
+//
+//   (require "geometry")
+//   (geometry/area 2)
+//
+// The lambdas it exports find the names of the module before those of their
+// caller. Requiring the same file under another alias binds its names again,
+// without evaluating it.
+//
+// Files are looked up in the directory of the module being loaded, then in
+// module_search_path(). Their forms are parsed as they are evaluated, so that
+// macros can call the functions defined before them, and the macros of the
+// caller are expanded by (load "file"). The parsed forms are cached by path
+// and modification time when no macros were defined in the environment:
+// requiring a module in another environment does not parse it again unless
+// the file changed.
+
+// "." and the directories of the CPPLISP_PATH environment variable,
+// separated by ':'. Not synchronized, set it before evaluating.
+std::vector<std::filesystem::path> &module_search_path();
+// throws when the file is not found
+std::filesystem::path resolve_module(const std::string &name);
+// evaluates the file on `env`, returns the value of its last form
+Result load_module(const std::filesystem::path &path, Env &env);
+// the forms of the file cached by load_module(), nullptr when they are not
+// cached or the file was modified since
+ProgramHandle cached_module(const std::filesystem::path &path);
+
+Result load_fn(std::vector<Result> arguments, Env &env);
+Nil require_fn(std::vector<Result> arguments, Env &env);
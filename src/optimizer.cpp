@@ -0,0 +1,414 @@
+#include "optimizer.h"
+
+#include "builtins.h"
+#include "checker.h"
+
+#include <algorithm>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// bodies at most this large are inlined
+constexpr std::size_t MAX_INLINE_SIZE = 32;
+// inlined bodies are optimized too, up to this depth of nested inlining
+constexpr std::size_t MAX_INLINE_DEPTH = 8;
+
+// builtins without side effects, evaluated when their arguments are constant
+const std::unordered_set<std::string> PURE_BUILTINS = {
+    "+",    "-",      "*",      "/",      "=",    "<",       ">",
+    "<=",   ">=",     "not",    "length", "cons", "append",  "concat",
+    "get",  "list",   "empty?", "first",  "rest", "reverse", "nth",
+    "last", "equal?", "hash"};
+
+// Returns `expr` with its direct subexpressions replaced by `f`, a copy of
+// `expr` if any of them changed, `expr` itself otherwise.
+template <typename F> ExprPtr map_children(const ExprPtr &expr, F f) {
+  bool changed = false;
+  auto map = [&](const ExprPtr &child) {
+    auto mapped = f(child);
+    changed = changed || mapped != child;
+    return mapped;
+  };
+  auto map_all = [&](const ExprList &exprs) {
+    ExprList mapped;
+    mapped.reserve(exprs.size());
+    for (const auto &e : exprs) {
+      mapped.push_back(map(e));
+    }
+    return mapped;
+  };
+  auto map_bindings = [&](const LetExpr::Bindings &vars) {
+    LetExpr::Bindings mapped;
+    for (const auto &[symbol, value] : vars) {
+      mapped.emplace_back(symbol, map(value));
+    }
+    return mapped;
+  };
+
+  ExprPtr result;
+  if (auto e = dynamic_cast<ListExpr *>(expr.get())) {
+    result = std::make_shared<ListExpr>(map_all(e->expressions));
+  } else if (auto e = dynamic_cast<QuasiquoteExpr *>(expr.get())) {
+    QuasiquoteExpr::Parts parts;
+    for (const auto &[splice, part] : e->parts) {
+      parts.emplace_back(splice, map(part));
+    }
+    result = std::make_shared<QuasiquoteExpr>(std::move(parts));
+  } else if (auto e = dynamic_cast<DoExpr *>(expr.get())) {
+    result = std::make_shared<DoExpr>(map_all(e->expressions));
+  } else if (auto e = dynamic_cast<IfExpr *>(expr.get())) {
+    result = std::make_shared<IfExpr>(map_all(e->expressions));
+  } else if (auto e = dynamic_cast<CondExpr *>(expr.get())) {
+    result = std::make_shared<CondExpr>(map_all(e->expressions));
+  } else if (auto e = dynamic_cast<DefineExpr *>(expr.get())) {
+    result = std::make_shared<DefineExpr>(e->var, map(e->expr));
+  } else if (auto e = dynamic_cast<LetExpr *>(expr.get())) {
+    auto vars = map_bindings(e->vars);
+    result = std::make_shared<LetExpr>(std::move(vars), map(e->expr));
+  } else if (auto e = dynamic_cast<LoopExpr *>(expr.get())) {
+    auto vars = map_bindings(e->vars);
+    result = std::make_shared<LoopExpr>(std::move(vars), map(e->expr));
+  } else if (auto e = dynamic_cast<RecurExpr *>(expr.get())) {
+    result = std::make_shared<RecurExpr>(map_all(e->expressions));
+  } else if (auto e = dynamic_cast<LambdaExpr *>(expr.get())) {
+    result = std::make_shared<LambdaExpr>(e->arguments, map(e->body));
+  } else if (auto e = dynamic_cast<AndExpr *>(expr.get())) {
+    result = std::make_shared<AndExpr>(map_all(e->exprs));
+  } else if (auto e = dynamic_cast<OrExpr *>(expr.get())) {
+    result = std::make_shared<OrExpr>(map_all(e->exprs));
+  } else if (auto e = dynamic_cast<InlineExpr *>(expr.get())) {
+    auto args = map_all(e->args);
+    auto inlined =
+        std::make_shared<InlineExpr>(e->params, std::move(args), map(e->body));
+    inlined->in_place = e->in_place;
+    result = inlined;
+  } else if (auto e = dynamic_cast<InlinedCallExpr *>(expr.get())) {
+    auto inlined = map(e->inlined);
+    result = std::make_shared<InlinedCallExpr>(e->name, e->body, inlined,
+                                               map(e->call));
+  } else if (auto e = dynamic_cast<ConstantExpr *>(expr.get())) {
+    // the call, e.g. folded or with the operator substituted, replaces the
+    // value built for the builtin
+    result = map(e->call);
+  }
+  return changed ? result : expr;
+}
+
+std::size_t size(Expr *expr) {
+  std::size_t n = 1;
+  for_each_child(expr, [&](Expr *child) { n += size(child); });
+  return n;
+}
+
+bool mentions(Expr *expr, const std::string &name) {
+  if (auto symbol = dynamic_cast<SymbolExpr *>(expr)) {
+    return symbol->symbol.name == name;
+  }
+  bool found = false;
+  for_each_child(expr, [&](Expr *child) {
+    found = found || mentions(child, name);
+  });
+  return found;
+}
+
+// whether a name of the body is only found in the closure of the lambda,
+// like the argument of an enclosing lambda that created it: inlined, the
+// body would look it up in env
+bool uses_closure(Expr *expr, const Lambda &lambda, const Env &env) {
+  if (auto symbol = dynamic_cast<SymbolExpr *>(expr)) {
+    const auto &name = symbol->symbol.name;
+    auto argument = std::any_of(
+        lambda.arguments.begin(), lambda.arguments.end(),
+        [&](const Symbol &argument) { return argument.name == name; });
+    return !argument && lambda.env->bindings.contains(name) &&
+           !env.bindings.contains(name);
+  }
+  bool found = false;
+  for_each_child(expr, [&](Expr *child) {
+    found = found || uses_closure(child, lambda, env);
+  });
+  return found;
+}
+
+// whether the arguments of a lambda can be replaced by other expressions in
+// its body: nothing binds names in it
+bool substitutable(Expr *expr) {
+  if (dynamic_cast<DefineExpr *>(expr) || dynamic_cast<LetExpr *>(expr) ||
+      dynamic_cast<LoopExpr *>(expr) || dynamic_cast<RecurExpr *>(expr) ||
+      dynamic_cast<LambdaExpr *>(expr) || dynamic_cast<InlineExpr *>(expr) ||
+      dynamic_cast<InlinedCallExpr *>(expr)) {
+    return false;
+  }
+  bool result = true;
+  for_each_child(expr,
+                 [&](Expr *child) { result = result && substitutable(child); });
+  return result;
+}
+
+std::optional<Result> constant(Expr *expr) {
+  if (auto e = dynamic_cast<LiteralExpr<Number> *>(expr)) {
+    return e->value;
+  } else if (auto e = dynamic_cast<LiteralExpr<String> *>(expr)) {
+    return e->value;
+  } else if (auto e = dynamic_cast<LiteralExpr<Nil> *>(expr)) {
+    return e->value;
+  } else if (auto e = dynamic_cast<QuoteExpr *>(expr)) {
+    return e->value;
+  }
+  return std::nullopt;
+}
+
+// evaluating it has no side effect and it evaluates to the same value each
+// time, it can be duplicated or dropped
+bool trivial(Expr *expr) {
+  return constant(expr) || dynamic_cast<SymbolExpr *>(expr);
+}
+
+ExprPtr constant_expr(Result value) {
+  if (auto n = std::get_if<Number>(&value)) {
+    return std::make_shared<LiteralExpr<Number>>(*n);
+  } else if (auto s = std::get_if<String>(&value)) {
+    return std::make_shared<LiteralExpr<String>>(std::move(*s));
+  }
+  return std::make_shared<QuoteExpr>(std::move(value));
+}
+
+ExprPtr substitute(const ExprPtr &expr,
+                   const std::unordered_map<std::string, ExprPtr> &args) {
+  if (auto symbol = dynamic_cast<SymbolExpr *>(expr.get())) {
+    auto it = args.find(symbol->symbol.name);
+    return it != args.end() ? it->second : expr;
+  }
+  return map_children(
+      expr, [&](const ExprPtr &child) { return substitute(child, args); });
+}
+
+struct Candidate {
+  std::vector<Symbol> params;
+  ExprPtr body;
+};
+
+std::optional<std::vector<Symbol>> simple_params(const LambdaExpr &lambda) {
+  std::vector<Symbol> params;
+  for (const auto &arg : lambda.arguments.expressions) {
+    auto symbol = dynamic_cast<SymbolExpr *>(arg.get());
+    if (symbol == nullptr || symbol->symbol.name == "&") {
+      return std::nullopt;
+    }
+    params.push_back(symbol->symbol);
+  }
+  return params;
+}
+
+class Optimizer {
+public:
+  Optimizer(const ExprList &program, const Env &env)
+      : bindings(program, env) {
+    for (const auto &[name, value] : env.bindings) {
+      auto lambda = std::get_if<Lambda>(&value);
+      if (lambda != nullptr && !lambda->variadic && !lambda->macro &&
+          !lambda->module &&
+          !uses_closure(lambda->body.get(), *lambda, env)) {
+        add_candidate(name, lambda->arguments, lambda->body);
+      }
+    }
+    for (const auto &[name, value] : bindings.definitions()) {
+      auto lambda = dynamic_cast<LambdaExpr *>(value);
+      if (lambda == nullptr || bindings.times_bound(name) != 1) {
+        continue;
+      }
+      if (auto params = simple_params(*lambda)) {
+        add_candidate(name, *params, lambda->body);
+      }
+    }
+  }
+
+  ExprPtr optimize(const ExprPtr &expr) {
+    if (auto symbol = dynamic_cast<SymbolExpr *>(expr.get())) {
+      return optimize_symbol(expr, symbol->symbol.name);
+    } else if (auto call = dynamic_cast<ListExpr *>(expr.get())) {
+      return optimize_call(expr, *call);
+    } else if (auto lambda = dynamic_cast<LambdaExpr *>(expr.get())) {
+      // the inlined calls are guarded by the identity of this body
+      if (frozen.contains(lambda->body.get())) {
+        return expr;
+      }
+    } else if (dynamic_cast<CondExpr *>(expr.get())) {
+      // the clauses are pairs of expressions, not calls
+      return map_children(expr, [&](const ExprPtr &clause) {
+        return map_children(clause,
+                            [&](const ExprPtr &e) { return optimize(e); });
+      });
+    } else if (dynamic_cast<IfExpr *>(expr.get())) {
+      auto result =
+          map_children(expr, [&](const ExprPtr &e) { return optimize(e); });
+      return fold_if(result);
+    }
+    return map_children(expr, [&](const ExprPtr &e) { return optimize(e); });
+  }
+
+private:
+  void add_candidate(const std::string &name, std::vector<Symbol> params,
+                     const ExprPtr &body) {
+    if (size(body.get()) > MAX_INLINE_SIZE || mentions(body.get(), name)) {
+      return;
+    }
+    candidates[name] = Candidate{std::move(params), body};
+    frozen.insert(body.get());
+  }
+
+  bool pure_builtin(const std::string &name) const {
+    return bindings.times_bound(name) == 0 && !bindings.bound_in_env(name) &&
+           PURE_BUILTINS.contains(name);
+  }
+
+  // Lambdas see the arguments of their caller, a body is only evaluated
+  // without binding its arguments when it cannot call one.
+  bool calls_only_pure_builtins(Expr *expr) const {
+    if (auto call = dynamic_cast<ListExpr *>(expr)) {
+      if (call->expressions.empty()) {
+        return true;
+      }
+      auto head = dynamic_cast<SymbolExpr *>(call->expressions[0].get());
+      if (head == nullptr || !pure_builtin(head->symbol.name)) {
+        return false;
+      }
+    }
+    bool result = true;
+    auto check = [&](Expr *child) {
+      result = result && calls_only_pure_builtins(child);
+    };
+    if (auto cond = dynamic_cast<CondExpr *>(expr)) {
+      for (const auto &clause : cond->expressions) {
+        for_each_child(clause.get(), check);
+      }
+    } else {
+      for_each_child(expr, check);
+    }
+    return result;
+  }
+
+  // a name never bound by the program to a constant of env, e.g. true or nil
+  ExprPtr optimize_symbol(const ExprPtr &expr, const std::string &name) {
+    if (bindings.times_bound(name) > 0 || !bindings.bound_in_env(name)) {
+      return expr;
+    }
+    const auto &value = bindings.env.bindings.at(name);
+    if (std::holds_alternative<Nil>(value) ||
+        std::holds_alternative<Boolean>(value) ||
+        std::holds_alternative<Number>(value) ||
+        std::holds_alternative<String>(value)) {
+      return constant_expr(value);
+    }
+    return expr;
+  }
+
+  ExprPtr optimize_call(const ExprPtr &expr, ListExpr &call) {
+    if (call.expressions.empty()) {
+      return expr;
+    }
+    auto head = dynamic_cast<SymbolExpr *>(call.expressions[0].get());
+    auto result = map_children(expr, [&](const ExprPtr &e) {
+      // the operator is looked up, not replaced by its value
+      return e.get() == head ? e : optimize(e);
+    });
+    if (head == nullptr) {
+      return result;
+    }
+
+    const auto &name = head->symbol.name;
+    auto &optimized = dynamic_cast<ListExpr &>(*result);
+    ExprList args(optimized.expressions.begin() + 1,
+                  optimized.expressions.end());
+
+    auto candidate = candidates.find(name);
+    if (candidate != candidates.end() &&
+        candidate->second.params.size() == args.size() &&
+        inlining.size() < MAX_INLINE_DEPTH &&
+        std::find(inlining.begin(), inlining.end(), name) == inlining.end()) {
+      return inline_call(name, candidate->second, args, result);
+    }
+
+    if (pure_builtin(name)) {
+      return fold_call(name, args, result);
+    }
+    return result;
+  }
+
+  ExprPtr inline_call(const std::string &name, const Candidate &candidate,
+                      const ExprList &args, const ExprPtr &call) {
+    inlining.push_back(name);
+    ExprPtr inlined;
+    bool in_place = substitutable(candidate.body.get()) &&
+                    calls_only_pure_builtins(candidate.body.get());
+    auto all_trivial =
+        std::all_of(args.begin(), args.end(),
+                    [](const ExprPtr &e) { return trivial(e.get()); });
+    if (in_place && all_trivial) {
+      // the constant arguments propagate in the body
+      std::unordered_map<std::string, ExprPtr> values;
+      for (int i = 0; i < args.size(); ++i) {
+        values[candidate.params[i].name] = args[i];
+      }
+      inlined = optimize(substitute(candidate.body, values));
+    } else {
+      auto inline_expr = std::make_shared<InlineExpr>(
+          candidate.params, args, optimize(candidate.body));
+      inline_expr->in_place = in_place;
+      inlined = inline_expr;
+    }
+    inlining.pop_back();
+    return std::make_shared<InlinedCallExpr>(name, candidate.body, inlined,
+                                             call);
+  }
+
+  ExprPtr fold_call(const std::string &name, const ExprList &args,
+                    const ExprPtr &call) {
+    std::vector<Result> values;
+    for (const auto &arg : args) {
+      auto value = constant(arg.get());
+      if (!value) {
+        return call;
+      }
+      values.push_back(std::move(*value));
+    }
+    try {
+      Env scratch;
+      return constant_expr(find_builtin(name)->fn(values, scratch));
+    } catch (std::runtime_error &) {
+      // reported when evaluated
+      return call;
+    }
+  }
+
+  ExprPtr fold_if(const ExprPtr &expr) {
+    auto &e = dynamic_cast<IfExpr &>(*expr);
+    auto condition = constant(e.expressions[0].get());
+    if (!condition) {
+      return expr;
+    }
+    try {
+      return is_true(*condition) ? e.expressions[1] : e.expressions[2];
+    } catch (std::runtime_error &) {
+      return expr;
+    }
+  }
+
+  ProgramBindings bindings;
+  std::unordered_map<std::string, Candidate> candidates;
+  // the bodies of the candidates, kept as they are
+  std::unordered_set<Expr *> frozen;
+  // the names whose body is being inlined, innermost last
+  std::vector<std::string> inlining;
+};
+
+} // namespace
+
+void optimize_program(ExprList &program, const Env &env) {
+  Optimizer optimizer(program, env);
+  for (auto &expr : program) {
+    expr = optimizer.optimize(expr);
+  }
+}
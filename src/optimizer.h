@@ -0,0 +1,14 @@
+#pragma once
+
+#include "ast.h"
+
+// Rewrites a whole program before it is evaluated:
+// - calls to small, non-recursive lambdas bound by a 'define' (of the program
+//   or of `env`) are replaced by the body of the lambda, guarded by a check
+//   that the name is still bound to it (see InlinedCallExpr). When the
+//   arguments are literals or names they are substituted in the body.
+// - calls to pure builtins with constant arguments are evaluated, as well as
+//   the 'if' whose condition becomes constant.
+// Expressions shared with `env` are never modified, the rewritten parts are
+// copies.
+void optimize_program(ExprList &program, const Env &env);
@@ -0,0 +1,44 @@
+#include "output.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+FdSink::~FdSink() {
+  try {
+    flush();
+  } catch (std::runtime_error &) {
+    // nothing sensible to do with a failed write while unwinding
+  }
+}
+
+void FdSink::write_through(std::string_view data) {
+  while (!data.empty()) {
+    auto n = ::write(fd, data.data(), data.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Cannot write to " + name + ": " +
+                               std::strerror(errno));
+    }
+    data.remove_prefix(n);
+  }
+}
+
+FdSink &stdout_sink() {
+  static FdSink sink(1, "<stdout>",
+                     isatty(1) ? Buffering::Line : Buffering::Full);
+  return sink;
+}
+
+std::recursive_mutex &stdout_mutex() {
+  static std::recursive_mutex mutex;
+  return mutex;
+}
+
+void set_stdout_buffering(Buffering buffering) {
+  stdout_sink().flush();
+  stdout_sink().buffering = buffering;
+}
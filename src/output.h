@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Buffered output. Values are printed straight into a sink, which only hands
+// its buffer to the underlying file once it is full (or on newlines, for
+// line-buffered sinks).
+class Sink {
+public:
+  explicit Sink(std::size_t capacity) : capacity(capacity) {}
+  virtual ~Sink() = default;
+
+  void write(std::string_view data) {
+    if (buffer.size() + data.size() > capacity) {
+      drain();
+      if (data.size() >= capacity) {
+        write_through(data);
+        return;
+      }
+    }
+    buffer.append(data);
+  }
+
+  void put(char c) {
+    if (buffer.size() == capacity) {
+      drain();
+    }
+    buffer.push_back(c);
+  }
+
+  // called by printers after each complete write
+  virtual void sync(bool line_ended) {}
+  virtual void flush() { drain(); }
+
+protected:
+  // empties the buffer into the underlying file
+  void drain() {
+    write_through(buffer);
+    buffer.clear();
+  }
+  virtual void write_through(std::string_view data) = 0;
+
+  std::string buffer;
+  std::size_t capacity;
+};
+
+enum class Buffering { None, Line, Full };
+
+class FdSink : public Sink {
+public:
+  FdSink(int fd, std::string name, Buffering buffering,
+         std::size_t capacity = 1 << 16)
+      : Sink(capacity), buffering(buffering), fd(fd), name(std::move(name)) {
+    buffer.reserve(capacity);
+  }
+  ~FdSink() override;
+
+  void sync(bool line_ended) override {
+    if (buffering == Buffering::None ||
+        (buffering == Buffering::Line && line_ended)) {
+      flush();
+    }
+  }
+
+  Buffering buffering;
+
+protected:
+  void write_through(std::string_view data) override;
+
+private:
+  int fd;
+  std::string name;
+};
+
+class StringSink : public Sink {
+public:
+  StringSink() : Sink(std::string().max_size()) {}
+
+  std::string &str() { return buffer; }
+
+protected:
+  void write_through(std::string_view) override {}
+};
+
+// stdout is line-buffered when attached to a terminal, fully buffered
+// otherwise
+FdSink &stdout_sink();
+// held by the builtins writing to stdout_sink(), processes run concurrently
+std::recursive_mutex &stdout_mutex();
+void set_stdout_buffering(Buffering buffering);
@@ -1,23 +1,42 @@
 #include "parser.h"
+#include "bignum.h"
+#include "memory.h"
 #include "utility.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <iostream>
+#include <optional>
 
-ExprPtr atom(const std::string &token) {
+// an integer with more digits than a double keeps exactly
+bool long_integer(const std::string &token) {
+  auto digits = token.size() - (token[0] == '-' || token[0] == '+');
+  return digits > 15 &&
+         std::all_of(token.end() - digits, token.end(), [](unsigned char c) {
+           return std::isdigit(c);
+         });
+}
+
+Result atom(const std::string &token) {
+  if (long_integer(token)) {
+    return parse_integer(token);
+  }
   try {
-    return std::make_shared<LiteralExpr<Number>>(std::stod(token));
+    return std::stod(token);
   } catch (std::invalid_argument &) {
-    return std::make_shared<SymbolExpr>(Symbol{token});
+    return Symbol{token};
   }
 }
 
-std::shared_ptr<LetExpr> parse_let(const ExprList &expressions) {
+LetExpr::Bindings parse_bindings(const ExprList &expressions,
+                                 const std::string &form) {
   if (expressions.size() < 2) {
-    throw SyntaxError("Requires two arguments for 'let'");
+    throw SyntaxError("Requires two arguments for '" + form + "'");
   }
 
   auto vars = dynamic_cast<ListExpr *>(expressions[0].get());
   if (vars == nullptr) {
-    throw SyntaxError("First argument of 'let' should be a list");
+    throw SyntaxError("First argument of '" + form + "' should be a list");
   }
 
   LetExpr::Bindings bindings;
@@ -28,16 +47,149 @@ std::shared_ptr<LetExpr> parse_let(const ExprList &expressions) {
     }
 
     if (i >= vars->expressions.size() - 1) {
-      throw SyntaxError("No value after 'let' variable: " +
-                        symbol->symbol.name);
+      throw SyntaxError("No value after '" + form +
+                        "' variable: " + symbol->symbol.name);
     }
     bindings.emplace_back(symbol->symbol, vars->expressions[i + 1]);
   }
+  return bindings;
+}
 
+std::shared_ptr<LetExpr> parse_let(const ExprList &expressions) {
+  auto bindings = parse_bindings(expressions, "let");
   auto body = expressions[1];
   return std::make_shared<LetExpr>(bindings, body);
 }
 
+// Appends an encoding of `value` that differs for any two values of
+// different types or contents, false when it is not plain data.
+bool constant_key(const Result &value, std::string &key) {
+  auto sized = [&](char tag, const std::string &s) {
+    key += tag;
+    key += std::to_string(s.size());
+    key += ':';
+    key += s;
+  };
+  if (std::holds_alternative<Nil>(value)) {
+    key += 'z';
+  } else if (auto b = std::get_if<Boolean>(&value)) {
+    key += *b ? 't' : 'f';
+  } else if (auto n = std::get_if<Number>(&value)) {
+    // the bits, 0 and -0 are different constants
+    char bytes[sizeof(Number)];
+    std::memcpy(bytes, n, sizeof(Number));
+    key += 'n';
+    key.append(bytes, sizeof(Number));
+  } else if (auto b = std::get_if<BigInt>(&value)) {
+    sized('i', to_decimal(*b));
+  } else if (auto s = std::get_if<String>(&value)) {
+    sized('s', *s);
+  } else if (auto s = std::get_if<Symbol>(&value)) {
+    sized('y', s->name);
+  } else if (auto l = std::get_if<List>(&value)) {
+    key += '(';
+    for (const auto &item : l->list) {
+      if (!constant_key(item, key)) {
+        return false;
+      }
+    }
+    key += ')';
+  } else {
+    return false;
+  }
+  return true;
+}
+
+Result ConstantPool::intern(Result value) {
+  std::string key;
+  if (!constant_key(value, key)) {
+    return value;
+  }
+  return values.try_emplace(std::move(key), std::move(value)).first->second;
+}
+
+// the value of a literal, quote or constant call
+std::optional<Result> constant_value(Expr *expr) {
+  if (auto e = dynamic_cast<LiteralExpr<Number> *>(expr)) {
+    return e->value;
+  } else if (auto e = dynamic_cast<LiteralExpr<String> *>(expr)) {
+    return e->value;
+  } else if (auto e = dynamic_cast<QuoteExpr *>(expr)) {
+    return e->value;
+  } else if (auto e = dynamic_cast<ConstantExpr *>(expr)) {
+    return e->value;
+  }
+  return std::nullopt;
+}
+
+// 'recur' is only allowed in tail position of the innermost 'loop', so
+// rebinding the loop variables is the last thing an iteration does
+void check_recur(const ExprPtr &expr, bool tail, std::size_t arity) {
+  auto e = expr.get();
+  if (auto recur = dynamic_cast<RecurExpr *>(e)) {
+    if (!tail) {
+      throw SyntaxError("'recur' must be in tail position of a 'loop'");
+    }
+    if (recur->expressions.size() != arity) {
+      throw SyntaxError("'recur' expects " + std::to_string(arity) +
+                        " arguments");
+    }
+    for (const auto &arg : recur->expressions) {
+      check_recur(arg, false, arity);
+    }
+  } else if (auto loop = dynamic_cast<LoopExpr *>(e)) {
+    // the body was checked against its own loop when parsed
+    for (const auto &pair : loop->vars) {
+      check_recur(pair.second, false, arity);
+    }
+  } else if (auto if_expr = dynamic_cast<IfExpr *>(e)) {
+    for (int i = 0; i < if_expr->expressions.size(); ++i) {
+      check_recur(if_expr->expressions[i], tail && (i == 1 || i == 2), arity);
+    }
+  } else if (auto do_expr = dynamic_cast<DoExpr *>(e)) {
+    for (int i = 0; i < do_expr->expressions.size(); ++i) {
+      check_recur(do_expr->expressions[i],
+                  tail && i == do_expr->expressions.size() - 1, arity);
+    }
+  } else if (auto cond = dynamic_cast<CondExpr *>(e)) {
+    for (const auto &clause : cond->expressions) {
+      if (auto pair = dynamic_cast<ListExpr *>(clause.get())) {
+        for (int i = 0; i < pair->expressions.size(); ++i) {
+          check_recur(pair->expressions[i], tail && i == 1, arity);
+        }
+      }
+    }
+  } else if (auto let = dynamic_cast<LetExpr *>(e)) {
+    for (const auto &pair : let->vars) {
+      check_recur(pair.second, false, arity);
+    }
+    check_recur(let->expr, tail, arity);
+  } else if (auto define = dynamic_cast<DefineExpr *>(e)) {
+    check_recur(define->expr, false, arity);
+  } else if (auto lambda = dynamic_cast<LambdaExpr *>(e)) {
+    check_recur(lambda->body, false, arity);
+  } else if (auto list = dynamic_cast<ListExpr *>(e)) {
+    for (const auto &expr : list->expressions) {
+      check_recur(expr, false, arity);
+    }
+  } else if (auto and_expr = dynamic_cast<AndExpr *>(e)) {
+    for (const auto &expr : and_expr->exprs) {
+      check_recur(expr, false, arity);
+    }
+  } else if (auto or_expr = dynamic_cast<OrExpr *>(e)) {
+    for (const auto &expr : or_expr->exprs) {
+      check_recur(expr, false, arity);
+    }
+  }
+}
+
+std::shared_ptr<LoopExpr> parse_loop(const ExprList &expressions) {
+  auto bindings = parse_bindings(expressions, "loop");
+  auto body = expressions[1];
+  check_recur(body, true, bindings.size());
+  return std::make_shared<LoopExpr>(bindings, body);
+}
+
 std::shared_ptr<DefineExpr> parse_define(const ExprList &expressions) {
   if (expressions.size() < 2) {
     throw std::runtime_error("Expected two arguments after 'define'");
@@ -74,6 +226,12 @@ ExprPtr parse_language_construct(SymbolExpr *s, const ExprList &expressions) {
   } else if (s->symbol.name == "let") {
     return parse_let(rest(expressions));
 
+  } else if (s->symbol.name == "loop") {
+    return parse_loop(rest(expressions));
+
+  } else if (s->symbol.name == "recur") {
+    return std::make_shared<RecurExpr>(rest(expressions));
+
   } else if (s->symbol.name == "lambda") {
     return parse_lambda(rest(expressions));
 
@@ -91,56 +249,340 @@ ExprPtr parse_language_construct(SymbolExpr *s, const ExprList &expressions) {
   }
 }
 
-ExprPtr Parser::parse(const Tokens &tokens) {
-  while (current < tokens.size()) {
-    auto token = tokens[current];
-    if (token.type == LEFTPAREN) {
-      current++;
+Result Parser::read(const Tokens &tokens) {
+  if (current >= tokens.size()) {
+    throw IncompleteStatement("Expected expression");
+  }
+
+  const auto &token = tokens[current++];
+  switch (token.type) {
+  case LEFTPAREN: {
+    List list;
+    std::vector<const Token *> starts;
+    while (true) {
       if (current >= tokens.size()) {
-        throw IncompleteStatement("Expected expression after '('");
+        throw IncompleteStatement("Expected ')'");
+      }
+      if (tokens[current].type == RIGHTPAREN) {
+        break;
       }
+      starts.push_back(&tokens[current]);
+      list.list.push_back(read(tokens));
+    }
 
-      ExprList expressions;
-      while (tokens[current].type != RIGHTPAREN) {
-        expressions.push_back(parse(tokens));
+    // go past the RIGHTPAREN
+    current++;
+    // the elements do not move anymore, the list is moved to its parent
+    for (int i = 0; record_positions && i < starts.size(); ++i) {
+      record_position(list.list[i], *starts[i]);
+    }
+    return list;
+  }
 
-        if (current >= tokens.size()) {
-          throw IncompleteStatement("Expected ')'");
-        }
+  case RIGHTPAREN:
+    throw SyntaxError("Unexpected ')'");
+
+  case STRING:
+    return token.val;
+
+  case SYMBOL:
+    return atom(token.val);
+
+  case QUOTE:
+    return read_prefixed("quote", tokens);
+
+  case QUASIQUOTE:
+    return read_prefixed("quasiquote", tokens);
+
+  case UNQUOTE:
+    return read_prefixed("unquote", tokens);
+
+  case UNQUOTE_SPLICING:
+    return read_prefixed("unquote-splicing", tokens);
+  }
+  throw SyntaxError("Unknown token");
+}
+
+// 'x is read as (quote x)
+Result Parser::read_prefixed(const char *name, const Tokens &tokens) {
+  if (current >= tokens.size()) {
+    throw IncompleteStatement("Expected expression");
+  }
+  const auto &start = tokens[current];
+  List list;
+  list.list.reserve(2);
+  list.list.push_back(Symbol{name});
+  // moved rather than copied, the positions of its elements stay valid
+  list.list.push_back(read(tokens));
+  if (record_positions) {
+    record_position(list.list[1], start);
+  }
+  return list;
+}
+
+void Parser::record_position(const Result &datum, const Token &start) {
+  positions[&datum] = {start.line, start.column};
+}
+
+// the symbol at the head of a list, if any
+const Symbol *head_symbol(const Result &datum) {
+  if (auto list = std::get_if<List>(&datum)) {
+    if (!list->list.empty()) {
+      return std::get_if<Symbol>(&list->list[0]);
+    }
+  }
+  return nullptr;
+}
+
+ExprPtr Parser::analyze(const Result &datum) {
+  auto expr = analyze_datum(datum);
+  if (record_positions) {
+    if (auto it = positions.find(&datum); it != positions.end()) {
+      expr->line = it->second.first;
+      expr->column = it->second.second;
+    }
+  }
+  return expr;
+}
+
+ExprPtr Parser::analyze_datum(const Result &datum) {
+  if (auto n = std::get_if<Number>(&datum)) {
+    return std::make_shared<LiteralExpr<Number>>(*n);
+  } else if (auto s = std::get_if<String>(&datum)) {
+    return std::make_shared<LiteralExpr<String>>(*s);
+  } else if (auto symbol = std::get_if<Symbol>(&datum)) {
+    return std::make_shared<SymbolExpr>(*symbol);
+  }
+
+  auto list = std::get_if<List>(&datum);
+  if (list == nullptr) {
+    // any other value, inserted in the code by a macro
+    return std::make_shared<QuoteExpr>(datum);
+  }
+  if (list->list.empty()) {
+    return std::make_shared<ListExpr>();
+  }
+
+  if (auto head = head_symbol(datum)) {
+    if (head->name == "quote") {
+      if (list->list.size() != 2) {
+        throw SyntaxError("Expected one argument for 'quote'");
       }
+      return std::make_shared<QuoteExpr>(constants.intern(list->list[1]));
 
-      // go past the RIGHTPAREN
-      current++;
-
-      if (expressions.empty()) {
-        return std::make_shared<ListExpr>();
-      } else {
-        auto s = dynamic_cast<SymbolExpr *>(expressions[0].get());
-        if (s != nullptr) {
-          return parse_language_construct(s, expressions);
-        } else {
-          return std::make_shared<ListExpr>(expressions);
-        }
+    } else if (head->name == "quasiquote") {
+      if (list->list.size() != 2) {
+        throw SyntaxError("Expected one argument for 'quasiquote'");
+      }
+      return quasiquote(list->list[1], 1);
+
+    } else if (head->name == "defmacro") {
+      return define_macro(*list);
+
+    } else if (auto macro = find_macro(head->name)) {
+      // expanded once, the resulting code is analyzed like any other
+      std::vector<Result> args(list->list.begin() + 1, list->list.end());
+      return analyze(apply_lambda(*macro, *env, args));
+    }
+  }
+
+  ExprList expressions;
+  expressions.reserve(list->list.size());
+  for (const auto &item : list->list) {
+    expressions.push_back(analyze(item));
+  }
+
+  auto s = dynamic_cast<SymbolExpr *>(expressions[0].get());
+  if (s != nullptr) {
+    if (auto constant = hoist_constant(expressions)) {
+      return constant;
+    }
+    return parse_language_construct(s, expressions);
+  } else {
+    return std::make_shared<ListExpr>(expressions);
+  }
+}
+
+ExprPtr Parser::quasiquote(const Result &datum, int depth) {
+  auto list = std::get_if<List>(&datum);
+  if (list == nullptr || list->list.empty()) {
+    return std::make_shared<QuoteExpr>(datum);
+  }
+
+  auto head = head_symbol(datum);
+  int inner_depth = depth;
+  if (head != nullptr && list->list.size() == 2) {
+    if (head->name == "unquote") {
+      if (depth == 1) {
+        return analyze(list->list[1]);
       }
+      inner_depth = depth - 1;
+    } else if (head->name == "unquote-splicing") {
+      inner_depth = depth - 1;
+    } else if (head->name == "quasiquote") {
+      inner_depth = depth + 1;
+    }
+  }
 
-    } else if (token.type == RIGHTPAREN) {
-      throw std::runtime_error("Unexpected ')'");
+  QuasiquoteExpr::Parts parts;
+  for (const auto &item : list->list) {
+    auto item_head = head_symbol(item);
+    if (depth == 1 && item_head != nullptr &&
+        item_head->name == "unquote-splicing") {
+      auto &spliced = std::get<List>(item).list;
+      if (spliced.size() != 2) {
+        throw SyntaxError("Expected one argument for 'unquote-splicing'");
+      }
+      parts.emplace_back(true, analyze(spliced[1]));
+    } else {
+      parts.emplace_back(false, quasiquote(item, inner_depth));
+    }
+  }
+  return std::make_shared<QuasiquoteExpr>(std::move(parts));
+}
 
-    } else if (token.type == STRING) {
-      current++;
-      return std::make_shared<LiteralExpr<String>>(token.val);
+ExprPtr Parser::define_macro(const List &form) {
+  // (defmacro name (args...) body)
+  if (env == nullptr) {
+    throw SyntaxError("'defmacro' requires an environment");
+  }
+  if (form.list.size() != 4) {
+    throw SyntaxError("Expected name, arguments and body for 'defmacro'");
+  }
+  auto name = std::get_if<Symbol>(&form.list[1]);
+  auto params = std::get_if<List>(&form.list[2]);
+  if (name == nullptr || params == nullptr) {
+    throw SyntaxError("Expected name, arguments and body for 'defmacro'");
+  }
 
+  ListExpr args;
+  for (const auto &param : params->list) {
+    if (auto symbol = std::get_if<Symbol>(&param)) {
+      args.expressions.push_back(std::make_shared<SymbolExpr>(*symbol));
     } else {
-      current++;
-      return atom(token.val);
+      throw SyntaxError("Macro argument is not a symbol");
     }
   }
+
+  auto macro = LambdaExpr(args, analyze(form.list[3])).evaluate(*env);
+  std::get<Lambda>(macro).macro = true;
+  (*env)[name->name] = macro;
+  return std::make_shared<LiteralExpr<Nil>>(Nil{});
+}
+
+// (list 1 2 3) is built once, the expression then evaluates to a copy
+// sharing its elements
+ExprPtr Parser::hoist_constant(const ExprList &expressions) {
+  auto head = dynamic_cast<SymbolExpr *>(expressions[0].get());
+  if (head == nullptr || head->symbol.name != "list" ||
+      (env != nullptr && env->get("list") != nullptr)) {
+    return nullptr;
+  }
+  List list;
+  list.list.reserve(expressions.size() - 1);
+  for (int i = 1; i < expressions.size(); ++i) {
+    auto value = constant_value(expressions[i].get());
+    if (!value) {
+      return nullptr;
+    }
+    list.list.push_back(std::move(*value));
+  }
+  return std::make_shared<ConstantExpr>(
+      "list", constants.intern(std::move(list)),
+      std::make_shared<ListExpr>(expressions));
+}
+
+const Lambda *Parser::find_macro(const std::string &name) const {
+  if (env == nullptr) {
+    return nullptr;
+  }
+  if (auto value = env->get(name)) {
+    if (auto lambda = std::get_if<Lambda>(value); lambda && lambda->macro) {
+      return lambda;
+    }
+  }
+  return nullptr;
+}
+
+ExprPtr Parser::parse(const Tokens &tokens) {
+  MemoryScope scope(MemoryCategory::Ast);
+  // left by a previous parse that failed
+  positions.clear();
+  auto start = current < tokens.size() ? &tokens[current] : nullptr;
+  auto datum = read(tokens);
+  if (record_positions) {
+    record_position(datum, *start);
+  }
+  auto expr = analyze(datum);
+  positions.clear();
+  // rejects any 'recur' that is not inside a 'loop'
+  check_recur(expr, false, 0);
+  return expr;
 }
 
 ExprList Parser::parse_all(const Tokens &tokens) {
   ExprList exprs;
-  while (current < tokens.size()) {
+  while (!done(tokens)) {
     exprs.push_back(parse(tokens));
   }
   return exprs;
 }
+
+void IncrementalParser::feed(const std::string &input) {
+  auto start = pending.size();
+  try {
+    tokenizer.feed(input, pending);
+  } catch (const std::runtime_error &) {
+    reset();
+    throw;
+  }
+
+  // only the new tokens are scanned to find where top-level expressions end
+  std::size_t form_start = 0;
+  for (auto i = start; i < pending.size(); ++i) {
+    if (pending[i].type == LEFTPAREN) {
+      depth++;
+    } else if (pending[i].type == RIGHTPAREN) {
+      if (depth == 0) {
+        reset();
+        throw SyntaxError("Unexpected ')'");
+      }
+      depth--;
+    }
+
+    if (depth == 0 && !is_prefix(pending[i].type)) {
+      ready.emplace_back(std::make_move_iterator(pending.begin() + form_start),
+                         std::make_move_iterator(pending.begin() + i + 1));
+      form_start = i + 1;
+    }
+  }
+  pending.erase(pending.begin(), pending.begin() + form_start);
+}
+
+ExprPtr IncrementalParser::next() {
+  if (ready.empty()) {
+    return nullptr;
+  }
+  // parsed only now, so that macros defined by the previous expressions are
+  // expanded
+  auto form = std::move(ready.front());
+  ready.pop_front();
+  try {
+    return Parser(env).parse(form);
+  } catch (const std::runtime_error &) {
+    // the expressions after it are dropped with the partial input
+    reset();
+    throw;
+  }
+}
+
+bool IncrementalParser::complete() const {
+  return pending.empty() && !tokenizer.in_token();
+}
+
+void IncrementalParser::reset() {
+  tokenizer = Tokenizer();
+  pending.clear();
+  depth = 0;
+  ready.clear();
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <deque>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -16,13 +20,76 @@ public:
 
 
 
+// The constant data of a program, built once by the parser: equal constants
+// share a single value, e.g. the lists of '(1 2) and (list 1 2).
+class ConstantPool {
+public:
+  // the pooled value equal to `value`, `value` itself the first time
+  Result intern(Result value);
+  std::size_t size() const { return values.size(); }
+
+private:
+  // by an exact encoding of the value
+  std::unordered_map<std::string, Result> values;
+};
+
 class Parser {
 private:
   int current;
+  // where macros are defined and expanded from, if any
+  Env *env;
+
+  // where each datum being read starts, when recording positions
+  std::unordered_map<const Result *, std::pair<std::uint32_t, std::uint32_t>>
+      positions;
+
+  ExprPtr analyze_datum(const Result &datum);
+  Result read_prefixed(const char *name, const Tokens &tokens);
+  void record_position(const Result &datum, const Token &start);
+  ExprPtr quasiquote(const Result &datum, int depth);
+  ExprPtr define_macro(const List &form);
+  ExprPtr hoist_constant(const ExprList &expressions);
+  const Lambda *find_macro(const std::string &name) const;
 
 public:
-  Parser() : current(0) {}
+  explicit Parser(Env *env = nullptr) : current(0), env(env) {}
+
+  // sets the line and column of the expressions parsed from the source
+  bool record_positions = false;
+  // the quoted data and constant lists of what it parsed
+  ConstantPool constants;
 
   ExprPtr parse(const Tokens &tokens);
   std::vector<ExprPtr> parse_all(const Tokens &tokens);
+  bool done(const Tokens &tokens) const { return current >= tokens.size(); }
+
+  // reads the next expression as data (lists, symbols, numbers, strings)
+  Result read(const Tokens &tokens);
+  // turns data into an expression, expanding macros
+  ExprPtr analyze(const Result &datum);
+};
+
+// Parses a program fed piece by piece, e.g. line by line in the REPL. Only
+// the new input is tokenized, and each top-level expression is parsed once,
+// as soon as it is closed.
+class IncrementalParser {
+public:
+  explicit IncrementalParser(Env *env = nullptr) : env(env) {}
+
+  // feed and next reset the parser when they throw a syntax error
+  void feed(const std::string &input);
+  // next complete top-level expression, nullptr when there is none
+  ExprPtr next();
+  // true when no expression is partially entered
+  bool complete() const;
+  // drops the partial input and the expressions not parsed yet
+  void reset();
+
+private:
+  Env *env;
+  Tokenizer tokenizer;
+  Tokens pending;
+  int depth = 0;
+  // complete top-level expressions, not parsed yet
+  std::deque<Tokens> ready;
 };
@@ -0,0 +1,147 @@
+#include "program.h"
+
+#include "parser.h"
+
+#include <functional>
+#include <string_view>
+
+namespace {
+
+// the macros of `after` that `before` does not have
+std::vector<std::pair<std::string, Lambda>>
+new_macros(const Env &before, const Env &after) {
+  std::vector<std::pair<std::string, Lambda>> macros;
+  for (const auto &[name, value] : after.bindings) {
+    auto macro = std::get_if<Lambda>(&value);
+    if (macro == nullptr || !macro->macro) {
+      continue;
+    }
+    auto previous = before.bindings.find(name);
+    if (previous == before.bindings.end() ||
+        !std::holds_alternative<Lambda>(previous->second) ||
+        std::get<Lambda>(previous->second).body != macro->body) {
+      macros.emplace_back(name, *macro);
+    }
+  }
+  return macros;
+}
+
+} // namespace
+
+ProgramHandle compile_program(const std::string &source, const Env &env) {
+  // macros are expanded in a copy, the program can define its own
+  Env macros = env;
+  auto program = std::make_shared<CompiledProgram>();
+  program->source = source;
+  program->forms = Parser(&macros).parse_all(tokenize(source));
+  program->macros = new_macros(env, macros);
+  return program;
+}
+
+ProgramHandle compile_and_run(const std::string &source, Env &env,
+                              Result &result) {
+  // only the macros are compared afterwards
+  Env before;
+  for (const auto &[name, value] : env.bindings) {
+    if (auto macro = std::get_if<Lambda>(&value); macro && macro->macro) {
+      before[name] = value;
+    }
+  }
+  auto program = std::make_shared<CompiledProgram>();
+  program->source = source;
+  auto tokens = tokenize(source);
+  Parser parser(&env);
+  result = Nil{};
+  while (!parser.done(tokens)) {
+    program->forms.push_back(parser.parse(tokens));
+    result = program->forms.back()->evaluate(env);
+  }
+  program->macros = new_macros(before, env);
+  return program;
+}
+
+Result run(const ProgramHandle &program, Env &env) {
+  for (const auto &[name, macro] : program->macros) {
+    env[name] = macro;
+  }
+  Result res;
+  for (const auto &form : program->forms) {
+    res = form->evaluate(env);
+  }
+  return res;
+}
+
+ProgramHandle ProgramCache::get(const std::string &source) {
+  if (auto program = find(source)) {
+    return program;
+  }
+  // parsed without the lock, another thread may add the same program
+  // meanwhile, both copies are equivalent
+  auto program = compile_program(source);
+  insert(program);
+  return program;
+}
+
+ProgramHandle ProgramCache::find(const std::string &source) {
+  auto hash = std::hash<std::string_view>()(source);
+  std::lock_guard lock(mutex);
+  auto [first, last] = index.equal_range(hash);
+  for (auto it = first; it != last; ++it) {
+    if ((*it->second)->source == source) {
+      hit_count++;
+      entries.splice(entries.begin(), entries, it->second);
+      return entries.front();
+    }
+  }
+  miss_count++;
+  return nullptr;
+}
+
+void ProgramCache::insert(ProgramHandle program) {
+  auto hash = std::hash<std::string_view>()(program->source);
+  std::lock_guard lock(mutex);
+  entries.push_front(std::move(program));
+  index.emplace(hash, entries.begin());
+  if (entries.size() > capacity) {
+    auto oldest = std::prev(entries.end());
+    auto [first, last] =
+        index.equal_range(std::hash<std::string_view>()((*oldest)->source));
+    for (auto it = first; it != last; ++it) {
+      if (it->second == oldest) {
+        index.erase(it);
+        break;
+      }
+    }
+    entries.erase(oldest);
+  }
+}
+
+std::size_t ProgramCache::size() const {
+  std::lock_guard lock(mutex);
+  return entries.size();
+}
+
+std::size_t ProgramCache::hits() const {
+  std::lock_guard lock(mutex);
+  return hit_count;
+}
+
+std::size_t ProgramCache::misses() const {
+  std::lock_guard lock(mutex);
+  return miss_count;
+}
+
+ProgramCache &program_cache() {
+  static ProgramCache cache;
+  return cache;
+}
+
+Result eval_cached(const std::string &program, Env &env) {
+  auto &cache = program_cache();
+  if (auto compiled = cache.find(program)) {
+    return run(compiled, env);
+  }
+  Result result;
+  cache.insert(compile_and_run(program, env, result));
+  return result;
+}
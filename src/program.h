@@ -0,0 +1,82 @@
+#pragma once
+
+#include "ast.h"
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A program parsed once and evaluated by run() any number of times, on any
+// environments and threads: evaluating it never modifies its expressions.
+//
+//   auto rule = compile_program("(> (get input \"size\") 10)");
+//   for (auto &input : inputs) {
+//     Env env;
+//     env["input"] = input;
+//     run(rule, env);
+//   }
+//
+// Macros are expanded when compiling, with the ones the program defines and
+// the ones of the `env` given to compile_program(). The program's macros are
+// defined in the environments it runs on, before its forms are evaluated.
+// As nothing is evaluated while compiling, a macro cannot call a function the
+// program defines: compile_and_run() can, like eval_with_env().
+struct CompiledProgram {
+  std::string source;
+  ExprList forms;
+  std::vector<std::pair<std::string, Lambda>> macros;
+};
+
+using ProgramHandle = std::shared_ptr<const CompiledProgram>;
+
+ProgramHandle compile_program(const std::string &source,
+                              const Env &env = Env());
+// evaluates the forms in order, returns the value of the last one
+Result run(const ProgramHandle &program, Env &env);
+// compiles the program while evaluating it on `env`, each form once the
+// previous ones are evaluated, with the macros of `env`; `result` is the
+// value of the last form
+ProgramHandle compile_and_run(const std::string &source, Env &env,
+                              Result &result);
+
+// The programs compiled last, by source. A program submitted again is
+// returned without being parsed, after hashing and comparing its source. Safe
+// to share between threads.
+class ProgramCache {
+public:
+  explicit ProgramCache(std::size_t capacity = 256) : capacity(capacity) {}
+
+  // compiled without the macros of any env
+  ProgramHandle get(const std::string &source);
+  // the cached program, or nullptr
+  ProgramHandle find(const std::string &source);
+  void insert(ProgramHandle program);
+
+  std::size_t size() const;
+  std::size_t hits() const;
+  std::size_t misses() const;
+
+private:
+  using Entries = std::list<ProgramHandle>;
+
+  const std::size_t capacity;
+  mutable std::mutex mutex;
+  // most recently used first
+  Entries entries;
+  // by hash of the source, colliding sources are chained
+  std::unordered_multimap<std::size_t, Entries::iterator> index;
+  std::size_t hit_count = 0;
+  std::size_t miss_count = 0;
+};
+
+// the cache of eval_cached()
+ProgramCache &program_cache();
+// eval_with_env() for programs evaluated repeatedly: they are parsed once and
+// kept in program_cache(). The first evaluation compiles them with
+// compile_and_run(), the macros are expanded as they were then.
+Result eval_cached(const std::string &program, Env &env);
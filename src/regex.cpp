@@ -0,0 +1,731 @@
+#include "regex.h"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cctype>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+constexpr int UNBOUNDED = -1;
+// the largest count of a repetition, and the largest automata
+constexpr int MAX_REPEAT = 1000;
+constexpr std::size_t MAX_NFA_STATES = 100000;
+// the cached DFA states are dropped when there are more, 1KB each
+constexpr std::size_t MAX_DFA_STATES = 4096;
+
+// the syntax tree of a pattern
+struct Node {
+  enum class Kind { Bytes, Concat, Alternate, Repeat, Begin, End };
+
+  Kind kind;
+  ByteSet bytes{};
+  std::vector<Node> children{};
+  int min = 0;
+  int max = UNBOUNDED;
+};
+
+ByteSet byte_range(unsigned char low, unsigned char high) {
+  ByteSet set;
+  for (int b = low; b <= high; ++b) {
+    set.set(b);
+  }
+  return set;
+}
+
+ByteSet byte_class(char name) {
+  switch (name) {
+  case 'd':
+    return byte_range('0', '9');
+  case 'w':
+    return byte_range('a', 'z') | byte_range('A', 'Z') |
+           byte_range('0', '9') | byte_range('_', '_');
+  default:
+    return byte_range(' ', ' ') | byte_range('\t', '\r');
+  }
+}
+
+class PatternParser {
+public:
+  explicit PatternParser(const std::string &pattern) : pattern(pattern) {}
+
+  Node parse() {
+    auto node = alternation();
+    if (pos < pattern.size()) {
+      fail("unmatched ')'");
+    }
+    return node;
+  }
+
+private:
+  [[noreturn]] void fail(const std::string &message) const {
+    throw std::runtime_error("Invalid regex \"" + pattern + "\": " + message);
+  }
+
+  bool accept(char c) {
+    if (pos < pattern.size() && pattern[pos] == c) {
+      pos++;
+      return true;
+    }
+    return false;
+  }
+
+  Node alternation() {
+    Node node{Node::Kind::Alternate};
+    node.children.push_back(concatenation());
+    while (accept('|')) {
+      node.children.push_back(concatenation());
+    }
+    if (node.children.size() == 1) {
+      return std::move(node.children[0]);
+    }
+    return node;
+  }
+
+  Node concatenation() {
+    Node node{Node::Kind::Concat};
+    while (pos < pattern.size() && pattern[pos] != '|' &&
+           pattern[pos] != ')') {
+      node.children.push_back(repetition());
+    }
+    return node;
+  }
+
+  Node repetition() {
+    auto node = atom();
+    while (pos < pattern.size()) {
+      int min = 0;
+      int max = UNBOUNDED;
+      if (accept('+')) {
+        min = 1;
+      } else if (accept('?')) {
+        max = 1;
+      } else if (!accept('*') && !counted(min, max)) {
+        break;
+      }
+      Node repeat{Node::Kind::Repeat};
+      repeat.min = min;
+      repeat.max = max;
+      repeat.children.push_back(std::move(node));
+      node = std::move(repeat);
+    }
+    return node;
+  }
+
+  // {n}, {n,} or {n,m}; a '{' starting something else is a literal
+  bool counted(int &min, int &max) {
+    if (pos + 1 >= pattern.size() || pattern[pos] != '{' ||
+        !std::isdigit(static_cast<unsigned char>(pattern[pos + 1]))) {
+      return false;
+    }
+    pos++;
+    min = max = number();
+    if (accept(',')) {
+      max = pos < pattern.size() && pattern[pos] == '}' ? UNBOUNDED : number();
+    }
+    if (!accept('}')) {
+      fail("missing '}'");
+    }
+    if (max != UNBOUNDED && max < min) {
+      fail("invalid repetition");
+    }
+    return true;
+  }
+
+  int number() {
+    int n = 0;
+    auto start = pos;
+    while (pos < pattern.size() &&
+           std::isdigit(static_cast<unsigned char>(pattern[pos]))) {
+      n = n * 10 + (pattern[pos++] - '0');
+      if (n > MAX_REPEAT) {
+        fail("repetition over " + std::to_string(MAX_REPEAT));
+      }
+    }
+    if (pos == start) {
+      fail("invalid repetition");
+    }
+    return n;
+  }
+
+  Node bytes(ByteSet set) {
+    Node node{Node::Kind::Bytes};
+    node.bytes = set;
+    return node;
+  }
+
+  Node atom() {
+    auto c = pattern[pos++];
+    switch (c) {
+    case '(': {
+      if (pattern.compare(pos, 2, "?:") == 0) {
+        pos += 2;
+      }
+      auto node = alternation();
+      if (!accept(')')) {
+        fail("missing ')'");
+      }
+      return node;
+    }
+    case '^':
+      return Node{Node::Kind::Begin};
+    case '$':
+      return Node{Node::Kind::End};
+    case '.':
+      return bytes(~byte_range('\n', '\n'));
+    case '[':
+      return bytes(bracket());
+    case '\\':
+      return bytes(escape());
+    case '*':
+    case '+':
+    case '?':
+      fail("nothing to repeat");
+    default:
+      return bytes(byte_range(c, c));
+    }
+  }
+
+  ByteSet escape() {
+    if (pos >= pattern.size()) {
+      fail("trailing '\\'");
+    }
+    auto c = pattern[pos++];
+    switch (c) {
+    case 'd':
+    case 'w':
+    case 's':
+      return byte_class(c);
+    case 'D':
+    case 'W':
+    case 'S':
+      return ~byte_class(std::tolower(c));
+    case 't':
+      return byte_range('\t', '\t');
+    case 'n':
+      return byte_range('\n', '\n');
+    case 'r':
+      return byte_range('\r', '\r');
+    default:
+      if (std::isalnum(static_cast<unsigned char>(c))) {
+        fail(std::string("unknown escape \\") + c);
+      }
+      return byte_range(c, c);
+    }
+  }
+
+  // a single byte of a class, or the bytes of an escaped class
+  ByteSet class_item() {
+    auto c = pattern[pos++];
+    return c == '\\' ? escape() : byte_range(c, c);
+  }
+
+  static unsigned char only_byte(const ByteSet &set) {
+    int b = 0;
+    while (!set.test(b)) {
+      b++;
+    }
+    return b;
+  }
+
+  // after the '['
+  ByteSet bracket() {
+    bool negated = accept('^');
+    ByteSet set;
+    // a ']' first is a literal
+    bool first = true;
+    while (true) {
+      if (pos >= pattern.size()) {
+        fail("missing ']'");
+      }
+      if (pattern[pos] == ']' && !first) {
+        pos++;
+        break;
+      }
+      first = false;
+      auto low = class_item();
+      if (low.count() == 1 && pos + 1 < pattern.size() &&
+          pattern[pos] == '-' && pattern[pos + 1] != ']') {
+        pos++;
+        auto high = class_item();
+        if (high.count() != 1 || only_byte(high) < only_byte(low)) {
+          fail("invalid range");
+        }
+        set |= byte_range(only_byte(low), only_byte(high));
+      } else {
+        set |= low;
+      }
+    }
+    return negated ? ~set : set;
+  }
+
+  const std::string &pattern;
+  std::size_t pos = 0;
+};
+
+// Thompson's construction: a state reads a byte, or leads to one or two
+// states without reading one, when its assertion holds
+struct NfaState {
+  enum class Kind { Bytes, Split, Begin, End, Match };
+
+  Kind kind;
+  ByteSet bytes{};
+  int out = -1;
+  int alt = -1;
+};
+
+struct Nfa {
+  std::vector<NfaState> states;
+  int start = 0;
+};
+
+// the automaton of the pattern read backwards, for `reverse`
+class NfaBuilder {
+public:
+  explicit NfaBuilder(bool reverse) : reverse(reverse) {}
+
+  Nfa build(const Node &root) {
+    auto match = add({NfaState::Kind::Match});
+    auto start = compile(root, match);
+    return {std::move(states), start};
+  }
+
+private:
+  int add(NfaState state) {
+    if (states.size() >= MAX_NFA_STATES) {
+      throw std::runtime_error("Regex too large");
+    }
+    states.push_back(state);
+    return states.size() - 1;
+  }
+
+  int split(int out, int alt) {
+    return add({NfaState::Kind::Split, {}, out, alt});
+  }
+
+  // the entry of `node`, followed by `next`
+  int compile(const Node &node, int next) {
+    switch (node.kind) {
+    case Node::Kind::Bytes:
+      return add({NfaState::Kind::Bytes, node.bytes, next});
+    case Node::Kind::Begin:
+    case Node::Kind::End: {
+      bool begin = (node.kind == Node::Kind::Begin) != reverse;
+      return add(
+          {begin ? NfaState::Kind::Begin : NfaState::Kind::End, {}, next});
+    }
+    case Node::Kind::Concat:
+      if (reverse) {
+        for (const auto &child : node.children) {
+          next = compile(child, next);
+        }
+      } else {
+        for (auto it = node.children.rbegin(); it != node.children.rend();
+             ++it) {
+          next = compile(*it, next);
+        }
+      }
+      return next;
+    case Node::Kind::Alternate: {
+      std::vector<int> entries;
+      for (const auto &child : node.children) {
+        entries.push_back(compile(child, next));
+      }
+      auto entry = entries.back();
+      for (auto i = entries.size() - 1; i-- > 0;) {
+        entry = split(entries[i], entry);
+      }
+      return entry;
+    }
+    default: {
+      const auto &child = node.children[0];
+      auto tail = next;
+      if (node.max == UNBOUNDED) {
+        tail = split(-1, next);
+        auto body = compile(child, tail);
+        states[tail].out = body;
+      } else {
+        // x{0,2} is (x(x)?)?
+        for (int i = node.min; i < node.max; ++i) {
+          tail = split(compile(child, tail), next);
+        }
+      }
+      for (int i = 0; i < node.min; ++i) {
+        tail = compile(child, tail);
+      }
+      return tail;
+    }
+    }
+  }
+
+  bool reverse;
+  std::vector<NfaState> states;
+};
+
+// A DFA built lazily from an NFA: each state is the set of NFA states the
+// NFA can be in, its transitions are computed once, on the first byte
+// reading them. An unanchored DFA also starts a match at each byte.
+class Dfa {
+public:
+  Dfa(const Nfa &nfa, bool unanchored)
+      : nfa(nfa), unanchored(unanchored), marks(nfa.states.size()) {}
+
+  // at the start of the text, the first state when `begin`
+  int start(bool begin) {
+    if (starts[begin] < 0) {
+      std::vector<int> set;
+      generation++;
+      closure(nfa.start, begin, false, set);
+      auto state = intern(std::move(set), begin);
+      starts[begin] = state;
+    }
+    return starts[begin];
+  }
+
+  int next(int state, unsigned char byte) {
+    auto target = states[state].next[byte];
+    if (target >= 0) {
+      return target;
+    }
+    std::vector<int> set;
+    generation++;
+    for (auto s : states[state].nfa) {
+      const auto &n = nfa.states[s];
+      if (n.kind == NfaState::Kind::Bytes && n.bytes.test(byte)) {
+        closure(n.out, false, false, set);
+      }
+    }
+    if (unanchored) {
+      closure(nfa.start, false, false, set);
+    }
+    auto flushed = flushes;
+    target = intern(std::move(set), false);
+    if (flushes == flushed) {
+      states[state].next[byte] = target;
+    }
+    return target;
+  }
+
+  // a match ends before the next byte
+  bool match(int state) const { return states[state].match; }
+  // a match ends at the end of the text
+  bool match_at_end(int state) const { return states[state].match_at_end; }
+  // no match can end after it
+  bool dead(int state) const { return states[state].nfa.empty(); }
+
+private:
+  struct State {
+    std::vector<int> nfa;
+    bool match = false;
+    bool match_at_end = false;
+    std::array<int, 256> next;
+  };
+
+  // Adds the states reachable from `s` without reading a byte, minus the
+  // Split and Begin states. End states are kept until the end of the text.
+  void closure(int s, bool begin, bool end, std::vector<int> &set) {
+    std::vector<int> stack{s};
+    while (!stack.empty()) {
+      s = stack.back();
+      stack.pop_back();
+      if (marks[s] == generation) {
+        continue;
+      }
+      marks[s] = generation;
+      const auto &n = nfa.states[s];
+      switch (n.kind) {
+      case NfaState::Kind::Split:
+        stack.push_back(n.alt);
+        stack.push_back(n.out);
+        break;
+      case NfaState::Kind::Begin:
+        if (begin) {
+          stack.push_back(n.out);
+        }
+        break;
+      case NfaState::Kind::End:
+        if (end) {
+          stack.push_back(n.out);
+        } else {
+          set.push_back(s);
+        }
+        break;
+      default:
+        set.push_back(s);
+      }
+    }
+  }
+
+  bool contains_match(const std::vector<int> &set) const {
+    return std::any_of(set.begin(), set.end(), [&](int s) {
+      return nfa.states[s].kind == NfaState::Kind::Match;
+    });
+  }
+
+  int intern(std::vector<int> set, bool begin) {
+    std::sort(set.begin(), set.end());
+    auto key = std::make_pair(begin, std::move(set));
+    auto it = index.find(key);
+    if (it != index.end()) {
+      return it->second;
+    }
+    if (states.size() >= MAX_DFA_STATES) {
+      states.clear();
+      index.clear();
+      starts = {-1, -1};
+      flushes++;
+    }
+
+    State state;
+    state.nfa = key.second;
+    state.match = contains_match(state.nfa);
+    std::vector<int> at_end;
+    generation++;
+    for (auto s : state.nfa) {
+      if (nfa.states[s].kind == NfaState::Kind::End) {
+        closure(nfa.states[s].out, begin, true, at_end);
+      }
+    }
+    state.match_at_end = state.match || contains_match(at_end);
+    state.next.fill(-1);
+    states.push_back(std::move(state));
+    index.emplace(std::move(key), states.size() - 1);
+    return states.size() - 1;
+  }
+
+  const Nfa &nfa;
+  bool unanchored;
+  std::vector<State> states;
+  std::map<std::pair<bool, std::vector<int>>, int> index;
+  std::array<int, 2> starts{-1, -1};
+  // the number of times the states were dropped
+  std::size_t flushes = 0;
+  // the NFA states already in the closure being computed
+  std::vector<unsigned> marks;
+  unsigned generation = 0;
+};
+
+// Calls `f` with the offset of each match start, in decreasing order, from
+// a scan of the text backwards.
+template <typename F> void match_starts(Dfa &dfa, std::string_view text, F f) {
+  auto state = dfa.start(true);
+  for (auto i = text.size();; --i) {
+    if (i == 0 ? dfa.match_at_end(state) : dfa.match(state)) {
+      f(i);
+    }
+    if (i == 0) {
+      break;
+    }
+    state = dfa.next(state, text[i - 1]);
+  }
+}
+
+// the end of the longest match starting at `from`, npos when there is none
+std::size_t longest_match(Dfa &dfa, std::string_view text, std::size_t from) {
+  auto end = std::string_view::npos;
+  auto state = dfa.start(from == 0);
+  for (auto i = from;; ++i) {
+    if (i == text.size() ? dfa.match_at_end(state) : dfa.match(state)) {
+      end = i;
+    }
+    if (i == text.size() || dfa.dead(state)) {
+      break;
+    }
+    state = dfa.next(state, text[i]);
+  }
+  return end;
+}
+
+std::shared_ptr<RegexProgram> regex_arg(const Result &arg,
+                                        const std::string &op) {
+  if (auto regex = std::get_if<Regex>(&arg)) {
+    return regex->program;
+  } else if (auto pattern = std::get_if<String>(&arg)) {
+    return compile_regex(*pattern);
+  }
+  throw std::runtime_error("'" + op + "' requires a regex, got " +
+                           to_string(arg));
+}
+
+std::size_t offset_arg(const Result &arg, const std::string &op) {
+  auto n = std::get_if<Number>(&arg);
+  if (n == nullptr || *n < 0 || std::trunc(*n) != *n) {
+    throw std::runtime_error("'" + op + "' requires offsets, got " +
+                             to_string(arg));
+  }
+  return static_cast<std::size_t>(*n);
+}
+
+// the slice of the string argument between the optional offsets
+std::string_view text_arg(const std::vector<Result> &arguments,
+                          const std::string &op) {
+  if (arguments.size() < 2 || arguments.size() > 4) {
+    throw std::runtime_error("'" + op + "' requires a regex, a string and "
+                             "optional start and end offsets");
+  }
+  auto s = std::get_if<String>(&arguments[1]);
+  if (s == nullptr) {
+    throw std::runtime_error("'" + op + "' requires a string, got " +
+                             to_string(arguments[1]));
+  }
+  std::string_view text(*s);
+  auto start = arguments.size() > 2 ? offset_arg(arguments[2], op) : 0;
+  auto end = arguments.size() > 3 ? offset_arg(arguments[3], op) : text.size();
+  if (start > end || end > text.size()) {
+    throw std::runtime_error("'" + op + "' offsets out of range");
+  }
+  return text.substr(start, end - start);
+}
+
+} // namespace
+
+struct RegexProgram {
+  explicit RegexProgram(const std::string &pattern)
+      : pattern(pattern), root(PatternParser(pattern).parse()),
+        forward(NfaBuilder(false).build(root)),
+        backward(NfaBuilder(true).build(root)) {}
+
+  std::string pattern;
+  Node root;
+  Nfa forward;
+  Nfa backward;
+
+  // the DFAs built by a match, kept for the next ones
+  struct Dfas {
+    explicit Dfas(const RegexProgram &program)
+        : search(program.forward, true), longest(program.forward, false),
+          starts(program.backward, true) {}
+
+    Dfa search;
+    Dfa longest;
+    Dfa starts;
+  };
+
+  // A match takes the DFAs from `idle` for its whole scan, the mutex is only
+  // held to take and give them back: concurrent matches each get their own.
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Dfas>> idle;
+};
+
+namespace {
+
+// the DFAs of a program, for one match
+class DfaLease {
+public:
+  explicit DfaLease(RegexProgram &program) : program(program) {
+    {
+      std::lock_guard lock(program.mutex);
+      if (!program.idle.empty()) {
+        dfas = std::move(program.idle.back());
+        program.idle.pop_back();
+      }
+    }
+    if (dfas == nullptr) {
+      dfas = std::make_unique<RegexProgram::Dfas>(program);
+    }
+  }
+
+  ~DfaLease() {
+    std::lock_guard lock(program.mutex);
+    program.idle.push_back(std::move(dfas));
+  }
+
+  DfaLease(const DfaLease &) = delete;
+  DfaLease &operator=(const DfaLease &) = delete;
+
+  RegexProgram::Dfas *operator->() const { return dfas.get(); }
+
+private:
+  RegexProgram &program;
+  std::unique_ptr<RegexProgram::Dfas> dfas;
+};
+
+} // namespace
+
+std::shared_ptr<RegexProgram> compile_regex(const std::string &pattern) {
+  return std::make_shared<RegexProgram>(pattern);
+}
+
+const std::string &regex_pattern(const RegexProgram &program) {
+  return program.pattern;
+}
+
+bool regex_search(RegexProgram &program, std::string_view text) {
+  DfaLease dfas(program);
+  auto &dfa = dfas->search;
+  auto state = dfa.start(true);
+  for (unsigned char c : text) {
+    if (dfa.match(state)) {
+      return true;
+    }
+    state = dfa.next(state, c);
+  }
+  return dfa.match_at_end(state);
+}
+
+std::optional<std::pair<std::size_t, std::size_t>>
+regex_find(RegexProgram &program, std::string_view text) {
+  DfaLease dfas(program);
+  auto start = std::string_view::npos;
+  match_starts(dfas->starts, text, [&](std::size_t i) { start = i; });
+  if (start == std::string_view::npos) {
+    return std::nullopt;
+  }
+  return std::make_pair(start, longest_match(dfas->longest, text, start));
+}
+
+std::vector<std::pair<std::size_t, std::size_t>>
+regex_find_all(RegexProgram &program, std::string_view text) {
+  DfaLease dfas(program);
+  std::vector<bool> starts(text.size() + 1);
+  match_starts(dfas->starts, text, [&](std::size_t i) { starts[i] = true; });
+
+  std::vector<std::pair<std::size_t, std::size_t>> matches;
+  for (std::size_t i = 0; i <= text.size(); ++i) {
+    if (!starts[i]) {
+      continue;
+    }
+    auto end = longest_match(dfas->longest, text, i);
+    matches.emplace_back(i, end);
+    // after an empty match, the next one starts one byte further
+    i = std::max(end, i + 1) - 1;
+  }
+  return matches;
+}
+
+Regex regex_fn(const std::vector<Result> &arguments) {
+  if (arguments.size() != 1 || !std::holds_alternative<String>(arguments[0])) {
+    throw std::runtime_error("'regex' requires a pattern string");
+  }
+  return Regex{compile_regex(std::get<String>(arguments[0]))};
+}
+
+Boolean re_match_fn(const std::vector<Result> &arguments) {
+  auto text = text_arg(arguments, "re-match?");
+  return regex_search(*regex_arg(arguments[0], "re-match?"), text);
+}
+
+Result re_find_fn(const std::vector<Result> &arguments) {
+  auto text = text_arg(arguments, "re-find");
+  auto match = regex_find(*regex_arg(arguments[0], "re-find"), text);
+  if (!match) {
+    return Nil{};
+  }
+  return String(text.substr(match->first, match->second - match->first));
+}
+
+List re_find_all_fn(const std::vector<Result> &arguments) {
+  auto text = text_arg(arguments, "re-find-all");
+  std::vector<Result> found;
+  for (auto [start, end] :
+       regex_find_all(*regex_arg(arguments[0], "re-find-all"), text)) {
+    found.emplace_back(String(text.substr(start, end - start)));
+  }
+  return List(std::move(found));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "types.h"
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Regular expressions. (regex "pattern") compiles a pattern once, into an
+// automaton matched in time linear in the length of the text, without
+// backtracking:
+//
+//   (define error (regex "^[0-9-]+ [0-9:]+ (ERROR|FATAL) "))
+//   (lazy-filter (lambda (line) (re-match? error line)) (read-lines log))
+//   (re-find (regex "[a-z]+@[a-z.]+") "mail bob@example.com")
+//   ; -> "bob@example.com"
+//   (re-find-all (regex "[0-9]+") "1 22 333") ; -> ("1" "22" "333")
+//
+// The syntax: literal characters, '.' (any character but '\n'), classes
+// like [a-z_] and [^0-9], the escapes \d \w \s \D \W \S \t \n \r and '\'
+// before a punctuation character, groups (...) or (?:...), alternatives a|b,
+// the repetitions * + ? {n} {n,} {n,m}, and the anchors ^ and $ at the
+// start and the end of the text. Patterns and texts are bytes. The match
+// found is the leftmost one, and the longest one starting there: (re-find
+// (regex "a|ab") "ab") is "ab". Groups do not capture.
+//
+// The builtins take the text and optional start and end byte offsets, the
+// slice between them is matched in place, like a whole string.
+
+// the NFAs of a pattern and the DFAs built from them as they are matched
+struct RegexProgram;
+
+// throws on an invalid pattern
+std::shared_ptr<RegexProgram> compile_regex(const std::string &pattern);
+const std::string &regex_pattern(const RegexProgram &program);
+
+// The compiled programs are shared by threads, concurrent matches build their
+// own DFAs.
+bool regex_search(RegexProgram &program, std::string_view text);
+// the start and end offsets of the leftmost longest match
+std::optional<std::pair<std::size_t, std::size_t>>
+regex_find(RegexProgram &program, std::string_view text);
+// the successive non-overlapping matches
+std::vector<std::pair<std::size_t, std::size_t>>
+regex_find_all(RegexProgram &program, std::string_view text);
+
+Regex regex_fn(const std::vector<Result> &arguments);
+Boolean re_match_fn(const std::vector<Result> &arguments);
+Result re_find_fn(const std::vector<Result> &arguments);
+List re_find_all_fn(const std::vector<Result> &arguments);
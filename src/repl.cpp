@@ -1,53 +1,198 @@
+#include <charconv>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <optional>
 #include <sstream>
+#include <string_view>
 #include "lisp.h"
+#include "memory.h"
+#include "output.h"
+
+void print_result(const Result &res) {
+    auto &sink = stdout_sink();
+    print_value(sink, res);
+    sink.put('\n');
+    sink.flush();
+}
 
 
 int main(int argc, char **argv) {
-    if (argc > 1) {
+    // --interpreted-stdlib replaces the native standard library with its
+    // cpplisp implementation
+    bool interpreted_stdlib_flag = false;
+    // --check reports arity and type errors in a script before running it
+    bool check_flag = false;
+    // --no-jit keeps hot lambdas interpreted
+    bool jit_flag = true;
+    // --emit-cpp prints the script translated to C++ instead of running it
+    bool emit_cpp_flag = false;
+    // --memory-stats prints the memory counters to stderr at exit
+    bool memory_stats_flag = false;
+    // --coverage prints the script annotated with the evaluation counts to
+    // stderr, --coverage-dump writes the counters to a file
+    bool coverage_flag = false;
+    const char *coverage_dump = nullptr;
+    // -I DIR adds a directory to the module search path
+    // --max-steps, --max-depth, --max-heap (bytes) and --timeout (ms) limit
+    // each evaluation
+    ResourceLimits limits;
+    const char *script = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        auto value = [&] {
+            if (i + 1 == argc) {
+                std::cerr << "Missing value for " << argv[i] << std::endl;
+                std::exit(1);
+            }
+            // a non-negative integer, without sign
+            std::string_view text = argv[i + 1];
+            unsigned long long n = 0;
+            auto [end, error] =
+                std::from_chars(text.data(), text.data() + text.size(), n);
+            if (error != std::errc() || end != text.data() + text.size()) {
+                std::cerr << "Invalid value for " << argv[i] << std::endl;
+                std::exit(1);
+            }
+            ++i;
+            return n;
+        };
+        if (std::string(argv[i]) == "--interpreted-stdlib") {
+            interpreted_stdlib_flag = true;
+        } else if (std::string(argv[i]) == "--check") {
+            check_flag = true;
+        } else if (std::string(argv[i]) == "--no-jit") {
+            jit_flag = false;
+        } else if (std::string(argv[i]) == "--emit-cpp") {
+            emit_cpp_flag = true;
+        } else if (std::string(argv[i]) == "--memory-stats") {
+            memory_stats_flag = true;
+        } else if (std::string(argv[i]) == "--coverage") {
+            coverage_flag = true;
+        } else if (std::string(argv[i]) == "--coverage-dump") {
+            if (i + 1 == argc) {
+                std::cerr << "Missing value for " << argv[i] << std::endl;
+                return 1;
+            }
+            coverage_dump = argv[++i];
+        } else if (std::string(argv[i]) == "-I") {
+            if (i + 1 == argc) {
+                std::cerr << "Missing value for " << argv[i] << std::endl;
+                return 1;
+            }
+            module_search_path().emplace_back(argv[++i]);
+        } else if (std::string(argv[i]) == "--max-steps") {
+            limits.max_steps = value();
+        } else if (std::string(argv[i]) == "--max-depth") {
+            limits.max_depth = value();
+        } else if (std::string(argv[i]) == "--max-heap") {
+            limits.max_heap_bytes = value();
+        } else if (std::string(argv[i]) == "--timeout") {
+            limits.timeout = std::chrono::milliseconds(value());
+        } else {
+            script = argv[i];
+        }
+    }
+
+    set_jit_enabled(jit_flag);
+    if (memory_stats_flag) {
+        print_memory_stats_at_exit();
+    }
+
+    Env env;
+    if (interpreted_stdlib_flag) {
+        eval_with_env(interpreted_stdlib(), env);
+    }
+
+    if (script != nullptr) {
         // Execute a single file
-        std::ifstream file(argv[1]);
+        std::ifstream file(script);
         if (!file.is_open()) {
-            std::cerr << "Cannot open file " << argv[1] << std::endl;
+            std::cerr << "Cannot open file " << script << std::endl;
             return 1;
         }
         std::stringstream buffer;
         buffer << file.rdbuf();
-        auto output = eval_program_with_stdlib(buffer.str());
-        std::cout << to_string(output) << std::endl;
+        // the modules next to the script come first
+        auto &search_path = module_search_path();
+        search_path.insert(search_path.begin(),
+                           std::filesystem::path(script).parent_path());
+        if (emit_cpp_flag) {
+            std::cout << emit_cpp(buffer.str());
+            return 0;
+        }
+        std::optional<Coverage> coverage;
+        if (coverage_flag || coverage_dump != nullptr) {
+            coverage.emplace(buffer.str());
+        }
+        auto report_coverage = [&] {
+            if (coverage_flag) {
+                coverage->report(std::cerr);
+            }
+            if (coverage_dump != nullptr) {
+                std::ofstream dump(coverage_dump);
+                coverage->dump(dump);
+            }
+        };
+        try {
+            auto output = with_limits(limits, [&] {
+                if (coverage) {
+                    return coverage->evaluate(env);
+                }
+                return check_flag ? eval_checked(buffer.str(), env)
+                                  : eval_with_env(buffer.str(), env);
+            });
+            print_result(output);
+        } catch (LimitError &e) {
+            stdout_sink().flush();
+            std::cerr << script << ": " << e.what() << std::endl;
+            if (coverage) {
+                // where the time or the memory went
+                report_coverage();
+            }
+            return 1;
+        } catch (std::exception &e) {
+            // what the script printed before the error is still written
+            stdout_sink().flush();
+            std::cerr << script << ": " << e.what() << std::endl;
+            return 1;
+        }
+        if (coverage) {
+            report_coverage();
+        }
         return 0;
     }
 
-    Env env;
-    eval_with_env(stdlib(), env);
-
-    std::string program;
+    IncrementalParser parser(&env);
     while (true) {
         std::string line;
-        if (program.empty()) {
-            std::cout << ">> ";
+        if (parser.complete()) {
+            stdout_sink().write(">> ");
         } else {
-            std::cout << "   ";
+            stdout_sink().write("   ");
+        }
+        stdout_sink().flush();
+        if (!std::getline(std::cin, line)) {
+            return 0;
         }
-        std::getline(std::cin, line);
-        program += line + "\n";
 
-        if (line == "exit") {
+        if (line == "exit" && parser.complete()) {
             return 0;
         }
 
         try {
-            auto res = eval_with_env(program, env);
-            std::cout << to_string(res) << std::endl;
-            program = "";
-        } catch (IncompleteStatement &) {
-            // multiline expression
+            // evaluate each expression as soon as it is closed
+            parser.feed(line + "\n");
+            while (auto expr = parser.next()) {
+                print_result(
+                    with_limits(limits, [&] { return expr->evaluate(env); }));
+            }
         } catch (std::runtime_error &e) {
-            std::cout << e.what() << std::endl;
-            program = "";
+            stdout_sink().write(e.what());
+            stdout_sink().put('\n');
+            stdout_sink().flush();
+            parser.reset();
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,83 @@
+#include "resources.h"
+
+#include <algorithm>
+#include <string>
+
+constinit thread_local ResourceState resource_state;
+
+namespace {
+
+// steps between two checks of the clock
+constexpr std::size_t CHECK_INTERVAL = 4096;
+
+void schedule_check(ResourceState &state) {
+  auto next = state.max_steps == SIZE_MAX ? SIZE_MAX : state.max_steps + 1;
+  if (state.timeout.count() > 0) {
+    next = std::min(next, state.steps + CHECK_INTERVAL);
+  }
+  state.next_check = next;
+}
+
+} // namespace
+
+void check_resources() {
+  auto &state = resource_state;
+  if (state.steps > state.max_steps) {
+    throw LimitError(LimitError::Kind::Steps,
+                     "Exceeded the limit of " +
+                         std::to_string(state.max_steps) +
+                         " evaluation steps");
+  }
+  if (state.timeout.count() > 0 &&
+      std::chrono::steady_clock::now() > state.deadline) {
+    throw LimitError(LimitError::Kind::Time,
+                     "Exceeded the time limit of " +
+                         std::to_string(state.timeout.count()) + " ms");
+  }
+  schedule_check(state);
+}
+
+void throw_depth_exceeded() {
+  throw LimitError(LimitError::Kind::Depth,
+                   "Exceeded the maximum call depth of " +
+                       std::to_string(resource_state.max_depth));
+}
+
+void throw_stack_exceeded() {
+  throw LimitError(LimitError::Kind::Depth,
+                   "Exceeded the stack of the task, the calls are nested too "
+                   "deeply");
+}
+
+void throw_heap_exceeded(std::size_t max_heap_bytes) {
+  throw LimitError(LimitError::Kind::Heap,
+                   "Exceeded the heap limit of " +
+                       std::to_string(max_heap_bytes) + " bytes");
+}
+
+ResourceScope::ResourceScope(const ResourceLimits &limits)
+    : previous(resource_state), previous_heap_limit(thread_heap_limit()) {
+  auto &state = resource_state;
+  // the steps and the depth are counted from here
+  state.steps = 0;
+  state.depth = 0;
+  state.max_steps = limits.max_steps > 0 ? limits.max_steps : SIZE_MAX;
+  state.max_depth = limits.max_depth > 0 ? limits.max_depth : SIZE_MAX;
+  state.timeout = limits.timeout;
+  if (limits.timeout.count() > 0) {
+    state.deadline = std::chrono::steady_clock::now() + limits.timeout;
+  }
+  state.active = limits.max_steps > 0 || limits.max_depth > 0 ||
+                 limits.max_heap_bytes > 0 || limits.timeout.count() > 0;
+  schedule_check(state);
+  set_thread_heap_limit(
+      limits.max_heap_bytes > 0
+          ? thread_live_bytes() +
+                static_cast<std::int64_t>(limits.max_heap_bytes)
+          : 0);
+}
+
+ResourceScope::~ResourceScope() {
+  resource_state = previous;
+  set_thread_heap_limit(previous_heap_limit);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "memory.h"
+#include "types.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// Limits on an evaluation, 0 is unlimited. A step is a lambda call, a loop
+// iteration or a builtin call; the depth counts nested lambda calls. The heap
+// is what the evaluating thread allocates and does not free, counted by the
+// operator new of lisp_memstats: without it the heap limit is not enforced.
+struct ResourceLimits {
+  std::size_t max_steps = 0;
+  std::size_t max_depth = 0;
+  std::size_t max_heap_bytes = 0;
+  std::chrono::milliseconds timeout{0};
+};
+
+// What this thread evaluates, see ResourceScope.
+struct ResourceState {
+  std::size_t steps = 0;
+  // check_resources() runs when `steps` reaches it
+  std::size_t next_check = SIZE_MAX;
+  std::size_t depth = 0;
+  std::size_t max_depth = SIZE_MAX;
+  std::size_t max_steps = SIZE_MAX;
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::time_point::max();
+  std::chrono::milliseconds timeout{0};
+  bool active = false;
+  // the lowest address calls can use, 0 when the stack is not checked; set
+  // on the stacks of tasks
+  std::uintptr_t stack_limit = 0;
+};
+
+extern constinit thread_local ResourceState resource_state;
+
+// Throws a LimitError when the steps or the time are exhausted.
+void check_resources();
+[[noreturn]] void throw_depth_exceeded();
+[[noreturn]] void throw_stack_exceeded();
+
+// an address in the frame of the caller
+inline std::uintptr_t stack_position() {
+  char here;
+  return reinterpret_cast<std::uintptr_t>(&here);
+}
+
+inline void count_step() {
+  if (++resource_state.steps >= resource_state.next_check) {
+    check_resources();
+  }
+}
+
+// one level of nested lambda calls, for the time of the call
+class CallDepth {
+public:
+  CallDepth() {
+    if (++resource_state.depth > resource_state.max_depth) {
+      --resource_state.depth;
+      throw_depth_exceeded();
+    }
+    if (stack_position() < resource_state.stack_limit) {
+      --resource_state.depth;
+      throw_stack_exceeded();
+    }
+  }
+  ~CallDepth() { --resource_state.depth; }
+
+  CallDepth(const CallDepth &) = delete;
+  CallDepth &operator=(const CallDepth &) = delete;
+};
+
+// Enforces `limits` on the evaluations made by this thread during its
+// lifetime, replacing the limits of an enclosing scope. The time limit
+// starts with the scope. Allocations over the heap limit throw
+// std::bad_alloc, which with_limits() turns into a LimitError.
+class ResourceScope {
+public:
+  explicit ResourceScope(const ResourceLimits &limits);
+  ~ResourceScope();
+
+  ResourceScope(const ResourceScope &) = delete;
+  ResourceScope &operator=(const ResourceScope &) = delete;
+
+private:
+  ResourceState previous;
+  std::int64_t previous_heap_limit;
+};
+
+[[noreturn]] void throw_heap_exceeded(std::size_t max_heap_bytes);
+
+// Calls `evaluate` within a ResourceScope, the host stays usable once a
+// limit is exceeded: the evaluation is unwound and the LimitError thrown.
+template <typename F>
+auto with_limits(const ResourceLimits &limits, F evaluate) {
+  {
+    ResourceScope scope(limits);
+    try {
+      return evaluate();
+    } catch (const std::bad_alloc &) {
+      if (!thread_heap_limit_exceeded()) {
+        throw;
+      }
+    }
+  }
+  // outside of the scope, the error itself can be allocated
+  throw_heap_exceeded(limits.max_heap_bytes);
+}
@@ -0,0 +1,342 @@
+#include "seq.h"
+
+#include "builtins.h"
+
+SeqNode::~SeqNode() {
+  // unlink the realized chain iteratively, a long sequence would otherwise
+  // overflow the stack through recursive destructors
+  while (tail && tail.use_count() == 1) {
+    auto next = std::move(tail->tail);
+    tail = std::move(next);
+  }
+}
+
+void SeqNode::realize() {
+  if (realized) {
+    return;
+  }
+  head = generator->next();
+  if (head) {
+    tail = std::make_shared<SeqNode>(generator);
+  } else {
+    // the sequence is exhausted, release whatever the generator holds
+    generator.reset();
+  }
+  realized = true;
+}
+
+Seq make_seq(std::shared_ptr<Generator> generator) {
+  return Seq{std::make_shared<SeqNode>(std::move(generator))};
+}
+
+bool seq_empty(const Seq &seq) {
+  seq.node->realize();
+  return !seq.node->head;
+}
+
+Result seq_first(const Seq &seq) {
+  seq.node->realize();
+  if (seq.node->head) {
+    return *seq.node->head;
+  }
+  return Nil{};
+}
+
+Seq seq_rest(const Seq &seq) {
+  seq.node->realize();
+  if (seq.node->tail) {
+    return Seq{seq.node->tail};
+  }
+  return seq;
+}
+
+List seq_to_list(const Seq &seq) {
+  List list;
+  for (auto node = seq.node; node; node = node->tail) {
+    node->realize();
+    if (node->head) {
+      list.list.push_back(*node->head);
+    }
+  }
+  return list;
+}
+
+Cursor::Cursor(Result seq) {
+  if (auto l = std::get_if<List>(&seq)) {
+    list = std::move(*l);
+  } else if (auto s = std::get_if<Seq>(&seq)) {
+    this->seq = std::move(*s);
+  } else {
+    throw std::runtime_error("Expected a list or a sequence, got " +
+                             to_string(seq));
+  }
+}
+
+std::optional<Result> Cursor::next() {
+  if (generator) {
+    return generator->next();
+  }
+
+  if (seq.node) {
+    if (!seq.node->realized && seq.node.use_count() == 1) {
+      // nobody else can observe this sequence, skip the memoized cells
+      generator = std::move(seq.node->generator);
+      seq.node.reset();
+      return generator->next();
+    }
+
+    seq.node->realize();
+    if (!seq.node->head) {
+      return std::nullopt;
+    }
+    auto value = *seq.node->head;
+    seq.node = seq.node->tail;
+    return value;
+  }
+
+  if (index < list.list.size()) {
+    return list.list.take(index++);
+  }
+  return std::nullopt;
+}
+
+namespace {
+
+Number number_argument(const Result &arg, const std::string &op) {
+  if (auto n = std::get_if<Number>(&arg)) {
+    return *n;
+  }
+  throw std::runtime_error("'" + op + "' requires a number, got " +
+                           to_string(arg));
+}
+
+const Result &function_argument(const Result &arg, const std::string &op) {
+  if (std::holds_alternative<Lambda>(arg) ||
+      std::holds_alternative<Builtin>(arg)) {
+    return arg;
+  }
+  throw std::runtime_error("'" + op + "' requires a function, got " +
+                           to_string(arg));
+}
+
+void check_arguments(const std::vector<Result> &arguments, int count,
+                     const std::string &op) {
+  if (arguments.size() != count) {
+    throw std::runtime_error("'" + op + "' requires exactly " +
+                             std::to_string(count) + " arguments");
+  }
+}
+
+// a function called from a generator, after the builtin that created it
+// returned, with a snapshot of the environment it was created in
+struct Function {
+  Function(const Result &fn, Env &env, const std::string &op)
+      : fn(function_argument(fn, op)), env(std::make_shared<Env>(env)) {}
+
+  Result operator()(std::vector<Result> args) const {
+    return call(fn, args, *env);
+  }
+
+  Result fn;
+  std::shared_ptr<Env> env;
+};
+
+class RangeGenerator : public Generator {
+public:
+  RangeGenerator(Number start, std::optional<Number> end, Number step)
+      : current(start), end(end), step(step) {}
+
+  std::optional<Result> next() override {
+    if (end && (step > 0 ? current >= *end : current <= *end)) {
+      return std::nullopt;
+    }
+    auto value = current;
+    current += step;
+    return value;
+  }
+
+private:
+  Number current;
+  std::optional<Number> end;
+  Number step;
+};
+
+class IterateGenerator : public Generator {
+public:
+  IterateGenerator(Function fn, Result start)
+      : fn(std::move(fn)), current(std::move(start)) {}
+
+  std::optional<Result> next() override {
+    // the function is applied lazily, only once the next value is requested
+    if (started) {
+      current = fn({current});
+    }
+    started = true;
+    return current;
+  }
+
+private:
+  Function fn;
+  Result current;
+  bool started = false;
+};
+
+class TakeGenerator : public Generator {
+public:
+  TakeGenerator(Cursor source, Number count)
+      : source(std::move(source)), remaining(count) {}
+
+  std::optional<Result> next() override {
+    if (remaining <= 0) {
+      return std::nullopt;
+    }
+    remaining--;
+    return source.next();
+  }
+
+private:
+  Cursor source;
+  Number remaining;
+};
+
+class DropGenerator : public Generator {
+public:
+  DropGenerator(Cursor source, Number count)
+      : source(std::move(source)), count(count) {}
+
+  std::optional<Result> next() override {
+    for (; count > 0; count--) {
+      if (!source.next()) {
+        return std::nullopt;
+      }
+    }
+    return source.next();
+  }
+
+private:
+  Cursor source;
+  Number count;
+};
+
+class MapGenerator : public Generator {
+public:
+  MapGenerator(Function fn, Cursor source)
+      : fn(std::move(fn)), source(std::move(source)) {}
+
+  std::optional<Result> next() override {
+    if (auto value = source.next()) {
+      return fn({std::move(*value)});
+    }
+    return std::nullopt;
+  }
+
+private:
+  Function fn;
+  Cursor source;
+};
+
+class FilterGenerator : public Generator {
+public:
+  FilterGenerator(Function pred, Cursor source)
+      : pred(std::move(pred)), source(std::move(source)) {}
+
+  std::optional<Result> next() override {
+    while (auto value = source.next()) {
+      if (is_true(pred({*value}))) {
+        return value;
+      }
+    }
+    return std::nullopt;
+  }
+
+private:
+  Function pred;
+  Cursor source;
+};
+
+} // namespace
+
+Seq range_fn(const std::vector<Result> &arguments) {
+  switch (arguments.size()) {
+  case 0:
+    return make_seq(std::make_shared<RangeGenerator>(0, std::nullopt, 1));
+  case 1:
+    return make_seq(std::make_shared<RangeGenerator>(
+        0, number_argument(arguments[0], "range"), 1));
+  case 2:
+  case 3: {
+    Number step =
+        arguments.size() == 3 ? number_argument(arguments[2], "range") : 1;
+    if (step == 0) {
+      throw std::runtime_error("'range' requires a non-zero step");
+    }
+    return make_seq(std::make_shared<RangeGenerator>(
+        number_argument(arguments[0], "range"),
+        number_argument(arguments[1], "range"), step));
+  }
+  default:
+    throw std::runtime_error("'range' requires at most 3 arguments");
+  }
+}
+
+Seq iterate_fn(const std::vector<Result> &arguments, Env &env) {
+  check_arguments(arguments, 2, "iterate");
+  return make_seq(std::make_shared<IterateGenerator>(
+      Function(arguments[0], env, "iterate"), arguments[1]));
+}
+
+Seq take_fn(std::vector<Result> arguments) {
+  check_arguments(arguments, 2, "take");
+  auto count = number_argument(arguments[0], "take");
+  return make_seq(std::make_shared<TakeGenerator>(
+      Cursor(std::move(arguments[1])), count));
+}
+
+Seq drop_fn(std::vector<Result> arguments) {
+  check_arguments(arguments, 2, "drop");
+  auto count = number_argument(arguments[0], "drop");
+  return make_seq(std::make_shared<DropGenerator>(
+      Cursor(std::move(arguments[1])), count));
+}
+
+Seq lazy_map_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 2, "lazy-map");
+  return make_seq(
+      std::make_shared<MapGenerator>(Function(arguments[0], env, "lazy-map"),
+                                     Cursor(std::move(arguments[1]))));
+}
+
+Seq lazy_filter_fn(std::vector<Result> arguments, Env &env) {
+  check_arguments(arguments, 2, "lazy-filter");
+  return make_seq(std::make_shared<FilterGenerator>(
+      Function(arguments[0], env, "lazy-filter"),
+      Cursor(std::move(arguments[1]))));
+}
+
+Result reduce_fn(std::vector<Result> arguments, Env &env) {
+  // (reduce fn init seq) or (reduce fn seq), starting from the first element
+  if (arguments.size() != 2 && arguments.size() != 3) {
+    throw std::runtime_error("'reduce' requires 2 or 3 arguments");
+  }
+  auto &fn = function_argument(arguments[0], "reduce");
+  Cursor cursor(std::move(arguments.back()));
+
+  Result acc;
+  if (arguments.size() == 3) {
+    acc = std::move(arguments[1]);
+  } else if (auto first = cursor.next()) {
+    acc = std::move(*first);
+  } else {
+    return Nil{};
+  }
+
+  std::vector<Result> args;
+  while (auto value = cursor.next()) {
+    // a builtin can take ownership of the argument vector
+    args.resize(2);
+    args[0] = std::move(acc);
+    args[1] = std::move(*value);
+    acc = call(fn, args, env);
+  }
+  return acc;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.h"
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Produces the elements of a lazy sequence one at a time, in order.
+class Generator {
+public:
+  virtual ~Generator() = default;
+  virtual std::optional<Result> next() = 0;
+};
+
+// A cell of a lazy sequence. Cells are realized on demand and memoized, so
+// `first`/`rest` can be called any number of times on the same value, while a
+// sequence whose head is no longer referenced is freed as it is consumed.
+struct SeqNode {
+  explicit SeqNode(std::shared_ptr<Generator> gen)
+      : generator(std::move(gen)) {}
+  ~SeqNode();
+
+  void realize();
+
+  std::shared_ptr<Generator> generator;
+  bool realized = false;
+  std::optional<Result> head;
+  std::shared_ptr<SeqNode> tail;
+};
+
+Seq make_seq(std::shared_ptr<Generator> generator);
+
+bool seq_empty(const Seq &seq);
+Result seq_first(const Seq &seq);
+Seq seq_rest(const Seq &seq);
+
+// realizes the whole sequence
+List seq_to_list(const Seq &seq);
+
+// Walks the elements of a list or a lazy sequence. When the cursor holds the
+// only reference to an unrealized sequence it pulls from its generator
+// directly, so chained lazy operations run as a single fused pass.
+class Cursor {
+public:
+  explicit Cursor(Result seq);
+
+  std::optional<Result> next();
+
+private:
+  List list;
+  std::size_t index = 0;
+  Seq seq;
+  std::shared_ptr<Generator> generator;
+};
+
+class Env;
+
+Seq range_fn(const std::vector<Result> &arguments);
+Seq iterate_fn(const std::vector<Result> &arguments, Env &env);
+Seq take_fn(std::vector<Result> arguments);
+Seq drop_fn(std::vector<Result> arguments);
+Seq lazy_map_fn(std::vector<Result> arguments, Env &env);
+Seq lazy_filter_fn(std::vector<Result> arguments, Env &env);
+Result reduce_fn(std::vector<Result> arguments, Env &env);
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// A vector whose copies share their elements until one of them is modified:
+// copying it copies a pointer, and the first change to a shared copy copies
+// the elements. Reading through a const reference never copies, the
+// non-const accessors and iterators make the elements unique first, like
+// the modifiers. An element reference or iterator obtained from a vector is
+// only valid until the vector is copied.
+//
+// A transient vector is modified in place by all its copies instead, e.g. to
+// append elements to an accumulator that is also bound to a variable, until
+// make_persistent() freezes it.
+//
+// The storage keeps free slots before the elements, so that inserting or
+// erasing at the front in place is amortized O(1) too, like at the back.
+template <typename T> class SharedVector {
+public:
+  using value_type = T;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using reference = T &;
+  using const_reference = const T &;
+  using iterator = typename std::vector<T>::iterator;
+  using const_iterator = typename std::vector<T>::const_iterator;
+
+  SharedVector() = default;
+  SharedVector(std::vector<T> items)
+      : items(items.empty() ? nullptr
+                            : std::make_shared<Storage>(std::move(items))) {}
+  SharedVector(std::initializer_list<T> items)
+      : SharedVector(std::vector<T>(items)) {}
+  template <typename It>
+  SharedVector(It first, It last) : SharedVector(std::vector<T>(first, last)) {}
+
+  std::size_t size() const { return items ? items->size() - items->head : 0; }
+  bool empty() const { return size() == 0; }
+  // false when other copies share the elements
+  bool unique() const { return items == nullptr || items.use_count() == 1; }
+  bool transient() const { return items && items->transient; }
+
+  // copies the elements first if they are shared
+  void make_transient() { own().transient = true; }
+  // the copies that share the elements copy them again on write
+  void make_persistent() {
+    if (items) {
+      items->transient = false;
+    }
+  }
+
+  std::span<const T> elements() const {
+    return items ? std::span<const T>(items->data() + items->head, size())
+                 : std::span<const T>();
+  }
+
+  // A hash of the elements computed by the caller, kept with them until
+  // they are modified, 0 when unknown. It is never kept for a transient
+  // vector.
+  std::size_t cached_hash() const {
+    return items ? items->hash.load(std::memory_order_relaxed) : 0;
+  }
+  void cache_hash(std::size_t hash) const {
+    if (items && !items->transient) {
+      items->hash.store(hash, std::memory_order_relaxed);
+    }
+  }
+
+  const_iterator begin() const {
+    return items ? items->cbegin() + items->head : none().begin();
+  }
+  const_iterator end() const { return items ? items->cend() : none().end(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  const T &operator[](std::size_t i) const { return (*items)[items->head + i]; }
+  const T &front() const { return (*items)[items->head]; }
+  const T &back() const { return items->back(); }
+
+  iterator begin() {
+    auto &v = own();
+    return v.begin() + v.head;
+  }
+  iterator end() { return own().end(); }
+  T &operator[](std::size_t i) {
+    auto &v = own();
+    return v[v.head + i];
+  }
+  T &front() { return (*this)[0]; }
+  T &back() { return own().back(); }
+  // the element, moved out when the elements are not shared
+  T take(std::size_t i) {
+    if (!unique()) {
+      return (*items)[items->head + i];
+    }
+    items->hash.store(0, std::memory_order_relaxed);
+    return std::move((*items)[items->head + i]);
+  }
+
+  void reserve(std::size_t n) {
+    auto &v = own();
+    v.reserve(v.head + n);
+  }
+  void push_back(const T &value) { own().push_back(value); }
+  void push_back(T &&value) { own().push_back(std::move(value)); }
+  template <typename... Args> T &emplace_back(Args &&...args) {
+    return own().emplace_back(std::forward<Args>(args)...);
+  }
+  void pop_back() { own().pop_back(); }
+  void resize(std::size_t n) {
+    auto &v = own();
+    v.resize(v.head + n);
+  }
+  void clear() {
+    if (transient()) {
+      items->clear();
+      items->head = 0;
+    } else {
+      items = nullptr;
+    }
+  }
+
+  iterator insert(const_iterator pos, T value) {
+    auto index = pos - cbegin();
+    if (copy_on_write()) {
+      // copied around the new element rather than copied then shifted
+      auto copy = std::make_shared<Storage>();
+      copy->reserve(size() + 1);
+      copy->insert(copy->end(), cbegin(), cbegin() + index);
+      copy->push_back(std::move(value));
+      copy->insert(copy->end(), cbegin() + index, cend());
+      items = std::move(copy);
+      return items->begin() + index;
+    }
+    auto &v = own();
+    if (index != 0) {
+      return v.insert(v.begin() + v.head + index, std::move(value));
+    }
+    if (v.head == 0) {
+      // as many free slots as elements, doubling the room at the front
+      auto room = std::max<std::size_t>(v.size(), 4);
+      std::vector<T> moved;
+      moved.reserve(room + v.size());
+      moved.resize(room);
+      std::move(v.begin(), v.end(), std::back_inserter(moved));
+      static_cast<std::vector<T> &>(v) = std::move(moved);
+      v.head = room;
+    }
+    v.head--;
+    v[v.head] = std::move(value);
+    return v.begin() + v.head;
+  }
+  iterator erase(const_iterator first, const_iterator last) {
+    auto from = first - cbegin();
+    auto to = last - cbegin();
+    if (copy_on_write()) {
+      auto copy = std::make_shared<Storage>();
+      copy->reserve(size() - (to - from));
+      copy->insert(copy->end(), cbegin(), cbegin() + from);
+      copy->insert(copy->end(), cbegin() + to, cend());
+      items = std::move(copy);
+      return items->begin() + from;
+    }
+    auto &v = own();
+    if (from == 0) {
+      // the erased slots become free slots
+      for (auto i = v.head; i < v.head + to; ++i) {
+        v[i] = T();
+      }
+      v.head += to;
+      return v.begin() + v.head;
+    }
+    return v.erase(v.begin() + v.head + from, v.begin() + v.head + to);
+  }
+  iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+private:
+  struct Storage : std::vector<T> {
+    Storage() = default;
+    explicit Storage(std::vector<T> items) : std::vector<T>(std::move(items)) {}
+    // without the free slots
+    Storage(const Storage &other)
+        : std::vector<T>(other.begin() + other.head, other.end()) {}
+
+    bool transient = false;
+    // the number of free slots before the elements
+    std::size_t head = 0;
+    // see cached_hash()
+    mutable std::atomic<std::size_t> hash = 0;
+  };
+
+  bool copy_on_write() const {
+    return items && !items->transient && items.use_count() != 1;
+  }
+
+  static const std::vector<T> &none() {
+    static const std::vector<T> empty;
+    return empty;
+  }
+
+  // the elements, copied first if they are shared and not transient
+  Storage &own() {
+    if (!items) {
+      items = std::make_shared<Storage>();
+    } else if (copy_on_write()) {
+      items = std::make_shared<Storage>(*items);
+    } else {
+      // the writes of the copies released by other threads happened before
+      std::atomic_thread_fence(std::memory_order_acquire);
+      items->hash.store(0, std::memory_order_relaxed);
+    }
+    return *items;
+  }
+
+  // null until elements are added
+  std::shared_ptr<Storage> items;
+};
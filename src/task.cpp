@@ -0,0 +1,135 @@
+#include "task.h"
+
+#include "lisp.h"
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+struct Task::Context {
+  ucontext_t task;
+  ucontext_t host;
+  void *stack = nullptr;
+  std::size_t mapped = 0;
+};
+
+namespace {
+
+constinit thread_local Task *current_task = nullptr;
+
+// thrown by yield() in a task destroyed while it is suspended
+struct Cancelled {};
+
+} // namespace
+
+Task::Task(std::string program, Env env, std::size_t stack_size)
+    : Task(
+          [program = std::move(program)](Env &env) {
+            return eval_with_env(program, env);
+          },
+          std::move(env), stack_size) {}
+
+Task::Task(Body body, Env env, std::size_t stack_size)
+    : body(std::move(body)), environment(std::move(env)),
+      context(std::make_unique<Context>()) {
+  auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  stack_size = (stack_size + page - 1) / page * page;
+  // the lowest page stays inaccessible, an overflow faults instead of
+  // overwriting other memory
+  auto stack = mmap(nullptr, stack_size + page, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    throw std::runtime_error("Cannot allocate the stack of a task");
+  }
+  mprotect(stack, page, PROT_NONE);
+  context->stack = stack;
+  context->mapped = stack_size + page;
+
+  // calls nested deeper throw, see CallDepth
+  resources.stack_limit = reinterpret_cast<std::uintptr_t>(stack) + page +
+                          std::min(STACK_RESERVE, stack_size / 4);
+
+  getcontext(&context->task);
+  context->task.uc_stack.ss_sp = static_cast<char *>(stack) + page;
+  context->task.uc_stack.ss_size = stack_size;
+  // where the evaluation continues once entry() returns
+  context->task.uc_link = &context->host;
+  makecontext(&context->task, entry, 0);
+}
+
+Task::~Task() {
+  if (state == State::Suspended) {
+    cancelled = true;
+    try {
+      resume();
+    } catch (...) {
+    }
+  }
+  munmap(context->stack, context->mapped);
+}
+
+Result Task::resume(Result value) {
+  if (state == State::Done) {
+    throw std::runtime_error("Cannot resume a finished task");
+  } else if (state == State::Running) {
+    throw std::runtime_error("Cannot resume a running task");
+  }
+
+  transfer = std::move(value);
+  state = State::Running;
+  auto caller = current_task;
+  current_task = this;
+  switch_thread_state();
+  swapcontext(&context->host, &context->task);
+  switch_thread_state();
+  current_task = caller;
+
+  if (error) {
+    std::rethrow_exception(std::exchange(error, nullptr));
+  }
+  return std::move(transfer);
+}
+
+void Task::entry() {
+  auto self = current_task;
+  try {
+    self->transfer = self->body(self->environment);
+  } catch (...) {
+    self->error = std::current_exception();
+  }
+  self->state = State::Done;
+}
+
+// the evaluation and the host each keep their memory category and limits
+void Task::switch_thread_state() {
+  std::swap(memory_category, current_memory_category);
+  std::swap(resources, resource_state);
+  auto limit = thread_heap_limit();
+  set_thread_heap_limit(heap_limit);
+  heap_limit = limit;
+}
+
+Result yield(Result value) {
+  auto self = current_task;
+  if (self == nullptr) {
+    throw std::runtime_error("'yield' outside of a task");
+  }
+  self->transfer = std::move(value);
+  self->state = Task::State::Suspended;
+  swapcontext(&self->context->task, &self->context->host);
+  if (self->cancelled) {
+    throw Cancelled{};
+  }
+  return std::move(self->transfer);
+}
+
+Result yield_fn(std::vector<Result> arguments) {
+  if (arguments.size() > 1) {
+    throw std::runtime_error("'yield' takes at most 1 argument");
+  }
+  return yield(arguments.empty() ? Nil{} : std::move(arguments[0]));
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "env.h"
+#include "memory.h"
+#include "resources.h"
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+
+// Evaluates a program on a stack of its own, so that it can suspend at
+// (yield value) and be resumed later by the host, from any thread but one at
+// a time. Thousands of tasks can be multiplexed on a few threads: a stack only
+// uses the memory its evaluation touches.
+//
+//   Task task("(+ 1 (yield \"input\"))");
+//   task.resume();               // -> "input", the value yielded
+//   task.resume(Number(41));     // -> 42, the result, task.done()
+//
+// Errors thrown by the evaluation are rethrown by resume(). Destroying a
+// suspended task unwinds its evaluation.
+//
+// The stack is reserved as large as the one of a thread, 8 MB by default.
+// Lambda calls nested so deeply that they would overflow it throw a
+// LimitError instead: they stop STACK_RESERVE bytes (or a quarter of a
+// smaller stack) before its end, left to the builtins they call.
+class Task {
+public:
+  using Body = std::function<Result(Env &env)>;
+
+  static constexpr std::size_t DEFAULT_STACK_SIZE = 8 << 20;
+  static constexpr std::size_t STACK_RESERVE = 256 << 10;
+
+  explicit Task(std::string program, Env env = Env(),
+                std::size_t stack_size = DEFAULT_STACK_SIZE);
+  // evaluates `body` instead of a program
+  Task(Body body, Env env, std::size_t stack_size = DEFAULT_STACK_SIZE);
+  ~Task();
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  // Runs until the next yield, whose value it returns, or the end of the
+  // program, returning its result. `value` is what the pending yield returns.
+  Result resume(Result value = Nil{});
+  bool done() const { return state == State::Done; }
+
+  Env &env() { return environment; }
+
+private:
+  enum class State { Created, Running, Suspended, Done };
+  struct Context;
+
+  static void entry();
+  void switch_thread_state();
+  friend Result yield(Result value);
+
+  Body body;
+  Env environment;
+  State state = State::Created;
+  // passed in both directions by resume() and yield()
+  Result transfer;
+  std::exception_ptr error;
+  bool cancelled = false;
+  std::unique_ptr<Context> context;
+
+  // the thread-local state of the evaluation while it is suspended
+  MemoryCategory memory_category = MemoryCategory::Other;
+  ResourceState resources;
+  std::int64_t heap_limit = 0;
+};
+
+// Suspends the task being evaluated, returning `value` from Task::resume()
+// and the value given to the next resume().
+Result yield(Result value);
+Result yield_fn(std::vector<Result> arguments);
@@ -1,14 +1,36 @@
 #include "tokenizer.h"
 
-#include <optional>
 #include <stdexcept>
 
-Tokens tokenize(const std::string &program) {
-    Tokens tokens;
-    std::optional <Token> tmp;
-    bool comment = false;
+char unescape(char c) {
+    switch (c) {
+        case 'n':
+            return '\n';
+        case 't':
+            return '\t';
+        case 'r':
+            return '\r';
+        default:
+            return c;
+    }
+}
+
+Token Tokenizer::start(TokenType type, std::string value) const {
+    Token token(type, std::move(value));
+    token.line = line;
+    token.column = column;
+    return token;
+}
+
+void Tokenizer::feed(const std::string &input, Tokens &tokens) {
+    for (auto c : input) {
+        if (newline) {
+            line++;
+            column = 0;
+        }
+        column++;
+        newline = c == '\n';
 
-    for (auto c : program) {
         if (c == '\n') {
             if (comment) {
                 comment = false;
@@ -19,6 +41,25 @@ Tokens tokenize(const std::string &program) {
             }
         }
 
+        if (unquote) {
+            unquote = false;
+            if (c == '@') {
+                tokens.back().type = UNQUOTE_SPLICING;
+                continue;
+            }
+        }
+
+        if (escape) {
+            tmp->val += unescape(c);
+            escape = false;
+            continue;
+        }
+
+        if (c == '\\' && tmp && tmp->type == STRING) {
+            escape = true;
+            continue;
+        }
+
         if (c == ';') {
             if (!tmp) {
                 comment = true;
@@ -43,9 +84,9 @@ Tokens tokenize(const std::string &program) {
                 } else if (tmp && tmp->type == SYMBOL) {
                     tokens.push_back(*tmp);
                     tmp = {};
-                    tokens.emplace_back(LEFTPAREN);
+                    tokens.push_back(start(LEFTPAREN));
                 } else {
-                    tokens.emplace_back(LEFTPAREN);
+                    tokens.push_back(start(LEFTPAREN));
                 }
                 break;
 
@@ -53,11 +94,11 @@ Tokens tokenize(const std::string &program) {
                 if (tmp && tmp->type == SYMBOL) {
                     tokens.push_back(*tmp);
                     tmp = {};
-                    tokens.emplace_back(RIGHTPAREN);
+                    tokens.push_back(start(RIGHTPAREN));
                 } else if (tmp && tmp->type == STRING) {
                     tmp->val += c;
                 } else {
-                    tokens.emplace_back(RIGHTPAREN);
+                    tokens.push_back(start(RIGHTPAREN));
                 }
                 break;
 
@@ -68,13 +109,28 @@ Tokens tokenize(const std::string &program) {
                 } else if (tmp && tmp->type == SYMBOL) {
                     throw std::runtime_error("Character '\"' not allowed in symbol names");
                 } else if (!tmp) {
-                    tmp = Token(STRING);
+                    tmp = start(STRING);
+                }
+                break;
+
+            case '\'':
+            case '`':
+            case ',':
+                if (tmp) {
+                    tmp->val += c;
+                } else if (c == '\'') {
+                    tokens.push_back(start(QUOTE));
+                } else if (c == '`') {
+                    tokens.push_back(start(QUASIQUOTE));
+                } else {
+                    tokens.push_back(start(UNQUOTE));
+                    unquote = true;
                 }
                 break;
 
             default:
                 if (!tmp) {
-                    tmp = Token(SYMBOL, std::string(1, c));
+                    tmp = start(SYMBOL, std::string(1, c));
                 } else {
                     tmp->val += c;
                 }
@@ -82,8 +138,26 @@ Tokens tokenize(const std::string &program) {
                 break;
         }
     }
+}
+
+void Tokenizer::finish(Tokens &tokens) {
     if (tmp) {
         tokens.push_back(*tmp);
+        tmp = {};
     }
+    comment = false;
+    escape = false;
+    unquote = false;
+}
+
+bool Tokenizer::in_token() const {
+    return tmp.has_value();
+}
+
+Tokens tokenize(const std::string &program) {
+    Tokens tokens;
+    Tokenizer tokenizer;
+    tokenizer.feed(program, tokens);
+    tokenizer.finish(tokens);
     return tokens;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -7,12 +9,25 @@ enum TokenType {
     LEFTPAREN,
     RIGHTPAREN,
     STRING,
-    SYMBOL
+    SYMBOL,
+    // prefixes: 'x `x ,x ,@x
+    QUOTE,
+    QUASIQUOTE,
+    UNQUOTE,
+    UNQUOTE_SPLICING
 };
 
+inline bool is_prefix(TokenType type) {
+    return type == QUOTE || type == QUASIQUOTE || type == UNQUOTE ||
+           type == UNQUOTE_SPLICING;
+}
+
 struct Token {
     TokenType type;
     std::string val;
+    // where the token starts in the input, from 1
+    std::uint32_t line = 0;
+    std::uint32_t column = 0;
 
     Token(TokenType type, std::string value) : type(type), val(std::move(value)) {}
 
@@ -21,4 +36,28 @@ struct Token {
 
 using Tokens = std::vector<Token>;
 
+// Resumable tokenizer, the input can be fed in pieces that split tokens,
+// strings or comments anywhere.
+class Tokenizer {
+public:
+    void feed(const std::string &input, Tokens &tokens);
+    // ends the input, emitting the token in progress if any
+    void finish(Tokens &tokens);
+    // true when a symbol or a string is partially read
+    bool in_token() const;
+
+private:
+    // a token starting at the current character
+    Token start(TokenType type, std::string value = "") const;
+
+    std::optional<Token> tmp;
+    // of the current character
+    std::uint32_t line = 1;
+    std::uint32_t column = 0;
+    bool newline = false;
+    bool comment = false;
+    bool escape = false;
+    bool unquote = false;
+};
+
 Tokens tokenize(const std::string &program);
\ No newline at end of file
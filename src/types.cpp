@@ -1,30 +1,242 @@
 #include "types.h"
 
+#include "bignum.h"
+#include "io.h"
+#include "output.h"
+#include "regex.h"
+#include "seq.h"
+
+#include <charconv>
+#include <functional>
+#include <type_traits>
+
 struct PrintVisitor {
-  std::string operator()(Number n) { return std::to_string(n); }
+  Sink &sink;
+
+  void operator()(Number n) {
+    // same format as std::to_string, without going through a string
+    char buffer[512];
+    auto res = std::to_chars(buffer, buffer + sizeof buffer, n,
+                             std::chars_format::fixed, 6);
+    sink.write(std::string_view(buffer, res.ptr - buffer));
+  }
+
+  void operator()(const BigInt &n) { sink.write(to_decimal(n)); }
 
-  std::string operator()(Nil &) { return "nil"; }
+  void operator()(const Nil &) { sink.write("nil"); }
 
-  std::string operator()(Symbol &s) { return s.name; }
+  void operator()(const Symbol &s) { sink.write(s.name); }
 
-  std::string operator()(Boolean b) { return b ? "true" : "false"; }
+  void operator()(Boolean b) { sink.write(b ? "true" : "false"); }
 
-  std::string operator()(List &list) {
-    std::string s = "(";
-    for (const auto &v : list.list) {
-      s += to_string(v) + " ";
+  void operator()(const List &list) {
+    sink.put('(');
+    for (int i = 0; i < list.list.size(); ++i) {
+      if (i > 0) {
+        sink.put(' ');
+      }
+      std::visit(*this, list.list[i]);
     }
-    if (s.size() > 1) {
-      s.pop_back();
+    sink.put(')');
+  }
+
+  void operator()(const Lambda &) { sink.write("lambda"); }
+
+  void operator()(const Builtin &builtin) {
+    sink.write("<builtin ");
+    sink.write(builtin.name);
+    sink.put('>');
+  }
+
+  void operator()(const String &s) {
+    sink.put('"');
+    sink.write(s);
+    sink.put('"');
+  }
+
+  void operator()(const File &file) {
+    sink.write("<file ");
+    sink.write(file.handle->name);
+    sink.put('>');
+  }
+
+  void operator()(const Channel &) { sink.write("<channel>"); }
+
+  void operator()(const Regex &regex) {
+    sink.write("<regex ");
+    sink.write(regex_pattern(*regex.program));
+    sink.put('>');
+  }
+
+  void operator()(const Seq &seq) {
+    sink.put('(');
+    for (auto s = seq; !seq_empty(s); s = seq_rest(s)) {
+      if (s.node != seq.node) {
+        sink.put(' ');
+      }
+      std::visit(*this, *s.node->head);
     }
-    s += ")";
-    return s;
+    sink.put(')');
   }
+};
+
+void print_value(Sink &sink, const Result &res) {
+  std::visit(PrintVisitor{sink}, res);
+}
+
+std::string to_string(const Result &res) {
+  StringSink sink;
+  print_value(sink, res);
+  return std::move(sink.str());
+}
+
+namespace {
+
+std::size_t combine(std::size_t seed, std::size_t hash) {
+  return seed ^ (hash + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+}
+
+std::size_t pointer_hash(const void *p) { return std::hash<const void *>()(p); }
+
+std::size_t hash_of(const Result &value, bool &cacheable);
+
+struct HashVisitor {
+  // cleared when the hash depends on a transient list, which can change
+  bool &cacheable;
 
-  std::string operator()(Lambda &) { return "lambda"; }
+  std::size_t operator()(Number n) {
+    // an integer beyond 2^53 is equal to the BigInt with the same value
+    if (std::abs(n) > MAX_EXACT && std::trunc(n) == n && std::isfinite(n)) {
+      return hash_integer(n);
+    }
+    // 0 and -0 are equal
+    return std::hash<Number>()(n == 0 ? 0.0 : n);
+  }
+
+  std::size_t operator()(const BigInt &n) { return hash_integer(n); }
+
+  std::size_t operator()(const Nil &) { return 0x6e696c; }
 
-  std::string operator()(String &s) { return "\"" + s + "\""; }
+  std::size_t operator()(Boolean b) { return b ? 1231 : 1237; }
+
+  std::size_t operator()(const String &s) {
+    return std::hash<std::string>()(s);
+  }
+
+  // not the hash of the string with the same name
+  std::size_t operator()(const Symbol &s) {
+    return combine(0x73796d, std::hash<std::string>()(s.name));
+  }
+
+  std::size_t operator()(const List &list) {
+    if (auto hash = list.list.cached_hash()) {
+      return hash;
+    }
+    std::size_t hash = combine(0x6c697374, list.list.size());
+    bool constant = !list.list.transient();
+    for (const auto &item : list.list) {
+      hash = combine(hash, hash_of(item, constant));
+    }
+    if (constant) {
+      list.list.cache_hash(hash);
+    } else {
+      cacheable = false;
+    }
+    return hash;
+  }
+
+  std::size_t operator()(const Lambda &lambda) {
+    return combine(pointer_hash(lambda.body.get()),
+                   pointer_hash(lambda.env.get()));
+  }
+
+  std::size_t operator()(const Builtin &builtin) {
+    return pointer_hash(reinterpret_cast<const void *>(builtin.fn));
+  }
+
+  std::size_t operator()(const File &file) {
+    return pointer_hash(file.handle.get());
+  }
+
+  std::size_t operator()(const Seq &seq) {
+    return pointer_hash(seq.node.get());
+  }
+
+  std::size_t operator()(const Channel &channel) {
+    return pointer_hash(channel.state.get());
+  }
+
+  std::size_t operator()(const Regex &regex) {
+    return pointer_hash(regex.program.get());
+  }
 };
 
-std::string to_string(Result res) { return std::visit(PrintVisitor{}, res); }
+std::size_t hash_of(const Result &value, bool &cacheable) {
+  return std::visit(HashVisitor{cacheable}, value);
+}
+
+bool same(Number a, Number b) { return a == b; }
+bool same(const BigInt &a, const BigInt &b) {
+  return a.negative == b.negative && *a.limbs == *b.limbs;
+}
+bool same(const Nil &, const Nil &) { return true; }
+bool same(Boolean a, Boolean b) { return a == b; }
+bool same(const String &a, const String &b) { return a == b; }
+bool same(const Symbol &a, const Symbol &b) { return a.name == b.name; }
+
+bool same(const List &a, const List &b) {
+  auto x = a.list.elements();
+  auto y = b.list.elements();
+  if (x.size() != y.size()) {
+    return false;
+  }
+  if (x.data() == y.data()) {
+    return true;
+  }
+  auto hash_a = a.list.cached_hash();
+  auto hash_b = b.list.cached_hash();
+  if (hash_a != 0 && hash_b != 0 && hash_a != hash_b) {
+    return false;
+  }
+  for (std::size_t i = 0; i < x.size(); ++i) {
+    if (!equal(x[i], y[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool same(const Lambda &a, const Lambda &b) {
+  return a.body == b.body && a.env == b.env;
+}
+
+bool same(const Builtin &a, const Builtin &b) { return a.fn == b.fn; }
+bool same(const File &a, const File &b) { return a.handle == b.handle; }
+bool same(const Seq &a, const Seq &b) { return a.node == b.node; }
+
+bool same(const Channel &a, const Channel &b) {
+  return a.state == b.state;
+}
+
+bool same(const Regex &a, const Regex &b) { return a.program == b.program; }
+
+} // namespace
+
+bool equal(const Result &a, const Result &b) {
+  if (a.index() != b.index()) {
+    if (is_number(a) && is_number(b)) {
+      return compare_numbers(a, b, "equal?") == 0;
+    }
+    return false;
+  }
+  return std::visit(
+      [&](const auto &x) {
+        return same(x, std::get<std::decay_t<decltype(x)>>(b));
+      },
+      a);
+}
 
+std::size_t hash_value(const Result &value) {
+  bool cacheable = true;
+  return hash_of(value, cacheable);
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "shared_vector.h"
+
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <variant>
@@ -11,6 +15,24 @@ public:
       : std::runtime_error(msg.c_str()) {}
 };
 
+// arity and type errors found by the checker, before evaluation
+class TypeError : public std::runtime_error {
+public:
+  explicit TypeError(const std::string &msg)
+      : std::runtime_error(msg.c_str()) {}
+};
+
+// a resource limit exceeded during evaluation, see ResourceLimits
+class LimitError : public std::runtime_error {
+public:
+  enum class Kind { Steps, Depth, Heap, Time };
+
+  LimitError(Kind kind, const std::string &msg)
+      : std::runtime_error(msg.c_str()), kind(kind) {}
+
+  Kind kind;
+};
+
 class Expr;
 
 struct Symbol {
@@ -25,21 +47,100 @@ using Number = double;
 
 struct List;
 struct Lambda;
-using Result = std::variant<Nil, Number, Lambda, Boolean, List, String, Symbol>;
+struct File;
+struct Seq;
+struct Builtin;
+struct Channel;
+struct BigInt;
+struct Regex;
+using Result = std::variant<Nil, Number, Lambda, Boolean, List, String, Symbol,
+                            File, Seq, Builtin, Channel, BigInt, Regex>;
 
 class Env;
+struct JitInfo;
 struct Lambda {
   std::vector<Symbol> arguments;
   std::shared_ptr<Expr> body;
   std::shared_ptr<Env> env;
+  // (lambda (x & rest) ...), the last argument is bound to a list
+  bool variadic = false;
+  // expanded at parse time, see 'defmacro'
+  bool macro = false;
+  // call count and native code, see jit.h
+  std::shared_ptr<JitInfo> jit;
+  // exported by a module: the names of its closure come before the bindings
+  // of its caller, see 'require'
+  bool module = false;
 };
 
+// copying a list shares its elements, see SharedVector
 struct List {
-  std::vector<Result> list;
+  SharedVector<Result> list;
 
   List() = default;
 
   explicit List(std::vector<Result> l) : list(std::move(l)) {}
 };
 
-std::string to_string(Result res);
\ No newline at end of file
+using BuiltinFn = Result (*)(std::vector<Result> &arguments, Env &env);
+
+// a native function, it can be passed around and called like a lambda
+struct Builtin {
+  const char *name;
+  BuiltinFn fn;
+};
+
+class FileHandle;
+struct File {
+  std::shared_ptr<FileHandle> handle;
+};
+
+struct SeqNode;
+struct Seq {
+  std::shared_ptr<SeqNode> node;
+};
+
+// a queue of messages between processes, see actors.h
+struct ChannelState;
+struct Channel {
+  std::shared_ptr<ChannelState> state;
+};
+
+// An integer too large for a Number to represent exactly, beyond 2^53 in
+// magnitude, see bignum.h. Immutable, copies share the limbs.
+struct BigInt {
+  bool negative = false;
+  // the magnitude, least significant limb first, without leading zero limbs
+  std::shared_ptr<const std::vector<std::uint32_t>> limbs;
+};
+
+// a compiled regular expression, see regex.h
+struct RegexProgram;
+struct Regex {
+  std::shared_ptr<RegexProgram> program;
+};
+
+class Sink;
+void print_value(Sink &sink, const Result &res);
+std::string to_string(const Result &res);
+
+// Structural equality, see 'equal?': numbers, strings, symbols and lists
+// are compared by value, the other values by identity (the same lambda, the
+// same file...). Lazy sequences are compared by identity too, comparing
+// them could realize infinite ones.
+bool equal(const Result &a, const Result &b);
+// equal values have equal hashes, the hash of a list is computed once
+std::size_t hash_value(const Result &value);
+
+// to use values as keys of unordered containers
+struct ResultHash {
+  std::size_t operator()(const Result &value) const {
+    return hash_value(value);
+  }
+};
+
+struct ResultEqual {
+  bool operator()(const Result &a, const Result &b) const {
+    return equal(a, b);
+  }
+};
\ No newline at end of file
@@ -0,0 +1,12 @@
+# Runs SCRIPT with INTERPRETER and PROGRAM, its translation to C++, and fails
+# unless they print the same output.
+execute_process(COMMAND ${INTERPRETER} ${SCRIPT}
+                OUTPUT_VARIABLE expected RESULT_VARIABLE interpreter_status)
+execute_process(COMMAND ${PROGRAM}
+                OUTPUT_VARIABLE actual RESULT_VARIABLE program_status)
+if(NOT interpreter_status EQUAL 0 OR NOT program_status EQUAL 0)
+  message(FATAL_ERROR "exit status ${interpreter_status}, ${program_status}")
+endif()
+if(NOT expected STREQUAL actual)
+  message(FATAL_ERROR "expected:\n${expected}\ngot:\n${actual}")
+endif()
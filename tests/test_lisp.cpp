@@ -1,6 +1,15 @@
 #include "catch.hpp"
 
+#include "../src/io.h"
 #include "../src/lisp.h"
+#include "../src/memory.h"
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
 
 TEST_CASE("Basic arithmetic") {
   auto res = eval_program("(+ 1 2)");
@@ -339,4 +348,1280 @@ TEST_CASE("booleans") {
     auto res = eval_program("false");
     REQUIRE(!std::get<bool>(res));
   }
-}
\ No newline at end of file
+}
+TEST_CASE("file io") {
+  auto path = std::filesystem::temp_directory_path() / "cpplisp_test_io.txt";
+  auto program = [&](const std::string &body) {
+    return "(define path \"" + path.string() + "\") " + body;
+  };
+
+  eval_program(program(R"lisp(
+(define f (open-file path "w"))
+(write f "one" "\n" "two\n3")
+(close f)
+)lisp"));
+
+  SECTION("read-line") {
+    auto res = eval_program(program(R"lisp(
+(define f (open-file path))
+(define a (read-line f))
+(define b (read-line f))
+(define c (read-line f))
+(define d (read-line f))
+(list a b c d)
+)lisp"));
+    auto l = std::get<List>(res).list;
+    REQUIRE(std::get<String>(l[0]) == "one");
+    REQUIRE(std::get<String>(l[1]) == "two");
+    REQUIRE(std::get<String>(l[2]) == "3");
+    REQUIRE(std::holds_alternative<Nil>(l[3]));
+  }
+
+  SECTION("read-all") {
+    auto res = eval_program(program("(read-all (open-file path))"));
+    REQUIRE(std::get<String>(res) == "one\ntwo\n3");
+  }
+
+  SECTION("read-lines") {
+    auto res = eval_program(program(R"lisp(
+(define lines (read-lines (open-file path)))
+(list (first lines) (first (rest lines)) (length lines) (empty? lines))
+)lisp"));
+    auto l = std::get<List>(res).list;
+    REQUIRE(std::get<String>(l[0]) == "one");
+    REQUIRE(std::get<String>(l[1]) == "two");
+    REQUIRE(std::get<Number>(l[2]) == 3);
+    REQUIRE(!std::get<bool>(l[3]));
+  }
+
+  SECTION("mmap") {
+    auto threshold = mmap_threshold();
+    set_mmap_threshold(1);
+    auto res = eval_program(program(R"lisp(
+(define lines (read-lines (open-file path)))
+(list (first (rest (rest lines))) (length lines))
+)lisp"));
+    set_mmap_threshold(threshold);
+    auto l = std::get<List>(res).list;
+    REQUIRE(std::get<String>(l[0]) == "3");
+    REQUIRE(std::get<Number>(l[1]) == 3);
+  }
+
+  SECTION("append") {
+    eval_program(program(
+        "(define f (open-file path \"a\")) (write f \"!\") (close f)"));
+    auto res = eval_program(program("(read-all (open-file path))"));
+    REQUIRE(std::get<String>(res) == "one\ntwo\n3!");
+  }
+
+  SECTION("closed file") {
+    REQUIRE_THROWS(eval_program(
+        program("(define f (open-file path)) (close f) (read-line f)")));
+  }
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("printing") {
+  SECTION("nested list") {
+    auto res = eval_program("(list 1 (list \"a\" (list)) true)");
+    REQUIRE(to_string(res) == "(1.000000 (\"a\" ()) true)");
+  }
+
+  SECTION("print builtins") {
+    REQUIRE_NOTHROW(eval_program("(print 1 2) (write \"\\n\") (flush)"));
+    REQUIRE(std::holds_alternative<Nil>(eval_program("(print)")));
+  }
+
+  SECTION("buffered file sink") {
+    auto path = std::filesystem::temp_directory_path() / "cpplisp_test_out.txt";
+    auto program = "(define f (open-file \"" + path.string() + "\" \"w\")) ";
+    auto read = [&] {
+      return std::get<String>(
+          eval_program("(read-all (open-file \"" + path.string() + "\"))"));
+    };
+
+    eval_program(program + "(write f (list 1 2) \" \" \"s\" \"\\n\")");
+    REQUIRE(read() == "(1.000000 2.000000) s\n");
+
+    auto before_flush = eval_program(
+        program + "(write f \"buffered\") (define content (read-all "
+                  "(open-file \"" +
+        path.string() + "\"))) (flush f) content");
+    REQUIRE(std::get<String>(before_flush).empty());
+    REQUIRE(read() == "buffered");
+
+    std::filesystem::remove(path);
+  }
+}
+
+TEST_CASE("lazy sequences") {
+  auto numbers = [](const Result &res) {
+    std::vector<Number> v;
+    for (const auto &r : std::get<List>(res).list) {
+      v.push_back(std::get<Number>(r));
+    }
+    return v;
+  };
+
+  SECTION("range") {
+    REQUIRE(to_string(eval_program("(range 3)")) ==
+            to_string(eval_program("(list 0 1 2)")));
+    REQUIRE(std::get<Number>(eval_program("(length (range 2 10 2))")) == 4);
+    REQUIRE(std::get<Number>(eval_program("(first (rest (range 5 0 -1)))")) ==
+            4);
+    REQUIRE(std::get<bool>(eval_program("(empty? (range 0))")));
+  }
+
+  SECTION("take and drop on infinite sequences") {
+    auto res = eval_program("(concat (list) (take 3 (drop 2 (range))))");
+    REQUIRE(numbers(res) == std::vector<Number>{2, 3, 4});
+  }
+
+  SECTION("iterate") {
+    auto res = eval_program(
+        "(concat (list) (take 4 (iterate (lambda (x) (* x 2)) 1)))");
+    REQUIRE(numbers(res) == std::vector<Number>{1, 2, 4, 8});
+  }
+
+  SECTION("lazy-map and lazy-filter") {
+    auto res = eval_program(R"lisp(
+(concat (list)
+  (take 3 (lazy-map (lambda (x) (* x x))
+                    (lazy-filter (lambda (x) (> x 3))
+                                 (range 1 100 3)))))
+)lisp");
+    REQUIRE(numbers(res) == std::vector<Number>{16, 49, 100});
+  }
+
+  SECTION("reduce") {
+    auto add = "(define add (lambda (a b) (+ a b))) ";
+    REQUIRE(std::get<Number>(eval_program(
+                std::string(add) + "(reduce add 0 (range 100001))")) ==
+            5000050000);
+    REQUIRE(std::get<Number>(eval_program(std::string(add) +
+                                          "(reduce add (list 1 2 3))")) == 6);
+    REQUIRE(std::holds_alternative<Nil>(
+        eval_program(std::string(add) + "(reduce add (list))")));
+  }
+
+  SECTION("memoized") {
+    auto res = eval_program(R"lisp(
+(define s (lazy-map (lambda (x) (+ x 1)) (range 3)))
+(list (first s) (first s) (length s) (length (rest s)))
+)lisp");
+    REQUIRE(numbers(res) == std::vector<Number>{1, 1, 3, 2});
+  }
+}
+
+TEST_CASE("loop") {
+  SECTION("counting") {
+    auto res = eval_program(R"lisp(
+(loop (i 0 acc 0)
+  (if (> i 100000)
+      acc
+      (recur (+ i 1) (+ acc i))))
+)lisp");
+    REQUIRE(std::get<Number>(res) == 5000050000);
+  }
+
+  SECTION("recur through cond, let and do") {
+    auto res = eval_program(R"lisp(
+(loop (n 10 steps 0)
+  (cond ((= n 1) steps)
+        ((> n 5) (let (m (- n 2)) (recur m (+ steps 1))))
+        (else (do (define k (- n 1)) (recur k (+ steps 1))))))
+)lisp");
+    REQUIRE(std::get<Number>(res) == 6);
+  }
+
+  SECTION("nested") {
+    auto res = eval_program(R"lisp(
+(loop (i 0 acc 0)
+  (if (= i 3)
+      acc
+      (recur (+ i 1)
+             (loop (j 0 acc acc) (if (= j 3) acc (recur (+ j 1) (+ acc 1)))))))
+)lisp");
+    REQUIRE(std::get<Number>(res) == 9);
+  }
+
+  SECTION("inside a lambda") {
+    auto res = eval_program(R"lisp(
+(define sum (lambda (n) (loop (i 0 acc 0) (if (> i n) acc (recur (+ i 1) (+ acc i))))))
+(+ (sum 10) (sum 3))
+)lisp");
+    REQUIRE(std::get<Number>(res) == 61);
+  }
+
+  SECTION("recur not in tail position") {
+    REQUIRE_THROWS_AS(eval_program("(loop (i 0) (+ 1 (recur i)))"),
+                      SyntaxError);
+    REQUIRE_THROWS_AS(
+        eval_program("(loop (i 0) ((lambda () (recur (+ i 1)))))"),
+        SyntaxError);
+    REQUIRE_THROWS_AS(eval_program("(recur 1)"), SyntaxError);
+    REQUIRE_THROWS_AS(eval_program("(loop (i 0) (recur 1 2))"), SyntaxError);
+  }
+}
+
+TEST_CASE("macros") {
+  SECTION("quote") {
+    REQUIRE(to_string(eval_program("'(a 1 \"b\")")) == "(a 1.000000 \"b\")");
+    REQUIRE(std::get<Symbol>(eval_program("(quote x)")).name == "x");
+    REQUIRE(to_string(eval_program("(first '((1 2) 3))")) ==
+            to_string(eval_program("(list 1 2)")));
+  }
+
+  SECTION("quasiquote") {
+    REQUIRE(to_string(eval_program("(define x 2) `(a ,x ,(+ x 1))")) ==
+            "(a 2.000000 3.000000)");
+    REQUIRE(to_string(eval_program("(define xs (list 1 2)) `(a ,@xs b)")) ==
+            "(a 1.000000 2.000000 b)");
+    REQUIRE(to_string(eval_program("`(a `(b ,(c ,(+ 1 2))))")) ==
+            "(a (quasiquote (b (unquote (c 3.000000)))))");
+    REQUIRE_THROWS(eval_program("`(a ,@1)"));
+  }
+
+  SECTION("defmacro") {
+    auto res = eval_program(R"lisp(
+(defmacro unless (test body) `(if ,test nil ,body))
+(unless false 3)
+)lisp");
+    REQUIRE(std::get<Number>(res) == 3);
+
+    // the arguments are not evaluated before being passed to the macro
+    res = eval_program(R"lisp(
+(defmacro when (test & body) `(if ,test (do ,@body) nil))
+(define x 1)
+(when false (define x 2))
+(when true (define x (+ x 10)) x)
+)lisp");
+    REQUIRE(std::get<Number>(res) == 11);
+  }
+
+  SECTION("macros using functions") {
+    auto res = eval_program(R"lisp(
+(define thread (lambda (x forms)
+  (if (empty? forms)
+      x
+      (thread `(,(first (first forms)) ,x ,@(rest (first forms)))
+              (rest forms)))))
+(defmacro -> (x & forms) (thread x forms))
+(-> 1 (+ 2) (* 3) (- 4))
+)lisp");
+    REQUIRE(std::get<Number>(res) == 5);
+  }
+
+  SECTION("variadic lambdas") {
+    REQUIRE(to_string(eval_program("((lambda (a & rest) rest) 1 2 3)")) ==
+            "(2.000000 3.000000)");
+    REQUIRE(to_string(eval_program("((lambda (& rest) rest))")) == "()");
+    REQUIRE_THROWS_AS(eval_program("(lambda (a &) a)"), SyntaxError);
+  }
+}
+
+TEST_CASE("type checking") {
+  Env env;
+
+  SECTION("arity") {
+    REQUIRE_THROWS_AS(
+        eval_checked("(define a 1) (define f (lambda (x y) x)) (f 1)", env),
+        TypeError);
+    // nothing is evaluated when the program does not check
+    REQUIRE(env.get("a") == nullptr);
+    REQUIRE_THROWS_AS(eval_checked("((lambda (x) x) 1 2)", env), TypeError);
+    REQUIRE_THROWS_AS(eval_checked("(= 1 2 3)", env), TypeError);
+    REQUIRE_THROWS_AS(eval_checked("(unknown 1)", env), TypeError);
+    REQUIRE(std::get<Number>(eval_checked(
+                "(define f (lambda (x & xs) x)) (f 1 2 3)", env)) == 1);
+  }
+
+  SECTION("types") {
+    REQUIRE_THROWS_AS(eval_checked("(+ 1 \"a\")", env), TypeError);
+    REQUIRE_THROWS_AS(eval_checked("(let (x (list)) (< x 2))", env),
+                      TypeError);
+    REQUIRE_THROWS_AS(eval_checked("(define s \"a\") (* 2 s)", env),
+                      TypeError);
+    REQUIRE_THROWS_AS(eval_checked("(- (if true 1 \"a\") (length 1))", env),
+                      std::runtime_error);
+  }
+
+  SECTION("names rebound by the program are not trusted") {
+    auto res = eval_checked("(define f (lambda (+) (+ 1 2))) (f list)", env);
+    REQUIRE(to_string(res) == "(1.000000 2.000000)");
+    REQUIRE(std::get<Number>(eval_checked(R"lisp(
+(define g (lambda () (f 1)))
+(define h (lambda (f) (g)))
+(define f (lambda (x y) x))
+(h (lambda (x) x))
+)lisp",
+                                          env)) == 1);
+  }
+
+  SECTION("loop variables are widened") {
+    auto res = eval_checked(
+        "(loop (x \"a\" i 0) (if (> i 0) (+ x 1) (recur 1 (+ i 1))))", env);
+    REQUIRE(std::get<Number>(res) == 2);
+  }
+
+  SECTION("proven numeric calls") {
+    auto ast = Parser(&env).parse_all(tokenize(R"lisp(
+(loop (i 0 acc 0) (if (> i 10) acc (recur (+ i 1) (+ acc i))))
+(define f (lambda (x) (+ x 1)))
+)lisp"));
+    check_program(ast, env);
+    auto loop = dynamic_cast<LoopExpr *>(ast[0].get());
+    auto test = dynamic_cast<IfExpr *>(loop->expr.get())->expressions[0];
+    REQUIRE(dynamic_cast<ListExpr *>(test.get())->numeric ==
+            NumericOp::Greater);
+    auto lambda = dynamic_cast<LambdaExpr *>(
+        dynamic_cast<DefineExpr *>(ast[1].get())->expr.get());
+    REQUIRE(dynamic_cast<ListExpr *>(lambda->body.get())->numeric ==
+            NumericOp::None);
+    REQUIRE(std::get<Number>(eval_all(env, ast).front()) == 55);
+
+    eval_with_env("(define > (lambda (a b) (>= a 0)))", env);
+    REQUIRE(std::get<Number>(eval_all(env, ast).front()) == 0);
+  }
+
+  SECTION("runtime errors") {
+    REQUIRE_THROWS_AS(eval_program("((lambda (x) x) 1 2)"),
+                      std::runtime_error);
+    REQUIRE_THROWS_AS(eval_program("(+ 1 \"a\")"), std::runtime_error);
+    REQUIRE_THROWS_AS(eval_program("(-)"), std::runtime_error);
+    REQUIRE(std::holds_alternative<Nil>(eval_program("(first (list))")));
+  }
+}
+
+TEST_CASE("optimizer") {
+  Env env;
+  auto optimized = [&](const std::string &program) {
+    auto ast = Parser(&env).parse_all(tokenize(program));
+    optimize_program(ast, env);
+    return ast;
+  };
+
+  SECTION("constant folding") {
+    auto ast = optimized("(+ 1 (* 2 3)) (if (< 2 1) (f) \"b\") (list 1 2)");
+    REQUIRE(dynamic_cast<LiteralExpr<Number> *>(ast[0].get())->value == 7);
+    REQUIRE(dynamic_cast<LiteralExpr<String> *>(ast[1].get())->value == "b");
+    REQUIRE(to_string(dynamic_cast<QuoteExpr *>(ast[2].get())->value) ==
+            "(1.000000 2.000000)");
+    // rebound by the program, not folded
+    ast = optimized("(define g (lambda (+) (+ 1 2)))");
+    auto lambda = dynamic_cast<LambdaExpr *>(
+        dynamic_cast<DefineExpr *>(ast[0].get())->expr.get());
+    REQUIRE(dynamic_cast<ListExpr *>(lambda->body.get()) != nullptr);
+  }
+
+  SECTION("inlining") {
+    auto ast = optimized("(define square (lambda (x) (* x x))) (square 3)");
+    auto call = dynamic_cast<InlinedCallExpr *>(ast[1].get());
+    REQUIRE(call != nullptr);
+    REQUIRE(dynamic_cast<LiteralExpr<Number> *>(call->inlined.get())->value ==
+            9);
+    REQUIRE(std::get<Number>(eval_all(env, ast).back()) == 9);
+
+    ast = optimized("(define fact (lambda (n) (if (= n 0) 1 (* n (fact (- n "
+                    "1)))))) (fact 5)");
+    REQUIRE(dynamic_cast<InlinedCallExpr *>(ast[1].get()) == nullptr);
+  }
+
+  SECTION("inlined lambdas still see the arguments of their caller") {
+    auto res = eval_checked(R"lisp(
+(define get-x (lambda () x))
+(define with-x (lambda (x) (get-x)))
+(with-x (+ 2 3))
+)lisp",
+                            env);
+    REQUIRE(std::get<Number>(res) == 5);
+  }
+
+  SECTION("lambdas capturing the arguments of another") {
+    eval_with_env("(define make-adder (lambda (k) (lambda (x) (+ x k)))) "
+                  "(define add5 (make-adder 5))",
+                  env);
+    REQUIRE(std::get<Number>(eval_checked("(add5 1)", env)) == 6);
+    auto ast = optimized("(add5 1)");
+    REQUIRE(dynamic_cast<InlinedCallExpr *>(ast[0].get()) == nullptr);
+  }
+
+  SECTION("redefined lambdas") {
+    eval_checked(R"lisp(
+(define inc (lambda (x) (+ x 1)))
+(define apply-inc (lambda (y) (inc y)))
+)lisp",
+                 env);
+    REQUIRE(std::get<Number>(eval_with_env("(apply-inc 2)", env)) == 3);
+    eval_with_env("(define inc (lambda (x) (* x 10)))", env);
+    REQUIRE(std::get<Number>(eval_with_env("(apply-inc 2)", env)) == 20);
+  }
+
+  SECTION("interpreted stdlib") {
+    eval_with_env(interpreted_stdlib(), env);
+    auto ast = optimized("(empty? (list))");
+    auto call = dynamic_cast<InlinedCallExpr *>(ast[0].get());
+    REQUIRE(std::get<Boolean>(
+        dynamic_cast<QuoteExpr *>(call->inlined.get())->value));
+    REQUIRE(to_string(eval_checked(
+                "(map (lambda (x) (* x 2)) (filter (lambda (x) (> x 1)) "
+                "(list 1 2 3)))",
+                env)) == "(4.000000 6.000000)");
+  }
+}
+
+TEST_CASE("jit") {
+  Env env;
+  auto state = [&](const std::string &name) {
+    return std::get<Lambda>(*env.get(name)).jit->state.load();
+  };
+
+  SECTION("recursive lambdas") {
+    eval_with_env(R"lisp(
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(define tak (lambda (x y z)
+  (if (not (< y x)) z
+    (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)))))
+)lisp",
+                  env);
+    REQUIRE(std::get<Number>(eval_with_env("(fib 20)", env)) == 6765);
+    REQUIRE(std::get<Number>(eval_with_env("(tak 18 12 6)", env)) == 7);
+    if (jit_supported()) {
+      REQUIRE(state("fib") == JitInfo::State::Compiled);
+      REQUIRE(state("tak") == JitInfo::State::Compiled);
+    }
+  }
+
+  SECTION("cond, let and logic") {
+    eval_with_env(R"lisp(
+(define f (lambda (n)
+  (cond ((= n 0) 0)
+        ((and (> n 5) (or (<= n 10) (= n 42))) (let (a (* n 2) b 1) (+ a b)))
+        (else (/ n 2)))))
+)lisp",
+                  env);
+    for (int i = 0; i < jit_threshold(); ++i) {
+      eval_with_env("(f 1)", env);
+    }
+    REQUIRE(std::get<Number>(eval_with_env("(f 0)", env)) == 0);
+    REQUIRE(std::get<Number>(eval_with_env("(f 7)", env)) == 15);
+    REQUIRE(std::get<Number>(eval_with_env("(f 42)", env)) == 85);
+    REQUIRE(std::get<Number>(eval_with_env("(f 20)", env)) == 10);
+    REQUIRE(std::get<Number>(eval_with_env("(f 3)", env)) == 1.5);
+    if (jit_supported()) {
+      REQUIRE(state("f") == JitInfo::State::Compiled);
+    }
+  }
+
+  SECTION("falls back to the interpreter") {
+    eval_with_env(R"lisp(
+(define inc (lambda (x) (+ x 1)))
+(define count (lambda (n) (if (= n 0) 0 (inc (count (- n 1))))))
+(count 100)
+)lisp",
+                  env);
+    // calls a lambda that is not itself
+    REQUIRE(state("count") == JitInfo::State::Failed);
+    // not numbers, or a rebound operator
+    REQUIRE_THROWS(eval_with_env("(inc \"a\")", env));
+    REQUIRE(std::get<Number>(eval_with_env("(let (+ -) (inc 1))", env)) == 0);
+    REQUIRE(std::get<Number>(eval_with_env("(inc 1)", env)) == 2);
+  }
+}
+
+TEST_CASE("memory stats") {
+  Env env;
+  auto live = [](MemoryCategory category) {
+    return memory_stats()[category].live_bytes;
+  };
+
+  auto lists = live(MemoryCategory::List);
+  eval_with_env("(define l (map (lambda (x) x) (range 0 1000)))", env);
+  REQUIRE(live(MemoryCategory::List) >= lists + 1000 * sizeof(Result));
+  auto closures = live(MemoryCategory::Closure);
+  eval_with_env("(define f (lambda (x) x))", env);
+  REQUIRE(live(MemoryCategory::Closure) > closures);
+
+  auto stats = memory_stats();
+  REQUIRE(stats.total.peak_bytes >= stats.total.live_bytes);
+  REQUIRE(stats[MemoryCategory::Environment].allocations > 0);
+
+  auto rows = std::get<List>(eval_with_env("(memory-stats)", env)).list;
+  REQUIRE(rows.size() == MEMORY_CATEGORIES + 1);
+  auto total = std::get<List>(rows[0]).list;
+  REQUIRE(std::get<String>(total[0]) == "total");
+  REQUIRE(std::get<Number>(total[1]) > 0);
+}
+
+TEST_CASE("resource limits") {
+  Env env;
+  eval_with_env(R"lisp(
+(define down (lambda (n) (if (= n 0) 0 (+ 1 (down (- n 1))))))
+(define grow (lambda (l) (grow (cons 1 l))))
+)lisp",
+                env);
+  auto kind = [&](const ResourceLimits &limits, const std::string &program) {
+    try {
+      with_limits(limits, [&] { return eval_with_env(program, env); });
+    } catch (LimitError &e) {
+      return e.kind;
+    }
+    FAIL("no limit exceeded");
+    return LimitError::Kind::Steps;
+  };
+
+  ResourceLimits limits;
+  limits.max_steps = 1000;
+  REQUIRE(kind(limits, "(loop (i 0) (recur (+ i 1)))") ==
+          LimitError::Kind::Steps);
+  limits = {};
+  limits.max_depth = 100;
+  REQUIRE(kind(limits, "(down 1000)") == LimitError::Kind::Depth);
+  REQUIRE(std::get<Number>(with_limits(limits, [&] {
+            return eval_with_env("(down 50)", env);
+          })) == 50);
+  limits = {};
+  limits.max_heap_bytes = 1 << 20;
+  REQUIRE(kind(limits, "(grow (list))") == LimitError::Kind::Heap);
+  limits = {};
+  limits.timeout = std::chrono::milliseconds(50);
+  REQUIRE(kind(limits, "(loop (i 0) (recur (+ i 1)))") ==
+          LimitError::Kind::Time);
+
+  // the environment is still usable, without limits
+  REQUIRE(std::get<Number>(eval_with_env("(down 2000)", env)) == 2000);
+  REQUIRE(thread_heap_limit() == 0);
+}
+
+TEST_CASE("tasks") {
+  SECTION("yield and resume") {
+    Task task(R"lisp(
+(define total (loop (i 0 sum 0)
+  (if (= i 3) sum (recur (+ i 1) (+ sum (yield i))))))
+(list "done" total)
+)lisp");
+    REQUIRE(std::get<Number>(task.resume()) == 0);
+    REQUIRE(std::get<Number>(task.resume(Number(10))) == 1);
+    REQUIRE(std::get<Number>(task.resume(Number(20))) == 2);
+    REQUIRE(!task.done());
+    auto result = std::get<List>(task.resume(Number(30))).list;
+    REQUIRE(std::get<Number>(result[1]) == 60);
+    REQUIRE(task.done());
+    REQUIRE(std::get<Number>(*task.env().get("total")) == 60);
+    REQUIRE_THROWS(task.resume());
+  }
+
+  SECTION("errors") {
+    Task task("(yield 1) (undefined-function)");
+    task.resume();
+    REQUIRE_THROWS_WITH(task.resume(), "Unknown operation: undefined-function");
+    REQUIRE(task.done());
+    REQUIRE_THROWS_WITH(eval_program("(yield 1)"),
+                        "'yield' outside of a task");
+  }
+
+  SECTION("many tasks on several threads") {
+    std::vector<std::unique_ptr<Task>> tasks;
+    for (int i = 0; i < 1000; ++i) {
+      tasks.push_back(std::make_unique<Task>(
+          "(define f (lambda (n) (+ n (yield n)))) (f (f " +
+          std::to_string(i) + "))"));
+    }
+    auto resume_all = [&](Number value) {
+      for (auto &task : tasks) {
+        task->resume(value);
+      }
+    };
+    resume_all(0);
+    std::thread(resume_all, 1).join();
+    for (int i = 0; i < tasks.size(); ++i) {
+      REQUIRE(std::get<Number>(tasks[i]->resume(Number(2))) == i + 3);
+    }
+    // suspended tasks are unwound
+    Task suspended("(let (l (list 1 2 3)) (yield l))");
+    suspended.resume();
+  }
+
+  SECTION("deep recursion") {
+    std::string f =
+        "(define f (lambda (n) (if (= n 0) (list) (cons n (f (- n 1))))))";
+    Task task(f + "(length (f 1000))");
+    REQUIRE(std::get<Number>(task.resume()) == 1000);
+    // too deep for the stack of the task
+    Task deeper(f + "(f 10000000)");
+    REQUIRE_THROWS_AS(deeper.resume(), LimitError);
+    // native code too
+    Task native("(define g (lambda (n) (if (= n 0) 0 (+ 1 (g (- n 1))))))"
+                "(g 10000000)");
+    REQUIRE_THROWS_AS(native.resume(), LimitError);
+  }
+}
+
+TEST_CASE("actors") {
+  SECTION("fan-out and fan-in") {
+    auto res = eval_program(R"lisp(
+(define results (channel))
+(define square (lambda (x) (send results (* x x))))
+(define spawn-all (lambda (n)
+  (if (= n 0) nil (do (spawn square n) (spawn-all (- n 1))))))
+(define collect (lambda (n sum)
+  (if (= n 0) sum (collect (- n 1) (+ sum (receive results))))))
+(spawn-all 100)
+(collect 100 0)
+)lisp");
+    REQUIRE(std::get<Number>(res) == 338350);
+  }
+
+  SECTION("mailboxes") {
+    auto res = eval_program(R"lisp(
+(define results (channel))
+(define relay (lambda (next) (send next (+ 1 (receive)))))
+(define chain (lambda (n next)
+  (if (= n 0) next (chain (- n 1) (spawn relay next)))))
+(send (chain 200 results) 0)
+(define relayed (receive results))
+(define reply (lambda ()
+  (let (message (receive)) (send (first message) (nth message 1)))))
+(send (spawn reply) (list results "pong"))
+(define replied (receive results))
+(define twice (lambda () (do (send (self) 21) (send results (* 2 (receive))))))
+(spawn twice)
+(list relayed replied (receive results))
+)lisp");
+    REQUIRE(to_string(res) == "(200.000000 \"pong\" 42.000000)");
+  }
+
+  SECTION("deep recursion") {
+    // the process running out of stack fails alone
+    auto res = eval_program(R"lisp(
+(define results (channel))
+(define f (lambda (n) (if (= n 0) (list) (cons n (f (- n 1))))))
+(spawn f 10000000)
+(spawn (lambda () (send results (length (f 1000)))))
+(receive results)
+)lisp");
+    REQUIRE(std::get<Number>(res) == 1000);
+  }
+
+  SECTION("values are copied") {
+    Env env;
+    eval_with_env("(define ch (channel))", env);
+    auto channel = std::get<Channel>(*env.get("ch"));
+    send(channel, List({Number(1)}));
+    REQUIRE(to_string(receive(channel)) == "(1.000000)");
+    REQUIRE_THROWS_WITH(eval_program("(send (channel) (range))"),
+                        "Cannot pass a lazy sequence to another process");
+    REQUIRE_THROWS_WITH(eval_program("(receive)"),
+                        "'receive' without a channel outside of a process");
+  }
+}
+
+TEST_CASE("coverage") {
+  Coverage coverage(R"lisp(
+(define sign (lambda (x)
+  (cond ((< x 0) "negative")
+        (else "positive"))))
+(sign 1) (sign 2)
+)lisp");
+  Env env;
+  REQUIRE(std::get<String>(coverage.evaluate(env)) == "positive");
+
+  auto hits = [&](std::uint32_t line, std::uint32_t column) {
+    for (const auto &counter : coverage.counters()) {
+      if (counter.expr->line == line && counter.expr->column == column) {
+        return counter.expr->hits.load();
+      }
+    }
+    FAIL("no counter at " << line << ":" << column);
+    return std::uint64_t(0);
+  };
+  REQUIRE(hits(3, 10) == 2);
+  REQUIRE(hits(3, 18) == 0);
+  REQUIRE(hits(4, 15) == 2);
+  REQUIRE(hits(5, 1) == 1);
+
+  std::ostringstream report;
+  coverage.report(report);
+  REQUIRE(report.str().find("      ##### ") == std::string::npos);
+  REQUIRE(report.str().find("           2     3 |   (cond") !=
+          std::string::npos);
+  REQUIRE(report.str().find("^0") != std::string::npos);
+
+  std::ostringstream dump;
+  coverage.dump(dump);
+  REQUIRE(dump.str().find("3 10 call 2 ") != std::string::npos);
+}
+
+TEST_CASE("compiled programs") {
+  SECTION("run many times") {
+    auto program = compile_program(R"lisp(
+(defmacro unless (c body) `(if ,c nil ,body))
+(define double (lambda (x) (* 2 x)))
+(unless (< input 0) (double input))
+)lisp");
+    REQUIRE(program->forms.size() == 3);
+    for (int i = -2; i < 3; ++i) {
+      Env env;
+      env["input"] = Number(i);
+      auto res = run(program, env);
+      if (i < 0) {
+        REQUIRE(std::holds_alternative<Nil>(res));
+      } else {
+        REQUIRE(std::get<Number>(res) == 2 * i);
+      }
+      REQUIRE(env.get("double") != nullptr);
+      REQUIRE(std::get<Lambda>(*env.get("unless")).macro);
+    }
+  }
+
+  SECTION("macros of the env") {
+    Env env;
+    eval_with_env("(defmacro twice (x) `(+ ,x ,x))", env);
+    REQUIRE(std::get<Number>(run(compile_program("(twice 3)", env), env)) ==
+            6);
+  }
+
+  SECTION("cache") {
+    ProgramCache cache(2);
+    auto a = cache.get("(+ 1 2)");
+    REQUIRE(cache.get("(+ 1 2)") == a);
+    auto b = cache.get("(+ 2 3)");
+    // "(+ 1 2)" is more recently used, "(+ 2 3)" is evicted
+    REQUIRE(cache.get("(+ 1 2)") == a);
+    cache.get("(+ 3 4)");
+    REQUIRE(cache.size() == 2);
+    REQUIRE(cache.get("(+ 1 2)") == a);
+    REQUIRE(cache.get("(+ 2 3)") != b);
+    REQUIRE(cache.hits() == 3);
+    REQUIRE(cache.misses() == 4);
+
+    Env env;
+    REQUIRE(std::get<Number>(eval_cached("(+ 1 2)", env)) == 3);
+    REQUIRE(std::get<Number>(eval_cached("(+ 1 2)", env)) == 3);
+  }
+
+  SECTION("macros calling functions defined before them") {
+    auto source = R"lisp(
+(define negated (lambda (op) (if (equal? op '<) '>= '<)))
+(defmacro unless< (a b body) `(if (,(negated '<) ,a ,b) ,body nil))
+(unless< 2 1 "yes")
+)lisp";
+    for (int i = 0; i < 2; ++i) {
+      Env env;
+      REQUIRE(std::get<String>(eval_cached(source, env)) == "yes");
+      REQUIRE(std::get<Lambda>(*env.get("unless<")).macro);
+    }
+  }
+}
+
+TEST_CASE("modules") {
+  auto directory =
+      std::filesystem::temp_directory_path() / "cpplisp_test_modules";
+  std::filesystem::create_directories(directory);
+  auto write = [&](const std::string &name, const std::string &code) {
+    std::ofstream(directory / name) << code;
+  };
+  write("helpers.cpplisp", "(define twice (lambda (x) (* 2 x)))");
+  write("geometry.cpplisp", R"lisp(
+(require "helpers")
+(define square (lambda (x) (* x x)))
+(define fact (lambda (n) (if (< n 2) 1 (* n (fact (- n 1))))))
+(define scaled (let (k 3) (lambda (x) (helpers/twice (* k (square x))))))
+)lisp");
+  write("constants.cpplisp", "(define answer 42)");
+  write("macros.cpplisp", R"lisp(
+(define twice-form (lambda (x) (list '* 2 x)))
+(defmacro twice (x) (twice-form x))
+(define four (twice 2))
+)lisp");
+  write("unless.cpplisp", "(define r (my-unless false 1 2))");
+  module_search_path().push_back(directory);
+
+  SECTION("require") {
+    Env env;
+    auto res = eval_with_env(R"lisp(
+(require "geometry")
+(require "geometry")
+(require "geometry" "g")
+(list (geometry/fact 5) (geometry/scaled 2) (g/square 3))
+)lisp",
+                             env);
+    REQUIRE(to_string(res) == "(120.000000 24.000000 9.000000)");
+    REQUIRE(env.get("square") == nullptr);
+    REQUIRE(env.get("geometry/helpers/twice") == nullptr);
+    // evaluated once for both aliases
+    REQUIRE(std::get<Boolean>(
+        eval_with_env("(equal? geometry/square g/square)", env)));
+  }
+
+  SECTION("the names of the module come first") {
+    Env env;
+    auto res = eval_checked(R"lisp(
+(define square (lambda (x) (+ x x)))
+(require "geometry")
+(list (geometry/scaled 2) (square 3))
+)lisp",
+                            env);
+    REQUIRE(to_string(res) == "(24.000000 6.000000)");
+    REQUIRE_THROWS_AS(eval_checked("(require \"geometry\") (geometry2/fact 3)",
+                                   env),
+                      TypeError);
+  }
+
+  SECTION("macros calling the functions of the module") {
+    Env env;
+    REQUIRE(std::get<Number>(
+                eval_with_env("(require \"macros\") macros/four", env)) == 4);
+    // from the cache
+    REQUIRE(std::get<Number>(
+                eval_program("(require \"macros\" \"m\") m/four")) == 4);
+    REQUIRE(std::get<Number>(eval_program("(load \"macros\") four")) == 4);
+  }
+
+  SECTION("load") {
+    Env env;
+    REQUIRE(std::get<Number>(eval_with_env(
+                "(load \"constants\") (+ answer 1)", env)) == 43);
+    REQUIRE_THROWS_WITH(eval_program("(require \"missing\")"),
+                        "Cannot find module missing");
+  }
+
+  SECTION("load expands the macros of the caller") {
+    REQUIRE(std::get<Number>(eval_program(R"lisp(
+(defmacro my-unless (c a b) (list 'if c b a))
+(load "unless")
+r
+)lisp")) == 1);
+    REQUIRE(std::get<Number>(eval_program(R"lisp(
+(defmacro my-unless (c a b) (list 'if c a b))
+(load "unless")
+r
+)lisp")) == 2);
+  }
+
+  SECTION("cached by modification time") {
+    auto path = resolve_module("constants");
+    Env env;
+    load_module(path, env);
+    auto program = cached_module(path);
+    REQUIRE(program != nullptr);
+    load_module(path, env);
+    REQUIRE(cached_module(path) == program);
+    write("constants.cpplisp", "(define answer 43)");
+    std::filesystem::last_write_time(
+        path, std::filesystem::last_write_time(path) +
+                  std::chrono::seconds(1));
+    REQUIRE(cached_module(path) == nullptr);
+    REQUIRE(std::get<Number>(eval_program("(load \"constants\") answer")) ==
+            43);
+  }
+
+  module_search_path().pop_back();
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("transient lists") {
+  auto number = [](const std::string &program, Env &env) {
+    return std::get<Number>(eval_with_env(program, env));
+  };
+  Env env;
+
+  SECTION("accumulator") {
+    auto res = eval_with_env(R"(
+      (loop (i 0 acc (transient (list)))
+        (if (< i 1000) (recur (+ i 1) (append i acc)) (persistent! acc))))",
+                             env);
+    auto &l = std::get<List>(res).list;
+    REQUIRE(l.size() == 1000);
+    REQUIRE(std::get<Number>(l[999]) == 999);
+    REQUIRE(!l.transient());
+  }
+
+  SECTION("cons accumulator") {
+    auto res = eval_with_env(R"(
+      (define xs (loop (i 0 acc (transient (list)))
+        (if (< i 1000) (recur (+ i 1) (cons i acc)) (persistent! acc))))
+      (list (first xs) (nth xs 1) (last xs) (length (rest (cons 5 xs)))))",
+                             env);
+    REQUIRE(to_string(res) == "(999.000000 998.000000 0.000000 1000.000000)");
+    REQUIRE(number("(length (cons 1 xs))", env) == 1001);
+    REQUIRE(number("(length xs)", env) == 1000);
+  }
+
+  SECTION("modified in place until persistent!") {
+    eval_with_env("(define xs (list 1 2 3))", env);
+    eval_with_env("(define t (transient xs))", env);
+    eval_with_env("(append 4 t)", env);
+    eval_with_env("(set-nth t 0 10)", env);
+    REQUIRE(number("(length t)", env) == 4);
+    REQUIRE(number("(get t 0)", env) == 10);
+    REQUIRE(number("(length (rest t))", env) == 3);
+    REQUIRE(number("(length t)", env) == 4);
+    REQUIRE(number("(length xs)", env) == 3);
+
+    eval_with_env("(define frozen (persistent! t))", env);
+    eval_with_env("(append 5 t)", env);
+    REQUIRE(number("(length t)", env) == 4);
+    REQUIRE(number("(length frozen)", env) == 4);
+  }
+
+  SECTION("persistent lists are not modified") {
+    eval_with_env("(define xs (list 1 2 3))", env);
+    REQUIRE(number("(get (set-nth xs 1 20) 1)", env) == 20);
+    REQUIRE(number("(length (cons 0 xs))", env) == 4);
+    REQUIRE(number("(get xs 1)", env) == 2);
+    REQUIRE(number("(length xs)", env) == 3);
+    REQUIRE_THROWS(eval_with_env("(set-nth xs 3 0)", env));
+  }
+}
+
+TEST_CASE("equality and hashing") {
+  auto boolean = [](const std::string &program) {
+    return std::get<Boolean>(eval_program(program));
+  };
+  REQUIRE(boolean("(equal? \"abc\" \"abc\")"));
+  REQUIRE(boolean("(equal? '(1 (a \"b\")) (list 1 (list 'a \"b\")))"));
+  REQUIRE(!boolean("(equal? '(1 2) '(1 2 3))"));
+  REQUIRE(!boolean("(equal? 'a \"a\")"));
+  REQUIRE(!boolean("(equal? 1 true)"));
+  REQUIRE(boolean("(equal? 0 (- 0))"));
+  REQUIRE(boolean("(equal? + +)"));
+  REQUIRE(boolean("(do (define f (lambda (x) x)) (equal? f f))"));
+  REQUIRE(!boolean("(equal? (lambda (x) x) (lambda (x) x))"));
+  REQUIRE(boolean("(= (hash (list 1 \"a\")) (hash '(1 \"a\")))"));
+  REQUIRE(boolean("(= (hash 0) (hash (- 0)))"));
+
+  SECTION("the hash of a list is kept until it is modified") {
+    Env env;
+    auto xs = std::get<List>(eval_with_env("(list 1 2 (+ 1 2))", env));
+    REQUIRE(xs.list.cached_hash() == 0);
+    auto hash = hash_value(xs);
+    REQUIRE(xs.list.cached_hash() == hash);
+    auto copy = xs;
+    copy.list.push_back(Number(4));
+    REQUIRE(copy.list.cached_hash() == 0);
+    REQUIRE(hash_value(copy) != hash);
+    REQUIRE(xs.list.cached_hash() == hash);
+    REQUIRE(!equal(xs, copy));
+
+    std::unordered_set<Result, ResultHash, ResultEqual> keys{xs, copy};
+    REQUIRE(keys.count(List({Number(1), Number(2), Number(3)})) == 1);
+    REQUIRE(keys.size() == 2);
+  }
+
+  SECTION("transient lists are hashed each time") {
+    Env env;
+    auto t = std::get<List>(eval_with_env("(transient (list 1 2))", env));
+    hash_value(t);
+    REQUIRE(t.list.cached_hash() == 0);
+  }
+}
+
+TEST_CASE("big integers") {
+  auto print = [](const std::string &program) {
+    return to_string(eval_program(program));
+  };
+  auto boolean = [](const std::string &program) {
+    return std::get<Boolean>(eval_program(program));
+  };
+  const std::string factorial =
+      "(define factorial (lambda (n) (if (= n 0) 1 (* n (factorial (- n "
+      "1))))))";
+
+  REQUIRE(print(factorial + "(factorial 25)") ==
+          "15511210043330985984000000");
+  REQUIRE(print(factorial + "(factorial 30)") ==
+          "265252859812191058636308480000000");
+  REQUIRE(print("(* 123456789012345678901234567890 "
+                "-987654321098765432109876543210)") ==
+          "-121932631137021795226185032733622923332237463801111263526900");
+  // back to a Number once it is small enough
+  REQUIRE(std::get<Number>(eval_program(
+              factorial + "(- (factorial 30) (* 30 (factorial 29)))")) == 0);
+  REQUIRE(std::get<Number>(eval_program(
+              factorial + "(/ (factorial 30) (factorial 28))")) == 870);
+  REQUIRE(std::holds_alternative<Number>(
+      eval_program(factorial + "(/ (factorial 30) 11 13 17 19 23 29 31)")));
+
+  REQUIRE(boolean("(< 9007199254740993 9007199254740994)"));
+  REQUIRE(boolean("(> 9007199254740993 9007199254740992.5)"));
+  REQUIRE(boolean("(< -1e300 -9007199254740993)"));
+  REQUIRE(print("(quotient 100000000000000000000000 -7)") ==
+          "-14285714285714285714285");
+  REQUIRE(std::get<Number>(
+              eval_program("(remainder -100000000000000000000000 7)")) == -5);
+  REQUIRE(std::get<Number>(eval_program("(quotient -7 2)")) == -3);
+  REQUIRE_THROWS(eval_program("(quotient 1.5 2)"));
+  REQUIRE_THROWS(eval_program("(remainder 100000000000000000000 0)"));
+
+  // at 2^53, where doubles start rounding
+  REQUIRE(print("(+ 9007199254740992 1)") == "9007199254740993");
+  REQUIRE(print("(* 321 28059810762433)") == "9007199254740993");
+  REQUIRE(print("(- -9007199254740992 1)") == "-9007199254740993");
+  REQUIRE(std::get<Number>(eval_program("(+ 9007199254740991 1)")) ==
+          9007199254740992.0);
+  REQUIRE(std::get<Number>(eval_program("(- 9007199254740993 2)")) ==
+          9007199254740991.0);
+  // doubles that were never exact stay doubles
+  REQUIRE(std::get<Number>(eval_program("(* 1e300 10)")) == 1e301);
+  REQUIRE(std::get<Number>(eval_program("(+ 1e20 1)")) == 1e20);
+
+  REQUIRE(boolean("(equal? (* 4294967296 4294967296) 18446744073709551616)"));
+  REQUIRE(boolean("(= (hash (* 4294967296 4294967296)) "
+                  "(hash 18446744073709551616))"));
+  REQUIRE(boolean("(equal? (* 4294967296 4294967296) (* 4294967296.0 "
+                  "4294967296.0))"));
+
+  SECTION("native code falls back to the interpreter on overflow") {
+    Env env;
+    eval_with_env(factorial, env);
+    for (int i = 0; i < jit_threshold(); ++i) {
+      eval_with_env("(factorial 10)", env);
+    }
+    REQUIRE(to_string(eval_with_env("(factorial 25)", env)) ==
+            "15511210043330985984000000");
+    REQUIRE(std::get<Number>(eval_with_env("(factorial 18)", env)) ==
+            6402373705728000);
+
+    eval_with_env("(define mul (lambda (a b) (* a b)))", env);
+    for (int i = 0; i < jit_threshold(); ++i) {
+      eval_with_env("(mul 2 3)", env);
+    }
+    REQUIRE(to_string(eval_with_env("(mul 321 28059810762433)", env)) ==
+            "9007199254740993");
+  }
+}
+
+TEST_CASE("regular expressions") {
+  auto print = [](const std::string &program) {
+    return to_string(eval_program(program));
+  };
+  auto boolean = [](const std::string &program) {
+    return std::get<Boolean>(eval_program(program));
+  };
+
+  REQUIRE(print("(re-find (regex \"[a-z]+@[a-z.]+\") "
+                "\"to bob@example.com\")") == "\"bob@example.com\"");
+  REQUIRE(print("(re-find-all \"[0-9]+\" \"1 22 333\")") ==
+          "(\"1\" \"22\" \"333\")");
+  REQUIRE(print("(re-find-all \"a*\" \"baaab\")") ==
+          "(\"\" \"aaa\" \"\" \"\")");
+  // the longest of the leftmost matches
+  REQUIRE(print("(re-find \"a|ab\" \"xab\")") == "\"ab\"");
+  REQUIRE(print("(re-find \"x{2,3}\" \"xxxxx\")") == "\"xxx\"");
+  REQUIRE(print("(re-find \"[]a]+\\\\.\" \"x]a].\")") == "\"]a].\"");
+  REQUIRE(print("(re-find \"\\\\d\" \"abc\")") == "nil");
+
+  REQUIRE(boolean("(re-match? \"^(a|b)*c$\" \"ababc\")"));
+  REQUIRE(!boolean("(re-match? \"^(a|b)*c$\" \"ababcd\")"));
+  REQUIRE(!boolean("(re-match? \"^b\" \"ab\")"));
+  REQUIRE(boolean("(re-match? \"(?:\\\\s|x)$\" \"a\\tb \")"));
+  // a slice is matched like a whole string
+  REQUIRE(print("(re-find \"^b\" \"abab\" 1)") == "\"b\"");
+  REQUIRE(print("(re-find \"b$\" \"abab\" 0 2)") == "\"b\"");
+  REQUIRE_THROWS(eval_program("(re-find \"a\" \"abc\" 2 5)"));
+
+  // without backtracking
+  REQUIRE(boolean("(re-match? \"^(a?){30}a{30}$\" \"" + std::string(30, 'a') +
+                  "\")"));
+  REQUIRE(!boolean("(re-match? \"^(a|aa)*$\" \"" + std::string(60, 'a') +
+                   "b\")"));
+
+  REQUIRE(print("(regex \"a+\")") == "<regex a+>");
+  REQUIRE(boolean("(do (define r (regex \"a\")) (equal? r r))"));
+  REQUIRE_THROWS(eval_program("(regex \"(a\")"));
+  REQUIRE_THROWS(eval_program("(regex \"a{3,1}\")"));
+  REQUIRE_THROWS(eval_program("(regex \"*\")"));
+
+  SECTION("shared by threads") {
+    auto program = compile_regex("[a-z]+@[a-z]+");
+    std::string text(10000, ' ');
+    text += "bob@example";
+    std::vector<std::thread> threads;
+    std::atomic<int> found = 0;
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([&] {
+        for (int j = 0; j < 20; ++j) {
+          auto match = regex_find(*program, text);
+          if (regex_search(*program, text) && match &&
+              match->first == 10000 && match->second == 10011) {
+            found++;
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    REQUIRE(found == 80);
+  }
+}
+
+TEST_CASE("json and csv") {
+  auto print = [](const std::string &program) {
+    return to_string(eval_program(program));
+  };
+  auto json = [](const std::string &program) {
+    return std::get<String>(eval_program("(json-string " + program + ")"));
+  };
+
+  REQUIRE(print(R"lisp(
+(json-parse "{\"a\": [1, 2.5, null, true], \"b\": {}}"))lisp") ==
+          "((a (1.000000 2.500000 nil true)) (b ()))");
+  REQUIRE(print(R"lisp((json-parse "\"\\u00e9\\ud83d\\ude00\""))lisp") ==
+          "\"\xc3\xa9\xf0\x9f\x98\x80\"");
+  REQUIRE(print("(json-parse \"123456789012345678901\")") ==
+          "123456789012345678901");
+  // beyond the range of a double
+  REQUIRE(print("(json-parse \"[1e400, -1e309, 1e-400]\")") ==
+          "(inf -inf 0.000000)");
+  REQUIRE(print(R"lisp((field (json-parse "{\"a\": 1}") 'a))lisp") ==
+          "1.000000");
+  REQUIRE(print(R"lisp((field (json-parse "{\"a\": 1}") "b"))lisp") == "nil");
+
+  REQUIRE(json("(list (list 'a 1) (list 'b \"q\\\"\\n\"))") ==
+          R"({"a":1,"b":"q\"\n"})");
+  REQUIRE(json("(list 0.5 nil true (list))") == "[0.5,null,true,[]]");
+  REQUIRE(json("(* 1000000000000 1000000000000)") ==
+          "1000000000000000000000000");
+  REQUIRE_THROWS(eval_program("(json-parse \"[1,]\")"));
+  REQUIRE_THROWS(eval_program("(json-parse \"01\")"));
+  REQUIRE_THROWS(eval_program("(json-parse \"[1] x\")"));
+
+  auto path = std::filesystem::temp_directory_path() / "cpplisp_test_data";
+  auto read = [&](const std::string &contents, const std::string &reader) {
+    std::ofstream(path, std::ios::binary) << contents;
+    return print("(reduce (lambda (acc x) (append x acc)) (list) (" + reader +
+                 " (open-file \"" + path.string() + "\")))");
+  };
+
+  REQUIRE(read("{\"id\": 1}\n\n[2, \"x\"]\n", "read-json") ==
+          "(((id 1.000000)) (2.000000 \"x\"))");
+  REQUIRE_THROWS(read("1\n{\n", "read-json"));
+
+  // quoted separators, quotes and line breaks, CRLF and blank lines
+  REQUIRE(read("name,age\r\n\"Smith, J\",42\r\n\r\n\"say \"\"hi\"\"\",\"two\n"
+               "lines\"\n007,\"12\"\n",
+               "read-csv") ==
+          "((\"name\" \"age\") (\"Smith, J\" 42.000000) (\"say \"hi\"\" "
+          "\"two\nlines\") (\"007\" \"12\"))");
+  REQUIRE(read("1e400,-1e309\n", "read-csv") == "((inf -inf))");
+  std::ofstream(path, std::ios::binary) << "a;1,5\n";
+  REQUIRE(print("(first (read-csv (open-file \"" + path.string() +
+                "\") \";\"))") == "(\"a\" \"1,5\")");
+  REQUIRE_THROWS(eval_program("(read-csv (open-file \"" + path.string() +
+                              "\") \"ab\")"));
+
+  eval_program("(define f (open-file \"" + path.string() + "\" \"w\")) "
+               "(write-csv f (list \"a\" 1 \"b,c\" \"say \\\"x\\\"\" \"12\")) "
+               "(write-json f (list (list 'k nil))) (close f)");
+  REQUIRE(std::get<String>(eval_program("(read-all (open-file \"" +
+                                        path.string() + "\"))")) ==
+          "a,1,\"b,c\",\"say \"\"x\"\"\",\"12\"\n{\"k\":null}\n");
+}
+
+TEST_CASE("native and interpreted stdlib agree", "[stdlib]") {
+  std::vector<std::pair<std::string, std::string>> cases = {
+      {"(map (lambda (x) (* x 2)) (list 1 2 3))", "(list 2 4 6)"},
+      {"(map (lambda (x) (* x 2)) (list))", "(list)"},
+      {"(filter (lambda (x) (> x 1)) (list 1 2 3))", "(list 2 3)"},
+      {"(fold (lambda (acc x) (+ acc x)) 10 (list 1 2 3))", "16"},
+      {"(reverse (list 1 2 3))", "(list 3 2 1)"},
+      {"(nth (list 1 2 3) 1)", "2"},
+      {"(last (list 1 2 3))", "3"},
+      {"(last (list))", "nil"},
+      {"(any? (lambda (x) (> x 2)) (list 1 2 3))", "true"},
+      {"(any? (lambda (x) (> x 5)) (list 1 2 3))", "false"},
+      {"(all? (lambda (x) (> x 0)) (list 1 2 3))", "true"},
+      {"(all? (lambda (x) (> x 1)) (list 1 2 3))", "false"},
+      {"(count (lambda (x) (> x 1)) (list 1 2 3))", "2"},
+      {"(empty? (list))", "true"},
+  };
+
+  for (const auto &[program, expected] : cases) {
+    INFO(program);
+    auto expected_value = to_string(eval_program(expected));
+    REQUIRE(to_string(eval_program_with_stdlib(program)) == expected_value);
+    REQUIRE(to_string(eval_program_with_interpreted_stdlib(program)) ==
+            expected_value);
+  }
+  REQUIRE(stdlib() == interpreted_stdlib());
+}
+
+TEST_CASE("native stdlib", "[stdlib]") {
+  SECTION("builtins as values") {
+    auto res = eval_program("(map first (list (list 1 2) (list 3)))");
+    REQUIRE(to_string(res) == to_string(eval_program("(list 1 3)")));
+    REQUIRE(std::get<Number>(eval_program("(reduce + 0 (range 5))")) == 10);
+    REQUIRE(std::get<Number>(eval_program("(define add +) (add 1 2)")) == 3);
+  }
+
+  SECTION("sort") {
+    REQUIRE(to_string(eval_program("(sort (list 3 1 2))")) ==
+            to_string(eval_program("(list 1 2 3)")));
+    REQUIRE(to_string(eval_program("(sort > (list 3 1 2))")) ==
+            to_string(eval_program("(list 3 2 1)")));
+    REQUIRE(to_string(eval_program("(sort (list \"b\" \"a\"))")) ==
+            "(\"a\" \"b\")");
+    REQUIRE(to_string(eval_program(
+                "(sort (lambda (a b) (< (first a) (first b))) "
+                "(list (list 1 1) (list 0 2) (list 1 3) (list 0 4)))")) ==
+            to_string(eval_program("(list (list 0 2) (list 0 4) (list 1 1) "
+                                   "(list 1 3))")));
+    REQUIRE_THROWS(eval_program("(sort (list 1 \"a\"))"));
+    REQUIRE(to_string(eval_program("(sort (list (* 1e10 1e10) 3 -5))")) ==
+            "(-5.000000 3.000000 100000000000000000000)");
+
+    auto pairs = "(list (list 1 \"a\") (list 0 \"b\") (list 1 \"c\") "
+                 "(list 0 \"d\"))";
+    auto sorted = to_string(eval_program(
+        "(list (list 0 \"b\") (list 0 \"d\") (list 1 \"a\") (list 1 \"c\"))"));
+    REQUIRE(to_string(eval_program("(sort-by first " + std::string(pairs) +
+                                   ")")) == sorted);
+    REQUIRE(to_string(eval_program(
+                "(sort-by (lambda (p) (json-string (first p))) " +
+                std::string(pairs) + ")")) == sorted);
+    REQUIRE(to_string(eval_program(
+                "(merge (lambda (p q) (< (first p) (first q))) "
+                "(list (list 0 \"x\") (list 2 \"x\")) "
+                "(list (list 0 \"y\") (list 1 \"y\")))")) ==
+            to_string(eval_program("(list (list 0 \"x\") (list 0 \"y\") "
+                                   "(list 1 \"y\") (list 2 \"x\"))")));
+    REQUIRE(to_string(eval_program("(merge (list 1 4) (range 2 4))")) ==
+            to_string(eval_program("(list 1 2 3 4)")));
+  }
+
+  SECTION("grouping") {
+    auto print = [](const std::string &program) {
+      return to_string(eval_program(program));
+    };
+    REQUIRE(print("(group-by (lambda (x) (remainder x 3)) (range 7))") ==
+            print("'((0 (0 3 6)) (1 (1 4)) (2 (2 5)))"));
+    REQUIRE(print("(count-by (lambda (x) (> x 2)) (list 1 5 2 7 9))") ==
+            print("'((false 2) (true 3))"));
+    REQUIRE(print("(frequencies (list \"a\" '(1) \"a\" (list 1)))") ==
+            print("'((\"a\" 2) ((1) 2))"));
+    REQUIRE(print("(distinct (list 3 1 3 2 1))") == print("'(3 1 2)"));
+    REQUIRE(print("(group-by first (list))") == "()");
+  }
+
+  SECTION("sequences") {
+    REQUIRE(std::get<Number>(eval_program("(nth (range 10) 7)")) == 7);
+    REQUIRE(std::get<Number>(eval_program("(last (range 10))")) == 9);
+    REQUIRE(to_string(eval_program("(map (lambda (x) (+ x 1)) (range 3))")) ==
+            to_string(eval_program("(list 1 2 3)")));
+    REQUIRE_THROWS(eval_program("(nth (list 1 2) 2)"));
+    REQUIRE_THROWS(eval_program("(nth (list 1 2) 0.5)"));
+    REQUIRE_THROWS(eval_program("(nth (list 1 2) -1)"));
+    REQUIRE(std::get<Number>(eval_program("(nth (list 1 2) 0)")) == 1);
+  }
+
+  SECTION("large lists") {
+    auto res = eval_program(R"lisp(
+(count (lambda (x) (> x 100))
+       (reverse (map (lambda (x) (* x 2)) (range 100000))))
+)lisp");
+    REQUIRE(std::get<Number>(res) == 99949);
+  }
+}
@@ -26,4 +26,104 @@ TEST_CASE("lambda parser") {
   Env env;
   auto lambda = e->evaluate(env);
   REQUIRE(std::holds_alternative<Lambda>(lambda));
-}
\ No newline at end of file
+}
+TEST_CASE("incremental parser") {
+  IncrementalParser parser;
+  REQUIRE(parser.complete());
+
+  SECTION("expression over several lines") {
+    parser.feed("(define x\n");
+    REQUIRE(!parser.complete());
+    REQUIRE(parser.next() == nullptr);
+    parser.feed("  (+ 1 2))\n");
+    REQUIRE(parser.complete());
+    REQUIRE(dynamic_cast<DefineExpr *>(parser.next().get()) != nullptr);
+    REQUIRE(parser.next() == nullptr);
+  }
+
+  SECTION("several expressions on one line") {
+    parser.feed("(+ 1 2) 3 (list\n");
+    REQUIRE(dynamic_cast<ListExpr *>(parser.next().get()) != nullptr);
+    REQUIRE(dynamic_cast<LiteralExpr<Number> *>(parser.next().get()) !=
+            nullptr);
+    REQUIRE(parser.next() == nullptr);
+    REQUIRE(!parser.complete());
+    parser.feed(")\n");
+    REQUIRE(parser.next() != nullptr);
+  }
+
+  SECTION("unterminated string") {
+    parser.feed("\"multi\n");
+    REQUIRE(!parser.complete());
+    parser.feed("line\"\n");
+    auto expr = parser.next();
+    REQUIRE(dynamic_cast<LiteralExpr<String> *>(expr.get())->value ==
+            "multi\nline");
+  }
+
+  SECTION("unexpected paren") {
+    REQUIRE_THROWS_AS(parser.feed(")"), SyntaxError);
+    REQUIRE(parser.complete());
+    REQUIRE_THROWS_AS(parser.feed("1 2 ) (list"), SyntaxError);
+    REQUIRE(parser.complete());
+    REQUIRE(parser.next() == nullptr);
+  }
+
+  SECTION("syntax error in a complete expression") {
+    parser.feed("(let (x)) (+ 1 2) (list\n");
+    REQUIRE_THROWS(parser.next());
+    REQUIRE(parser.complete());
+    REQUIRE(parser.next() == nullptr);
+    parser.feed("3\n");
+    REQUIRE(dynamic_cast<LiteralExpr<Number> *>(parser.next().get()) !=
+            nullptr);
+  }
+
+  SECTION("quote at the end of a line") {
+    parser.feed("'\n");
+    REQUIRE(!parser.complete());
+    parser.feed("(a b)\n");
+    REQUIRE(dynamic_cast<QuoteExpr *>(parser.next().get()) != nullptr);
+  }
+
+  SECTION("large form") {
+    parser.feed("(list");
+    for (int i = 0; i < 10000; ++i) {
+      parser.feed(" " + std::to_string(i) + "\n");
+    }
+    parser.feed(")");
+    auto expr = parser.next();
+    // built by the parser, its elements are constants
+    auto *constant = dynamic_cast<ConstantExpr *>(expr.get());
+    REQUIRE(std::get<List>(constant->value).list.size() == 10000);
+    auto list = dynamic_cast<ListExpr *>(constant->call.get());
+    REQUIRE(list->expressions.size() == 10001);
+  }
+}
+
+TEST_CASE("constant pool") {
+  Env env;
+  Parser parser(&env);
+  auto tokens = tokenize("(list 1 2 (list 3)) '(1 2 (3)) (list 1 x) '(1 2)");
+  auto constant = parser.parse(tokens);
+  auto quote = parser.parse(tokens);
+  REQUIRE(dynamic_cast<ConstantExpr *>(constant.get()) != nullptr);
+  REQUIRE(dynamic_cast<ListExpr *>(parser.parse(tokens).get()) != nullptr);
+  parser.parse(tokens);
+  REQUIRE(parser.constants.size() == 3);
+
+  // equal constants share their elements, and so do their values
+  auto a = std::get<List>(constant->evaluate(env));
+  auto b = std::get<List>(quote->evaluate(env));
+  REQUIRE(a.list.elements().data() == b.list.elements().data());
+  REQUIRE(a.list.size() == 3);
+
+  // modifying a value copies it first
+  a.list.push_back(Number(4));
+  REQUIRE(a.list.size() == 4);
+  REQUIRE(std::get<List>(constant->evaluate(env)).list.size() == 3);
+
+  // a binding shadowing the builtin is called instead
+  env["list"] = Number(0);
+  REQUIRE_THROWS(constant->evaluate(env));
+}
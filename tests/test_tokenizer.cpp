@@ -29,6 +29,12 @@ TEST_CASE("tokenize strings") {
     REQUIRE(tokens[2].val == "hello world");
 }
 
+TEST_CASE("escaped characters in strings") {
+    auto tokens = tokenize(R"lisp("a\nb \"quoted\" \\")lisp");
+    REQUIRE(tokens.size() == 1);
+    REQUIRE(tokens[0].val == "a\nb \"quoted\" \\");
+}
+
 TEST_CASE("ignore comments") {
     SECTION("only comments") {
         auto tokens = tokenize("; ignore this");
@@ -50,6 +56,31 @@ TEST_CASE("ignore comments") {
     }
 }
 
+TEST_CASE("quote characters") {
+    auto tokens = tokenize("'a `(b ,c ,@d) e'f");
+    REQUIRE(tokens.size() == 11);
+    REQUIRE(tokens[0].type == QUOTE);
+    REQUIRE(tokens[2].type == QUASIQUOTE);
+    REQUIRE(tokens[5].type == UNQUOTE);
+    REQUIRE(tokens[7].type == UNQUOTE_SPLICING);
+    REQUIRE(tokens[10].val == "e'f");
+}
+
 TEST_CASE("misplaced \" character") {
     REQUIRE_THROWS(tokenize("(te\"st expression)"));
-}
\ No newline at end of file
+}
+TEST_CASE("resumable tokenizer") {
+    Tokenizer tokenizer;
+    Tokens tokens;
+    tokenizer.feed("(print \"hel", tokens);
+    REQUIRE(tokens.size() == 2);
+    REQUIRE(tokenizer.in_token());
+    tokenizer.feed("lo\" sym", tokens);
+    tokenizer.feed("bol) ; com", tokens);
+    tokenizer.feed("ment\n(", tokens);
+    tokenizer.finish(tokens);
+    REQUIRE(tokens.size() == 6);
+    REQUIRE(tokens[2].val == "hello");
+    REQUIRE(tokens[3].val == "symbol");
+    REQUIRE(tokens[5].type == LEFTPAREN);
+}